@@ -11,6 +11,15 @@ multiboot2_header_start:
     dw 0                     ; Flags: 0 (optional)
     dd 8                     ; Size of this tag
 
+    ; Framebuffer request tag: ask GRUB for a 1920x1080x32 linear framebuffer
+    dw 5                     ; Type: Framebuffer
+    dw 1                     ; Flags: 1 (optional, fall back to text mode)
+    dd 20                    ; Size of this tag
+    dd 1920                  ; Width
+    dd 1080                  ; Height
+    dd 32                    ; Depth (bits per pixel)
+    dd 0                     ; Padding to keep the next tag 8-byte aligned
+
     ; End tag (required)
     dw 0                     ; Type: 0 (end tag)
     dw 0                     ; Flags: 0
@@ -24,6 +33,7 @@ extern kernel_main               ; Entry point to C kernel
 _start:
     cli                          ; Disable interrupts
     mov esp, stack_top           ; Set up stack pointer (32-bit)
+    mov [multiboot_info], ebx    ; Save Multiboot2 info pointer for the kernel
 
     call setup_64bit             ; Set up 64-bit mode
     jmp 0x08:higher_half         ; Far jump to 64-bit code segment (selector 0x08)
@@ -73,6 +83,7 @@ higher_half:
     mov gs, ax
     mov ss, ax
 
+    mov edi, [multiboot_info]    ; First argument: Multiboot2 info pointer
     call kernel_main             ; Call kernel
     hlt                          ; Halt CPU if kernel returns
 section .data
@@ -84,27 +95,36 @@ gdt:
     dq 0x00AF9A000000FFFF        ; Base=0, Limit=0xFFFFF, Present, Code, 64-bit
     ; 64-bit data segment (selector 0x10)
     dq 0x00CF92000000FFFF        ; Base=0, Limit=0xFFFFF, Present, Data
+gdt_end:
 
 gdt_descriptor:
     dw gdt_end - gdt - 1         ; GDT size
     dq gdt                       ; GDT address (64-bit address for 64-bit mode)
 
-; Minimal paging structures (identity map the first 2MB)
+; Boot paging structures: identity map the first 4GB with 2MB pages so the
+; kernel can reach the linear framebuffer and other MMIO below 4GB
 align 4096
 pml4:
     dq pdpt + 0x07               ; Present, Read/Write
     times 511 dq 0               ; Fill rest with zeros
 pdpt:
-    dq pdt + 0x07                ; Present, Read/Write
-    times 511 dq 0
+    dq pdt + 0x07                ; 0GB - 1GB
+    dq pdt + 0x1000 + 0x07       ; 1GB - 2GB
+    dq pdt + 0x2000 + 0x07       ; 2GB - 3GB
+    dq pdt + 0x3000 + 0x07       ; 3GB - 4GB
+    times 508 dq 0
 pdt:
-    dq 0x0000000000000087        ; Map first 2MB: Present, Read/Write, Page Size (2MB)
-    times 511 dq 0
-
-gdt_end:
+%assign i 0
+%rep 2048
+    dq (i << 21) | 0x87          ; Present, Read/Write, Page Size (2MB)
+%assign i i + 1
+%endrep
 
 section .bss
 align 16
+multiboot_info:
+    resd 1                       ; Physical address of the Multiboot2 info
+align 16
 stack_bottom:
     resb 8192                    ; Reserve 8KB for stack
 stack_top:
\ No newline at end of file
@@ -0,0 +1,153 @@
+#ifndef AHCI_H
+#define AHCI_H
+
+#include <stdint.h>
+
+#define AHCI_MAX_CONTROLLERS 2
+#define AHCI_MAX_PORTS 8               // SATA disks driven across all controllers
+#define AHCI_SLOTS 32                  // Command slots per port (and NCQ tags)
+#define AHCI_PRDT_ENTRIES 8            // Scatter-gather entries per command
+#define AHCI_PRD_MAX_BYTES (4 * 1024 * 1024) // Byte count field is 22 bits
+#define AHCI_MAX_SECTORS 2048          // 1 MiB per command
+#define AHCI_TIMEOUT_MS 1000
+
+// PCI class of an AHCI controller; registers live in BAR5 (ABAR)
+#define AHCI_PCI_CLASS 0x01
+#define AHCI_PCI_SUBCLASS 0x06
+#define AHCI_ABAR 5
+
+// Generic host control
+#define AHCI_CAP_NCS_SHIFT 8           // Command slots - 1
+#define AHCI_CAP_SNCQ (1u << 30)       // Native command queuing
+#define AHCI_GHC_IE (1u << 1)          // Global interrupt enable
+#define AHCI_GHC_AE (1u << 31)         // AHCI mode
+
+// Port command and status
+#define AHCI_PxCMD_ST (1u << 0)        // Process the command list
+#define AHCI_PxCMD_SUD (1u << 1)       // Spin up device
+#define AHCI_PxCMD_POD (1u << 2)       // Power on device
+#define AHCI_PxCMD_FRE (1u << 4)       // FIS receive enable
+#define AHCI_PxCMD_FR (1u << 14)       // FIS receive running
+#define AHCI_PxCMD_CR (1u << 15)       // Command list running
+#define AHCI_PxTFD_BSY 0x80
+#define AHCI_PxTFD_DRQ 0x08
+#define AHCI_PxTFD_ERR 0x01
+#define AHCI_SSTS_DET_PRESENT 3        // Device present, PHY up
+#define AHCI_SIG_ATA 0x00000101        // Plain SATA disk (not ATAPI)
+
+// Port interrupt status bits
+#define AHCI_PxIS_DHRS (1u << 0)       // D2H register FIS
+#define AHCI_PxIS_PSS (1u << 1)        // PIO setup FIS
+#define AHCI_PxIS_DSS (1u << 2)        // DMA setup FIS
+#define AHCI_PxIS_SDBS (1u << 3)       // Set device bits FIS (NCQ completion)
+#define AHCI_PxIS_DPS (1u << 5)        // Descriptor processed
+#define AHCI_PxIS_IFS (1u << 27)       // Interface fatal error
+#define AHCI_PxIS_HBDS (1u << 28)      // Host bus data error
+#define AHCI_PxIS_HBFS (1u << 29)      // Host bus fatal error
+#define AHCI_PxIS_TFES (1u << 30)      // Task file error
+#define AHCI_PxIS_ERRORS (AHCI_PxIS_IFS | AHCI_PxIS_HBDS | AHCI_PxIS_HBFS | AHCI_PxIS_TFES)
+
+// Command header flags
+#define AHCI_CMD_FIS_DWORDS 5          // Length of a register H2D FIS
+#define AHCI_CMD_WRITE (1u << 6)       // Host to device data
+
+// ATA
+#define FIS_TYPE_REG_H2D 0x27
+#define FIS_COMMAND 0x80               // Register FIS carries a command
+#define ATA_DEVICE_LBA 0x40
+#define ATA_CMD_READ_DMA_EXT 0x25
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_READ_FPDMA 0x60        // NCQ read
+#define ATA_CMD_WRITE_FPDMA 0x61       // NCQ write
+#define ATA_CMD_FLUSH_EXT 0xEA
+#define ATA_CMD_IDENTIFY 0xEC
+
+// Port registers, 0x80 bytes each from ABAR + 0x100. All fields are
+// naturally aligned dwords, so the layout needs no packing.
+typedef struct {
+    uint32_t clb;                  // Command list base
+    uint32_t clbu;
+    uint32_t fb;                   // Received FIS base
+    uint32_t fbu;
+    uint32_t is;                   // Interrupt status
+    uint32_t ie;                   // Interrupt enable
+    uint32_t cmd;
+    uint32_t reserved0;
+    uint32_t tfd;                  // Task file data
+    uint32_t sig;
+    uint32_t ssts;                 // SATA status
+    uint32_t sctl;
+    uint32_t serr;
+    uint32_t sact;                 // NCQ tags outstanding
+    uint32_t ci;                   // Command slots issued
+    uint32_t sntf;
+    uint32_t fbs;
+    uint32_t reserved1[11];
+    uint32_t vendor[4];
+} ahci_port_regs;
+
+typedef struct {
+    uint32_t cap;
+    uint32_t ghc;
+    uint32_t is;                   // One bit per port with a pending interrupt
+    uint32_t pi;                   // Ports implemented
+    uint32_t vs;
+    uint32_t ccc_ctl;
+    uint32_t ccc_ports;
+    uint32_t em_loc;
+    uint32_t em_ctl;
+    uint32_t cap2;
+    uint32_t bohc;
+    uint8_t reserved[0x100 - 0x2C];
+    ahci_port_regs ports[32];
+} ahci_hba_regs;
+
+// Command list entry, 32 per port
+typedef struct {
+    uint16_t flags;                // FIS length in dwords, write bit, ...
+    uint16_t prdt_length;          // Entries in the command table's PRDT
+    uint32_t prd_byte_count;       // Bytes transferred, written by the HBA
+    uint32_t ctba;                 // Command table base (128-byte aligned)
+    uint32_t ctbau;
+    uint32_t reserved[4];
+} __attribute__((packed)) ahci_command_header;
+
+// Physical region descriptor
+typedef struct {
+    uint32_t dba;                  // Data base address
+    uint32_t dbau;
+    uint32_t reserved;
+    uint32_t dbc;                  // Byte count - 1 (bits 0-21), bit 31 interrupt
+} __attribute__((packed)) ahci_prd;
+
+typedef struct {
+    uint8_t cfis[64];              // Command FIS
+    uint8_t acmd[16];              // ATAPI command
+    uint8_t reserved[48];
+    ahci_prd prdt[AHCI_PRDT_ENTRIES];
+} __attribute__((packed)) ahci_command_table;
+
+// Register FIS, host to device
+typedef struct {
+    uint8_t type;                  // FIS_TYPE_REG_H2D
+    uint8_t flags;                 // FIS_COMMAND
+    uint8_t command;
+    uint8_t feature_lo;            // NCQ: sector count 7:0
+    uint8_t lba0;
+    uint8_t lba1;
+    uint8_t lba2;
+    uint8_t device;
+    uint8_t lba3;
+    uint8_t lba4;
+    uint8_t lba5;
+    uint8_t feature_hi;            // NCQ: sector count 15:8
+    uint8_t count_lo;              // NCQ: tag in bits 7:3
+    uint8_t count_hi;
+    uint8_t icc;
+    uint8_t control;
+    uint32_t reserved;
+} __attribute__((packed)) fis_reg_h2d;
+
+int ahci_init(void);
+
+#endif
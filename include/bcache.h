@@ -0,0 +1,59 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include <stdint.h>
+#include "block.h"
+
+#define BCACHE_READAHEAD_MIN 4     // Blocks read ahead once a stream turns sequential
+#define BCACHE_READAHEAD_MAX 256   // Largest readahead window, in blocks
+
+// Per-block state lists, one bit per block each
+#define BCACHE_DIRTY 0             // Data newer than the disk, written back in place
+#define BCACHE_META 1              // Metadata newer than the journal
+#define BCACHE_JOURNALED 2         // Logged in a journal transaction not yet checkpointed
+#define BCACHE_FREED 3             // Freed, but the free is not durable yet: do not reuse
+#define BCACHE_FRESH 4             // Allocated since the last commit: nothing durable points here
+#define BCACHE_STAGED 5            // Picked for a journal transaction of their own
+#define BCACHE_LISTS 6
+
+// Block cache over the mounted volume image. Every block has a fixed frame
+// in the image, so the cache tracks state rather than placement: which
+// blocks have been read from the device (resident) and which lists they
+// are on.
+typedef struct {
+    uint64_t hits;                 // Blocks found resident
+    uint64_t misses;               // Blocks read from the device on demand
+    uint64_t readahead;            // Blocks read ahead of demand
+    uint64_t writeback;            // Blocks written back in place
+    uint64_t writeback_requests;   // Device requests those took
+    uint64_t errors;               // Failed device requests
+    uint64_t corrupt;              // Blocks read that failed verification
+    uint32_t resident;             // Blocks currently in memory
+    uint32_t dirty;                // Data blocks waiting for writeback
+    uint32_t meta;                 // Metadata blocks waiting for a journal commit
+    uint32_t journaled;            // Metadata blocks waiting for a checkpoint
+} bcache_stats;
+
+// Checks a block just read from the device; nonzero keeps it out of the cache
+typedef int (*bcache_verify_fn)(uint32_t block);
+
+int bcache_attach(block_device *dev, uint8_t *image, uint32_t block_size, uint32_t nblocks, int resident);
+int bcache_load(uint32_t start, uint32_t count);
+int bcache_read(uint32_t start, uint32_t count, uint32_t limit);
+void bcache_install(uint32_t start, uint32_t count);
+void bcache_dirty(uint32_t start, uint32_t count);
+void bcache_dirty_meta(uint32_t start, uint32_t count);
+void bcache_discard(uint32_t start, uint32_t count);
+void bcache_mark(int list, uint32_t start, uint32_t count, int value);
+int bcache_test(int list, uint32_t block);
+uint32_t bcache_next(int list, uint32_t from);
+uint32_t bcache_count(int list);
+void bcache_clear(int list);
+const uint64_t *bcache_bits(int list);
+int bcache_write_home(int list);
+int bcache_writeback(void);
+uint32_t bcache_dirty_count(void);
+void bcache_set_verify(bcache_verify_fn verify);
+void bcache_get_stats(bcache_stats *stats);
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include <stdint.h>
+
+#define BLOCK_MAX_DEVICES 8
+#define BLOCK_SECTOR_SIZE 512      // Unit of block_request.sector and .count
+#define BLOCK_BATCH 64             // Requests handed to a driver per submit call
+#define BLOCK_PENDING 1            // block_request.status while in flight
+
+#define BLOCK_OP_READ 0
+#define BLOCK_OP_WRITE 1
+#define BLOCK_OP_FLUSH 2           // Make completed writes durable
+
+// One transfer. The buffer is handed to the device for DMA, so it must be
+// identity mapped and physically contiguous (any kernel or phys_alloc memory).
+typedef struct {
+    uint64_t sector;               // First sector
+    void *buffer;
+    uint32_t count;                // Sectors, 0 for a flush
+    uint8_t op;                    // BLOCK_OP_*
+    volatile int8_t status;        // BLOCK_PENDING, then 0 or -1
+} block_request;
+
+typedef struct block_device block_device;
+
+struct block_device {
+    char name[8];                  // "vda", ...
+    uint64_t sectors;              // Capacity in sectors
+    uint32_t max_sectors;          // Largest single request
+    uint32_t queue_depth;          // Requests the driver keeps in flight
+    int read_only;
+    int polled;                    // Spin on completions even when the IRQ could wake us
+    // Run count requests to completion, keeping up to queue_depth of them
+    // in flight. Returns 0 if every request succeeded.
+    int (*submit)(block_device *dev, block_request *reqs, int count);
+    void *driver;                  // Driver private state
+    uint32_t active;               // Submit calls in progress (kept by block.c)
+    uint64_t requests;             // Statistics kept by block.c
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+};
+
+int block_register(block_device *dev);
+int block_device_count(void);
+block_device *block_get_device(int index);
+block_device *block_find_device(const char *name);
+int block_submit(block_device *dev, block_request *reqs, int count);
+int block_read(block_device *dev, uint64_t sector, void *buffer, uint64_t count);
+int block_write(block_device *dev, uint64_t sector, const void *buffer, uint64_t count);
+int block_flush(block_device *dev);
+
+#endif
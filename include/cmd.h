@@ -1,7 +0,0 @@
-#ifndef CMD_H
-#define CMD_H
-
-void normalize_path(const char *path, char *result, char *current_directory, int max_input);
-
-
-#endif
\ No newline at end of file
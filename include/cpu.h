@@ -0,0 +1,136 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdint.h>
+
+// Model specific registers
+#define MSR_MTRR_CAP 0xFE
+#define MSR_MTRR_PHYSBASE0 0x200
+#define MSR_MTRR_PHYSMASK0 0x201
+#define MSR_PAT 0x277
+#define MSR_MTRR_DEF_TYPE 0x2FF
+
+// CPUID leaf 1 feature bits
+#define CPUID_EDX_MTRR (1u << 12)
+#define CPUID_EDX_PAT (1u << 16)
+#define CPUID_ECX_SSE42 (1u << 20)
+
+#define RFLAGS_IF (1u << 9)        // Interrupt enable flag
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    __asm__ volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d) {
+    __asm__ volatile("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(0));
+}
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline uint64_t read_cr0(void) {
+    uint64_t value;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr0(uint64_t value) {
+    __asm__ volatile("mov %0, %%cr0" : : "r"(value) : "memory");
+}
+
+static inline uint64_t read_cr3(void) {
+    uint64_t value;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr3(uint64_t value) {
+    __asm__ volatile("mov %0, %%cr3" : : "r"(value) : "memory");
+}
+
+static inline void wbinvd(void) {
+    __asm__ volatile("wbinvd" : : : "memory");
+}
+
+// 16/32-bit port I/O (byte access lives in isr.asm)
+static inline uint16_t inw(uint16_t port) {
+    uint16_t value;
+    __asm__ volatile("inw %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+
+static inline void outw(uint16_t port, uint16_t value) {
+    __asm__ volatile("outw %0, %1" : : "a"(value), "Nd"(port));
+}
+
+static inline uint32_t inl(uint16_t port) {
+    uint32_t value;
+    __asm__ volatile("inl %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+
+static inline void outl(uint16_t port, uint32_t value) {
+    __asm__ volatile("outl %0, %1" : : "a"(value), "Nd"(port));
+}
+
+// Device register access through an uncached mapping
+static inline uint8_t mmio_read8(volatile void *addr) {
+    return *(volatile uint8_t *)addr;
+}
+
+static inline uint16_t mmio_read16(volatile void *addr) {
+    return *(volatile uint16_t *)addr;
+}
+
+static inline uint32_t mmio_read32(volatile void *addr) {
+    return *(volatile uint32_t *)addr;
+}
+
+static inline void mmio_write8(volatile void *addr, uint8_t value) {
+    *(volatile uint8_t *)addr = value;
+}
+
+static inline void mmio_write16(volatile void *addr, uint16_t value) {
+    *(volatile uint16_t *)addr = value;
+}
+
+static inline void mmio_write32(volatile void *addr, uint32_t value) {
+    *(volatile uint32_t *)addr = value;
+}
+
+// Order normal memory (descriptor rings) against device register access
+static inline void memory_barrier(void) {
+    __asm__ volatile("mfence" : : : "memory");
+}
+
+static inline void cpu_relax(void) {
+    __asm__ volatile("pause" : : : "memory");
+}
+
+// Disable interrupts and return the previous RFLAGS for irq_restore
+static inline uint64_t irq_save(void) {
+    uint64_t flags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint64_t flags) {
+    __asm__ volatile("push %0; popfq" : : "r"(flags) : "memory", "cc");
+}
+
+static inline int interrupts_enabled(void) {
+    uint64_t flags;
+    __asm__ volatile("pushfq; pop %0" : "=r"(flags));
+    return (flags & RFLAGS_IF) != 0;
+}
+
+#endif
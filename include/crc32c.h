@@ -0,0 +1,13 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdint.h>
+
+// CRC-32C (Castagnoli), the checksum the SSE4.2 crc32 instruction computes.
+// crc32c(0, data, len) checksums a buffer; passing the previous result as
+// crc continues it over more data.
+void crc32c_init(void);
+uint32_t crc32c(uint32_t crc, const void *data, uint64_t len);
+int crc32c_hardware(void);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef FBCON_H
+#define FBCON_H
+
+#include <stdint.h>
+
+#define FBCON_MAX_WIDTH 1920       // Largest framebuffer the back buffer covers
+#define FBCON_MAX_HEIGHT 1080
+#define FBCON_MAX_GLYPH_WIDTH 16   // Largest PSF glyph we expand
+#define FBCON_MAX_GLYPH_HEIGHT 32
+#define FBCON_CACHE_SLOTS 8        // Cached foreground/background color pairs
+
+extern int fbcon_active;
+extern uint32_t fbcon_cols;
+extern uint32_t fbcon_rows;
+
+int fbcon_init(void);
+void fbcon_put_char(char c, uint32_t row, uint32_t col, uint8_t attr);
+void fbcon_scroll(uint8_t attr);
+void fbcon_clear(uint8_t attr);
+void fbcon_present(void);
+uint64_t fbcon_redraw(void);
+
+#endif
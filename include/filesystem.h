@@ -2,51 +2,319 @@
 #define FILESYSTEM_H
 
 #include <stdint.h>
+#include "block.h"
 
-#define FS_SIZE (64 * 1024)        // 64 KB file system
-#define MAX_FILES 32               // Max number of files
-#define MAX_FILENAME 12            // Max filename length (including null)
-#define BLOCK_SIZE 512             // Block size in bytes
-#define MAX_BLOCKS (FS_SIZE / BLOCK_SIZE) // Number of blocks
-#define MAX_CHILDREN 8             // Max files per directory
+#define FS_MAGIC 0xCAFE            // Superblock magic number
+#define FS_VERSION 9               // 9 = sparse files (8 snapshots, 7 LZ4-compressed files, 6 per-block CRC32C, 5 metadata journal, 4 per-block refcounts, 3 inode table, 2 had 32 fixed entries)
+#define BLOCK_SIZE 4096            // Block size in bytes
+#define SECTORS_PER_BLOCK (BLOCK_SIZE / BLOCK_SECTOR_SIZE)
+#define FS_DEFAULT_SIZE (8 * 1024 * 1024) // Volume formatted at boot
+#define FS_RAMDISK_MODULE "ramdisk" // Command line of the boot module holding a prebuilt volume
+#define FS_MIN_BLOCKS 16           // Smallest volume mkfs accepts
+#define FS_BYTES_PER_INODE 16384   // Default inode density at mkfs
+#define FS_MAX_NAME 255            // Max name length (excluding null)
+#define FS_MAX_PATH 1024           // Max path length handled internally
+#define NO_BLOCK 0                 // Block 0 holds the superblock, so 0 means "none"
+#define NO_INODE 0                 // Inode numbers start at 1
+#define ROOT_INODE 1
+#define INLINE_EXTENTS 8           // Extents stored directly in fs_inode
+#define EXTENTS_PER_BLOCK (BLOCK_SIZE / sizeof(fs_extent)) // Extents in an indirect block
+#define MAX_EXTENTS (INLINE_EXTENTS + EXTENTS_PER_BLOCK)
+#define INODES_PER_BLOCK (BLOCK_SIZE / sizeof(fs_inode))
+#define REFS_PER_BLOCK (BLOCK_SIZE / sizeof(uint16_t))
+#define SUMS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
+#define MAX_BLOCK_REFS 0xFFFF      // Sharing limit for one block
+#define DIRENT_HEADER 8            // Bytes before the name in fs_dirent
+#define DIRENT_LEN(name_len) ((DIRENT_HEADER + (name_len) + 3) & ~3u) // Record size, 4-byte aligned
+#define DCACHE_SIZE 1024           // Dentry cache slots (power of two)
+#define DCACHE_NAME_MAX 40         // Longer names bypass the dentry cache
+#define DCACHE_NEGATIVE 0xFFFFFFFF // Cached "name does not exist"
+#define FS_MAX_OPEN 32             // Open file descriptors
+#define FS_MAX_IOV 16              // Pieces gathered per internal fs_read_iov pass
+#define FS_JOURNAL_RATIO 64        // mkfs gives the journal 1/64 of the volume...
+#define FS_JOURNAL_MIN_BLOCKS 8    // ...but at least this many blocks
+#define FS_JOURNAL_MAX_BLOCKS 1024 // ...and at most this many (4 MiB)
+#define FS_JOURNAL_MAGIC 0x4C4E524A // "JRNL"
+#define FS_SCRUB_MAX 32            // Most blocks one fs_scrub call checks
+#define FS_DEFRAG_MAX 256          // Most blocks one fs_defrag call copies
+#define FS_CLUSTER_SIZE 65536      // Bytes of a compressed file encoded as one unit
+#define FS_CLUSTER_CACHE 16        // Decoded clusters kept in memory
+#define FS_COMPRESS_MAGIC 0x345A4C43 // "CLZ4"
+#define FS_MAX_SNAPSHOTS 8         // Snapshot slots in the superblock
+#define FS_SNAPSHOT_NAME 23        // Max snapshot name length (excluding null)
+#define FS_WALK_DEPTH 64           // Directory levels fs_walk_next descends
 
+// Journal block types
+#define FS_JOURNAL_HEADER 1        // Journal block 0: where replay starts
+#define FS_JOURNAL_DESCRIPTOR 2    // Opens a transaction, lists its blocks
+#define FS_JOURNAL_COMMIT 3        // Closes a transaction
+
+// fs_open flags (same values as POSIX open)
+#define FS_O_RDONLY 0x000
+#define FS_O_WRONLY 0x001
+#define FS_O_RDWR 0x002
+#define FS_O_ACCMODE 0x003
+#define FS_O_CREAT 0x040           // Create the file if it does not exist
+#define FS_O_TRUNC 0x200           // Truncate to zero length on open
+#define FS_O_APPEND 0x400          // Every write goes to the end of the file
+
+// fs_find modes
+#define FS_FIND_EXACT 0            // The name itself
+#define FS_FIND_PREFIX 1           // Names starting with the pattern
+#define FS_FIND_GLOB 2             // Names matching, with * and ? as wildcards
+
+// fs_lseek whence values
+#define FS_SEEK_SET 0
+#define FS_SEEK_CUR 1
+#define FS_SEEK_END 2
+#define FS_SEEK_DATA 3             // Next offset that is not in a hole
+#define FS_SEEK_HOLE 4             // Next hole, end of file included
+
+// Inode types
+#define FS_TYPE_FREE 0
+#define FS_TYPE_FILE 1
+#define FS_TYPE_DIR 2
+
+// Inode flags
+#define FS_FLAG_COMPRESS 0x0001    // Keep the file compressed (fs_set_compression)
+#define FS_FLAG_COMPRESSED 0x0002  // Its blocks hold an fs_compress_header and clusters
+
+// On-disk layout, all offsets in blocks:
+//   0                          superblock and snapshot table
+//   bitmap_start..             free-space bitmap, one bit per block (1 = used)
+//   refcount_start..           uint16_t owner count per block (0 = free)
+//   checksum_start..           uint32_t CRC32C per block (see below)
+//   inode_start..              inode table, inode n at index n - 1
+//   journal_start..            metadata journal (see fs_journal_block)
+//   data_start..total_blocks   file and directory data
+// Every block in use has a checksum except the checksum table itself and
+// the journal, whose transactions carry their own.
+//
+// A snapshot is a frozen copy of the inode table. Its map block lists, for
+// each inode table block, the data block holding the copy (NO_BLOCK where
+// every inode was free). The snapshot owns the map, the copies and a copy
+// of each indirect extent block, and holds one reference to every block
+// the copied inodes map, so those are copied before being written.
 typedef struct {
-    char name[MAX_FILENAME];       // File or directory name
-    uint32_t size;                 // File size in bytes (0 for directories)
-    uint16_t first_block;          // Index of first block in FAT (data or children)
-    uint8_t is_directory;          // 1 for directory, 0 for file
-    uint8_t parent_index;          // Index of parent directory (255 for root)
-} fs_entry;
+    char name[FS_SNAPSHOT_NAME + 1];
+    uint32_t map_block;            // NO_BLOCK for an unused slot
+    uint32_t files;                // Inodes in use when it was taken
+    uint64_t id;                   // Creation order, from 1
+} fs_snapshot;
 
 typedef struct {
-    uint32_t magic;                // Magic number (e.g., 0xCAFE)
-    uint32_t total_size;           // Total size of file system
-    uint32_t num_files;            // Number of files
-    fs_entry files[MAX_FILES];     // File and directory entries
+    uint32_t magic;                // Magic number (FS_MAGIC)
+    uint32_t version;              // On-disk layout version (FS_VERSION)
+    uint32_t block_size;           // Bytes per block (BLOCK_SIZE)
+    uint32_t total_blocks;         // Volume size in blocks
+    uint32_t inode_count;          // Slots in the inode table
+    uint32_t bitmap_start;         // First bitmap block
+    uint32_t bitmap_blocks;
+    uint32_t refcount_start;       // First refcount table block
+    uint32_t refcount_blocks;
+    uint32_t inode_start;          // First inode table block
+    uint32_t inode_blocks;
+    uint32_t data_start;           // First data block
+    uint32_t root_inode;           // Inode of "/"
+    uint32_t free_blocks;          // Unallocated blocks
+    uint32_t free_inodes;          // Unallocated inodes
+    uint32_t journal_start;        // First journal block
+    uint32_t journal_blocks;
+    uint32_t checksum_start;       // First checksum table block
+    uint32_t checksum_blocks;
+    uint64_t next_snapshot;        // id of the next snapshot taken, less 1
+    fs_snapshot snapshots[FS_MAX_SNAPSHOTS];
 } fs_superblock;
 
+// Metadata journal. Block 0 is a header; transactions follow in the rest
+// of the region, each one contiguous and wrapping back to block 1 when it
+// does not fit before the end:
+//   descriptor  header + the home block number of each logged block,
+//               continuing into further descriptor blocks if needed
+//   images      one copy of each logged block, in descriptor order
+//   commit      header whose checksum covers descriptor and images
+// Replay starts at the header's tail and applies transactions while their
+// sequence numbers keep counting up from the header's sequence.
+typedef struct {
+    uint32_t magic;                // FS_JOURNAL_MAGIC
+    uint32_t type;                 // FS_JOURNAL_*
+    uint64_t sequence;             // Transaction number (header: the one at tail)
+    uint32_t tail;                 // Header: journal block of the oldest live transaction
+    uint32_t tags;                 // Descriptor and commit: blocks logged
+    uint32_t desc_blocks;          // Descriptor and commit: descriptor blocks
+    uint32_t checksum;             // Commit: checksum of descriptor and images
+} fs_journal_block;
+
+// A run of physically contiguous blocks backing logical blocks
+// [logical, logical + length) of a file or directory
+typedef struct {
+    uint32_t logical;              // First logical block covered
+    uint32_t start;                // First physical block
+    uint32_t length;               // Number of blocks
+} fs_extent;
+
+// Fixed-size inode; names live in the parent's directory entries
+typedef struct {
+    uint16_t type;                 // FS_TYPE_*
+    uint16_t flags;
+    uint32_t parent;               // Inode of the containing directory
+    uint64_t size;                 // File size in bytes (directories: bytes of dirent blocks)
+    uint32_t extent_count;         // Total extents (inline + indirect)
+    uint32_t indirect_block;       // Block holding extents past INLINE_EXTENTS
+    fs_extent extents[INLINE_EXTENTS]; // First extents, sorted by logical block
+    uint32_t reserved[2];
+} fs_inode;
+
+// Data of a compressed file. inode->size stays the size of the contents;
+// the blocks hold this header, the cluster offsets, then the clusters back
+// to back. Cluster i holds the FS_CLUSTER_SIZE bytes of the file from
+// i * FS_CLUSTER_SIZE on (the last one whatever remains), stored in bytes
+// [offsets[i], offsets[i + 1]) of the blocks in LZ4 block format, or as is
+// when that is no shorter.
+typedef struct {
+    uint32_t magic;                // FS_COMPRESS_MAGIC
+    uint32_t clusters;
+    uint64_t size;                 // Same as inode->size
+    uint32_t offsets[];            // clusters + 1 entries
+} fs_compress_header;
+
+// Directory entry. Entries are packed back to back and rec_len chains them
+// to the end of the block; slack after an entry is reused for new names.
+typedef struct {
+    uint32_t inode;                // NO_INODE for an unused record
+    uint16_t rec_len;              // Bytes from this entry to the next
+    uint8_t name_len;              // Name length, not null-terminated
+    uint8_t type;                  // FS_TYPE_* of the target
+    char name[];
+} fs_dirent;
+
+// Open file: the inode is resolved once at fs_open
+typedef struct {
+    fs_inode *inode;               // Cached inode pointer, 0 if the slot is free
+    uint32_t ino;                  // Inode number
+    uint32_t flags;                // FS_O_* flags from fs_open
+    uint64_t offset;               // Position for fs_read/fs_write
+    uint32_t pins;                 // Outstanding fs_read_iov references
+} fs_file;
+
+// A directory entry as fs_read_dir reports it
+typedef struct {
+    char name[FS_MAX_NAME + 1];
+    uint32_t inode;
+    uint16_t type;                 // FS_TYPE_*
+    uint64_t size;
+} fs_dir_entry;
+
+// Position of a tree walk (fs_walk_start/fs_walk_next): the directories
+// being walked, outermost first, and how far each has been read
+typedef struct {
+    uint32_t depth;
+    uint32_t dirs[FS_WALK_DEPTH];
+    uint64_t cookies[FS_WALK_DEPTH];
+} fs_walker;
+
+// One contiguous piece of file data, pointing into the volume itself
 typedef struct {
-    uint16_t next_block;           // Next block index or 0xFFFF for end
-} fs_fat_entry;
+    const uint8_t *base;
+    uint32_t len;
+} fs_iovec;
 
 typedef struct {
     uint32_t total_files;          // Number of files
     uint32_t total_directories;    // Number of directories
-    uint32_t used_blocks;          // Number of used blocks
+    uint32_t used_blocks;          // Number of used blocks (including metadata)
     uint32_t free_blocks;          // Number of free blocks
-    uint32_t total_size;           // Total size of all files
+    uint64_t total_size;           // Total size of all files
+    uint32_t block_size;           // Volume geometry
+    uint32_t total_blocks;
+    uint32_t total_inodes;
+    uint32_t free_inodes;
+    uint32_t shared_blocks;        // Blocks referenced by more than one file
+    uint32_t dcache_hits;          // Path components resolved from the dentry cache
+    uint32_t dcache_misses;        // Path components that needed a directory scan
+    uint64_t cache_hits;           // Block cache: blocks found in memory
+    uint64_t cache_misses;         // Blocks read from the disk on demand
+    uint64_t cache_readahead;      // Blocks read ahead of a sequential reader
+    uint64_t cache_writeback;      // Dirty blocks written back
+    uint32_t dirty_blocks;         // Blocks changed since the last writeback
+    uint32_t journal_blocks;       // Journal size
+    uint32_t journal_used;         // Journal blocks holding live transactions
+    uint64_t journal_commits;      // Transactions written
+    uint64_t journal_logged;       // Metadata blocks logged by them
+    uint64_t journal_checkpoints;  // Times the journal was emptied into place
+    uint64_t journal_replayed;     // Transactions replayed at mount
+    uint32_t checksum_errors;      // Blocks found not matching their checksum
+    uint64_t scrubbed_blocks;      // Blocks checked by fs_scrub
+    uint32_t scrub_passes;         // Times fs_scrub covered the whole volume
+    uint32_t compressed_files;     // Files stored compressed
+    uint64_t compressed_bytes;     // Their contents
+    uint64_t compressed_stored;    // Bytes of blocks holding them
+    uint64_t cluster_hits;         // Compressed reads served from decoded clusters
+    uint64_t cluster_decodes;      // Clusters decompressed
+    uint64_t decoded_bytes;        // Bytes they decompressed to
+    uint64_t decode_cycles;        // TSC cycles spent decompressing
+    uint64_t file_extents;         // Extents of all files
+    uint32_t fragmented_files;     // Files in more than one extent
+    uint64_t defrag_moved;         // Blocks fs_defrag has copied
+    uint32_t defrag_passes;        // Times fs_defrag covered every file
+    uint32_t dedup_enabled;        // Whether file writes are being deduplicated
+    uint64_t dedup_hits;           // Blocks written that matched an existing block
+    uint32_t data_blocks;          // Data blocks in use
+    uint64_t shared_refs;          // References to them beyond the first
+    uint32_t snapshots;            // Snapshots kept
 } fs_stats;
 
 void fs_init(void);
+int fs_format(void *image, uint64_t size, uint32_t inode_count);
+int fs_mkfs(uint64_t size, uint32_t inode_count);
+int fs_superblock_valid(const fs_superblock *sb, uint64_t max_blocks);
+int fs_load(block_device *dev);
+int fs_mount_image(void *image, uint64_t size);
+int fs_sync(void);
+void fs_update_checksums(void);
+int fs_scrub(uint32_t count);
+int fs_defrag(uint32_t count);
+block_device *fs_backing_device(void);
 int fs_create_file(const char *path);
 int fs_create_directory(const char *path);
 int fs_delete_file(const char *path);
+int fs_rename(const char *old_path, const char *new_path);
+int fs_clone(const char *src_path, const char *dst_path);
+int fs_set_compression(const char *path, int enable);
+int fs_set_dedup(int enable);
+int fs_snapshot_create(const char *name);
+int fs_snapshot_restore(const char *name);
+int fs_snapshot_delete(const char *name);
+int fs_snapshot_list(fs_snapshot *list, int max);
 int fs_write_file(const char *path, const char *data, uint32_t size);
 int fs_read_file(const char *path, char *buffer, uint32_t max_size);
 void fs_list_files(const char *path);
+int fs_read_dir(const char *path, uint64_t *cookie, fs_dir_entry *entry);
+int fs_walk_start(fs_walker *walker, const char *path);
+int fs_walk_next(fs_walker *walker, fs_dir_entry *entry, uint32_t *depth);
+int fs_find(const char *pattern, int mode, uint32_t *inodes, int max);
+int fs_inode_path(uint32_t ino, char *path, uint32_t size);
+int fs_open(const char *path, int flags);
+int fs_close(int fd);
+int fs_pread(int fd, void *buffer, uint32_t count, uint64_t offset);
+int fs_pwrite(int fd, const void *data, uint32_t count, uint64_t offset);
+int fs_read(int fd, void *buffer, uint32_t count);
+int fs_write(int fd, const void *data, uint32_t count);
+int64_t fs_lseek(int fd, int64_t offset, int whence);
+int fs_truncate(int fd, uint64_t size);
+int fs_punch_hole(int fd, uint64_t offset, uint64_t len);
+int fs_read_iov(int fd, uint64_t offset, uint32_t len, fs_iovec *iov, int n);
+int fs_release_iov(int fd);
+uint64_t fs_file_size(int fd);
 int find_entry(const char *path, int *parent_index);
-uint16_t allocate_block(void);
-void free_blocks(uint16_t first_block);
+int fs_lookup_at(uint32_t dir, const char *path, int *parent_index);
+int fs_chdir(const char *path);
+uint32_t fs_cwd(void);
+int fs_getcwd(char *path, uint32_t size);
+uint32_t allocate_block(void);
+uint32_t allocate_contiguous(uint32_t count);
+void free_block_run(uint32_t start, uint32_t count);
 void fs_get_stats(fs_stats *stats);
+int fs_check_stats(void);
 
-#endif
\ No newline at end of file
+#endif
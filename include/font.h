@@ -0,0 +1,31 @@
+#ifndef FONT_H
+#define FONT_H
+
+#include <stdint.h>
+
+#define PSF1_MAGIC0 0x36
+#define PSF1_MAGIC1 0x04
+#define PSF1_MODE512 0x01          // Font has 512 glyphs instead of 256
+#define PSF2_MAGIC 0x864AB572
+
+typedef struct {
+    uint8_t magic[2];              // PSF1_MAGIC0, PSF1_MAGIC1
+    uint8_t mode;                  // PSF1_MODE* flags
+    uint8_t charsize;              // Bytes per glyph (= height, width is 8)
+} __attribute__((packed)) psf1_header;
+
+typedef struct {
+    uint32_t magic;                // PSF2_MAGIC
+    uint32_t version;              // Always 0
+    uint32_t headersize;           // Offset of the glyph bitmaps
+    uint32_t flags;                // 1 if there is a unicode table
+    uint32_t numglyph;             // Number of glyphs
+    uint32_t bytesperglyph;        // Bytes per glyph
+    uint32_t height;               // Glyph height in pixels
+    uint32_t width;                // Glyph width in pixels
+} __attribute__((packed)) psf2_header;
+
+extern const uint8_t console_font_psf[];
+extern const uint32_t console_font_psf_size;
+
+#endif
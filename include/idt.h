@@ -4,6 +4,9 @@
 #include <stdint.h>
 
 #define IDT_ENTRIES 256
+#define IRQ_BASE_VECTOR 0x20       // PIC lines are remapped to 0x20-0x2F
+#define IRQ_LINES 16
+#define IRQ_MAX_HANDLERS 4         // Devices sharing one PCI interrupt line
 
 struct idt_entry {
     uint16_t offset_low;
@@ -27,6 +30,12 @@ extern void outb(uint16_t port, uint8_t val);
 // PIC functions
 void pic_remap(void);
 void pic_send_eoi(uint8_t irq);
+void pic_unmask(uint8_t irq);
+int pic_irq_deliverable(uint8_t irq);
+
+// Device interrupts; handlers run with interrupts off and must not send EOI
+typedef void (*irq_handler_t)(void);
+int irq_register(uint8_t irq, irq_handler_t handler);
 
 void idt_init(void);
 void keyboard_handler(void);
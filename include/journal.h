@@ -0,0 +1,28 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include "block.h"
+#include "filesystem.h"
+
+#define JOURNAL_MAX_TRANSACTIONS (FS_JOURNAL_MAX_BLOCKS / 2) // Live at once
+
+typedef struct {
+    uint64_t commits;              // Transactions written
+    uint64_t logged;               // Metadata blocks logged by them
+    uint64_t written;              // Journal blocks written (descriptors, images, commits)
+    uint64_t checkpoints;          // Times the journal was emptied into place
+    uint64_t replayed;             // Transactions replayed at mount
+    uint64_t overflows;            // Batches too big for the journal, written in place
+    uint32_t blocks;               // Journal size
+    uint32_t used;                 // Blocks holding live transactions
+} journal_stats;
+
+int journal_attach(block_device *dev, uint8_t *image, const fs_superblock *sb);
+int journal_replay(void);
+int journal_commit(void);
+int journal_commit_list(int list);
+int journal_checkpoint(void);
+void journal_get_stats(journal_stats *stats);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stdint.h>
+
+// LZ4 block format, without the frame around it: a run of sequences, each
+// some literal bytes followed by a copy of at least four bytes from up to
+// 64 KiB back, the last sequence literals only.
+//
+// lz4_compress returns the compressed size, or 0 if the result would not
+// fit in capacity bytes. lz4_decompress returns the bytes decoded, or -1
+// if src is malformed or decodes to more than capacity; it never reads or
+// writes outside the two buffers.
+uint32_t lz4_compress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t capacity);
+int lz4_decompress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t capacity);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stdint.h>
+
+#define MEMORY_MAX_RANGES 32       // Free physical ranges tracked by the allocator
+#define MEMORY_MAX_MODULES 8       // Boot modules remembered for later lookup
+#define MULTIBOOT_TAG_MODULE 3     // Multiboot2 boot module tag
+#define MULTIBOOT_TAG_MMAP 6       // Multiboot2 memory map tag
+#define MULTIBOOT_MEMORY_AVAILABLE 1
+
+// Multiboot2 memory map tag; entry_size bytes per entry follow the header
+typedef struct {
+    uint32_t type;                 // Tag type (6 for memory map)
+    uint32_t size;                 // Size of this tag
+    uint32_t entry_size;           // Size of one entry
+    uint32_t entry_version;        // Entry format version (0)
+} __attribute__((packed)) multiboot_mmap_tag;
+
+typedef struct {
+    uint64_t base;                 // Physical start address
+    uint64_t length;               // Length in bytes
+    uint32_t type;                 // 1 = available RAM
+    uint32_t reserved;
+} __attribute__((packed)) multiboot_mmap_entry;
+
+// Multiboot2 module tag: a file GRUB loaded next to the kernel ("module2
+// <file> <cmdline>" in grub.cfg)
+typedef struct {
+    uint32_t type;                 // Tag type (3 for a module)
+    uint32_t size;                 // Size of this tag, command line included
+    uint32_t mod_start;            // Physical address of the module
+    uint32_t mod_end;              // One past its last byte
+    char cmdline[];                // Null-terminated module command line
+} __attribute__((packed)) multiboot_module_tag;
+
+void memory_init(void *multiboot_info);
+void memory_reserve(uint64_t start, uint64_t end);
+void *phys_alloc(uint64_t size, uint64_t align);
+uint64_t memory_free_bytes(void);
+void *memory_find_module(const char *cmdline, uint64_t *size);
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef NVME_H
+#define NVME_H
+
+#include <stdint.h>
+
+#define NVME_MAX_CONTROLLERS 2
+#define NVME_ADMIN_QUEUE_SIZE 16
+#define NVME_IO_QUEUE_SIZE 64          // Entries per I/O submission/completion queue
+#define NVME_MAX_SECTORS 2048          // 1 MiB per command, one PRP list page
+#define NVME_CPUS 1                    // I/O queue pairs: one per CPU (uniprocessor kernel)
+#define NVME_TIMEOUT_MS 2000           // Admin commands and enable/disable
+
+// PCI class of an NVM Express controller
+#define NVME_PCI_CLASS 0x01
+#define NVME_PCI_SUBCLASS 0x08
+
+// Controller registers (BAR0)
+#define NVME_REG_CAP 0x00              // Capabilities (64-bit)
+#define NVME_REG_VS 0x08
+#define NVME_REG_CC 0x14               // Controller configuration
+#define NVME_REG_CSTS 0x1C             // Controller status
+#define NVME_REG_AQA 0x24              // Admin queue attributes
+#define NVME_REG_ASQ 0x28              // Admin submission queue base (64-bit)
+#define NVME_REG_ACQ 0x30              // Admin completion queue base (64-bit)
+#define NVME_REG_DOORBELLS 0x1000
+
+#define NVME_CC_ENABLE 0x1
+#define NVME_CC_IOSQES (6 << 16)       // 64-byte submission entries
+#define NVME_CC_IOCQES (4 << 20)       // 16-byte completion entries
+#define NVME_CSTS_READY 0x1
+#define NVME_CSTS_FATAL 0x2
+
+// Admin opcodes
+#define NVME_ADMIN_CREATE_SQ 0x01
+#define NVME_ADMIN_CREATE_CQ 0x05
+#define NVME_ADMIN_IDENTIFY 0x06
+#define NVME_ADMIN_SET_FEATURES 0x09
+#define NVME_FEATURE_NUM_QUEUES 0x07
+#define NVME_IDENTIFY_NAMESPACE 0
+#define NVME_IDENTIFY_CONTROLLER 1
+
+// NVM opcodes
+#define NVME_CMD_FLUSH 0x00
+#define NVME_CMD_WRITE 0x01
+#define NVME_CMD_READ 0x02
+
+// Queue creation flags (CDW11)
+#define NVME_QUEUE_CONTIGUOUS 0x1
+#define NVME_CQ_IRQ_ENABLED 0x2
+
+// Submission queue entry
+typedef struct {
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t cid;                  // Command identifier, echoed in the completion
+    uint32_t nsid;
+    uint64_t reserved;
+    uint64_t metadata;
+    uint64_t prp1;                 // First data page
+    uint64_t prp2;                 // Second page, or PRP list for longer transfers
+    uint32_t cdw10;
+    uint32_t cdw11;
+    uint32_t cdw12;
+    uint32_t cdw13;
+    uint32_t cdw14;
+    uint32_t cdw15;
+} __attribute__((packed)) nvme_command;
+
+// Completion queue entry
+typedef struct {
+    uint32_t result;
+    uint32_t reserved;
+    uint16_t sq_head;
+    uint16_t sq_id;
+    uint16_t cid;
+    uint16_t status;               // Bit 0 is the phase tag, bits 1-15 the status
+} __attribute__((packed)) nvme_completion;
+
+int nvme_init(void);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef PAGING_H
+#define PAGING_H
+
+#include <stdint.h>
+
+#define PAGE_SIZE 4096
+#define LARGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Page table entry bits
+#define PAGE_PRESENT 0x001
+#define PAGE_WRITE 0x002
+#define PAGE_USER 0x004
+#define PAGE_PWT 0x008             // Write-through (PAT index bit 0)
+#define PAGE_PCD 0x010             // Cache disable (PAT index bit 1)
+#define PAGE_HUGE 0x080            // 2MB page in a page directory entry
+#define PAGE_PAT_4K 0x080          // PAT index bit 2 in a 4KB page table entry
+#define PAGE_PAT_2M 0x1000         // PAT index bit 2 in a 2MB page directory entry
+#define PAGE_ADDR_MASK 0x000FFFFFFFFFF000ULL
+
+// Memory types the mapping API can apply
+#define PAGE_CACHE_WB 0            // Write-back (normal RAM)
+#define PAGE_CACHE_WC 1            // Write-combining (framebuffers)
+#define PAGE_CACHE_WT 2            // Write-through
+#define PAGE_CACHE_UC 3            // Uncached (device registers)
+
+extern int pat_enabled;
+
+void paging_init(void);
+int paging_identity_map(uint64_t phys, uint64_t size, int cache_type);
+const char *paging_cache_name(int cache_type);
+
+#endif
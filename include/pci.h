@@ -0,0 +1,73 @@
+#ifndef PCI_H
+#define PCI_H
+
+#include <stdint.h>
+
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA 0xCFC
+#define PCI_MAX_DEVICES 64         // Functions remembered by pci_init
+#define PCI_BAR_COUNT 6
+#define PCI_NO_IRQ 0xFF            // Interrupt line not routed
+
+// Configuration space offsets
+#define PCI_VENDOR_ID 0x00
+#define PCI_DEVICE_ID 0x02
+#define PCI_COMMAND 0x04
+#define PCI_STATUS 0x06
+#define PCI_REVISION 0x08
+#define PCI_PROG_IF 0x09
+#define PCI_SUBCLASS 0x0A
+#define PCI_CLASS 0x0B
+#define PCI_HEADER_TYPE 0x0E
+#define PCI_BAR0 0x10
+#define PCI_CAPABILITY_LIST 0x34
+#define PCI_INTERRUPT_LINE 0x3C
+
+#define PCI_COMMAND_IO 0x0001
+#define PCI_COMMAND_MEMORY 0x0002
+#define PCI_COMMAND_MASTER 0x0004  // Allow the device to DMA
+#define PCI_COMMAND_INTX_DISABLE 0x0400
+#define PCI_STATUS_CAP_LIST 0x0010
+#define PCI_HEADER_MULTIFUNCTION 0x80
+
+#define PCI_BAR_IO 0x1
+#define PCI_BAR_TYPE_64 0x4
+#define PCI_BAR_PREFETCH 0x8
+
+// Capability IDs
+#define PCI_CAP_ID_MSI 0x05
+#define PCI_CAP_ID_VNDR 0x09       // Vendor specific (virtio uses these)
+#define PCI_CAP_ID_MSIX 0x11
+
+typedef struct {
+    uint8_t bus;
+    uint8_t device;
+    uint8_t function;
+    uint8_t irq_line;              // Legacy PIC line, PCI_NO_IRQ if none
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint8_t class_code;
+    uint8_t subclass;
+    uint8_t prog_if;
+    uint8_t revision;
+    uint64_t bar[PCI_BAR_COUNT];   // Decoded base address, 0 if unused
+    uint64_t bar_size[PCI_BAR_COUNT];
+    uint8_t bar_io[PCI_BAR_COUNT]; // 1 for I/O port BARs
+} pci_device;
+
+void pci_init(void);
+int pci_device_count(void);
+pci_device *pci_get_device(int index);
+pci_device *pci_find_device(uint16_t vendor_id, uint16_t device_id, int nth);
+pci_device *pci_find_class(uint8_t class_code, uint8_t subclass, int nth);
+uint8_t pci_read8(pci_device *dev, uint8_t offset);
+uint16_t pci_read16(pci_device *dev, uint8_t offset);
+uint32_t pci_read32(pci_device *dev, uint8_t offset);
+void pci_write16(pci_device *dev, uint8_t offset, uint16_t value);
+void pci_write32(pci_device *dev, uint8_t offset, uint32_t value);
+uint8_t pci_find_capability(pci_device *dev, uint8_t cap_id, uint8_t after);
+void pci_enable(pci_device *dev);
+void *pci_map_bar(pci_device *dev, int bar);
+const char *pci_class_name(uint8_t class_code);
+
+#endif
@@ -3,5 +3,6 @@
 #define PIT_H
 
 void pit_init(uint32_t frequency);
+uint64_t tsc_frequency(void);
 
 #endif
\ No newline at end of file
@@ -14,6 +14,10 @@ int strcmp(const char *str1, const char *str2);
 int starts_with(const char *str, const char *prefix);
 int string_length(const char *str);
 void string_copy(char *dest, const char *src, int max_input);
+void *memcpy(void *dest, const void *src, size_t n);
+void *memmove(void *dest, const void *src, size_t n);
+void *memset(void *ptr, int value, size_t n);
+int memcmp(const void *a, const void *b, size_t n);
 
 
 
@@ -8,10 +8,14 @@
 
 extern uint8_t cursor_row;
 extern uint8_t cursor_col;
+extern uint8_t screen_width;       // Console size in cells (VGA or framebuffer)
+extern uint8_t screen_height;
 extern int vga_lock;
 
+void console_init(void);
 void print_char(char c, uint8_t row, uint8_t col);
 void print_string(const char *str);
+void print_chars(const char *str, uint32_t len);
 void scroll_screen(void);
 void clear_screen_proper(void);
 
@@ -0,0 +1,122 @@
+#ifndef VIRTIO_H
+#define VIRTIO_H
+
+#include <stdint.h>
+
+#define VIRTIO_VENDOR_ID 0x1AF4
+#define VIRTIO_BLK_DEVICE_ID 0x1042          // Modern (virtio 1.0) block device
+#define VIRTIO_BLK_TRANSITIONAL_ID 0x1001    // Transitional device, also has the modern BARs
+#define VIRTIO_BLK_MAX_DEVICES 4
+#define VIRTIO_QUEUE_MAX 128                 // Descriptors used per virtqueue (power of two)
+#define VIRTIO_BLK_MAX_SECTORS 2048          // 1 MiB per request
+
+// Device status bits
+#define VIRTIO_STATUS_ACKNOWLEDGE 0x01
+#define VIRTIO_STATUS_DRIVER 0x02
+#define VIRTIO_STATUS_DRIVER_OK 0x04
+#define VIRTIO_STATUS_FEATURES_OK 0x08
+#define VIRTIO_STATUS_FAILED 0x80
+
+// Feature bits
+#define VIRTIO_BLK_F_RO 5                    // Device is read-only
+#define VIRTIO_BLK_F_FLUSH 9                 // Cache flush command
+#define VIRTIO_F_VERSION_1 32                // Modern interface
+
+// virtio_pci_cap.cfg_type
+#define VIRTIO_PCI_CAP_COMMON_CFG 1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG 2
+#define VIRTIO_PCI_CAP_ISR_CFG 3
+#define VIRTIO_PCI_CAP_DEVICE_CFG 4
+
+#define VIRTIO_ISR_QUEUE 0x01                // Used ring was updated
+#define VIRTIO_MSI_NO_VECTOR 0xFFFF
+
+// Descriptor flags
+#define VIRTQ_DESC_F_NEXT 1
+#define VIRTQ_DESC_F_WRITE 2                 // Device writes this buffer
+#define VIRTQ_USED_F_NO_NOTIFY 1             // Device asks not to be kicked
+
+// Block request types and status values
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_T_FLUSH 4
+#define VIRTIO_BLK_S_OK 0
+
+// Vendor capability locating a register block inside a BAR
+typedef struct {
+    uint8_t cap_vndr;
+    uint8_t cap_next;
+    uint8_t cap_len;
+    uint8_t cfg_type;              // VIRTIO_PCI_CAP_*
+    uint8_t bar;
+    uint8_t padding[3];
+    uint32_t offset;               // Offset within the BAR
+    uint32_t length;
+} __attribute__((packed)) virtio_pci_cap;
+
+// Common configuration registers (VIRTIO_PCI_CAP_COMMON_CFG)
+typedef struct {
+    uint32_t device_feature_select;
+    uint32_t device_feature;
+    uint32_t driver_feature_select;
+    uint32_t driver_feature;
+    uint16_t msix_config;
+    uint16_t num_queues;
+    uint8_t device_status;
+    uint8_t config_generation;
+    uint16_t queue_select;
+    uint16_t queue_size;
+    uint16_t queue_msix_vector;
+    uint16_t queue_enable;
+    uint16_t queue_notify_off;
+    uint32_t queue_desc_lo;
+    uint32_t queue_desc_hi;
+    uint32_t queue_driver_lo;      // Available ring
+    uint32_t queue_driver_hi;
+    uint32_t queue_device_lo;      // Used ring
+    uint32_t queue_device_hi;
+} __attribute__((packed)) virtio_pci_common_cfg;
+
+// Block device configuration (VIRTIO_PCI_CAP_DEVICE_CFG), leading fields
+typedef struct {
+    uint32_t capacity_lo;          // Capacity in 512-byte sectors
+    uint32_t capacity_hi;
+    uint32_t size_max;
+    uint32_t seg_max;
+} __attribute__((packed)) virtio_blk_config;
+
+// Split virtqueue layout
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} __attribute__((packed)) virtq_desc;
+
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;                  // Where the driver puts the next entry
+    uint16_t ring[];
+} __attribute__((packed)) virtq_avail;
+
+typedef struct {
+    uint32_t id;                   // Head descriptor of the finished chain
+    uint32_t len;
+} __attribute__((packed)) virtq_used_elem;
+
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;                  // Where the device puts the next entry
+    virtq_used_elem ring[];
+} __attribute__((packed)) virtq_used;
+
+// Header descriptor of every block request
+typedef struct {
+    uint32_t type;                 // VIRTIO_BLK_T_*
+    uint32_t reserved;
+    uint64_t sector;
+} __attribute__((packed)) virtio_blk_req_header;
+
+int virtio_blk_init(void);
+
+#endif
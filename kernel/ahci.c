@@ -0,0 +1,443 @@
+#include "ahci.h"
+#include "block.h"
+#include "pci.h"
+#include "idt.h"
+#include "cpu.h"
+#include "pit.h"
+#include "memory.h"
+#include "vga.h"
+#include "utils.h"
+
+#define AHCI_CAP_S64A (1u << 31)       // 64-bit DMA addresses
+#define AHCI_FIS_AREA_SIZE 256
+#define AHCI_PORT_IRQS (AHCI_PxIS_DHRS | AHCI_PxIS_PSS | AHCI_PxIS_DSS | AHCI_PxIS_SDBS | \
+                        AHCI_PxIS_DPS | AHCI_PxIS_ERRORS)
+
+typedef struct {
+    pci_device *pci;
+    volatile ahci_hba_regs *hba;
+    uint32_t cap;
+    uint32_t slots;                // Command slots implemented by the HBA
+    int use_irq;
+} ahci_controller;
+
+// One SATA disk. Command slot n uses command table n and, with NCQ, tag n,
+// so a completed bit in PxCI/PxSACT leads straight to its request.
+typedef struct {
+    ahci_controller *c;
+    volatile ahci_port_regs *regs;
+    uint32_t number;               // Port index on the controller
+    ahci_command_header *cmd_list;
+    ahci_command_table *tables;
+    uint8_t *fis;
+    uint32_t slot_mask;            // Slots we may use (HBA slots, NCQ depth)
+    uint32_t issued;               // Slots handed to the HBA, not yet reaped
+    int ncq;
+    int has_write_cache;
+    int flushing;                  // A non-queued flush is in flight
+    int error;                     // Port stopped on an error, needs recovery
+    block_request *requests[AHCI_SLOTS];
+    block_device dev;
+} ahci_port;
+
+static ahci_controller controllers[AHCI_MAX_CONTROLLERS];
+static int controller_count = 0;
+static ahci_port ports[AHCI_MAX_PORTS];
+static int port_count = 0;
+
+static uint64_t deadline_ms(uint32_t ms) {
+    return rdtsc() + tsc_frequency() / 1000 * ms;
+}
+
+// Spin until (reg & mask) == 0, giving up after AHCI_TIMEOUT_MS
+static int wait_clear(volatile uint32_t *reg, uint32_t mask) {
+    uint64_t deadline = deadline_ms(AHCI_TIMEOUT_MS);
+    while (mmio_read32(reg) & mask) {
+        if (rdtsc() > deadline) return -1;
+        cpu_relax();
+    }
+    return 0;
+}
+
+static int port_stop(volatile ahci_port_regs *r) {
+    mmio_write32(&r->cmd, mmio_read32(&r->cmd) & ~AHCI_PxCMD_ST);
+    if (wait_clear(&r->cmd, AHCI_PxCMD_CR) != 0) return -1;
+    mmio_write32(&r->cmd, mmio_read32(&r->cmd) & ~AHCI_PxCMD_FRE);
+    return wait_clear(&r->cmd, AHCI_PxCMD_FR);
+}
+
+static int port_start(volatile ahci_port_regs *r) {
+    mmio_write32(&r->serr, 0xFFFFFFFF);
+    mmio_write32(&r->is, 0xFFFFFFFF);
+    mmio_write32(&r->cmd, mmio_read32(&r->cmd) | AHCI_PxCMD_FRE);
+    if (wait_clear(&r->tfd, AHCI_PxTFD_BSY | AHCI_PxTFD_DRQ) != 0) return -1;
+    mmio_write32(&r->cmd, mmio_read32(&r->cmd) | AHCI_PxCMD_ST);
+    return 0;
+}
+
+// COMRESET: hold DET=1 for at least 1ms, then wait for the link to return
+static int port_reset(volatile ahci_port_regs *r) {
+    mmio_write32(&r->sctl, (mmio_read32(&r->sctl) & ~0xFu) | 1);
+    uint64_t deadline = deadline_ms(2);
+    while (rdtsc() < deadline) cpu_relax();
+    mmio_write32(&r->sctl, mmio_read32(&r->sctl) & ~0xFu);
+
+    deadline = deadline_ms(AHCI_TIMEOUT_MS);
+    while ((mmio_read32(&r->ssts) & 0xF) != AHCI_SSTS_DET_PRESENT) {
+        if (rdtsc() > deadline) return -1;
+        cpu_relax();
+    }
+    mmio_write32(&r->serr, 0xFFFFFFFF);
+    return 0;
+}
+
+// After an error the HBA stops fetching commands; only clearing PxCMD.ST
+// resets PxCI/PxSACT, and the device needs a reset to leave the error state
+static int port_recover(ahci_port *p) {
+    volatile ahci_port_regs *r = p->regs;
+    if (port_stop(r) != 0 || port_reset(r) != 0 || port_start(r) != 0) return -1;
+    mmio_write32(&r->ie, p->c->use_irq ? AHCI_PORT_IRQS : 0);
+    p->error = 0;
+    return 0;
+}
+
+static void fill_fis(fis_reg_h2d *fis, uint8_t command, uint64_t lba) {
+    memset(fis, 0, sizeof(fis_reg_h2d));
+    fis->type = FIS_TYPE_REG_H2D;
+    fis->flags = FIS_COMMAND;
+    fis->command = command;
+    fis->device = ATA_DEVICE_LBA;
+    fis->lba0 = (uint8_t)lba;
+    fis->lba1 = (uint8_t)(lba >> 8);
+    fis->lba2 = (uint8_t)(lba >> 16);
+    fis->lba3 = (uint8_t)(lba >> 24);
+    fis->lba4 = (uint8_t)(lba >> 32);
+    fis->lba5 = (uint8_t)(lba >> 40);
+}
+
+// Describe [addr, addr + bytes) in the slot's PRDT and fill in its header
+static void set_prdt(ahci_port *p, uint32_t slot, uint64_t addr, uint32_t bytes, int write) {
+    ahci_command_header *header = &p->cmd_list[slot];
+    ahci_command_table *table = &p->tables[slot];
+    uint16_t entries = 0;
+
+    while (bytes > 0 && entries < AHCI_PRDT_ENTRIES) {
+        uint32_t chunk = (bytes > AHCI_PRD_MAX_BYTES) ? AHCI_PRD_MAX_BYTES : bytes;
+        ahci_prd *prd = &table->prdt[entries++];
+        prd->dba = (uint32_t)addr;
+        prd->dbau = (uint32_t)(addr >> 32);
+        prd->reserved = 0;
+        prd->dbc = chunk - 1;
+        addr += chunk;
+        bytes -= chunk;
+    }
+    header->flags = AHCI_CMD_FIS_DWORDS | (write ? AHCI_CMD_WRITE : 0);
+    header->prdt_length = entries;
+    header->prd_byte_count = 0;
+}
+
+// Translate a block request into a command in a free slot; the slot is
+// issued to the HBA later, together with the rest of the batch
+static void queue_request(ahci_port *p, uint32_t slot, block_request *req) {
+    fis_reg_h2d *fis = (fis_reg_h2d *)p->tables[slot].cfis;
+    int write = req->op == BLOCK_OP_WRITE;
+
+    if (req->op == BLOCK_OP_FLUSH) {
+        fill_fis(fis, ATA_CMD_FLUSH_EXT, 0);
+        set_prdt(p, slot, 0, 0, 0);
+        p->flushing = 1;
+    } else if (p->ncq) {
+        // FPDMA: the sector count moves to the feature field, the tag to count 7:3
+        fill_fis(fis, write ? ATA_CMD_WRITE_FPDMA : ATA_CMD_READ_FPDMA, req->sector);
+        fis->feature_lo = (uint8_t)req->count;
+        fis->feature_hi = (uint8_t)(req->count >> 8);
+        fis->count_lo = (uint8_t)(slot << 3);
+        set_prdt(p, slot, (uint64_t)req->buffer, req->count * BLOCK_SECTOR_SIZE, write);
+    } else {
+        fill_fis(fis, write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT, req->sector);
+        fis->count_lo = (uint8_t)req->count;
+        fis->count_hi = (uint8_t)(req->count >> 8);
+        set_prdt(p, slot, (uint64_t)req->buffer, req->count * BLOCK_SECTOR_SIZE, write);
+    }
+    p->requests[slot] = req;
+    p->issued |= 1u << slot;
+}
+
+static void retire(ahci_port *p, uint32_t done, int8_t status) {
+    while (done) {
+        uint32_t slot = __builtin_ctz(done);
+        done &= done - 1;
+        p->requests[slot]->status = status;
+        p->requests[slot] = 0;
+        p->issued &= ~(1u << slot);
+    }
+}
+
+// Retire every slot the HBA has cleared from PxCI (and PxSACT for NCQ).
+// On an error the port halts, so whatever is still issued fails and waits
+// for port_recover. Runs from the IRQ handler and from waiters with
+// interrupts off.
+static void port_reap(ahci_port *p) {
+    volatile ahci_port_regs *r = p->regs;
+    uint32_t is = mmio_read32(&r->is);
+    if (is) {
+        mmio_write32(&r->is, is);
+        mmio_write32(&p->c->hba->is, 1u << p->number);
+    }
+    if (is & AHCI_PxIS_ERRORS) p->error = 1;
+
+    uint32_t active = mmio_read32(&r->ci) | mmio_read32(&r->sact);
+    memory_barrier();
+    retire(p, p->issued & ~active, 0);
+    if (p->error) retire(p, p->issued, -1);
+    if (p->issued == 0) p->flushing = 0;
+}
+
+// Nothing has finished since the last reap
+static int port_busy(ahci_port *p) {
+    volatile ahci_port_regs *r = p->regs;
+    if (p->issued == 0 || (mmio_read32(&r->is) & AHCI_PxIS_ERRORS)) return 0;
+    uint32_t active = mmio_read32(&r->ci) | mmio_read32(&r->sact);
+    return (p->issued & ~active) == 0;
+}
+
+// Wait for at least one completion, sleeping on the interrupt when it can
+// reach us and polling the port registers otherwise
+static void wait_for_completion(ahci_port *p) {
+    ahci_controller *c = p->c;
+    if (c->use_irq && !p->dev.polled && pic_irq_deliverable(c->pci->irq_line)) {
+        __asm__ volatile("cli");
+        if (port_busy(p)) {
+            __asm__ volatile("sti; hlt" : : : "memory");
+        } else {
+            __asm__ volatile("sti");
+        }
+        return;
+    }
+    while (port_busy(p)) {
+        cpu_relax();
+    }
+}
+
+// A flush is not queueable, so it runs alone: after everything before it
+// has completed and before anything after it is issued
+static int can_queue(ahci_port *p, block_request *req) {
+    if (p->flushing) return 0;
+    if (req->op == BLOCK_OP_FLUSH) return p->issued == 0;
+    return 1;
+}
+
+// Same pipelining as the other drivers: fill free slots, issue them with
+// one PxSACT/PxCI write per refill, and top up as completions free slots
+static int ahci_submit(block_device *dev, block_request *reqs, int count) {
+    ahci_port *p = (ahci_port *)dev->driver;
+    int next = 0;
+
+    while (next < count || p->issued) {
+        uint64_t flags = irq_save();
+        if (p->error && p->issued == 0 && port_recover(p) != 0) {
+            for (; next < count; next++) reqs[next].status = -1;
+            irq_restore(flags);
+            break;
+        }
+
+        uint32_t slots = 0;
+        uint32_t tags = 0;
+        uint32_t free = p->slot_mask & ~p->issued;
+        while (next < count && free && !p->error) {
+            block_request *req = &reqs[next];
+            if (req->op == BLOCK_OP_FLUSH && !p->has_write_cache) {
+                req->status = 0;
+                next++;
+                continue;
+            }
+            if (!can_queue(p, req)) break;
+            uint32_t slot = __builtin_ctz(free);
+            free &= free - 1;
+            queue_request(p, slot, req);
+            slots |= 1u << slot;
+            if (p->ncq && req->op != BLOCK_OP_FLUSH) tags |= 1u << slot;
+            next++;
+        }
+        if (slots) {
+            memory_barrier();
+            if (tags) mmio_write32(&p->regs->sact, tags);
+            mmio_write32(&p->regs->ci, slots);
+        }
+        port_reap(p);
+        int blocked = p->issued && (next == count || (p->slot_mask & ~p->issued) == 0 ||
+                                    !can_queue(p, &reqs[next]));
+        irq_restore(flags);
+
+        if (blocked) wait_for_completion(p);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (reqs[i].status != 0) return -1;
+    }
+    return 0;
+}
+
+static void ahci_irq(void) {
+    for (int i = 0; i < port_count; i++) {
+        ahci_port *p = &ports[i];
+        if (mmio_read32(&p->c->hba->is) & (1u << p->number)) port_reap(p);
+    }
+}
+
+// Run IDENTIFY DEVICE in slot 0 by polling (setup only, port IRQs still off)
+static int port_identify(ahci_port *p, uint16_t *identify) {
+    fis_reg_h2d *fis = (fis_reg_h2d *)p->tables[0].cfis;
+    fill_fis(fis, ATA_CMD_IDENTIFY, 0);
+    fis->device = 0;
+    set_prdt(p, 0, (uint64_t)identify, 512, 0);
+    memory_barrier();
+    mmio_write32(&p->regs->ci, 1);
+
+    uint64_t deadline = deadline_ms(AHCI_TIMEOUT_MS);
+    while (mmio_read32(&p->regs->ci) & 1) {
+        if (mmio_read32(&p->regs->is) & AHCI_PxIS_ERRORS) return -1;
+        if (rdtsc() > deadline) return -1;
+        cpu_relax();
+    }
+    return (mmio_read32(&p->regs->tfd) & AHCI_PxTFD_ERR) ? -1 : 0;
+}
+
+static int port_probe(ahci_controller *c, uint32_t number, ahci_port *p) {
+    static uint16_t identify[256] __attribute__((aligned(512)));
+    volatile ahci_port_regs *r = &c->hba->ports[number];
+
+    if ((mmio_read32(&r->ssts) & 0xF) != AHCI_SSTS_DET_PRESENT) return -1;
+    if (mmio_read32(&r->sig) != AHCI_SIG_ATA) return -1;  // No disk, or ATAPI
+
+    memset(p, 0, sizeof(ahci_port));
+    p->c = c;
+    p->regs = r;
+    p->number = number;
+    if (port_stop(r) != 0) return -1;
+
+    p->cmd_list = (ahci_command_header *)phys_alloc(sizeof(ahci_command_header) * AHCI_SLOTS, 1024);
+    p->fis = (uint8_t *)phys_alloc(AHCI_FIS_AREA_SIZE, AHCI_FIS_AREA_SIZE);
+    p->tables = (ahci_command_table *)phys_alloc(sizeof(ahci_command_table) * AHCI_SLOTS, 128);
+    if (!p->cmd_list || !p->fis || !p->tables) return -1;
+    uint64_t highest = (uint64_t)p->tables + sizeof(ahci_command_table) * AHCI_SLOTS;
+    if (!(c->cap & AHCI_CAP_S64A) && (highest >> 32)) return -1;
+    memset(p->cmd_list, 0, sizeof(ahci_command_header) * AHCI_SLOTS);
+    memset(p->fis, 0, AHCI_FIS_AREA_SIZE);
+    memset(p->tables, 0, sizeof(ahci_command_table) * AHCI_SLOTS);
+
+    for (uint32_t slot = 0; slot < AHCI_SLOTS; slot++) {
+        p->cmd_list[slot].ctba = (uint32_t)(uint64_t)&p->tables[slot];
+        p->cmd_list[slot].ctbau = (uint32_t)((uint64_t)&p->tables[slot] >> 32);
+    }
+    mmio_write32(&r->clb, (uint32_t)(uint64_t)p->cmd_list);
+    mmio_write32(&r->clbu, (uint32_t)((uint64_t)p->cmd_list >> 32));
+    mmio_write32(&r->fb, (uint32_t)(uint64_t)p->fis);
+    mmio_write32(&r->fbu, (uint32_t)((uint64_t)p->fis >> 32));
+    mmio_write32(&r->ie, 0);
+    mmio_write32(&r->cmd, mmio_read32(&r->cmd) | AHCI_PxCMD_SUD | AHCI_PxCMD_POD);
+    if (port_start(r) != 0) return -1;
+
+    if (port_identify(p, identify) != 0) return -1;
+    if (!(identify[83] & (1 << 10))) return -1;  // LBA48 only
+    uint64_t sectors = identify[100] | ((uint64_t)identify[101] << 16) |
+                       ((uint64_t)identify[102] << 32) | ((uint64_t)identify[103] << 48);
+    if (sectors == 0) return -1;
+    // Logical sectors larger than 512 bytes are not supported
+    if ((identify[106] & 0xC000) == 0x4000 && (identify[106] & (1 << 12))) {
+        uint32_t words = identify[117] | ((uint32_t)identify[118] << 16);
+        if (words * 2 != BLOCK_SECTOR_SIZE) return -1;
+    }
+
+    uint32_t depth = c->slots;
+    p->ncq = (c->cap & AHCI_CAP_SNCQ) && (identify[76] & (1 << 8));
+    if (p->ncq && (uint32_t)(identify[75] & 0x1F) + 1 < depth) {
+        depth = (identify[75] & 0x1F) + 1;
+    }
+    p->slot_mask = (depth == 32) ? 0xFFFFFFFF : (1u << depth) - 1;
+    p->has_write_cache = (identify[85] & (1 << 5)) != 0;
+
+    block_device *dev = &p->dev;
+    dev->name[0] = 's';
+    dev->name[1] = 'd';
+    dev->name[2] = 'a' + port_count;
+    dev->name[3] = '\0';
+    dev->sectors = sectors;
+    dev->max_sectors = AHCI_MAX_SECTORS;
+    dev->queue_depth = depth;
+    dev->read_only = 0;
+    dev->submit = ahci_submit;
+    dev->driver = p;
+    return 0;
+}
+
+static void print_port(ahci_port *p) {
+    char buffer[24];
+    print_string("ahci: ");
+    print_string(p->dev.name);
+    print_string(" ");
+    itoa(p->dev.sectors / 2048, buffer, 10);
+    print_string(buffer);
+    print_string(p->ncq ? " MB, NCQ depth " : " MB, no NCQ, slots ");
+    itoa(p->dev.queue_depth, buffer, 10);
+    print_string(buffer);
+    if (p->c->use_irq) {
+        print_string(", IRQ ");
+        itoa(p->c->pci->irq_line, buffer, 10);
+        print_string(buffer);
+    }
+    print_string("\n");
+}
+
+static int ahci_probe(pci_device *pci, ahci_controller *c) {
+    c->pci = pci;
+    c->hba = (volatile ahci_hba_regs *)pci_map_bar(pci, AHCI_ABAR);
+    if (!c->hba) return -1;
+    pci_enable(pci);
+
+    mmio_write32(&c->hba->ghc, mmio_read32(&c->hba->ghc) | AHCI_GHC_AE);
+    c->cap = mmio_read32(&c->hba->cap);
+    c->slots = ((c->cap >> AHCI_CAP_NCS_SHIFT) & 0x1F) + 1;
+    c->use_irq = 0;
+    return 0;
+}
+
+int ahci_init(void) {
+    for (int nth = 0; controller_count < AHCI_MAX_CONTROLLERS; nth++) {
+        pci_device *pci = pci_find_class(AHCI_PCI_CLASS, AHCI_PCI_SUBCLASS, nth);
+        if (!pci) break;
+
+        ahci_controller *c = &controllers[controller_count];
+        if (ahci_probe(pci, c) != 0) {
+            print_string("ahci: controller setup failed\n");
+            continue;
+        }
+        controller_count++;
+
+        int first = port_count;
+        uint32_t implemented = mmio_read32(&c->hba->pi);
+        for (uint32_t n = 0; n < 32 && port_count < AHCI_MAX_PORTS; n++) {
+            if (!(implemented & (1u << n))) continue;
+            ahci_port *p = &ports[port_count];
+            if (port_probe(c, n, p) != 0) continue;
+            if (block_register(&p->dev) != 0) break;
+            port_count++;
+        }
+        if (port_count == first) continue;
+
+        // Port interrupts are enabled only once every disk is set up
+        c->use_irq = pci->irq_line != PCI_NO_IRQ && irq_register(pci->irq_line, ahci_irq) == 0;
+        if (c->use_irq) {
+            for (int i = first; i < port_count; i++) {
+                mmio_write32(&ports[i].regs->is, 0xFFFFFFFF);
+                mmio_write32(&ports[i].regs->ie, AHCI_PORT_IRQS);
+            }
+            mmio_write32(&c->hba->is, 0xFFFFFFFF);
+            mmio_write32(&c->hba->ghc, mmio_read32(&c->hba->ghc) | AHCI_GHC_IE);
+        }
+        for (int i = first; i < port_count; i++) {
+            print_port(&ports[i]);
+        }
+    }
+    return port_count;
+}
@@ -0,0 +1,316 @@
+#include "bcache.h"
+#include "memory.h"
+#include "vga.h"
+#include <string.h>
+
+typedef struct {
+    block_device *dev;             // 0 when the image has no backing device
+    uint8_t *image;
+    uint32_t block_size;
+    uint32_t sectors_per_block;
+    uint32_t nblocks;
+    uint64_t *resident;            // 1 = the frame holds the block's contents
+    uint64_t *lists[BCACHE_LISTS]; // BCACHE_DIRTY, BCACHE_META, ...
+    uint32_t counts[BCACHE_LISTS];
+    uint64_t bitmap_bytes;         // Capacity of each bitmap
+    int writing;                   // List the queued writes take blocks off
+    uint32_t stream_start;         // Last bcache_read range, for sequential detection
+    uint32_t stream_next;
+    uint32_t window;               // Current readahead window
+    bcache_verify_fn verify;       // Run on every block read, if set
+    bcache_stats stats;
+} bcache_state;
+
+static bcache_state cache;
+static block_request batch[BLOCK_BATCH];
+static int batch_count = 0;
+
+// First index in [from, limit) whose bit equals want, or limit
+static uint32_t bit_find(const uint64_t *bits, uint32_t from, uint32_t limit, int want) {
+    while (from < limit) {
+        uint64_t word = bits[from / 64];
+        if (!want) word = ~word;
+        word &= ~0ULL << (from % 64);
+        if (word) {
+            uint32_t found = (from & ~63u) + __builtin_ctzll(word);
+            return found < limit ? found : limit;
+        }
+        from = (from & ~63u) + 64;
+    }
+    return limit;
+}
+
+// Set bits [start, start + count) to value; returns how many changed
+static uint32_t bits_set(uint64_t *bits, uint32_t start, uint32_t count, int value) {
+    uint32_t changed = 0;
+    for (uint32_t i = start; i < start + count; i++) {
+        uint64_t mask = 1ULL << (i % 64);
+        uint64_t *word = &bits[i / 64];
+        if (((*word & mask) != 0) != value) {
+            *word ^= mask;
+            changed++;
+        }
+    }
+    return changed;
+}
+
+// Clamp [start, start + count) to the volume; returns the end
+static uint32_t range_end(uint32_t start, uint32_t count) {
+    if (start >= cache.nblocks) return start;
+    return (count > cache.nblocks - start) ? cache.nblocks : start + count;
+}
+
+int bcache_attach(block_device *dev, uint8_t *image, uint32_t block_size, uint32_t nblocks, int resident) {
+    uint64_t bytes = ((uint64_t)nblocks + 63) / 64 * sizeof(uint64_t);
+    if (dev && bytes > cache.bitmap_bytes) {
+        uint64_t *bits[BCACHE_LISTS + 1];
+        for (int i = 0; i <= BCACHE_LISTS; i++) {
+            bits[i] = (uint64_t *)phys_alloc(bytes, sizeof(uint64_t));
+            if (!bits[i]) return -1;
+        }
+        cache.resident = bits[BCACHE_LISTS];
+        for (int i = 0; i < BCACHE_LISTS; i++) cache.lists[i] = bits[i];
+        cache.bitmap_bytes = bytes;
+    }
+
+    cache.dev = dev;
+    cache.image = image;
+    cache.block_size = block_size;
+    cache.sectors_per_block = block_size / BLOCK_SECTOR_SIZE;
+    cache.nblocks = nblocks;
+    cache.stream_start = 0;
+    cache.stream_next = 0;
+    cache.window = 0;
+    batch_count = 0;
+    memset(&cache.stats, 0, sizeof(bcache_stats));
+    memset(cache.counts, 0, sizeof(cache.counts));
+    cache.stats.resident = (resident || !dev) ? nblocks : 0;
+    if (dev) {
+        memset(cache.resident, resident ? 0xFF : 0, bytes);
+        for (int i = 0; i < BCACHE_LISTS; i++) memset(cache.lists[i], 0, bytes);
+    }
+    return 0;
+}
+
+// Run the queued requests. Completed reads make their blocks resident,
+// unless a block fails verification, and completed writes take them off
+// the list being written; failed ones leave the state alone.
+static int batch_submit(void) {
+    if (batch_count == 0) return 0;
+    int result = block_submit(cache.dev, batch, batch_count);
+    for (int i = 0; i < batch_count; i++) {
+        block_request *req = &batch[i];
+        uint32_t start = req->sector / cache.sectors_per_block;
+        uint32_t count = req->count / cache.sectors_per_block;
+        if (req->status != 0) {
+            cache.stats.errors++;
+            result = -1;
+        } else if (req->op == BLOCK_OP_READ) {
+            for (uint32_t block = start; block < start + count; block++) {
+                if (cache.verify && cache.verify(block) != 0) {
+                    cache.stats.corrupt++;
+                    continue;
+                }
+                cache.stats.resident += bits_set(cache.resident, block, 1, 1);
+            }
+        } else {
+            int list = cache.writing;
+            cache.counts[list] -= bits_set(cache.lists[list], start, count, 0);
+            cache.stats.writeback += count;
+        }
+    }
+    batch_count = 0;
+    return result;
+}
+
+// Queue blocks [start, start + count) in requests as large as the device
+// takes; the batch goes out whenever it fills
+static int queue_run(uint8_t op, uint32_t start, uint32_t count) {
+    uint32_t per_request = cache.dev->max_sectors / cache.sectors_per_block;
+    if (per_request == 0) return -1;
+
+    int result = 0;
+    while (count > 0) {
+        uint32_t chunk = (count < per_request) ? count : per_request;
+        block_request *req = &batch[batch_count++];
+        req->sector = (uint64_t)start * cache.sectors_per_block;
+        req->buffer = cache.image + (uint64_t)start * cache.block_size;
+        req->count = chunk * cache.sectors_per_block;
+        req->op = op;
+        req->status = BLOCK_PENDING;
+        if (op == BLOCK_OP_WRITE) cache.stats.writeback_requests++;
+        start += chunk;
+        count -= chunk;
+        if (batch_count == BLOCK_BATCH && batch_submit() != 0) result = -1;
+    }
+    return result;
+}
+
+// Read every missing block of [start, ra_end). Blocks before end were asked
+// for; the rest are readahead.
+static int fill(uint32_t start, uint32_t end, uint32_t ra_end) {
+    int result = 0;
+    uint32_t block = start;
+    while (block < ra_end) {
+        uint32_t run = bit_find(cache.resident, block, ra_end, 0);
+        if (run >= ra_end) break;
+        uint32_t run_end = bit_find(cache.resident, run, ra_end, 1);
+        uint32_t split = (run_end < end) ? run_end : end;
+        if (split < run) split = run;
+        cache.stats.misses += split - run;
+        cache.stats.readahead += run_end - split;
+        if (queue_run(BLOCK_OP_READ, run, run_end - run) != 0) result = -1;
+        block = run_end;
+    }
+    if (batch_submit() != 0) result = -1;
+    if (result != 0) {
+        print_string("bcache: read error on ");
+        print_string(cache.dev->name);
+        print_string("\n");
+        return result;
+    }
+    // Blocks that failed verification are still missing
+    return bit_find(cache.resident, start, end, 0) < end ? -1 : 0;
+}
+
+// Make sure [start, start + count) is in memory, reading only what is missing
+int bcache_load(uint32_t start, uint32_t count) {
+    if (!cache.dev) return 0;
+    uint32_t end = range_end(start, count);
+    if (bit_find(cache.resident, start, end, 0) >= end) {
+        cache.stats.hits += end - start;
+        return 0;
+    }
+    uint64_t missed = cache.stats.misses;
+    int result = fill(start, end, end);
+    cache.stats.hits += (end - start) - (cache.stats.misses - missed);
+    return result;
+}
+
+// bcache_load for file data. A range that continues the previous one grows
+// the readahead window (up to BCACHE_READAHEAD_MAX), and a miss then also
+// reads that far ahead, but never past limit (the end of the extent).
+int bcache_read(uint32_t start, uint32_t count, uint32_t limit) {
+    if (!cache.dev) return 0;
+    uint32_t end = range_end(start, count);
+    if (start == cache.stream_next) {
+        cache.window = cache.window ? cache.window * 2 : BCACHE_READAHEAD_MIN;
+        if (cache.window > BCACHE_READAHEAD_MAX) cache.window = BCACHE_READAHEAD_MAX;
+    } else if (start < cache.stream_start || start > cache.stream_next) {
+        cache.window = 0;
+    }
+    cache.stream_start = start;
+    cache.stream_next = end;
+
+    if (bit_find(cache.resident, start, end, 0) >= end) {
+        cache.stats.hits += end - start;
+        return 0;
+    }
+    uint32_t ra_end = range_end(end, cache.window);
+    if (ra_end > limit) ra_end = (limit > end) ? limit : end;
+    uint64_t missed = cache.stats.misses;
+    int result = fill(start, end, ra_end);
+    cache.stats.hits += (end - start) - (cache.stats.misses - missed);
+    return result;
+}
+
+// Blocks about to be overwritten completely: resident without a read
+void bcache_install(uint32_t start, uint32_t count) {
+    if (!cache.dev) return;
+    uint32_t end = range_end(start, count);
+    cache.stats.resident += bits_set(cache.resident, start, end - start, 1);
+}
+
+// Set or clear blocks [start, start + count) on a list
+void bcache_mark(int list, uint32_t start, uint32_t count, int value) {
+    if (!cache.dev) return;
+    uint32_t end = range_end(start, count);
+    uint32_t changed = bits_set(cache.lists[list], start, end - start, value);
+    if (value) cache.counts[list] += changed;
+    else cache.counts[list] -= changed;
+}
+
+void bcache_dirty(uint32_t start, uint32_t count) {
+    bcache_mark(BCACHE_DIRTY, start, count, 1);
+}
+
+// Metadata goes through the journal rather than straight back in place
+void bcache_dirty_meta(uint32_t start, uint32_t count) {
+    bcache_mark(BCACHE_META, start, count, 1);
+}
+
+// Freed blocks: whatever they hold no longer needs writing anywhere
+void bcache_discard(uint32_t start, uint32_t count) {
+    bcache_mark(BCACHE_DIRTY, start, count, 0);
+    bcache_mark(BCACHE_META, start, count, 0);
+}
+
+int bcache_test(int list, uint32_t block) {
+    if (!cache.dev || block >= cache.nblocks) return 0;
+    return (cache.lists[list][block / 64] >> (block % 64)) & 1;
+}
+
+// First block at or after from on the list, or the block count if none
+uint32_t bcache_next(int list, uint32_t from) {
+    if (!cache.dev) return cache.nblocks;
+    return bit_find(cache.lists[list], from, cache.nblocks, 1);
+}
+
+uint32_t bcache_count(int list) {
+    return cache.dev ? cache.counts[list] : 0;
+}
+
+// Take every block off a list
+void bcache_clear(int list) {
+    if (!cache.dev || cache.counts[list] == 0) return;
+    memset(cache.lists[list], 0, (cache.nblocks + 63) / 64 * sizeof(uint64_t));
+    cache.counts[list] = 0;
+}
+
+// The list's bitmap, for callers that scan it a word at a time; 0 when
+// nothing is ever on a list (no backing device)
+const uint64_t *bcache_bits(int list) {
+    return cache.dev ? cache.lists[list] : 0;
+}
+
+// Write every block on the list back in place in ascending block order,
+// adjacent blocks coalesced into the largest requests the device accepts.
+// Blocks leave the list as their writes complete.
+int bcache_write_home(int list) {
+    if (!cache.dev || cache.counts[list] == 0) return 0;
+
+    int result = 0;
+    uint32_t block = 0;
+    cache.writing = list;
+    while (block < cache.nblocks) {
+        uint32_t run = bit_find(cache.lists[list], block, cache.nblocks, 1);
+        if (run >= cache.nblocks) break;
+        uint32_t run_end = bit_find(cache.lists[list], run, cache.nblocks, 0);
+        if (queue_run(BLOCK_OP_WRITE, run, run_end - run) != 0) result = -1;
+        block = run_end;
+    }
+    if (batch_submit() != 0) result = -1;
+    return result;
+}
+
+// File data is written in place
+int bcache_writeback(void) {
+    return bcache_write_home(BCACHE_DIRTY);
+}
+
+// Blocks that still have to reach the disk one way or another
+uint32_t bcache_dirty_count(void) {
+    return bcache_count(BCACHE_DIRTY) + bcache_count(BCACHE_META);
+}
+
+void bcache_set_verify(bcache_verify_fn verify) {
+    cache.verify = verify;
+}
+
+void bcache_get_stats(bcache_stats *stats) {
+    if (!stats) return;
+    *stats = cache.stats;
+    stats->dirty = bcache_count(BCACHE_DIRTY);
+    stats->meta = bcache_count(BCACHE_META);
+    stats->journaled = bcache_count(BCACHE_JOURNALED);
+}
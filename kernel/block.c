@@ -0,0 +1,105 @@
+#include "block.h"
+#include "utils.h"
+
+static block_device *devices[BLOCK_MAX_DEVICES];
+static int device_count = 0;
+static block_request batch[BLOCK_BATCH];  // Too big for a 4KB task stack
+
+int block_register(block_device *dev) {
+    if (!dev || !dev->submit || device_count >= BLOCK_MAX_DEVICES) return -1;
+    if (dev->max_sectors == 0 || dev->queue_depth == 0) return -1;
+    dev->polled = 0;
+    dev->active = 0;
+    dev->requests = 0;
+    dev->bytes_read = 0;
+    dev->bytes_written = 0;
+    devices[device_count++] = dev;
+    return 0;
+}
+
+int block_device_count(void) {
+    return device_count;
+}
+
+block_device *block_get_device(int index) {
+    if (index < 0 || index >= device_count) return 0;
+    return devices[index];
+}
+
+block_device *block_find_device(const char *name) {
+    for (int i = 0; i < device_count; i++) {
+        if (strcmp(devices[i]->name, name) == 0) return devices[i];
+    }
+    return 0;
+}
+
+// Validate a batch and run it on the driver, keeping statistics
+int block_submit(block_device *dev, block_request *reqs, int count) {
+    if (!dev || count <= 0) return -1;
+
+    uint64_t read = 0, written = 0;
+    for (int i = 0; i < count; i++) {
+        block_request *req = &reqs[i];
+        req->status = BLOCK_PENDING;
+        if (req->op == BLOCK_OP_FLUSH) continue;
+        if (req->op > BLOCK_OP_FLUSH || req->count == 0 || req->count > dev->max_sectors ||
+            req->sector > dev->sectors || req->count > dev->sectors - req->sector) {
+            return -1;
+        }
+        if (req->op == BLOCK_OP_WRITE) {
+            if (dev->read_only) return -1;
+            written += (uint64_t)req->count * BLOCK_SECTOR_SIZE;
+        } else {
+            read += (uint64_t)req->count * BLOCK_SECTOR_SIZE;
+        }
+    }
+
+    dev->active++;
+    int result = dev->submit(dev, reqs, count);
+    dev->active--;
+    dev->requests += count;
+    dev->bytes_read += read;
+    dev->bytes_written += written;
+    return result;
+}
+
+// Split [sector, sector + count) into requests of at most max_sectors and
+// hand them to the driver BLOCK_BATCH at a time, so one large transfer keeps
+// the device queue full instead of waiting on each piece.
+static int block_transfer(block_device *dev, uint8_t op, uint64_t sector, uint8_t *buffer, uint64_t count) {
+    if (!dev) return -1;
+
+    while (count > 0) {
+        int n = 0;
+        while (n < BLOCK_BATCH && count > 0) {
+            uint32_t chunk = (count < dev->max_sectors) ? count : dev->max_sectors;
+            batch[n].sector = sector;
+            batch[n].buffer = buffer;
+            batch[n].count = chunk;
+            batch[n].op = op;
+            sector += chunk;
+            buffer += (uint64_t)chunk * BLOCK_SECTOR_SIZE;
+            count -= chunk;
+            n++;
+        }
+        if (block_submit(dev, batch, n) != 0) return -1;
+    }
+    return 0;
+}
+
+int block_read(block_device *dev, uint64_t sector, void *buffer, uint64_t count) {
+    return block_transfer(dev, BLOCK_OP_READ, sector, (uint8_t *)buffer, count);
+}
+
+int block_write(block_device *dev, uint64_t sector, const void *buffer, uint64_t count) {
+    return block_transfer(dev, BLOCK_OP_WRITE, sector, (uint8_t *)buffer, count);
+}
+
+int block_flush(block_device *dev) {
+    block_request request;
+    request.sector = 0;
+    request.buffer = 0;
+    request.count = 0;
+    request.op = BLOCK_OP_FLUSH;
+    return block_submit(dev, &request, 1);
+}
@@ -0,0 +1,163 @@
+#include "crc32c.h"
+#include "cpu.h"
+
+#define CRC32C_POLY 0x82F63B78     // Castagnoli polynomial, bit-reflected
+#define CRC32C_LONG 1024           // Stripe sizes for the three-way hardware loop
+#define CRC32C_SHORT 256           // (powers of two, see crc32c_zeros)
+
+// With SSE4.2 the crc32 instruction does 8 bytes per step, but each step
+// depends on the last and takes three cycles. Checksumming three stripes
+// at once keeps the unit busy every cycle; the three partial CRCs are
+// then joined by shifting the earlier ones over the length of the later
+// stripes, which the zeros tables do with four lookups. Without SSE4.2, slicing-by-8 tables do
+// 8 bytes per step at a few cycles/byte.
+static int use_hardware = 0;
+static int initialized = 0;
+static uint32_t table[8][256];                 // Slicing-by-8
+static uint32_t zeros_long[4][256];            // Shift a CRC past CRC32C_LONG zero bytes
+static uint32_t zeros_short[4][256];           // ... and past CRC32C_SHORT
+
+// Multiply the 32x32 GF(2) matrix mat by vec
+static uint32_t gf2_times(const uint32_t *mat, uint32_t vec) {
+    uint32_t sum = 0;
+    while (vec) {
+        if (vec & 1) sum ^= *mat;
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+static void gf2_square(uint32_t *square, const uint32_t *mat) {
+    for (int n = 0; n < 32; n++) square[n] = gf2_times(mat, mat[n]);
+}
+
+// Tables applying the operator "append len zero bytes" to a CRC one byte
+// of it at a time. len must be a power of two.
+static void crc32c_zeros(uint32_t zeros[4][256], uint32_t len) {
+    uint32_t even[32], odd[32];
+
+    // Operator for one zero bit, then squared up to one zero byte
+    odd[0] = CRC32C_POLY;
+    for (int n = 1; n < 32; n++) odd[n] = 1u << (n - 1);
+    gf2_square(even, odd);         // 2 bits
+    gf2_square(odd, even);         // 4 bits
+    gf2_square(even, odd);         // 1 byte
+    uint32_t *op = even;
+    for (len >>= 1; len; len >>= 1) {
+        uint32_t *next = (op == even) ? odd : even;
+        gf2_square(next, op);
+        op = next;
+    }
+
+    for (uint32_t n = 0; n < 256; n++) {
+        zeros[0][n] = gf2_times(op, n);
+        zeros[1][n] = gf2_times(op, n << 8);
+        zeros[2][n] = gf2_times(op, n << 16);
+        zeros[3][n] = gf2_times(op, n << 24);
+    }
+}
+
+static uint32_t crc32c_shift(uint32_t zeros[4][256], uint32_t crc) {
+    return zeros[0][crc & 0xFF] ^ zeros[1][(crc >> 8) & 0xFF] ^
+           zeros[2][(crc >> 16) & 0xFF] ^ zeros[3][crc >> 24];
+}
+
+void crc32c_init(void) {
+    if (initialized) return;
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++) crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        table[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = table[0][n];
+        for (int k = 1; k < 8; k++) {
+            crc = table[0][crc & 0xFF] ^ (crc >> 8);
+            table[k][n] = crc;
+        }
+    }
+    crc32c_zeros(zeros_long, CRC32C_LONG);
+    crc32c_zeros(zeros_short, CRC32C_SHORT);
+
+    uint32_t a, b, c, d;
+    cpuid(1, &a, &b, &c, &d);
+    use_hardware = (c & CPUID_ECX_SSE42) != 0;
+    initialized = 1;
+}
+
+static inline uint64_t crc32_u64(uint64_t crc, uint64_t value) {
+    __asm__("crc32q %1, %0" : "+r"(crc) : "rm"(value));
+    return crc;
+}
+
+static inline uint32_t crc32_u8(uint32_t crc, uint8_t value) {
+    __asm__("crc32b %1, %0" : "+r"(crc) : "rm"(value));
+    return crc;
+}
+
+// Three stripes of stripe bytes at once while 3 * stripe bytes remain
+static const uint8_t *crc32c_stripes(uint64_t *crc, const uint8_t *next, uint64_t *len,
+                                     uint32_t stripe, uint32_t zeros[4][256]) {
+    while (*len >= 3ULL * stripe) {
+        uint64_t crc0 = *crc, crc1 = 0, crc2 = 0;
+        const uint8_t *end = next + stripe;
+        do {
+            crc0 = crc32_u64(crc0, *(const uint64_t *)next);
+            crc1 = crc32_u64(crc1, *(const uint64_t *)(next + stripe));
+            crc2 = crc32_u64(crc2, *(const uint64_t *)(next + 2 * stripe));
+            next += 8;
+        } while (next < end);
+        crc0 = crc32c_shift(zeros, crc0) ^ crc1;
+        *crc = crc32c_shift(zeros, crc0) ^ crc2;
+        next += 2 * stripe;
+        *len -= 3ULL * stripe;
+    }
+    return next;
+}
+
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *next, uint64_t len) {
+    uint64_t crc0 = crc;
+    while (len && ((uintptr_t)next & 7)) {
+        crc0 = crc32_u8(crc0, *next++);
+        len--;
+    }
+    next = crc32c_stripes(&crc0, next, &len, CRC32C_LONG, zeros_long);
+    next = crc32c_stripes(&crc0, next, &len, CRC32C_SHORT, zeros_short);
+    while (len >= 8) {
+        crc0 = crc32_u64(crc0, *(const uint64_t *)next);
+        next += 8;
+        len -= 8;
+    }
+    while (len--) crc0 = crc32_u8(crc0, *next++);
+    return crc0;
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *next, uint64_t len) {
+    while (len && ((uintptr_t)next & 7)) {
+        crc = table[0][(crc ^ *next++) & 0xFF] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t word = *(const uint64_t *)next ^ crc;
+        crc = table[7][word & 0xFF] ^ table[6][(word >> 8) & 0xFF] ^
+              table[5][(word >> 16) & 0xFF] ^ table[4][(word >> 24) & 0xFF] ^
+              table[3][(word >> 32) & 0xFF] ^ table[2][(word >> 40) & 0xFF] ^
+              table[1][(word >> 48) & 0xFF] ^ table[0][word >> 56];
+        next += 8;
+        len -= 8;
+    }
+    while (len--) crc = table[0][(crc ^ *next++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, uint64_t len) {
+    if (!initialized) crc32c_init();
+    crc = ~crc;
+    crc = use_hardware ? crc32c_hw(crc, (const uint8_t *)data, len) : crc32c_sw(crc, (const uint8_t *)data, len);
+    return ~crc;
+}
+
+int crc32c_hardware(void) {
+    return use_hardware;
+}
@@ -0,0 +1,272 @@
+#include "fbcon.h"
+#include "framebuffer.h"
+#include "font.h"
+#include "utils.h"
+
+#define FBCON_CACHE_BYTES (1024 * 1024)   // Pool for pre-expanded glyphs
+#define FBCON_CACHED_GLYPHS 256           // Glyphs per color pair
+
+int fbcon_active = 0;
+uint32_t fbcon_cols = 0;
+uint32_t fbcon_rows = 0;
+
+// Standard VGA text palette so attribute bytes keep their meaning
+static const uint32_t vga_palette[16] = {
+    0x000000, 0x0000AA, 0x00AA00, 0x00AAAA, 0xAA0000, 0xAA00AA, 0xAA5500, 0xAAAAAA,
+    0x555555, 0x5555FF, 0x55FF55, 0x55FFFF, 0xFF5555, 0xFF55FF, 0xFFFF55, 0xFFFFFF
+};
+
+// Parsed PSF font
+static const uint8_t *glyph_bitmaps = 0;
+static uint32_t glyph_count = 0;
+static uint32_t glyph_width = 0;
+static uint32_t glyph_height = 0;
+static uint32_t glyph_stride = 0;         // Bytes per bitmap row
+static uint32_t glyph_bytes = 0;          // Bytes per glyph bitmap
+static uint32_t glyph_pixels = 0;         // Pixels per expanded glyph
+
+// Expanded glyphs for one foreground/background pair, filled lazily
+typedef struct {
+    uint8_t attr;                         // VGA attribute (bg << 4 | fg)
+    uint8_t in_use;
+    uint32_t last_used;
+    uint32_t valid[FBCON_CACHED_GLYPHS / 32];
+    uint32_t *pixels;
+} glyph_cache_slot;
+
+static uint32_t glyph_pool[FBCON_CACHE_BYTES / 4] __attribute__((aligned(64)));
+static glyph_cache_slot glyph_cache[FBCON_CACHE_SLOTS];
+static uint32_t glyph_cache_slots = 0;
+static uint32_t glyph_cache_clock = 0;
+static glyph_cache_slot *last_slot = 0;
+
+// Back buffer holds the text area as a ring of text rows: visible row r is
+// stored at ring row (ring_top + r) % fbcon_rows, so scrolling only moves
+// ring_top and clears one row. The framebuffer is then refreshed with one
+// big copy per ring segment.
+static uint32_t back_buffer[FBCON_MAX_WIDTH * FBCON_MAX_HEIGHT] __attribute__((aligned(64)));
+static uint32_t back_width = 0;           // Pixels per back buffer scanline
+static uint32_t ring_top = 0;
+static int redraw_pending = 0;
+
+static void fill32(uint32_t *dst, uint32_t value, uint64_t count) {
+    __asm__ volatile("rep stosl" : "+D"(dst), "+c"(count) : "a"(value) : "memory");
+}
+
+static uint32_t *ring_row_pixels(uint32_t ring_row) {
+    return back_buffer + (uint64_t)ring_row * glyph_height * back_width;
+}
+
+static uint32_t *visible_row_pixels(uint32_t row) {
+    return ring_row_pixels((ring_top + row) % fbcon_rows);
+}
+
+static uint8_t *fb_row_address(uint32_t row) {
+    return (uint8_t *)fb_info.addr + (uint64_t)row * glyph_height * fb_info.pitch;
+}
+
+static int fbcon_load_font(const uint8_t *font, uint32_t size) {
+    if (size >= sizeof(psf2_header) && ((const psf2_header *)font)->magic == PSF2_MAGIC) {
+        const psf2_header *hdr = (const psf2_header *)font;
+        if (hdr->width == 0 || hdr->width > FBCON_MAX_GLYPH_WIDTH ||
+            hdr->height == 0 || hdr->height > FBCON_MAX_GLYPH_HEIGHT) {
+            return -1;
+        }
+        glyph_bitmaps = font + hdr->headersize;
+        glyph_count = hdr->numglyph;
+        glyph_width = hdr->width;
+        glyph_height = hdr->height;
+        glyph_bytes = hdr->bytesperglyph;
+    } else if (size >= sizeof(psf1_header) && font[0] == PSF1_MAGIC0 && font[1] == PSF1_MAGIC1) {
+        const psf1_header *hdr = (const psf1_header *)font;
+        if (hdr->charsize == 0 || hdr->charsize > FBCON_MAX_GLYPH_HEIGHT) {
+            return -1;
+        }
+        glyph_bitmaps = font + sizeof(psf1_header);
+        glyph_count = (hdr->mode & PSF1_MODE512) ? 512 : 256;
+        glyph_width = 8;
+        glyph_height = hdr->charsize;
+        glyph_bytes = hdr->charsize;
+    } else {
+        return -1;
+    }
+
+    glyph_stride = (glyph_width + 7) / 8;
+    glyph_pixels = glyph_width * glyph_height;
+    if (glyph_bitmaps + (uint64_t)glyph_count * glyph_bytes > font + size) {
+        return -1;
+    }
+    return 0;
+}
+
+// Find (or recycle the least recently used) cache slot for a color pair
+static glyph_cache_slot *glyph_cache_lookup(uint8_t attr) {
+    glyph_cache_clock++;
+    if (last_slot && last_slot->attr == attr) {
+        last_slot->last_used = glyph_cache_clock;
+        return last_slot;
+    }
+
+    glyph_cache_slot *victim = &glyph_cache[0];
+    for (uint32_t i = 0; i < glyph_cache_slots; i++) {
+        glyph_cache_slot *slot = &glyph_cache[i];
+        if (slot->in_use && slot->attr == attr) {
+            slot->last_used = glyph_cache_clock;
+            last_slot = slot;
+            return slot;
+        }
+        if (!slot->in_use || (victim->in_use && slot->last_used < victim->last_used)) {
+            victim = slot;
+        }
+    }
+
+    victim->attr = attr;
+    victim->in_use = 1;
+    victim->last_used = glyph_cache_clock;
+    for (uint32_t i = 0; i < FBCON_CACHED_GLYPHS / 32; i++) {
+        victim->valid[i] = 0;
+    }
+    last_slot = victim;
+    return victim;
+}
+
+// Return the 32-bpp expansion of a glyph, expanding it on first use
+static const uint32_t *glyph_expanded(uint8_t c, uint8_t attr) {
+    glyph_cache_slot *slot = glyph_cache_lookup(attr);
+    uint32_t *pixels = slot->pixels + (uint32_t)c * glyph_pixels;
+
+    if (slot->valid[c / 32] & (1u << (c % 32))) {
+        return pixels;
+    }
+
+    uint32_t fg = vga_palette[attr & 0x0F];
+    uint32_t bg = vga_palette[(attr >> 4) & 0x0F];
+    const uint8_t *bitmap = glyph_bitmaps + (uint32_t)(c < glyph_count ? c : 0) * glyph_bytes;
+
+    for (uint32_t y = 0; y < glyph_height; y++) {
+        const uint8_t *line = bitmap + y * glyph_stride;
+        for (uint32_t x = 0; x < glyph_width; x++) {
+            int set = line[x / 8] & (0x80 >> (x % 8));
+            pixels[y * glyph_width + x] = set ? fg : bg;
+        }
+    }
+
+    slot->valid[c / 32] |= 1u << (c % 32);
+    return pixels;
+}
+
+int fbcon_init(void) {
+    if (fb_info.addr == 0 || fb_info.bpp != 32) {
+        return -1;
+    }
+    if (fbcon_load_font(console_font_psf, console_font_psf_size) != 0) {
+        return -1;
+    }
+
+    uint32_t width = fb_info.width < FBCON_MAX_WIDTH ? fb_info.width : FBCON_MAX_WIDTH;
+    uint32_t height = fb_info.height < FBCON_MAX_HEIGHT ? fb_info.height : FBCON_MAX_HEIGHT;
+
+    // cursor_row/cursor_col are 8-bit, so cap the grid at 255x255 cells
+    fbcon_cols = width / glyph_width;
+    fbcon_rows = height / glyph_height;
+    if (fbcon_cols > 255) fbcon_cols = 255;
+    if (fbcon_rows > 255) fbcon_rows = 255;
+    if (fbcon_cols == 0 || fbcon_rows == 0) {
+        return -1;
+    }
+    back_width = fbcon_cols * glyph_width;
+
+    // Carve the glyph pool into one slot per cached color pair
+    uint32_t slot_pixels = FBCON_CACHED_GLYPHS * glyph_pixels;
+    glyph_cache_slots = (FBCON_CACHE_BYTES / 4) / slot_pixels;
+    if (glyph_cache_slots > FBCON_CACHE_SLOTS) glyph_cache_slots = FBCON_CACHE_SLOTS;
+    for (uint32_t i = 0; i < glyph_cache_slots; i++) {
+        glyph_cache[i].in_use = 0;
+        glyph_cache[i].pixels = glyph_pool + i * slot_pixels;
+    }
+    last_slot = 0;
+
+    fbcon_active = 1;
+    fbcon_clear(0x0F);
+    return 0;
+}
+
+void fbcon_put_char(char c, uint32_t row, uint32_t col, uint8_t attr) {
+    if (!fbcon_active || row >= fbcon_rows || col >= fbcon_cols) return;
+
+    const uint64_t *glyph = (const uint64_t *)glyph_expanded((uint8_t)c, attr);
+    uint32_t words = glyph_width / 2;     // Two pixels per 64-bit store
+    uint32_t *cell = visible_row_pixels(row) + col * glyph_width;
+
+    for (uint32_t y = 0; y < glyph_height; y++) {
+        uint64_t *dst = (uint64_t *)(cell + y * back_width);
+        for (uint32_t i = 0; i < words; i++) {
+            dst[i] = glyph[i];
+        }
+        if (glyph_width & 1) {
+            ((uint32_t *)dst)[glyph_width - 1] = ((const uint32_t *)glyph)[glyph_width - 1];
+        }
+        glyph = (const uint64_t *)((const uint32_t *)glyph + glyph_width);
+    }
+
+    // A pending full redraw will pick this cell up; otherwise push it now
+    if (redraw_pending) return;
+
+    uint8_t *fb = fb_row_address(row) + col * glyph_width * 4;
+    for (uint32_t y = 0; y < glyph_height; y++) {
+        memcpy(fb + y * fb_info.pitch, cell + y * back_width, glyph_width * 4);
+    }
+}
+
+void fbcon_scroll(uint8_t attr) {
+    if (!fbcon_active) return;
+
+    // The old top row becomes the new bottom row
+    fill32(ring_row_pixels(ring_top), vga_palette[(attr >> 4) & 0x0F],
+           (uint64_t)glyph_height * back_width);
+    ring_top = (ring_top + 1) % fbcon_rows;
+    redraw_pending = 1;
+}
+
+void fbcon_clear(uint8_t attr) {
+    if (!fbcon_active) return;
+
+    uint32_t bg = vga_palette[(attr >> 4) & 0x0F];
+    fill32(back_buffer, bg, (uint64_t)fbcon_rows * glyph_height * back_width);
+    for (uint32_t y = 0; y < fb_info.height; y++) {
+        fill32((uint32_t *)((uint8_t *)fb_info.addr + (uint64_t)y * fb_info.pitch), bg, fb_info.width);
+    }
+    ring_top = 0;
+    redraw_pending = 0;
+}
+
+// Copy the back buffer to the framebuffer if a scroll left it stale
+void fbcon_present(void) {
+    if (!fbcon_active || !redraw_pending) return;
+
+    uint64_t row_bytes = (uint64_t)back_width * 4;
+    uint32_t first = fbcon_rows - ring_top;   // Text rows before the ring wraps
+
+    if (fb_info.pitch == row_bytes) {
+        uint64_t text_row_bytes = row_bytes * glyph_height;
+        memcpy(fb_row_address(0), ring_row_pixels(ring_top), first * text_row_bytes);
+        memcpy(fb_row_address(first), ring_row_pixels(0), ring_top * text_row_bytes);
+    } else {
+        for (uint32_t row = 0; row < fbcon_rows; row++) {
+            uint8_t *fb = fb_row_address(row);
+            uint32_t *src = visible_row_pixels(row);
+            for (uint32_t y = 0; y < glyph_height; y++) {
+                memcpy(fb + y * fb_info.pitch, src + y * back_width, row_bytes);
+            }
+        }
+    }
+    redraw_pending = 0;
+}
+
+// Unconditionally repaint the whole console; returns the bytes written
+uint64_t fbcon_redraw(void) {
+    if (!fbcon_active) return 0;
+    redraw_pending = 1;
+    fbcon_present();
+    return (uint64_t)fbcon_rows * glyph_height * back_width * 4;
+}
@@ -1,15 +1,161 @@
 #include "filesystem.h"
+#include "bcache.h"
+#include "cpu.h"
+#include "crc32c.h"
+#include "journal.h"
+#include "lz4.h"
+#include "memory.h"
 #include "vga.h"
 #include "utils.h"
 #include "task.h"
 #include <string.h>
 
-static uint8_t fs_buffer[FS_SIZE] __attribute__((aligned(16)));
-static fs_superblock *superblock = (fs_superblock *)fs_buffer;
-static fs_fat_entry *fat = (fs_fat_entry *)(fs_buffer + sizeof(fs_superblock));
-static uint8_t *data_area = fs_buffer + sizeof(fs_superblock) + sizeof(fs_fat_entry) * MAX_BLOCKS;
+// Mounted volume. The superblock, bitmap and inode table all point into the
+// image; nothing about the geometry is compiled in.
+static uint8_t *volume = 0;
+static fs_superblock *superblock = 0;
+static uint64_t *block_bitmap = 0;     // 1 = used
+static uint16_t *block_refs = 0;       // Owners per block
+static fs_inode *inode_table = 0;
+static uint32_t *block_sums = 0;       // CRC32C per block
+
+// Memory set aside for volumes formatted by fs_mkfs
+static uint8_t *volume_memory = 0;
+static uint64_t volume_capacity = 0;
 
 static int fs_initialized = 0;
+static fs_file open_files[FS_MAX_OPEN];
+static block_device *backing_device = 0;  // Disk the volume is loaded from and synced to
+static uint32_t alloc_hint = 0;        // Next-fit position for blocks
+static uint32_t inode_hint = 1;        // Next-fit position for inodes
+static uint32_t cwd_inode = ROOT_INODE; // Where relative paths start
+static uint32_t shared_block_count = 0;
+static uint32_t extra_refs = 0;        // Owners beyond the first, summed over all blocks
+static int format_pending = 0;         // mkfs output not yet on the disk at all
+
+// Checksums are brought up to date in one pass before each commit rather
+// than on every write, so a block changed many times between syncs is
+// summed once. Until then its sum is stale and nothing checks it.
+static uint64_t *sums_stale = 0;       // 1 = block changed since its sum was taken
+static uint64_t stale_capacity = 0;    // Bytes allocated for sums_stale
+static uint32_t checksum_errors = 0;
+static uint32_t scrub_cursor = 0;      // Next block fs_scrub checks
+static uint64_t scrubbed_blocks = 0;
+static uint32_t scrub_passes = 0;
+static uint8_t scrub_buffer[FS_SCRUB_MAX * BLOCK_SIZE] __attribute__((aligned(BLOCK_SIZE)));
+static uint32_t defrag_cursor = 1;     // Next inode fs_defrag looks at
+static uint64_t defrag_moved = 0;
+static uint32_t defrag_passes = 0;
+
+// Compressed files (FS_FLAG_COMPRESSED) are cut into clusters compressed
+// one by one, so reading at any offset decodes a single cluster. Decoded
+// clusters stay in a small LRU cache; a sequential reader decodes each one
+// once and copies the rest of its reads out of memory.
+typedef struct {
+    uint32_t ino;                  // NO_INODE for an empty slot
+    uint32_t cluster;
+    uint32_t len;                  // Bytes decoded
+    uint32_t last_use;
+} cluster_slot;
+
+static cluster_slot cluster_cache[FS_CLUSTER_CACHE];
+static uint8_t *cluster_memory = 0;    // FS_CLUSTER_CACHE decoded clusters, allocated on first use
+static uint32_t cluster_clock = 0;
+static uint64_t cluster_hits = 0;
+static uint64_t cluster_decodes = 0;
+static uint64_t decoded_bytes = 0;
+static uint64_t decode_cycles = 0;
+static uint8_t cluster_buffer[FS_CLUSTER_SIZE];   // A cluster read whole: compressor input, or stored data spanning extents
+static uint8_t compress_buffer[FS_CLUSTER_SIZE];  // Compressor output
+
+// Holes in a file read as zeros out of here: fs_read_iov hands out pieces
+// of it, and read_range clears the buffer instead of copying them
+#define ZERO_SPAN 65536                // Longest hole piece map_range returns
+static uint8_t zero_span[ZERO_SPAN];
+
+// Deduplication (opt-in, per mount). File blocks written while it is on are
+// hashed into an index of DEDUP_WAYS-slot buckets; a block whose contents are already in
+// the volume is mapped to the existing copy, which gains an owner, and its
+// own block is freed. The index only says where to look: a candidate must
+// still be the block that was indexed (freeing it clears its bit in
+// dedup_indexed) and must compare equal byte for byte.
+typedef struct {
+    uint64_t hash;
+    uint32_t block;
+} dedup_entry;
+
+#define DEDUP_WAYS 4                   // Slots probed from a hash's home slot
+
+static int dedup_enabled = 0;
+static dedup_entry *dedup_index = 0;
+static uint32_t dedup_slots = 0;       // Power of two, at least the volume's block count
+static uint64_t *dedup_indexed = 0;    // 1 = the block is in the index under its current contents
+static uint32_t dedup_capacity = 0;    // Blocks the index and bitmap were allocated for
+static uint64_t dedup_hits = 0;        // Blocks written that turned out to be duplicates
+
+// Totals fs_get_stats reports, counted once at mount and then kept current
+// by every path that creates, frees, resizes or (de)compresses an inode
+typedef struct {
+    uint32_t files;
+    uint32_t directories;
+    uint64_t file_bytes;           // Sum of file sizes
+    uint32_t compressed_files;
+    uint64_t compressed_bytes;     // Their sizes
+    uint64_t compressed_blocks;    // Blocks their extents map
+    uint64_t file_extents;         // Extents of all files
+    uint32_t fragmented_files;     // Files in more than one extent
+} fs_totals;
+
+static fs_totals totals;
+
+// Indirect extent blocks made for fs_snapshot_restore before it changes
+// anything
+static uint32_t *restore_copies = 0;
+static uint32_t restore_capacity = 0;
+
+// Name index: the name and parent of every linked inode, so find can
+// answer without walking the tree. Each name is chained twice: by a hash
+// of the whole name, for exact lookups, and by a hash of its first
+// NAME_PREFIX bytes, so a prefix at least that long (or a glob's literal
+// start) only visits names sharing it. Built on first use after a mount
+// and kept current by add_child_to_directory and
+// remove_child_from_directory from then on.
+#define NAME_BUCKETS 1024
+#define NAME_PREFIX 2
+#define NAME_ARENA_MIN 65536
+#define NAME_BY_NAME 0
+#define NAME_BY_PREFIX 1
+
+typedef struct {
+    uint32_t parent;               // NO_INODE if the inode has no name
+    uint32_t name;                 // Offset of the name in name_arena
+    uint32_t next[2];              // Next inode in each chain
+    uint8_t len;
+} name_entry;
+
+static int names_built = 0;
+static name_entry *name_entries = 0;    // By inode number
+static uint32_t name_entries_capacity = 0;
+static char *name_arena = 0;
+static uint32_t name_arena_size = 0;
+static uint32_t name_arena_used = 0;
+static uint32_t name_heads[2][NAME_BUCKETS];
+
+// Dentry cache: direct-mapped on (parent inode, name hash). A slot either
+// names a child inode or records that the name is absent (negative entry).
+// Names longer than DCACHE_NAME_MAX are always looked up in the directory.
+typedef struct {
+    uint32_t hash;
+    uint32_t parent;
+    uint32_t child;                // DCACHE_NEGATIVE if the name does not exist
+    uint8_t valid;
+    uint8_t name_len;
+    char name[DCACHE_NAME_MAX];
+} dcache_entry;
+
+static dcache_entry dcache[DCACHE_SIZE];
+static uint32_t dcache_hits = 0;
+static uint32_t dcache_misses = 0;
 
 // Helper: String length with bounds checking
 int fs_strlen(const char *str) {
@@ -19,17 +165,6 @@ int fs_strlen(const char *str) {
     return len;
 }
 
-// Helper: String copy with bounds checking
-void fs_strcpy(char *dest, const char *src) {
-    if (!dest || !src) return;
-    int i = 0;
-    while (src[i] && i < MAX_FILENAME - 1) {
-        dest[i] = src[i];
-        i++;
-    }
-    dest[i] = '\0';
-}
-
 // Helper: String compare with null checks
 int fs_strcmp(const char *str1, const char *str2) {
     if (!str1 || !str2) return -1;
@@ -49,9 +184,10 @@ void fs_memset(void *ptr, int value, uint32_t size) {
     }
 }
 
-// Helper: Extract filename from path
-void extract_filename(const char *path, char *filename) {
-    if (!path || !filename) return;
+// Helper: Extract filename from path. Returns its length, or -1 if the
+// name is empty, "." or "..", or longer than FS_MAX_NAME.
+int extract_filename(const char *path, char *filename) {
+    if (!path || !filename) return -1;
     
     const char *last_slash = path;
     const char *p = path;
@@ -64,13 +200,16 @@ void extract_filename(const char *path, char *filename) {
     
     // Copy filename with bounds checking
     int i = 0;
-    while (*last_slash && i < MAX_FILENAME - 1) {
+    while (*last_slash && i < FS_MAX_NAME) {
         filename[i++] = *last_slash++;
     }
     filename[i] = '\0';
+    if (i == 0 || *last_slash) return -1;
+    if (filename[0] == '.' && (i == 1 || (i == 2 && filename[1] == '.'))) return -1;
+    return i;
 }
 
-// Helper: Get parent path
+// Helper: Get parent path; "" (the current directory) if path has no slash
 void get_parent_path(const char *path, char *parent) {
     if (!path || !parent) return;
     
@@ -85,490 +224,2950 @@ void get_parent_path(const char *path, char *parent) {
         }
     }
     
-    if (last_slash <= 0) {
+    if (last_slash < 0) {
+        parent[0] = '\0';
+    } else if (last_slash == 0) {
         parent[0] = '/';
         parent[1] = '\0';
     } else {
-        for (int i = 0; i < last_slash && i < 255; i++) {
+        if (last_slash > FS_MAX_PATH - 1) last_slash = FS_MAX_PATH - 1;
+        for (int i = 0; i < last_slash; i++) {
             parent[i] = path[i];
         }
         parent[last_slash] = '\0';
     }
 }
 
-// Helper: Validate file index
-int is_valid_file_index(int index) {
-    return (index >= 0 && index < MAX_FILES);
+// Helper: Inode by number, or 0 if out of range
+static fs_inode *get_inode(uint32_t ino) {
+    if (ino == NO_INODE || ino > superblock->inode_count) return 0;
+    return &inode_table[ino - 1];
+}
+
+static int is_directory(uint32_t ino) {
+    fs_inode *inode = get_inode(ino);
+    return inode && inode->type == FS_TYPE_DIR;
 }
 
 // Helper: Validate block index
-int is_valid_block_index(uint16_t block) {
-    return (block > 0 && block < MAX_BLOCKS);
+int is_valid_block_index(uint32_t block) {
+    return (block >= superblock->data_start && block < superblock->total_blocks);
 }
 
-// Helper: Find file or directory by path
-int find_entry(const char *path, int *parent_index) {
-    if (!fs_initialized) return -1;
-    if (parent_index) *parent_index = 255;
-    
-    // Handle root directory
-    if (!path || path[0] == '\0' || (path[0] == '/' && path[1] == '\0')) {
-        for (int i = 0; i < MAX_FILES; i++) {
-            if (superblock->files[i].name[0] != '\0' && 
-                superblock->files[i].is_directory && 
-                superblock->files[i].parent_index == 255) {
-                return i;
-            }
-        }
-        return -1;
+// Checksum helpers
+static int sum_stale(uint32_t block) {
+    return (sums_stale[block / 64] >> (block % 64)) & 1;
+}
+
+static void mark_stale(uint32_t start, uint32_t count) {
+    for (uint32_t block = start; block < start + count; block++) {
+        sums_stale[block / 64] |= 1ULL << (block % 64);
     }
-    
-    // Start from root
-    int current_index = find_entry("/", NULL);
-    if (current_index == -1) return -1;
-    
-    char path_copy[256];
-    fs_strcpy(path_copy, path);
-    
-    // Skip leading slash
-    char *token = path_copy;
-    if (*token == '/') token++;
-    
-    char *next_slash;
-    while (*token) {
-        // Find next component
-        next_slash = token;
-        while (*next_slash && *next_slash != '/') next_slash++;
-        
-        char component[MAX_FILENAME];
-        int comp_len = next_slash - token;
-        if (comp_len >= MAX_FILENAME) return -1;
-        
-        for (int i = 0; i < comp_len; i++) {
-            component[i] = token[i];
-        }
-        component[comp_len] = '\0';
-        
-        // Search in current directory
-        int found = -1;
-        if (!is_valid_file_index(current_index) || !superblock->files[current_index].is_directory) {
-            return -1;
+}
+
+// Blocks whose contents changed: data is written back in place, metadata
+// through the journal
+static void data_dirty(uint32_t start, uint32_t count) {
+    bcache_dirty(start, count);
+    mark_stale(start, count);
+}
+
+static void meta_dirty(uint32_t start, uint32_t count) {
+    bcache_dirty_meta(start, count);
+    mark_stale(start, count);
+}
+
+// Whether a block carries a checksum: it must be in use, and neither part
+// of the checksum table nor of the journal
+static int block_summed(uint32_t block) {
+    if (block >= superblock->total_blocks) return 0;
+    if (block >= superblock->checksum_start && block < superblock->checksum_start + superblock->checksum_blocks) {
+        return 0;
+    }
+    if (block >= superblock->journal_start && block < superblock->data_start) return 0;
+    return (block_bitmap[block / 64] >> (block % 64)) & 1;
+}
+
+static uint32_t checksum_of(const uint8_t *data) {
+    return crc32c(0, data, BLOCK_SIZE);
+}
+
+static void checksum_error(uint32_t block) {
+    char buffer[16];
+    checksum_errors++;
+    print_string("Filesystem: checksum mismatch in block ");
+    itoa(block, buffer, 10);
+    print_string(buffer);
+    print_string("\n");
+}
+
+// Block cache hook: check every block read from the disk against its sum
+static int verify_block(uint32_t block) {
+    if (!fs_initialized || !block_summed(block) || sum_stale(block)) return 0;
+    if (checksum_of(volume + (uint64_t)block * BLOCK_SIZE) == block_sums[block]) return 0;
+    checksum_error(block);
+    return -1;
+}
+
+// Helper: Address of a block, read from the backing device on first use
+static uint8_t *block_ptr(uint32_t block) {
+    bcache_load(block, 1);
+    return volume + (uint64_t)block * BLOCK_SIZE;
+}
+
+// Helper: Address of bytes [offset, offset + len) of the run starting at
+// block start, about to be overwritten. Blocks the range covers completely
+// need no read; only partial blocks at either edge are loaded.
+static uint8_t *write_ptr(uint32_t start, uint64_t offset, uint64_t len) {
+    uint32_t first = start + offset / BLOCK_SIZE;
+    uint32_t last = start + (offset + len - 1) / BLOCK_SIZE;
+    if (offset % BLOCK_SIZE) bcache_load(first, 1);
+    if ((offset + len) % BLOCK_SIZE) bcache_load(last, 1);
+    bcache_install(first, last - first + 1);
+    data_dirty(first, last - first + 1);
+    return volume + (uint64_t)start * BLOCK_SIZE + offset;
+}
+
+// Metadata is journaled per table block: each helper marks the block
+// holding the entry that changed
+static void superblock_dirty(void) {
+    meta_dirty(0, 1);
+}
+
+static void bitmap_dirty(uint32_t block) {
+    meta_dirty(superblock->bitmap_start + block / (BLOCK_SIZE * 8), 1);
+}
+
+static void refs_dirty(uint32_t block) {
+    meta_dirty(superblock->refcount_start + block / REFS_PER_BLOCK, 1);
+}
+
+static void inode_dirty(fs_inode *inode) {
+    meta_dirty(superblock->inode_start + (uint32_t)(inode - inode_table) / INODES_PER_BLOCK, 1);
+}
+
+// An inode's extent list changed: the inode and its indirect block
+static void extents_dirty(fs_inode *inode) {
+    inode_dirty(inode);
+    if (inode->indirect_block != NO_BLOCK) meta_dirty(inode->indirect_block, 1);
+}
+
+// The table block holding a block's checksum. The table has no sums of its
+// own, so it is not marked stale.
+static void sums_dirty(uint32_t block) {
+    bcache_dirty_meta(superblock->checksum_start + block / SUMS_PER_BLOCK, 1);
+}
+
+// Bitmap helpers
+static int block_in_use(uint32_t block) {
+    return (block_bitmap[block / 64] >> (block % 64)) & 1;
+}
+
+static void mark_block_used(uint32_t block) {
+    block_bitmap[block / 64] |= 1ULL << (block % 64);
+    superblock->free_blocks--;
+    bitmap_dirty(block);
+    superblock_dirty();
+}
+
+static void mark_block_free(uint32_t block) {
+    block_bitmap[block / 64] &= ~(1ULL << (block % 64));
+    superblock->free_blocks++;
+    bitmap_dirty(block);
+    superblock_dirty();
+}
+
+// Reference counts: a used block has one owner per file mapping it. Clones
+// add owners, and a block goes back to the bitmap when its last owner lets go.
+static void ref_block(uint32_t block) {
+    if (++block_refs[block] == 2) shared_block_count++;
+    if (block_refs[block] > 1) extra_refs++;
+    refs_dirty(block);
+}
+
+static int block_shared(uint32_t block) {
+    return block_refs[block] > 1;
+}
+
+// Free blocks that must not be handed out yet. A block freed since the last
+// commit could still belong to its old owner after a crash, and a block the
+// journal holds a copy of would have that copy replayed over its new
+// contents. When nothing else is left, a checkpoint releases the second
+// kind and the first is reused anyway until the next commit.
+static int reuse_freed = 0;
+
+// Bitmap word index with the blocks held back counted as used
+static uint64_t bitmap_word(uint32_t index) {
+    uint64_t word = block_bitmap[index];
+    if (bcache_count(BCACHE_JOURNALED)) word |= bcache_bits(BCACHE_JOURNALED)[index];
+    if (!reuse_freed && bcache_count(BCACHE_FREED)) word |= bcache_bits(BCACHE_FREED)[index];
+    return word;
+}
+
+static int block_available(uint32_t block) {
+    return !((bitmap_word(block / 64) >> (block % 64)) & 1);
+}
+
+// Out of space: release the blocks held back. Returns 1 if that may help.
+static int release_held_blocks(void) {
+    if (reuse_freed) return 0;
+    if (bcache_count(BCACHE_FREED) == 0 && bcache_count(BCACHE_JOURNALED) == 0) return 0;
+    journal_checkpoint();
+    reuse_freed = 1;
+    return 1;
+}
+
+// First block >= from and < limit whose bit equals want_used, or limit.
+// Works a 64-bit word at a time; tzcnt/bsf locates the bit inside a word.
+static uint32_t bitmap_find(uint32_t from, uint32_t limit, int want_used) {
+    while (from < limit) {
+        uint64_t word = bitmap_word(from / 64);
+        if (!want_used) word = ~word;
+        word &= ~0ULL << (from % 64);
+        if (word) {
+            uint32_t found = (from & ~63u) + __builtin_ctzll(word);
+            return found < limit ? found : limit;
         }
-        
-        uint16_t block = superblock->files[current_index].first_block;
-        while (is_valid_block_index(block) && block != 0xFFFE) {
-            uint8_t *block_data = data_area + block * BLOCK_SIZE;
-            for (int i = 0; i < MAX_CHILDREN; i++) {
-                uint8_t child_index = block_data[i];
-                if (is_valid_file_index(child_index) &&
-                    superblock->files[child_index].name[0] != '\0' &&
-                    fs_strcmp(superblock->files[child_index].name, component) == 0) {
-                    found = child_index;
-                    break;
-                }
-            }
-            if (found != -1) break;
-            
-            if (fat[block].next_block == 0xFFFE) break;
-            block = fat[block].next_block;
+        from = (from & ~63u) + 64;
+    }
+    return limit;
+}
+
+// Find a run of count free blocks in [from, limit), or return 0
+static uint32_t find_free_run(uint32_t from, uint32_t limit, uint32_t count) {
+    while (from < limit) {
+        uint32_t start = bitmap_find(from, limit, 0);
+        if (start >= limit || limit - start < count) return 0;
+        uint32_t end = bitmap_find(start, start + count, 1);
+        if (end - start >= count) return start;
+        from = end;
+    }
+    return 0;
+}
+
+// Mark a free run used and move the next-fit hint past it. A fresh block's
+// old contents are never read, so it is not fetched from the device.
+static void claim_run(uint32_t start, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        mark_block_used(start + i);
+        block_refs[start + i] = 1;
+        refs_dirty(start + i);
+    }
+    bcache_install(start, count);
+    bcache_mark(BCACHE_FRESH, start, count, 1);
+    alloc_hint = start + count;
+    if (alloc_hint >= superblock->total_blocks) alloc_hint = superblock->data_start;
+}
+
+// Next-fit: search from the last allocation, then wrap around once
+static uint32_t next_free_run(uint32_t count) {
+    uint32_t total = superblock->total_blocks;
+    uint32_t start = find_free_run(alloc_hint, total, count);
+    if (start == 0) {
+        uint32_t wrap_limit = alloc_hint + count - 1;
+        if (wrap_limit > total) wrap_limit = total;
+        start = find_free_run(superblock->data_start, wrap_limit, count);
+    }
+    return start;
+}
+
+// First free block from the hint on, wrapping around; total if none
+static uint32_t next_free_block(void) {
+    uint32_t total = superblock->total_blocks;
+    uint32_t start = bitmap_find(alloc_hint, total, 0);
+    if (start >= total) start = bitmap_find(superblock->data_start, total, 0);
+    return start;
+}
+
+// Helper: Allocate a run of count sequential blocks
+uint32_t allocate_contiguous(uint32_t count) {
+    if (!fs_initialized || count == 0 || count > superblock->free_blocks) return NO_BLOCK;
+
+    uint32_t start = next_free_run(count);
+    if (start == 0 && release_held_blocks()) start = next_free_run(count);
+    if (start == 0) return NO_BLOCK;
+
+    claim_run(start, count);
+    return start;
+}
+
+// Helper: Allocate a block
+uint32_t allocate_block(void) {
+    return allocate_contiguous(1);
+}
+
+// Helper: Allocate up to want sequential blocks. Takes the whole request as
+// one run if possible, otherwise the first free run after the hint.
+static uint32_t allocate_extent(uint32_t want, uint32_t *got) {
+    if (!fs_initialized || want == 0 || superblock->free_blocks == 0) return NO_BLOCK;
+
+    uint32_t total = superblock->total_blocks;
+    uint32_t start = (want <= superblock->free_blocks) ? next_free_run(want) : 0;
+    if (start != 0) {
+        *got = want;
+    } else {
+        start = next_free_block();
+        if (start >= total && release_held_blocks()) start = next_free_block();
+        if (start >= total) return NO_BLOCK;
+        uint32_t limit = (total - start < want) ? total : start + want;
+        *got = bitmap_find(start, limit, 1) - start;
+    }
+    claim_run(start, *got);
+    return start;
+}
+
+// Helper: Drop one reference to each block in a run, freeing blocks that
+// have no owners left
+void free_block_run(uint32_t start, uint32_t count) {
+    if (!fs_initialized) return;
+    for (uint32_t block = start; block < start + count; block++) {
+        if (!is_valid_block_index(block) || !block_in_use(block)) continue;
+        if (block_refs[block] == 2) shared_block_count--;
+        if (block_refs[block] > 1) extra_refs--;
+        if (block_refs[block] > 0) block_refs[block]--;
+        refs_dirty(block);
+        if (block_refs[block] == 0) {
+            if (dedup_indexed) dedup_indexed[block / 64] &= ~(1ULL << (block % 64));
+            mark_block_free(block);
+            bcache_discard(block, 1);
+            bcache_mark(BCACHE_FREED, block, 1, 1);
         }
-        
-        if (found == -1) {
-            if (parent_index) *parent_index = current_index;
-            return -1;
+    }
+}
+
+// Extent helpers. The first INLINE_EXTENTS live in the inode, the rest in
+// its indirect block, so extent i is addressable without walking anything.
+static fs_extent *extent_at(fs_inode *inode, uint32_t i) {
+    if (i < INLINE_EXTENTS) return &inode->extents[i];
+    return (fs_extent *)block_ptr(inode->indirect_block) + (i - INLINE_EXTENTS);
+}
+
+// Helper: Number of logical blocks mapped by an inode
+static uint32_t inode_nblocks(fs_inode *inode) {
+    if (inode->extent_count == 0) return 0;
+    fs_extent *last = extent_at(inode, inode->extent_count - 1);
+    return last->logical + last->length;
+}
+
+// Helper: Number of blocks an inode's extents map; fewer than
+// inode_nblocks when it has holes
+static uint32_t mapped_blocks(fs_inode *inode) {
+    uint32_t blocks = 0;
+    for (uint32_t e = 0; e < inode->extent_count; e++) {
+        blocks += extent_at(inode, e)->length;
+    }
+    return blocks;
+}
+
+// Helper: Binary search for the extent covering a logical block, or -1
+static int find_extent(fs_inode *inode, uint32_t logical) {
+    int lo = 0;
+    int hi = (int)inode->extent_count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        fs_extent *ext = extent_at(inode, mid);
+        if (logical < ext->logical) {
+            hi = mid - 1;
+        } else if (logical >= ext->logical + ext->length) {
+            lo = mid + 1;
+        } else {
+            return mid;
         }
-        
-        if (parent_index) *parent_index = current_index;
-        current_index = found;
-        
-        // Move to next component
-        token = next_slash;
-        if (*token == '/') token++;
     }
-    
-    return current_index;
+    return -1;
 }
 
-// Helper: Allocate a block
-uint16_t allocate_block(void) {
-    if (!fs_initialized) return 0xFFFF;
-    
-    for (int i = 1; i < MAX_BLOCKS; i++) { // Start from 1, reserve 0
-        if (fat[i].next_block == 0xFFFF) {
-            fat[i].next_block = 0xFFFE; // Mark as used, end of chain
-            return i;
+// Helper: Index of the first extent ending past a logical block: the one
+// covering it, or the one after the hole it is in. extent_count if no
+// data follows.
+static uint32_t extent_from(fs_inode *inode, uint32_t logical) {
+    uint32_t lo = 0;
+    uint32_t hi = inode->extent_count;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        fs_extent *ext = extent_at(inode, mid);
+        if (ext->logical + ext->length <= logical) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
     }
-    return 0xFFFF;
+    return lo;
 }
 
-// Helper: Free blocks
-void free_blocks(uint16_t first_block) {
-    if (!fs_initialized || !is_valid_block_index(first_block)) return;
-    
-    uint16_t block = first_block;
-    int safety_counter = 0;
-    
-    while (is_valid_block_index(block) && block != 0xFFFE && safety_counter < MAX_BLOCKS) {
-        uint16_t next = fat[block].next_block;
-        fat[block].next_block = 0xFFFF; // Mark as free
-        block = next;
-        safety_counter++;
+// Helper: Map a logical block to its physical block, or NO_BLOCK
+static uint32_t map_block(fs_inode *inode, uint32_t logical) {
+    int e = find_extent(inode, logical);
+    if (e == -1) return NO_BLOCK;
+    fs_extent *ext = extent_at(inode, e);
+    return ext->start + (logical - ext->logical);
+}
+
+// Helper: Make room for extra more extents, allocating the indirect block
+// when the list first spills out of the inode
+static int reserve_extents(fs_inode *inode, uint32_t extra) {
+    uint32_t needed = inode->extent_count + extra;
+    if (needed > MAX_EXTENTS) return -1;
+    if (needed > INLINE_EXTENTS && inode->indirect_block == NO_BLOCK) {
+        uint32_t indirect = allocate_block();
+        if (indirect == NO_BLOCK) return -1;
+        inode->indirect_block = indirect;
     }
+    return 0;
 }
 
-// Helper: Add child to directory
-int add_child_to_directory(int parent_index, int child_index) {
-    if (!fs_initialized || !is_valid_file_index(parent_index) || 
-        !is_valid_file_index(child_index) || !superblock->files[parent_index].is_directory) {
-        return -1;
+// Helper: Change an inode's extent count, keeping the fragmentation
+// totals current
+static void set_extent_count(fs_inode *inode, uint32_t count) {
+    if (inode->type == FS_TYPE_FILE) {
+        totals.file_extents += (int64_t)count - inode->extent_count;
+        totals.fragmented_files += (count > 1) - (inode->extent_count > 1);
     }
-    
-    uint16_t block = superblock->files[parent_index].first_block;
-    
-    // Try to find empty slot in existing blocks
-    while (is_valid_block_index(block) && block != 0xFFFE) {
-        uint8_t *block_data = data_area + block * BLOCK_SIZE;
-        for (int i = 0; i < MAX_CHILDREN; i++) {
-            if (block_data[i] == 255) {
-                block_data[i] = child_index;
-                return 0;
-            }
+    inode->extent_count = count;
+}
+
+// Helper: Insert an extent at position index, shifting later ones up.
+// The caller has reserved the slot.
+static void insert_extent(fs_inode *inode, uint32_t index, uint32_t logical, uint32_t start, uint32_t length) {
+    for (uint32_t i = inode->extent_count; i > index; i--) {
+        *extent_at(inode, i) = *extent_at(inode, i - 1);
+    }
+    set_extent_count(inode, inode->extent_count + 1);
+    fs_extent *ext = extent_at(inode, index);
+    ext->logical = logical;
+    ext->start = start;
+    ext->length = length;
+    extents_dirty(inode);
+}
+
+// Helper: Join extent e to the one before it if they continue each other
+// both logically and physically
+static void merge_with_previous(fs_inode *inode, uint32_t e) {
+    if (e == 0 || e >= inode->extent_count) return;
+    fs_extent *prev = extent_at(inode, e - 1);
+    fs_extent *ext = extent_at(inode, e);
+    if (prev->logical + prev->length != ext->logical || prev->start + prev->length != ext->start) return;
+    prev->length += ext->length;
+    for (uint32_t i = e; i + 1 < inode->extent_count; i++) {
+        *extent_at(inode, i) = *extent_at(inode, i + 1);
+    }
+    set_extent_count(inode, inode->extent_count - 1);
+    extents_dirty(inode);
+}
+
+// Helper: Append a physical run after the inode's last logical block,
+// growing the last extent instead when the run is adjacent to it
+static int append_extent(fs_inode *inode, uint32_t start, uint32_t length) {
+    uint32_t logical = inode_nblocks(inode);
+    if (inode->extent_count > 0) {
+        fs_extent *last = extent_at(inode, inode->extent_count - 1);
+        if (last->start + last->length == start) {
+            last->length += length;
+            extents_dirty(inode);
+            return 0;
         }
-        
-        if (fat[block].next_block == 0xFFFE) break;
-        block = fat[block].next_block;
     }
-    
-    // Need new block
-    uint16_t new_block = allocate_block();
-    if (new_block == 0xFFFF) return -1;
-    
-    uint8_t *block_data = data_area + new_block * BLOCK_SIZE;
-    fs_memset(block_data, 255, BLOCK_SIZE);
-    block_data[0] = child_index;
-    
-    if (superblock->files[parent_index].first_block == 0xFFFF) {
-        superblock->files[parent_index].first_block = new_block;
-    } else if (is_valid_block_index(block)) {
-        fat[block].next_block = new_block;
+
+    if (reserve_extents(inode, 1) != 0) return -1;
+    insert_extent(inode, inode->extent_count, logical, start, length);
+    return 0;
+}
+
+// Helper: Point count blocks of extent e, starting skip blocks in, at the
+// run beginning with new_start. The extent is split into up to three.
+static int remap_extent(fs_inode *inode, uint32_t e, uint32_t skip, uint32_t count, uint32_t new_start) {
+    fs_extent old = *extent_at(inode, e);
+    uint32_t tail = old.length - skip - count;
+    if (reserve_extents(inode, (skip > 0) + (tail > 0)) != 0) return -1;
+
+    uint32_t index = e;
+    if (skip > 0) {
+        extent_at(inode, e)->length = skip;
+        index = e + 1;
+        insert_extent(inode, index, old.logical + skip, new_start, count);
+    } else {
+        extent_at(inode, e)->start = new_start;
+        extent_at(inode, e)->length = count;
     }
-    
+    if (tail > 0) {
+        insert_extent(inode, index + 1, old.logical + skip + count, old.start + skip + count, tail);
+    }
+    extents_dirty(inode);
     return 0;
 }
 
-// Helper: Remove child from directory
-int remove_child_from_directory(int parent_index, int child_index) {
-    if (!fs_initialized || !is_valid_file_index(parent_index) || 
-        !is_valid_file_index(child_index) || !superblock->files[parent_index].is_directory) {
-        return -1;
+// Helper: Free the indirect block once the extents fit in the inode again
+static void drop_indirect(fs_inode *inode) {
+    if (inode->extent_count <= INLINE_EXTENTS && inode->indirect_block != NO_BLOCK) {
+        free_block_run(inode->indirect_block, 1);
+        inode->indirect_block = NO_BLOCK;
     }
-    
-    uint16_t block = superblock->files[parent_index].first_block;
-    while (is_valid_block_index(block) && block != 0xFFFE) {
-        uint8_t *block_data = data_area + block * BLOCK_SIZE;
-        for (int i = 0; i < MAX_CHILDREN; i++) {
-            if (block_data[i] == child_index) {
-                block_data[i] = 255;
-                return 0;
+}
+
+// Helper: Drop every block at or past logical block nblocks, trimming the
+// extent that straddles it. The indirect block goes once it is unused.
+static void shrink_blocks(fs_inode *inode, uint32_t nblocks) {
+    extents_dirty(inode);
+    while (inode->extent_count > 0) {
+        fs_extent *last = extent_at(inode, inode->extent_count - 1);
+        if (last->logical >= nblocks) {
+            free_block_run(last->start, last->length);
+            set_extent_count(inode, inode->extent_count - 1);
+            continue;
+        }
+        if (last->logical + last->length > nblocks) {
+            uint32_t keep = nblocks - last->logical;
+            free_block_run(last->start + keep, last->length - keep);
+            last->length = keep;
+        }
+        break;
+    }
+    drop_indirect(inode);
+}
+
+// Helper: Release every block an inode maps, including its indirect block
+static void free_extents(fs_inode *inode) {
+    shrink_blocks(inode, 0);
+}
+
+// Helper: Turn logical blocks [logical, logical + count) into a hole,
+// releasing the blocks behind them. Splitting an extent in two takes a
+// slot; -1 if there is none, with nothing changed.
+static int unmap_blocks(fs_inode *inode, uint32_t logical, uint32_t count) {
+    uint32_t end = logical + count;
+    uint32_t e = extent_from(inode, logical);
+    if (e == inode->extent_count) return 0;
+
+    fs_extent *ext = extent_at(inode, e);
+    if (ext->logical < logical && ext->logical + ext->length > end) {
+        if (reserve_extents(inode, 1) != 0) return -1;
+        ext = extent_at(inode, e);
+        uint32_t keep = end - ext->logical;
+        insert_extent(inode, e + 1, end, ext->start + keep, ext->length - keep);
+        ext = extent_at(inode, e);
+        free_block_run(ext->start + (logical - ext->logical), count);
+        ext->length = logical - ext->logical;
+        return 0;
+    }
+
+    // Keep the head of an extent the range starts inside, then drop the
+    // extents it covers whole and trim the one it ends inside
+    extents_dirty(inode);
+    if (ext->logical < logical) {
+        uint32_t keep = logical - ext->logical;
+        free_block_run(ext->start + keep, ext->length - keep);
+        ext->length = keep;
+        e++;
+    }
+    uint32_t first = e;
+    while (e < inode->extent_count) {
+        ext = extent_at(inode, e);
+        if (ext->logical >= end) break;
+        if (ext->logical + ext->length > end) {
+            uint32_t cut = end - ext->logical;
+            free_block_run(ext->start, cut);
+            ext->logical = end;
+            ext->start += cut;
+            ext->length -= cut;
+            break;
+        }
+        free_block_run(ext->start, ext->length);
+        e++;
+    }
+    uint32_t gone = e - first;
+    if (gone == 0) return 0;
+    for (uint32_t i = e; i < inode->extent_count; i++) {
+        *extent_at(inode, i - gone) = *extent_at(inode, i);
+    }
+    set_extent_count(inode, inode->extent_count - gone);
+    drop_indirect(inode);
+    return 0;
+}
+
+// Helper: Back count unmapped blocks from logical block logical on with
+// new blocks. Free blocks right after the extent before the hole are
+// taken first, so a file written in order stays in one run. Either the
+// whole hole is mapped or, if space runs out, none of it.
+static int map_hole(fs_inode *inode, uint32_t logical, uint32_t count) {
+    uint32_t first = logical;
+    while (count > 0) {
+        uint32_t e = extent_from(inode, logical);
+        fs_extent *prev = (e > 0) ? extent_at(inode, e - 1) : 0;
+        if (prev && prev->logical + prev->length != logical) prev = 0;
+        uint32_t got = 0;
+        uint32_t start = NO_BLOCK;
+
+        if (prev) {
+            uint32_t next = prev->start + prev->length;
+            uint32_t total = superblock->total_blocks;
+            if (next < total && block_available(next)) {
+                uint32_t limit = (total - next < count) ? total : next + count;
+                got = bitmap_find(next, limit, 1) - next;
+                claim_run(next, got);
+                start = next;
             }
         }
-        if (fat[block].next_block == 0xFFFE) break;
-        block = fat[block].next_block;
+        if (start == NO_BLOCK) start = allocate_extent(count, &got);
+        if (start == NO_BLOCK) {
+            unmap_blocks(inode, first, logical - first);
+            return -1;
+        }
+
+        if (prev && prev->start + prev->length == start) {
+            prev->length += got;
+            extents_dirty(inode);
+            merge_with_previous(inode, e);
+        } else if (reserve_extents(inode, 1) == 0) {
+            insert_extent(inode, e, logical, start, got);
+            merge_with_previous(inode, e + 1);
+        } else {
+            free_block_run(start, got);
+            unmap_blocks(inode, first, logical - first);
+            return -1;
+        }
+        logical += got;
+        count -= got;
     }
-    return -1;
+    return 0;
 }
 
-void fs_init(void) {
-    // Clear entire filesystem
-    fs_memset(fs_buffer, 0, FS_SIZE);
-    
-    // Initialize superblock
-    superblock->magic = 0xCAFE;
-    superblock->total_size = FS_SIZE;
-    superblock->num_files = 0;
-    
-    // Initialize file entries
-    for (int i = 0; i < MAX_FILES; i++) {
-        superblock->files[i].name[0] = '\0';
-        superblock->files[i].size = 0;
-        superblock->files[i].first_block = 0xFFFF;
-        superblock->files[i].is_directory = 0;
-        superblock->files[i].parent_index = 255;
+// Helper: Number of blocks needed to hold size bytes
+static uint32_t blocks_for(uint64_t size) {
+    return (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+// Helper: Describe up to n pieces of [offset, offset + len) as pointers
+// into the volume, one per extent touched, and holes as pieces of
+// zero_span. The caller clamps len to the file size. Returns the number of
+// pieces filled, stopping before any piece the disk could not supply
+// intact (-1 if that is the first).
+static int map_range(fs_inode *inode, uint64_t offset, uint32_t len, fs_iovec *iov, int n) {
+    uint32_t e = extent_from(inode, offset / BLOCK_SIZE);
+    int count = 0;
+    uint32_t done = 0;
+    while (done < len && count < n) {
+        fs_extent *ext = (e < inode->extent_count) ? extent_at(inode, e) : 0;
+        uint64_t pos = offset + done;
+        if (!ext || pos < (uint64_t)ext->logical * BLOCK_SIZE) {
+            uint64_t piece = ext ? (uint64_t)ext->logical * BLOCK_SIZE - pos : len - done;
+            if (piece > len - done) piece = len - done;
+            if (piece > ZERO_SPAN) piece = ZERO_SPAN;
+            iov[count].base = zero_span;
+            iov[count].len = piece;
+            count++;
+            done += piece;
+            continue;
+        }
+        uint64_t ext_offset = pos - (uint64_t)ext->logical * BLOCK_SIZE;
+        uint64_t piece = (uint64_t)ext->length * BLOCK_SIZE - ext_offset;
+        if (piece > len - done) piece = len - done;
+        uint32_t first = ext->start + ext_offset / BLOCK_SIZE;
+        if (bcache_read(first, blocks_for(ext_offset + piece) - ext_offset / BLOCK_SIZE,
+                        ext->start + ext->length) != 0) {
+            if (count == 0) return -1;
+            break;
+        }
+        iov[count].base = volume + (uint64_t)ext->start * BLOCK_SIZE + ext_offset;
+        iov[count].len = piece;
+        count++;
+        done += piece;
+        e++;
     }
-    
-    // Initialize FAT - all blocks free
-    for (int i = 0; i < MAX_BLOCKS; i++) {
-        fat[i].next_block = 0xFFFF;
+    return count;
+}
+
+// Helper: Copy len bytes starting at offset out of an inode's blocks,
+// one bulk copy per extent and a clear per hole. A read error cuts the
+// copy short, or fails it with -1 if nothing was read.
+static int read_range(fs_inode *inode, uint64_t offset, uint8_t *buffer, uint32_t len) {
+    if (offset >= inode->size) return 0;
+    if (len > inode->size - offset) len = inode->size - offset;
+
+    fs_iovec iov[FS_MAX_IOV];
+    uint32_t done = 0;
+    while (done < len) {
+        int count = map_range(inode, offset + done, len - done, iov, FS_MAX_IOV);
+        if (count < 0 && done == 0) return -1;
+        if (count <= 0) break;
+        for (int i = 0; i < count; i++) {
+            if (iov[i].base == zero_span) {
+                memset(buffer + done, 0, iov[i].len);
+            } else {
+                memcpy(buffer + done, iov[i].base, iov[i].len);
+            }
+            done += iov[i].len;
+        }
     }
-    
-    fs_initialized = 1;
-    
-    // Create root directory
-    uint16_t root_block = allocate_block();
-    if (root_block != 0xFFFF) {
-        uint8_t *block_data = data_area + root_block * BLOCK_SIZE;
-        fs_memset(block_data, 255, BLOCK_SIZE);
-        
-        fs_strcpy(superblock->files[0].name, "root");
-        superblock->files[0].size = 0;
-        superblock->files[0].first_block = root_block;
-        superblock->files[0].is_directory = 1;
-        superblock->files[0].parent_index = 255;
-        superblock->num_files = 1;
+    return done;
+}
+
+// Helper: Copy len bytes into an inode's already-mapped blocks starting at
+// offset, or zero them when src is 0. Holes in the range are passed over;
+// they already read as zeros.
+static void write_range(fs_inode *inode, uint64_t offset, const uint8_t *src, uint64_t len) {
+    uint32_t e = extent_from(inode, offset / BLOCK_SIZE);
+    uint64_t done = 0;
+    while (done < len && e < inode->extent_count) {
+        fs_extent *ext = extent_at(inode, e);
+        uint64_t ext_begin = (uint64_t)ext->logical * BLOCK_SIZE;
+        if (offset + done < ext_begin) {
+            if (ext_begin - offset >= len) break;
+            done = ext_begin - offset;
+        }
+        uint64_t ext_offset = offset + done - ext_begin;
+        uint64_t n = (uint64_t)ext->length * BLOCK_SIZE - ext_offset;
+        if (n > len - done) n = len - done;
+        uint8_t *dst = write_ptr(ext->start, ext_offset, n);
+        if (src) {
+            memcpy(dst, src + done, n);
+        } else {
+            memset(dst, 0, n);
+        }
+        done += n;
+        e++;
     }
-    
-    // Create sample files safely
-    if (fs_create_file("/welcome.txt") == 0) {
-        fs_write_file("/welcome.txt", "Welcome to CAPTAIN-OS v1.3!\nImproved filesystem with better stability and error handling.", 97);
+}
+
+// Helper: Check whether fs_read_iov pointers into an inode are outstanding
+static int inode_pinned(fs_inode *inode) {
+    for (int i = 0; i < FS_MAX_OPEN; i++) {
+        if (open_files[i].inode == inode && open_files[i].pins > 0) return 1;
     }
-    
-    if (fs_create_file("/readme.txt") == 0) {
-        fs_write_file("/readme.txt", "CAPTAIN-OS v1.3\nFeatures: Enhanced multitasking, robust filesystem, shell commands\nType 'help' for commands.", 106);
+    return 0;
+}
+
+// Helper: Number of an inode in the table
+static uint32_t inode_number(fs_inode *inode) {
+    return (uint32_t)(inode - inode_table) + 1;
+}
+
+static uint32_t clusters_for(uint64_t size) {
+    return (size + FS_CLUSTER_SIZE - 1) / FS_CLUSTER_SIZE;
+}
+
+// Helper: Bytes of the file cluster c decodes to
+static uint32_t cluster_length(fs_inode *inode, uint32_t c) {
+    uint64_t left = inode->size - (uint64_t)c * FS_CLUSTER_SIZE;
+    return (left < FS_CLUSTER_SIZE) ? left : FS_CLUSTER_SIZE;
+}
+
+static uint8_t *cluster_data(cluster_slot *slot) {
+    return cluster_memory + (uint64_t)(slot - cluster_cache) * FS_CLUSTER_SIZE;
+}
+
+// Helper: Forget the decoded clusters of an inode whose blocks changed
+static void cluster_drop(uint32_t ino) {
+    for (int i = 0; i < FS_CLUSTER_CACHE; i++) {
+        if (cluster_cache[i].ino == ino) cluster_cache[i].ino = NO_INODE;
+    }
+}
+
+// Helper: Read exactly len bytes at offset of a compressed file's blocks
+static int read_stored(fs_inode *inode, uint64_t offset, void *buffer, uint32_t len) {
+    return read_range(inode, offset, (uint8_t *)buffer, len) == (int)len ? 0 : -1;
+}
+
+// Helper: Where cluster c is stored, checked against the header and the
+// inode so a damaged header cannot send the decoder anywhere else
+static int cluster_bounds(fs_inode *inode, uint32_t c, uint32_t *start, uint32_t *stored) {
+    fs_compress_header header;
+    uint32_t bounds[2];
+    if (read_stored(inode, 0, &header, sizeof(header)) != 0 ||
+        read_stored(inode, sizeof(header) + (uint64_t)c * sizeof(uint32_t), bounds, sizeof(bounds)) != 0) {
+        return -1;
+    }
+    if (header.magic != FS_COMPRESS_MAGIC || header.size != inode->size ||
+        header.clusters != clusters_for(inode->size) || c >= header.clusters ||
+        bounds[1] <= bounds[0] || bounds[1] - bounds[0] > cluster_length(inode, c)) {
+        return -1;
+    }
+    *start = bounds[0];
+    *stored = bounds[1] - bounds[0];
+    return 0;
+}
+
+// Helper: Cache slot holding cluster c of a compressed file, decoding it
+// into the least recently used slot on a miss. Slots of files with
+// fs_read_iov pins outstanding are never reused. Returns 0 if the cluster
+// cannot be read or is corrupt.
+static cluster_slot *cluster_get(fs_inode *inode, uint32_t c) {
+    uint32_t ino = inode_number(inode);
+    cluster_slot *victim = 0;
+    for (int i = 0; i < FS_CLUSTER_CACHE; i++) {
+        cluster_slot *slot = &cluster_cache[i];
+        if (slot->ino == ino && slot->cluster == c) {
+            slot->last_use = ++cluster_clock;
+            cluster_hits++;
+            return slot;
+        }
+        if (slot->ino != NO_INODE && inode_pinned(get_inode(slot->ino))) continue;
+        if (!victim || slot->last_use < victim->last_use) victim = slot;
+    }
+    if (!victim) return 0;
+    if (!cluster_memory) {
+        cluster_memory = (uint8_t *)phys_alloc((uint64_t)FS_CLUSTER_CACHE * FS_CLUSTER_SIZE, BLOCK_SIZE);
+        if (!cluster_memory) return 0;
+    }
+
+    uint32_t start, stored;
+    if (cluster_bounds(inode, c, &start, &stored) != 0) return 0;
+
+    // Decode straight out of the volume when the cluster lies in one extent
+    const uint8_t *src = cluster_buffer;
+    fs_iovec piece;
+    if (map_range(inode, start, stored, &piece, 1) == 1 && piece.len == stored) {
+        src = piece.base;
+    } else if (read_stored(inode, start, cluster_buffer, stored) != 0) {
+        return 0;
+    }
+
+    uint32_t len = cluster_length(inode, c);
+    uint8_t *data = cluster_data(victim);
+    victim->ino = NO_INODE;
+    if (stored == len) {
+        memcpy(data, src, len);
+    } else {
+        uint64_t begin = rdtsc();
+        int decoded = lz4_decompress(src, stored, data, len);
+        decode_cycles += rdtsc() - begin;
+        if (decoded != (int)len) {
+            char buffer[16];
+            print_string("Filesystem: cannot decode cluster ");
+            itoa(c, buffer, 10);
+            print_string(buffer);
+            print_string(" of inode ");
+            itoa(ino, buffer, 10);
+            print_string(buffer);
+            print_string("\n");
+            return 0;
+        }
+        cluster_decodes++;
+        decoded_bytes += len;
+    }
+    victim->ino = ino;
+    victim->cluster = c;
+    victim->len = len;
+    victim->last_use = ++cluster_clock;
+    return victim;
+}
+
+// Helper: read_range for any file, decoding compressed ones cluster by
+// cluster
+static int inode_read(fs_inode *inode, uint64_t offset, uint8_t *buffer, uint32_t len) {
+    if (!(inode->flags & FS_FLAG_COMPRESSED)) return read_range(inode, offset, buffer, len);
+    if (offset >= inode->size) return 0;
+    if (len > inode->size - offset) len = inode->size - offset;
+
+    uint32_t done = 0;
+    while (done < len) {
+        uint64_t pos = offset + done;
+        cluster_slot *slot = cluster_get(inode, pos / FS_CLUSTER_SIZE);
+        if (!slot) return done ? (int)done : -1;
+        uint32_t within = pos % FS_CLUSTER_SIZE;
+        uint32_t n = slot->len - within;
+        if (n > len - done) n = len - done;
+        memcpy(buffer + done, cluster_data(slot) + within, n);
+        done += n;
+    }
+    return done;
+}
+
+// Helper: Copy-on-write. Give the inode private copies of the shared blocks
+// in [offset, offset + len) before that range is written. Blocks the range
+// covers completely are reallocated but not copied.
+static int unshare_range(fs_inode *inode, uint64_t offset, uint64_t len) {
+    if (len == 0 || shared_block_count == 0) return 0;
+
+    uint32_t logical = offset / BLOCK_SIZE;
+    uint32_t end = blocks_for(offset + len);
+    while (logical < end) {
+        uint32_t e = extent_from(inode, logical);
+        if (e == inode->extent_count) break;
+        fs_extent *ext = extent_at(inode, e);
+        if (ext->logical > logical) {
+            logical = ext->logical;
+            continue;
+        }
+        uint32_t skip = logical - ext->logical;
+        uint32_t phys = ext->start + skip;
+        if (!block_shared(phys)) {
+            logical++;
+            continue;
+        }
+
+        // Take the whole run of shared blocks inside this extent at once
+        uint32_t limit = ext->logical + ext->length;
+        if (limit > end) limit = end;
+        uint32_t count = 1;
+        while (logical + count < limit && block_shared(phys + count)) count++;
+
+        if (inode_pinned(inode)) return -1;
+        uint32_t got = 0;
+        uint32_t fresh = allocate_extent(count, &got);
+        if (fresh == NO_BLOCK) return -1;
+        for (uint32_t i = 0; i < got; i++) {
+            uint64_t block_start = (uint64_t)(logical + i) * BLOCK_SIZE;
+            if (block_start < offset || block_start + BLOCK_SIZE > offset + len) {
+                memcpy(block_ptr(fresh + i), block_ptr(phys + i), BLOCK_SIZE);
+            }
+        }
+        data_dirty(fresh, got);
+        if (remap_extent(inode, e, skip, got, fresh) != 0) {
+            free_block_run(fresh, got);
+            return -1;
+        }
+        free_block_run(phys, got);
+        logical += got;
+    }
+    return 0;
+}
+
+// Helper: Empty the dedup index, sizing it for the mounted volume
+static int dedup_reset(void) {
+    uint32_t total = superblock->total_blocks;
+    uint32_t slots = 1;
+    while (slots < total) slots <<= 1;
+    if (total > dedup_capacity) {
+        dedup_entry *index = (dedup_entry *)phys_alloc((uint64_t)slots * sizeof(dedup_entry), BLOCK_SIZE);
+        uint64_t *bits = (uint64_t *)phys_alloc(((uint64_t)total + 63) / 64 * sizeof(uint64_t), sizeof(uint64_t));
+        if (!index || !bits) return -1;
+        dedup_index = index;
+        dedup_indexed = bits;
+        dedup_capacity = total;
+    }
+    dedup_slots = slots;
+    memset(dedup_index, 0, (uint64_t)slots * sizeof(dedup_entry));
+    memset(dedup_indexed, 0, ((uint64_t)total + 63) / 64 * sizeof(uint64_t));
+    return 0;
+}
+
+// Helper: 64-bit hash of a block for the dedup index. Four independent
+// multiply-rotate lanes take a word each per step, so the multiplies
+// overlap, and are folded together at the end.
+static uint64_t block_hash(const uint8_t *data) {
+    const uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+    const uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+    uint64_t lanes[4] = {prime1 + prime2, prime2, 0, -prime1};
+    for (uint32_t i = 0; i < BLOCK_SIZE; i += 32) {
+        for (int k = 0; k < 4; k++) {
+            uint64_t word;
+            memcpy(&word, data + i + k * 8, sizeof(word));
+            uint64_t lane = lanes[k] + word * prime2;
+            lanes[k] = ((lane << 31) | (lane >> 33)) * prime1;
+        }
+    }
+    uint64_t hash = ((lanes[0] << 1) | (lanes[0] >> 63)) + ((lanes[1] << 7) | (lanes[1] >> 57)) +
+                    ((lanes[2] << 12) | (lanes[2] >> 52)) + ((lanes[3] << 18) | (lanes[3] >> 46));
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+    hash *= prime1;
+    return hash ^ (hash >> 32);
+}
+
+static int dedup_valid(uint32_t block) {
+    return (dedup_indexed[block / 64] >> (block % 64)) & 1;
+}
+
+// Helper: Block in the index holding exactly data, or NO_BLOCK
+static uint32_t dedup_lookup(uint64_t hash, uint32_t home, const uint8_t *data) {
+    for (uint32_t way = 0; way < DEDUP_WAYS; way++) {
+        dedup_entry *slot = &dedup_index[(home + way) & (dedup_slots - 1)];
+        uint32_t block = slot->block;
+        if (slot->hash != hash || !dedup_valid(block) || block_refs[block] >= MAX_BLOCK_REFS) continue;
+        if (bcache_load(block, 1) != 0) continue;
+        if (memcmp(volume + (uint64_t)block * BLOCK_SIZE, data, BLOCK_SIZE) == 0) return block;
+    }
+    return NO_BLOCK;
+}
+
+// Helper: Map each block fully written by [offset, offset + len) onto an
+// identical block already in the volume, or index it if there is none.
+// Runs after the data is in place, so a block that cannot be shared (its
+// extent list is full, say) simply stays where it was written.
+static void dedup_range(fs_inode *inode, uint64_t offset, uint32_t len) {
+    if (inode_pinned(inode)) return;
+    uint32_t end = (offset + len) / BLOCK_SIZE;
+    for (uint32_t logical = blocks_for(offset); logical < end; logical++) {
+        int e = find_extent(inode, logical);
+        if (e == -1) continue;
+        fs_extent *ext = extent_at(inode, e);
+        uint32_t skip = logical - ext->logical;
+        uint32_t block = ext->start + skip;
+        const uint8_t *data = block_ptr(block);
+        uint64_t hash = block_hash(data);
+        uint32_t home = hash & (dedup_slots - 1);
+        uint32_t match = dedup_lookup(hash, home, data);
+
+        if (match != NO_BLOCK && match != block && remap_extent(inode, e, skip, 1, match) == 0) {
+            ref_block(match);
+            free_block_run(block, 1);
+            merge_with_previous(inode, find_extent(inode, logical));
+            dedup_hits++;
+            continue;
+        }
+
+        // Take a slot nobody is using any more, else evict the home slot
+        dedup_entry *slot = &dedup_index[home];
+        for (uint32_t way = 0; way < DEDUP_WAYS; way++) {
+            dedup_entry *candidate = &dedup_index[(home + way) & (dedup_slots - 1)];
+            if (!dedup_valid(candidate->block)) {
+                slot = candidate;
+                break;
+            }
+        }
+        slot->hash = hash;
+        slot->block = block;
+        dedup_indexed[block / 64] |= 1ULL << (block % 64);
+    }
+}
+
+// Helper: Add an inode's share to t (sign 1) or take it out (sign -1).
+// Paths that change an inode's type, size, flags or a compressed file's
+// blocks take it out first and add it back after.
+static void account_inode(fs_totals *t, fs_inode *inode, int sign) {
+    if (inode->type == FS_TYPE_DIR) {
+        t->directories += sign;
+    } else if (inode->type == FS_TYPE_FILE) {
+        t->files += sign;
+        t->file_bytes += sign * (int64_t)inode->size;
+        if (inode->flags & FS_FLAG_COMPRESSED) {
+            t->compressed_files += sign;
+            t->compressed_bytes += sign * (int64_t)inode->size;
+            t->compressed_blocks += sign * (int64_t)mapped_blocks(inode);
+        }
+    }
+}
+
+// Helper: Full scan of the inode table into t
+static void count_totals(fs_totals *t) {
+    fs_memset(t, 0, sizeof(fs_totals));
+    for (uint32_t i = 0; i < superblock->inode_count; i++) {
+        fs_inode *inode = &inode_table[i];
+        account_inode(t, inode, 1);
+        if (inode->type == FS_TYPE_FILE) {
+            t->file_extents += inode->extent_count;
+            t->fragmented_files += inode->extent_count > 1;
+        }
+    }
+}
+
+// Helper: Change an inode's size, keeping the totals current
+static void set_size(fs_inode *inode, uint64_t size) {
+    account_inode(&totals, inode, -1);
+    inode->size = size;
+    account_inode(&totals, inode, 1);
+    inode_dirty(inode);
+}
+
+// Helper: Whether len bytes at data are all zeros
+static int all_zero(const uint8_t *data, uint64_t len) {
+    uint64_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        if (word) return 0;
+    }
+    for (; i < len; i++) {
+        if (data[i]) return 0;
+    }
+    return 1;
+}
+
+// Helper: Whether what a write of len bytes from src at offset puts in
+// logical block b is all zeros. The rest of a block in a hole is zeros
+// already, so such a block can stay a hole.
+static int block_written_zero(const uint8_t *src, uint64_t offset, uint64_t len, uint32_t b) {
+    uint64_t from = (uint64_t)b * BLOCK_SIZE;
+    uint64_t to = from + BLOCK_SIZE;
+    if (from < offset) from = offset;
+    if (to > offset + len) to = offset + len;
+    return all_zero(src + (from - offset), to - from);
+}
+
+// Helper: The part of a write of len bytes from src at offset that falls
+// in the hole [pos, stop). Blocks that would get only zeros stay in the
+// hole; the others are mapped in runs, the bytes of them the write does
+// not cover cleared, and filled.
+static int write_hole(fs_inode *inode, uint64_t offset, const uint8_t *src, uint64_t len, uint64_t pos, uint64_t stop) {
+    uint64_t end = offset + len;
+    uint32_t b = pos / BLOCK_SIZE;
+    uint32_t last = blocks_for(stop);
+    while (b < last) {
+        if (block_written_zero(src, offset, len, b)) {
+            b++;
+            continue;
+        }
+        uint32_t run = b + 1;
+        while (run < last && !block_written_zero(src, offset, len, run)) run++;
+        if (map_hole(inode, b, run - b) != 0) return -1;
+
+        uint64_t from = (uint64_t)b * BLOCK_SIZE;
+        uint64_t to = (uint64_t)run * BLOCK_SIZE;
+        if (from < offset) {
+            write_range(inode, from, 0, offset - from);
+            from = offset;
+        }
+        if (to > end) {
+            write_range(inode, end, 0, to - end);
+            to = end;
+        }
+        write_range(inode, from, src + (from - offset), to - from);
+        b = run;
+    }
+    return 0;
+}
+
+// Helper: Write len bytes at offset. Blocks are mapped only where the
+// data is not all zeros, so a hole written with zeros stays a hole, and
+// so does everything between the old end of file and offset. Returns len,
+// or -1 if space runs out, in which case the size is unchanged but data
+// before the point of failure may have been written.
+static int inode_write(fs_inode *inode, uint64_t offset, const uint8_t *src, uint32_t len) {
+    uint64_t end = offset + len;
+    if (end < offset || end / BLOCK_SIZE >= 0xFFFFFFFFULL) return -1;
+
+    uint64_t old_size = inode->size;
+    uint64_t dirty = (offset < old_size) ? offset : old_size;
+    if (unshare_range(inode, dirty, end - dirty) != 0) return -1;
+
+    // Only the rest of the old last block needs clearing; blocks past it
+    // are holes
+    uint64_t old_end = (uint64_t)blocks_for(old_size) * BLOCK_SIZE;
+    if (offset > old_size) {
+        write_range(inode, old_size, 0, ((offset < old_end) ? offset : old_end) - old_size);
+    }
+
+    uint64_t pos = offset;
+    while (pos < end) {
+        uint32_t e = extent_from(inode, pos / BLOCK_SIZE);
+        fs_extent *ext = (e < inode->extent_count) ? extent_at(inode, e) : 0;
+        uint64_t ext_begin = ext ? (uint64_t)ext->logical * BLOCK_SIZE : end;
+        uint64_t stop;
+        if (pos < ext_begin) {
+            stop = (ext_begin < end) ? ext_begin : end;
+            if (write_hole(inode, offset, src, len, pos, stop) != 0) {
+                if (end > old_size) shrink_blocks(inode, blocks_for(old_size));
+                return -1;
+            }
+        } else {
+            stop = ext_begin + (uint64_t)ext->length * BLOCK_SIZE;
+            if (stop > end) stop = end;
+            write_range(inode, pos, src + (pos - offset), stop - pos);
+        }
+        pos = stop;
+    }
+
+    if (end > old_size) set_size(inode, end);
+    if (dedup_enabled && inode->type == FS_TYPE_FILE) dedup_range(inode, offset, len);
+    return len;
+}
+
+// Helper: Set an inode's size, freeing blocks past the new end. Growing
+// only clears the rest of the old last block; the extension is a hole.
+// Blocks under a pin are never freed.
+static int inode_resize(fs_inode *inode, uint64_t size) {
+    uint64_t old_size = inode->size;
+    if (size < old_size && inode_pinned(inode)) {
+        return -1;
+    }
+    if (size <= old_size) {
+        shrink_blocks(inode, blocks_for(size));
+        set_size(inode, size);
+        return 0;
+    }
+    if (size / BLOCK_SIZE >= 0xFFFFFFFFULL) return -1;
+    uint64_t old_end = (uint64_t)blocks_for(old_size) * BLOCK_SIZE;
+    uint64_t clear = ((size < old_end) ? size : old_end) - old_size;
+    if (unshare_range(inode, old_size, clear) != 0) return -1;
+    write_range(inode, old_size, 0, clear);
+    set_size(inode, size);
+    return 0;
+}
+
+// Helper: Check whether any descriptor refers to an inode
+static int inode_is_open(uint32_t ino) {
+    for (int i = 0; i < FS_MAX_OPEN; i++) {
+        if (open_files[i].inode && open_files[i].ino == ino) return 1;
+    }
+    return 0;
+}
+
+// Helper: Allocate a free inode of the given type, or NO_INODE
+static uint32_t alloc_inode(uint16_t type, uint32_t parent) {
+    if (superblock->free_inodes == 0) return NO_INODE;
+
+    uint32_t count = superblock->inode_count;
+    for (uint32_t n = 0; n < count; n++) {
+        uint32_t ino = (inode_hint - 1 + n) % count + 1;
+        fs_inode *inode = get_inode(ino);
+        if (inode->type != FS_TYPE_FREE) continue;
+
+        fs_memset(inode, 0, sizeof(fs_inode));
+        inode->type = type;
+        inode->parent = parent;
+        inode->indirect_block = NO_BLOCK;
+        account_inode(&totals, inode, 1);
+        superblock->free_inodes--;
+        inode_hint = ino % count + 1;
+        inode_dirty(inode);
+        superblock_dirty();
+        return ino;
+    }
+    return NO_INODE;
+}
+
+// Helper: Release an inode and everything it maps
+static void free_inode(uint32_t ino) {
+    fs_inode *inode = get_inode(ino);
+    if (!inode || inode->type == FS_TYPE_FREE) return;
+    account_inode(&totals, inode, -1);
+    free_extents(inode);
+    cluster_drop(ino);
+    fs_memset(inode, 0, sizeof(fs_inode));
+    superblock->free_inodes++;
+    inode_dirty(inode);
+    superblock_dirty();
+}
+
+// Helper: Whether every block an inode maps can take one more owner
+static int extents_referable(fs_inode *inode) {
+    for (uint32_t e = 0; e < inode->extent_count; e++) {
+        fs_extent *ext = extent_at(inode, e);
+        for (uint32_t i = 0; i < ext->length; i++) {
+            if (block_refs[ext->start + i] >= MAX_BLOCK_REFS) return 0;
+        }
+    }
+    return 1;
+}
+
+// Helper: Add or drop one owner of every block an inode maps
+static void ref_extents(fs_inode *inode) {
+    for (uint32_t e = 0; e < inode->extent_count; e++) {
+        fs_extent *ext = extent_at(inode, e);
+        for (uint32_t i = 0; i < ext->length; i++) {
+            ref_block(ext->start + i);
+        }
+    }
+}
+
+static void unref_extents(fs_inode *inode) {
+    for (uint32_t e = 0; e < inode->extent_count; e++) {
+        fs_extent *ext = extent_at(inode, e);
+        free_block_run(ext->start, ext->length);
+    }
+}
+
+// Helper: Trade the blocks of two inodes
+static void swap_extents(fs_inode *a, fs_inode *b) {
+    fs_inode held = *a;
+    a->extent_count = b->extent_count;
+    a->indirect_block = b->indirect_block;
+    memcpy(a->extents, b->extents, sizeof(a->extents));
+    b->extent_count = held.extent_count;
+    b->indirect_block = held.indirect_block;
+    memcpy(b->extents, held.extents, sizeof(b->extents));
+    extents_dirty(a);
+    extents_dirty(b);
+}
+
+// Helper: Store a file as LZ4 clusters. The compressed copy is built in a
+// scratch inode and traded for the file's blocks only if it takes fewer of
+// them; otherwise the file is left as it is. Returns -1 if the copy could
+// not be made.
+static int inode_compress(fs_inode *inode) {
+    if (inode->size == 0 || (inode->flags & FS_FLAG_COMPRESSED)) return 0;
+    uint32_t clusters = clusters_for(inode->size);
+    uint64_t header_len = sizeof(fs_compress_header) + (uint64_t)(clusters + 1) * sizeof(uint32_t);
+    if (inode->size + header_len > 0xFFFFFFFFULL || inode_pinned(inode)) return -1;
+
+    uint32_t scratch_ino = alloc_inode(FS_TYPE_FILE, inode->parent);
+    if (scratch_ino == NO_INODE) return -1;
+    fs_inode *scratch = get_inode(scratch_ino);
+
+    uint32_t offset = header_len;
+    int result = inode_resize(scratch, header_len);
+    for (uint32_t c = 0; result == 0 && c < clusters; c++) {
+        uint32_t len = cluster_length(inode, c);
+        if (read_range(inode, (uint64_t)c * FS_CLUSTER_SIZE, cluster_buffer, len) != (int)len) {
+            result = -1;
+            break;
+        }
+        uint32_t packed = lz4_compress(cluster_buffer, len, compress_buffer, len - 1);
+        const uint8_t *data = packed ? compress_buffer : cluster_buffer;
+        if (!packed) packed = len;
+        if (inode_write(scratch, sizeof(fs_compress_header) + (uint64_t)c * sizeof(uint32_t),
+                        (const uint8_t *)&offset, sizeof(offset)) < 0 ||
+            inode_write(scratch, offset, data, packed) < 0) {
+            result = -1;
+        }
+        offset += packed;
+    }
+
+    fs_compress_header header = {FS_COMPRESS_MAGIC, clusters, inode->size};
+    if (result == 0 &&
+        (inode_write(scratch, sizeof(header) + (uint64_t)clusters * sizeof(uint32_t),
+                     (const uint8_t *)&offset, sizeof(offset)) < 0 ||
+         inode_write(scratch, 0, (const uint8_t *)&header, sizeof(header)) < 0)) {
+        result = -1;
+    }
+
+    uint32_t before = mapped_blocks(inode) + (inode->indirect_block != NO_BLOCK);
+    uint32_t after = mapped_blocks(scratch) + (scratch->indirect_block != NO_BLOCK);
+    if (result == 0 && after < before) {
+        account_inode(&totals, inode, -1);
+        swap_extents(inode, scratch);
+        inode->flags |= FS_FLAG_COMPRESSED;
+        account_inode(&totals, inode, 1);
+        inode_dirty(inode);
+        cluster_drop(inode_number(inode));
+    }
+    free_inode(scratch_ino);
+    return result;
+}
+
+// Helper: Turn a compressed file back into plain blocks, keeping only its
+// first keep bytes, before it is changed. FS_FLAG_COMPRESS stays set and
+// the file is compressed again when it is last closed.
+static int inode_expand(fs_inode *inode, uint64_t keep) {
+    if (!(inode->flags & FS_FLAG_COMPRESSED)) return 0;
+    if (inode_pinned(inode)) return -1;
+    if (keep > inode->size) keep = inode->size;
+
+    uint32_t scratch_ino = alloc_inode(FS_TYPE_FILE, inode->parent);
+    if (scratch_ino == NO_INODE) return -1;
+    fs_inode *scratch = get_inode(scratch_ino);
+
+    int result = 0;
+    for (uint64_t offset = 0; result == 0 && offset < keep; offset += FS_CLUSTER_SIZE) {
+        cluster_slot *slot = cluster_get(inode, offset / FS_CLUSTER_SIZE);
+        uint32_t len = (keep - offset < FS_CLUSTER_SIZE) ? keep - offset : FS_CLUSTER_SIZE;
+        if (!slot || inode_write(scratch, offset, cluster_data(slot), len) < 0) result = -1;
+    }
+
+    if (result == 0) {
+        account_inode(&totals, inode, -1);
+        swap_extents(inode, scratch);
+        inode->flags &= ~FS_FLAG_COMPRESSED;
+        inode->size = keep;
+        account_inode(&totals, inode, 1);
+        inode_dirty(inode);
+        cluster_drop(inode_number(inode));
+    }
+    free_inode(scratch_ino);
+    return result;
+}
+
+// Helper: Compress a file that asked for it once nothing has it open
+static void compress_if_idle(uint32_t ino) {
+    fs_inode *inode = get_inode(ino);
+    if (inode && (inode->flags & FS_FLAG_COMPRESS) && !inode_is_open(ino)) {
+        inode_compress(inode);
+    }
+}
+
+// Helper: FNV-1a hash of a name component
+static uint32_t fs_name_hash(const char *name, uint32_t len) {
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static dcache_entry *dcache_slot(uint32_t parent, uint32_t hash) {
+    return &dcache[(hash ^ (parent * 0x9E3779B1u)) & (DCACHE_SIZE - 1)];
+}
+
+static int dcache_matches(dcache_entry *e, uint32_t parent, const char *name, uint32_t len, uint32_t hash) {
+    return e->valid && e->parent == parent && e->hash == hash &&
+           e->name_len == len && memcmp(e->name, name, len) == 0;
+}
+
+// Returns 1 and sets *child (NO_INODE for a negative entry) on a hit
+static int dcache_lookup(uint32_t parent, const char *name, uint32_t len, uint32_t hash, uint32_t *child) {
+    dcache_entry *e = dcache_slot(parent, hash);
+    if (dcache_matches(e, parent, name, len, hash)) {
+        dcache_hits++;
+        *child = (e->child == DCACHE_NEGATIVE) ? NO_INODE : e->child;
+        return 1;
+    }
+    dcache_misses++;
+    return 0;
+}
+
+static void dcache_insert(uint32_t parent, const char *name, uint32_t len, uint32_t hash, uint32_t child) {
+    if (len > DCACHE_NAME_MAX) return;
+    dcache_entry *e = dcache_slot(parent, hash);
+    e->valid = 1;
+    e->parent = parent;
+    e->hash = hash;
+    e->child = (child == NO_INODE) ? DCACHE_NEGATIVE : child;
+    e->name_len = len;
+    memcpy(e->name, name, len);
+}
+
+// Drop whatever the cache believes about name in parent
+static void dcache_invalidate(uint32_t parent, const char *name, uint32_t len) {
+    uint32_t hash = fs_name_hash(name, len);
+    dcache_entry *e = dcache_slot(parent, hash);
+    if (e->valid && e->parent == parent && e->hash == hash) {
+        e->valid = 0;
+    }
+}
+
+// Drop every entry under a directory whose inode is about to be recycled
+static void dcache_purge_parent(uint32_t parent) {
+    for (int i = 0; i < DCACHE_SIZE; i++) {
+        if (dcache[i].valid && dcache[i].parent == parent) {
+            dcache[i].valid = 0;
+        }
+    }
+}
+
+static void dcache_reset(void) {
+    for (int i = 0; i < DCACHE_SIZE; i++) {
+        dcache[i].valid = 0;
+    }
+    dcache_hits = 0;
+    dcache_misses = 0;
+}
+
+// Helper: Format an empty directory block as one unused record
+static void init_dir_block(uint32_t block) {
+    fs_dirent *de = (fs_dirent *)block_ptr(block);
+    meta_dirty(block, 1);
+    de->inode = NO_INODE;
+    de->rec_len = BLOCK_SIZE;
+    de->name_len = 0;
+    de->type = FS_TYPE_FREE;
+}
+
+// Helper: Physical block behind logical block b of a directory that is
+// about to change, copied first if a snapshot still shares it
+static uint32_t dir_block_writable(fs_inode *dir, uint32_t b) {
+    // A one-byte range never covers the block, so its contents are copied
+    if (unshare_range(dir, (uint64_t)b * BLOCK_SIZE, 1) != 0) return NO_BLOCK;
+    return map_block(dir, b);
+}
+
+// Helper: Scan a directory's blocks for a child by name
+static uint32_t scan_directory(uint32_t dir_ino, const char *name, uint32_t len) {
+    fs_inode *dir = get_inode(dir_ino);
+    uint32_t nblocks = inode_nblocks(dir);
+    for (uint32_t b = 0; b < nblocks; b++) {
+        uint8_t *data = block_ptr(map_block(dir, b));
+        uint32_t offset = 0;
+        while (offset < BLOCK_SIZE) {
+            fs_dirent *de = (fs_dirent *)(data + offset);
+            if (de->rec_len < DIRENT_HEADER) break;  // Corrupt chain
+            if (de->inode != NO_INODE && de->name_len == len &&
+                memcmp(de->name, name, len) == 0) {
+                return de->inode;
+            }
+            offset += de->rec_len;
+        }
+    }
+    return NO_INODE;
+}
+
+// Helper: Look up one path component, going through the dentry cache
+static uint32_t lookup_child(uint32_t dir_ino, const char *name, uint32_t len) {
+    uint32_t hash = fs_name_hash(name, len);
+    uint32_t cached;
+    if (len <= DCACHE_NAME_MAX && dcache_lookup(dir_ino, name, len, hash, &cached)) {
+        return cached;
+    }
+
+    uint32_t found = scan_directory(dir_ino, name, len);
+    dcache_insert(dir_ino, name, len, hash, found);
+    return found;
+}
+
+// Resolve path from the directory dir, openat-style: an absolute path
+// starts at the root instead, "." stays where it is and ".." goes to the
+// parent (the root is its own parent). An empty path is dir itself. If
+// parent_index is given it receives the directory the last component was
+// found in. Returns the inode number, or -1.
+int fs_lookup_at(uint32_t dir, const char *path, int *parent_index) {
+    if (!fs_initialized) return -1;
+    if (parent_index) *parent_index = NO_INODE;
+
+    uint32_t current = (path && path[0] == '/') ? superblock->root_inode : dir;
+    if (!get_inode(current)) return -1;
+    if (!path) return current;
+
+    // Skip leading slashes
+    const char *token = path;
+    while (*token == '/') token++;
+
+    while (*token) {
+        // Find next component
+        const char *next_slash = token;
+        while (*next_slash && *next_slash != '/') next_slash++;
+
+        uint32_t comp_len = next_slash - token;
+        if (comp_len > FS_MAX_NAME) return -1;
+
+        if (!is_directory(current)) {
+            return -1;
+        }
+
+        if (comp_len == 2 && token[0] == '.' && token[1] == '.') {
+            current = get_inode(current)->parent;
+            if (parent_index) *parent_index = get_inode(current)->parent;
+        } else if (!(comp_len == 1 && token[0] == '.')) {
+            uint32_t found = lookup_child(current, token, comp_len);
+            if (parent_index) *parent_index = current;
+            if (found == NO_INODE) {
+                return -1;
+            }
+            current = found;
+        }
+
+        // Move to next component
+        token = next_slash;
+        while (*token == '/') token++;
+    }
+
+    return current;
+}
+
+// Helper: Find file or directory by path, relative ones from the current
+// directory; returns its inode number
+int find_entry(const char *path, int *parent_index) {
+    return fs_lookup_at(cwd_inode, path, parent_index);
+}
+
+// Make path the directory relative paths start from
+int fs_chdir(const char *path) {
+    int ino = find_entry(path, NULL);
+    if (ino == -1 || !is_directory(ino)) return -1;
+    cwd_inode = ino;
+    return 0;
+}
+
+// The current directory as a handle for fs_lookup_at
+uint32_t fs_cwd(void) {
+    return cwd_inode;
+}
+
+// Write the current directory's full path into path
+int fs_getcwd(char *path, uint32_t size) {
+    return fs_inode_path(cwd_inode, path, size);
+}
+
+// Helper: Match a name against a pattern where * stands for any run of
+// characters and ? for any one. On a mismatch after a *, the * is made to
+// swallow one more character and matching resumes; no recursion.
+static int glob_match(const char *pattern, uint32_t plen, const char *name, uint32_t nlen) {
+    uint32_t p = 0, n = 0;
+    uint32_t star = plen, star_n = 0;
+    while (n < nlen) {
+        if (p < plen && pattern[p] == '*') {
+            star = p++;
+            star_n = n;
+        } else if (p < plen && (pattern[p] == '?' || pattern[p] == name[n])) {
+            p++;
+            n++;
+        } else if (star < plen) {
+            p = star + 1;
+            n = ++star_n;
+        } else {
+            return 0;
+        }
+    }
+    while (p < plen && pattern[p] == '*') p++;
+    return p == plen;
+}
+
+// Helper: Chain heads for a name
+static uint32_t *name_head(int chain, const char *name, uint32_t len) {
+    if (chain == NAME_BY_PREFIX && len > NAME_PREFIX) len = NAME_PREFIX;
+    return &name_heads[chain][fs_name_hash(name, len) & (NAME_BUCKETS - 1)];
+}
+
+// Helper: Take an inode out of the name index
+static void names_remove(uint32_t child) {
+    if (!names_built || child > superblock->inode_count) return;
+    name_entry *e = &name_entries[child];
+    if (e->parent == NO_INODE) return;
+    for (int chain = 0; chain < 2; chain++) {
+        uint32_t *link = name_head(chain, name_arena + e->name, e->len);
+        while (*link != NO_INODE && *link != child) link = &name_entries[*link].next[chain];
+        if (*link == child) *link = e->next[chain];
+    }
+    e->parent = NO_INODE;
+}
+
+// Helper: Record an inode's name; -1 if the arena is full
+static int names_insert(uint32_t child, uint32_t parent, const char *name, uint32_t len) {
+    if (child > superblock->inode_count) return 0;
+    names_remove(child);
+    if (name_arena_used + len > name_arena_size) return -1;
+    name_entry *e = &name_entries[child];
+    memcpy(name_arena + name_arena_used, name, len);
+    e->name = name_arena_used;
+    e->len = len;
+    e->parent = parent;
+    name_arena_used += len;
+    for (int chain = 0; chain < 2; chain++) {
+        uint32_t *head = name_head(chain, name, len);
+        e->next[chain] = *head;
+        *head = child;
+    }
+    return 0;
+}
+
+// Helper: Keep a built index current as a name is linked. Names removed
+// leave their bytes in the arena; when it fills, the index is dropped and
+// rebuilt, compacted, on next use.
+static void names_add(uint32_t child, uint32_t parent, const char *name, uint32_t len) {
+    if (names_built && names_insert(child, parent, name, len) != 0) names_built = 0;
+}
+
+// Helper: Keep a built index current as a name is unlinked. fs_rename
+// links the new name before unlinking the old, so the inode is only
+// dropped if the index still has it under this name.
+static void names_drop(uint32_t child, uint32_t parent, const char *name, uint32_t len) {
+    if (!names_built || child > superblock->inode_count) return;
+    name_entry *e = &name_entries[child];
+    if (e->parent == parent && e->len == len && memcmp(name_arena + e->name, name, len) == 0) {
+        names_remove(child);
+    }
+}
+
+// Helper: Build the name index from every directory in the inode table.
+// The arena starts at twice what the last build needed and doubles until
+// the names fit.
+static int names_build(void) {
+    if (names_built) return 0;
+    uint32_t count = superblock->inode_count + 1;
+    if (count > name_entries_capacity) {
+        name_entry *entries = (name_entry *)phys_alloc(count * sizeof(name_entry), sizeof(uint64_t));
+        if (!entries) return -1;
+        name_entries = entries;
+        name_entries_capacity = count;
+    }
+    uint32_t want = name_arena_used * 2;
+    if (want < NAME_ARENA_MIN) want = NAME_ARENA_MIN;
+
+    for (;;) {
+        if (want > name_arena_size) {
+            char *arena = (char *)phys_alloc(want, sizeof(uint64_t));
+            if (!arena) return -1;
+            name_arena = arena;
+            name_arena_size = want;
+        }
+        memset(name_entries, 0, count * sizeof(name_entry));
+        memset(name_heads, 0, sizeof(name_heads));
+        name_arena_used = 0;
+
+        int full = 0;
+        for (uint32_t ino = 1; ino < count && !full; ino++) {
+            if (!is_directory(ino)) continue;
+            fs_inode *dir = get_inode(ino);
+            uint32_t nblocks = inode_nblocks(dir);
+            for (uint32_t b = 0; b < nblocks && !full; b++) {
+                uint8_t *data = block_ptr(map_block(dir, b));
+                uint32_t offset = 0;
+                while (offset < BLOCK_SIZE) {
+                    fs_dirent *de = (fs_dirent *)(data + offset);
+                    if (de->rec_len < DIRENT_HEADER) break;
+                    if (de->inode != NO_INODE && names_insert(de->inode, ino, de->name, de->name_len) != 0) {
+                        full = 1;
+                        break;
+                    }
+                    offset += de->rec_len;
+                }
+            }
+        }
+        if (!full) break;
+        want = name_arena_size * 2;
+    }
+    names_built = 1;
+    return 0;
+}
+
+// Helper: Add a name to a directory. The first record with enough slack
+// after its own name is split; a new block is appended only when none has.
+int add_child_to_directory(uint32_t dir_ino, const char *name, uint32_t len, uint32_t child) {
+    if (!fs_initialized || !is_directory(dir_ino) || !get_inode(child) ||
+        len == 0 || len > FS_MAX_NAME) {
+        return -1;
+    }
+    
+    fs_inode *dir = get_inode(dir_ino);
+    uint32_t need = DIRENT_LEN(len);
+    uint32_t nblocks = inode_nblocks(dir);
+    fs_dirent *slot = 0;
+    uint32_t slot_block = NO_BLOCK;
+    
+    // Try to find room in existing blocks
+    for (uint32_t b = 0; b < nblocks && !slot; b++) {
+        uint8_t *data = block_ptr(map_block(dir, b));
+        uint32_t offset = 0;
+        while (offset < BLOCK_SIZE) {
+            fs_dirent *de = (fs_dirent *)(data + offset);
+            if (de->rec_len < DIRENT_HEADER) break;
+            uint32_t used = (de->inode != NO_INODE) ? DIRENT_LEN(de->name_len) : 0;
+            if (de->rec_len >= used + need) {
+                slot_block = dir_block_writable(dir, b);
+                if (slot_block == NO_BLOCK) return -1;
+                de = (fs_dirent *)(block_ptr(slot_block) + offset);
+                if (used) {
+                    fs_dirent *next = (fs_dirent *)((uint8_t *)de + used);
+                    next->rec_len = de->rec_len - used;
+                    de->rec_len = used;
+                    de = next;
+                }
+                slot = de;
+                break;
+            }
+            offset += de->rec_len;
+        }
+    }
+    
+    // Need new block
+    if (!slot) {
+        uint32_t new_block = allocate_block();
+        if (new_block == NO_BLOCK) return -1;
+        if (append_extent(dir, new_block, 1) != 0) {
+            free_block_run(new_block, 1);
+            return -1;
+        }
+        dir->size += BLOCK_SIZE;
+        inode_dirty(dir);
+        init_dir_block(new_block);
+        slot = (fs_dirent *)block_ptr(new_block);
+        slot_block = new_block;
+    }
+    
+    meta_dirty(slot_block, 1);
+    slot->inode = child;
+    slot->name_len = len;
+    slot->type = get_inode(child)->type;
+    memcpy(slot->name, name, len);
+    dcache_invalidate(dir_ino, name, len);
+    names_add(child, dir_ino, name, len);
+    return 0;
+}
+
+// Helper: Remove a name from a directory; its record is merged into the
+// one before it so the space is reusable
+int remove_child_from_directory(uint32_t dir_ino, const char *name, uint32_t len) {
+    if (!fs_initialized || !is_directory(dir_ino)) {
+        return -1;
+    }
+    
+    fs_inode *dir = get_inode(dir_ino);
+    uint32_t nblocks = inode_nblocks(dir);
+    for (uint32_t b = 0; b < nblocks; b++) {
+        uint8_t *data = block_ptr(map_block(dir, b));
+        uint32_t prev_offset = BLOCK_SIZE;
+        uint32_t offset = 0;
+        while (offset < BLOCK_SIZE) {
+            fs_dirent *de = (fs_dirent *)(data + offset);
+            if (de->rec_len < DIRENT_HEADER) break;
+            if (de->inode != NO_INODE && de->name_len == len &&
+                memcmp(de->name, name, len) == 0) {
+                uint32_t block = dir_block_writable(dir, b);
+                if (block == NO_BLOCK) return -1;
+                data = block_ptr(block);
+                de = (fs_dirent *)(data + offset);
+                fs_dirent *prev = (prev_offset < BLOCK_SIZE) ? (fs_dirent *)(data + prev_offset) : 0;
+                uint32_t child = de->inode;
+                if (prev) {
+                    prev->rec_len += de->rec_len;
+                } else {
+                    de->inode = NO_INODE;
+                }
+                meta_dirty(block, 1);
+                dcache_invalidate(dir_ino, name, len);
+                names_drop(child, dir_ino, name, len);
+                return 0;
+            }
+            prev_offset = offset;
+            offset += de->rec_len;
+        }
+    }
+    return -1;
+}
+
+// Helper: Check whether a directory has no live entries
+static int directory_empty(fs_inode *dir) {
+    uint32_t nblocks = inode_nblocks(dir);
+    for (uint32_t b = 0; b < nblocks; b++) {
+        uint8_t *data = block_ptr(map_block(dir, b));
+        uint32_t offset = 0;
+        while (offset < BLOCK_SIZE) {
+            fs_dirent *de = (fs_dirent *)(data + offset);
+            if (de->rec_len < DIRENT_HEADER) break;
+            if (de->inode != NO_INODE) return 0;
+            offset += de->rec_len;
+        }
+    }
+    return 1;
+}
+
+// Helper: Point the in-memory state at a formatted image
+static int fs_attach(uint8_t *image) {
+    fs_superblock *sb = (fs_superblock *)image;
+    uint64_t stale_bytes = ((uint64_t)sb->total_blocks + 63) / 64 * sizeof(uint64_t);
+    if (stale_bytes > stale_capacity) {
+        uint64_t *bits = (uint64_t *)phys_alloc(stale_bytes, sizeof(uint64_t));
+        if (!bits) return -1;
+        sums_stale = bits;
+        stale_capacity = stale_bytes;
+    }
+    memset(sums_stale, 0, stale_bytes);
+
+    volume = image;
+    superblock = sb;
+    block_bitmap = (uint64_t *)block_ptr(superblock->bitmap_start);
+    block_refs = (uint16_t *)block_ptr(superblock->refcount_start);
+    block_sums = (uint32_t *)block_ptr(superblock->checksum_start);
+    inode_table = (fs_inode *)block_ptr(superblock->inode_start);
+    alloc_hint = superblock->data_start;
+    inode_hint = 1;
+    cwd_inode = superblock->root_inode;
+    dcache_reset();
+    names_built = 0;
+    for (int i = 0; i < FS_MAX_OPEN; i++) {
+        open_files[i].inode = 0;
+    }
+    shared_block_count = 0;
+    extra_refs = 0;
+    for (uint32_t block = superblock->data_start; block < superblock->total_blocks; block++) {
+        if (block_refs[block] > 1) {
+            shared_block_count++;
+            extra_refs += block_refs[block] - 1;
+        }
+    }
+    count_totals(&totals);
+    if (dedup_enabled && dedup_reset() != 0) dedup_enabled = 0;
+    dedup_hits = 0;
+    checksum_errors = 0;
+    scrubbed_blocks = 0;
+    scrub_passes = 0;
+    scrub_cursor = 0;
+    defrag_cursor = 1;
+    defrag_moved = 0;
+    defrag_passes = 0;
+    memset(cluster_cache, 0, sizeof(cluster_cache));
+    cluster_hits = 0;
+    cluster_decodes = 0;
+    decoded_bytes = 0;
+    decode_cycles = 0;
+    bcache_set_verify(verify_block);
+    fs_initialized = 1;
+    return 0;
+}
+
+// Check the metadata just mounted against its checksums; data is checked
+// as it is read. Returns the number of bad blocks.
+static uint32_t verify_metadata(void) {
+    uint32_t bad = 0;
+    for (uint32_t block = 0; block < superblock->journal_start; block++) {
+        if (verify_block(block) != 0) bad++;
+    }
+    return bad;
+}
+
+// Lay out an empty file system in image. Only the metadata blocks are
+// written, so formatting cost does not grow with the data area.
+int fs_format(void *image, uint64_t size, uint32_t inode_count) {
+    if (!image) return -1;
+
+    uint64_t blocks = size / BLOCK_SIZE;
+    if (blocks > 0xFFFFFFFFULL) blocks = 0xFFFFFFFFULL;
+    if (blocks < FS_MIN_BLOCKS) return -1;
+    uint32_t total_blocks = blocks;
+
+    if (inode_count == 0) inode_count = size / FS_BYTES_PER_INODE;
+    if (inode_count < INODES_PER_BLOCK) inode_count = INODES_PER_BLOCK;
+
+    uint32_t bits_per_block = BLOCK_SIZE * 8;
+    uint32_t bitmap_blocks = (total_blocks + bits_per_block - 1) / bits_per_block;
+    uint32_t refcount_blocks = (total_blocks + REFS_PER_BLOCK - 1) / REFS_PER_BLOCK;
+    uint32_t checksum_blocks = (total_blocks + SUMS_PER_BLOCK - 1) / SUMS_PER_BLOCK;
+    uint32_t inode_blocks = (inode_count + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+    uint32_t journal_blocks = total_blocks / FS_JOURNAL_RATIO;
+    if (journal_blocks < FS_JOURNAL_MIN_BLOCKS) journal_blocks = FS_JOURNAL_MIN_BLOCKS;
+    if (journal_blocks > FS_JOURNAL_MAX_BLOCKS) journal_blocks = FS_JOURNAL_MAX_BLOCKS;
+    uint64_t data_start = 1 + (uint64_t)bitmap_blocks + refcount_blocks + checksum_blocks + inode_blocks + journal_blocks;
+    if (data_start + 1 > total_blocks) return -1;  // No room for the root directory
+
+    fs_initialized = 0;
+    uint8_t *base = (uint8_t *)image;
+    fs_memset(base, 0, data_start * BLOCK_SIZE);
+
+    fs_superblock *sb = (fs_superblock *)base;
+    sb->magic = FS_MAGIC;
+    sb->version = FS_VERSION;
+    sb->block_size = BLOCK_SIZE;
+    sb->total_blocks = total_blocks;
+    sb->inode_count = inode_blocks * INODES_PER_BLOCK;  // Use the whole last table block
+    sb->bitmap_start = 1;
+    sb->bitmap_blocks = bitmap_blocks;
+    sb->refcount_start = 1 + bitmap_blocks;
+    sb->refcount_blocks = refcount_blocks;
+    sb->checksum_start = sb->refcount_start + refcount_blocks;
+    sb->checksum_blocks = checksum_blocks;
+    sb->inode_start = sb->checksum_start + checksum_blocks;
+    sb->inode_blocks = inode_blocks;
+    sb->journal_start = sb->inode_start + inode_blocks;
+    sb->journal_blocks = journal_blocks;
+    sb->data_start = data_start;
+    sb->root_inode = ROOT_INODE;
+    sb->free_blocks = total_blocks - data_start;
+    sb->free_inodes = sb->inode_count;
+
+    // Metadata blocks and the bitmap's tail past the last block are "used";
+    // metadata has a single permanent owner
+    uint64_t *bitmap = (uint64_t *)(base + (uint64_t)sb->bitmap_start * BLOCK_SIZE);
+    uint16_t *refs = (uint16_t *)(base + (uint64_t)sb->refcount_start * BLOCK_SIZE);
+    for (uint32_t block = 0; block < data_start; block++) {
+        bitmap[block / 64] |= 1ULL << (block % 64);
+        refs[block] = 1;
+    }
+    for (uint64_t block = total_blocks; block < (uint64_t)bitmap_blocks * bits_per_block; block++) {
+        bitmap[block / 64] |= 1ULL << (block % 64);
+    }
+
+    // Empty journal: replay starts at block 1 and finds nothing there
+    fs_journal_block *journal = (fs_journal_block *)(base + (uint64_t)sb->journal_start * BLOCK_SIZE);
+    journal->magic = FS_JOURNAL_MAGIC;
+    journal->type = FS_JOURNAL_HEADER;
+    journal->sequence = 1;
+    journal->tail = 1;
+
+    if (fs_attach(base) != 0) return -1;
+
+    // Create root directory
+    uint32_t root = alloc_inode(FS_TYPE_DIR, ROOT_INODE);
+    uint32_t root_block = allocate_block();
+    if (root != ROOT_INODE || root_block == NO_BLOCK) {
+        fs_initialized = 0;
+        return -1;
+    }
+    fs_inode *root_inode = get_inode(root);
+    init_dir_block(root_block);
+    append_extent(root_inode, root_block, 1);
+    root_inode->size = BLOCK_SIZE;
+    mark_stale(0, superblock->data_start);
+    fs_update_checksums();
+    return 0;
+}
+
+// Make sure volume_memory holds at least size bytes. Memory is reused when
+// the volume fits in what an earlier mkfs or load obtained.
+static int volume_reserve(uint64_t size) {
+    if (size > volume_capacity) {
+        uint8_t *memory = (uint8_t *)phys_alloc(size, BLOCK_SIZE);
+        if (!memory) return -1;
+        volume_memory = memory;
+        volume_capacity = size;
+    }
+    return 0;
+}
+
+// Format a fresh volume of size bytes in RAM. Every block starts resident,
+// and the whole metadata area (the zeroed journal included) is dirty until
+// the first sync, which writes it in place rather than through the journal.
+int fs_mkfs(uint64_t size, uint32_t inode_count) {
+    size &= ~(uint64_t)(BLOCK_SIZE - 1);
+    if (size < (uint64_t)FS_MIN_BLOCKS * BLOCK_SIZE) return -1;
+    if (volume_reserve(size) != 0) return -1;
+    uint64_t blocks = size / BLOCK_SIZE;
+    if (blocks > 0xFFFFFFFFULL) blocks = 0xFFFFFFFFULL;
+    if (bcache_attach(backing_device, volume_memory, BLOCK_SIZE, blocks, 1) != 0) return -1;
+    if (fs_format(volume_memory, size, inode_count) != 0) return -1;
+    if (journal_attach(backing_device, volume_memory, superblock) != 0) {
+        fs_initialized = 0;
+        return -1;
+    }
+    bcache_dirty(0, superblock->data_start);
+    format_pending = 1;
+    reuse_freed = 0;
+    return 0;
+}
+
+// Check that a superblock describes a layout fs_attach can trust: regions
+// back to back, each big enough, and the volume no larger than max_blocks
+int fs_superblock_valid(const fs_superblock *sb, uint64_t max_blocks) {
+    if (sb->magic != FS_MAGIC || sb->version != FS_VERSION || sb->block_size != BLOCK_SIZE) return 0;
+    if (sb->total_blocks < FS_MIN_BLOCKS || sb->total_blocks > max_blocks) return 0;
+    if (sb->bitmap_start != 1 ||
+        sb->refcount_start != sb->bitmap_start + sb->bitmap_blocks ||
+        sb->checksum_start != sb->refcount_start + sb->refcount_blocks ||
+        sb->inode_start != (uint64_t)sb->checksum_start + sb->checksum_blocks ||
+        sb->journal_start != (uint64_t)sb->inode_start + sb->inode_blocks ||
+        sb->data_start != (uint64_t)sb->journal_start + sb->journal_blocks ||
+        sb->data_start >= sb->total_blocks) {
+        return 0;
+    }
+    if (sb->journal_blocks < FS_JOURNAL_MIN_BLOCKS || sb->journal_blocks > FS_JOURNAL_MAX_BLOCKS) {
+        return 0;
+    }
+    if ((uint64_t)sb->bitmap_blocks * BLOCK_SIZE * 8 < sb->total_blocks ||
+        (uint64_t)sb->refcount_blocks * REFS_PER_BLOCK < sb->total_blocks ||
+        (uint64_t)sb->checksum_blocks * SUMS_PER_BLOCK < sb->total_blocks ||
+        sb->inode_count > (uint64_t)sb->inode_blocks * INODES_PER_BLOCK ||
+        sb->inode_count == 0 || sb->root_inode != ROOT_INODE) {
+        return 0;
+    }
+    for (int i = 0; i < FS_MAX_SNAPSHOTS; i++) {
+        const fs_snapshot *snap = &sb->snapshots[i];
+        if (snap->map_block != NO_BLOCK &&
+            (snap->map_block < sb->data_start || snap->map_block >= sb->total_blocks ||
+             snap->name[FS_SNAPSHOT_NAME] != '\0' || sb->inode_blocks > BLOCK_SIZE / sizeof(uint32_t))) {
+            return 0;
+        }
+    }
+    return sb->free_blocks <= sb->total_blocks && sb->free_inodes <= sb->inode_count;
+}
+
+// Mount the volume stored on dev. Only the metadata tables and the journal
+// header are read here, plus whatever the journal has to replay; data
+// blocks come in through the block cache as they are first used.
+int fs_load(block_device *dev) {
+    static uint8_t first_block[BLOCK_SIZE] __attribute__((aligned(BLOCK_SIZE)));
+    if (!dev || dev->sectors < SECTORS_PER_BLOCK) return -1;
+
+    if (block_read(dev, 0, first_block, SECTORS_PER_BLOCK) != 0) return -1;
+    fs_superblock *sb = (fs_superblock *)first_block;
+    if (!fs_superblock_valid(sb, dev->sectors / SECTORS_PER_BLOCK)) return -1;
+    if (volume_reserve((uint64_t)sb->total_blocks * BLOCK_SIZE) != 0) return -1;
+
+    fs_initialized = 0;
+    backing_device = dev;
+    if (bcache_attach(dev, volume_memory, BLOCK_SIZE, sb->total_blocks, 0) != 0 ||
+        bcache_load(0, sb->journal_start + 1) != 0 ||
+        journal_attach(dev, volume_memory, (fs_superblock *)volume_memory) != 0 ||
+        journal_replay() != 0 ||
+        fs_attach(volume_memory) != 0) {
+        return -1;
+    }
+    verify_metadata();
+    format_pending = 0;
+    reuse_freed = 0;
+    return 0;
+}
+
+// Mount a volume that is already in memory, such as a boot module, where
+// it lies: nothing is copied, and changes stay in that memory
+int fs_mount_image(void *image, uint64_t size) {
+    fs_superblock *sb = (fs_superblock *)image;
+    if (!image || size < BLOCK_SIZE || !fs_superblock_valid(sb, size / BLOCK_SIZE)) return -1;
+
+    fs_initialized = 0;
+    backing_device = 0;
+    if (bcache_attach(0, (uint8_t *)image, BLOCK_SIZE, sb->total_blocks, 1) != 0 ||
+        journal_attach(0, (uint8_t *)image, sb) != 0 ||
+        journal_replay() != 0 ||
+        fs_attach((uint8_t *)image) != 0) {
+        return -1;
+    }
+    verify_metadata();
+    format_pending = 0;
+    reuse_freed = 0;
+    return 0;
+}
+
+// Table blocks that will change when the stale checksums are updated
+static uint32_t stale_table_blocks(void) {
+    uint32_t words = (superblock->total_blocks + 63) / 64;
+    uint32_t words_per_table = SUMS_PER_BLOCK / 64;
+    uint32_t count = 0;
+    for (uint32_t w = 0; w < words; w += words_per_table) {
+        uint32_t end = (w + words_per_table < words) ? w + words_per_table : words;
+        for (uint32_t i = w; i < end; i++) {
+            if (sums_stale[i]) {
+                count++;
+                break;
+            }
+        }
+    }
+    return count;
+}
+
+// Put blocks staged for a journal transaction back where they came from
+static void unstage(void) {
+    uint32_t total = superblock->total_blocks;
+    for (uint32_t block = bcache_next(BCACHE_STAGED, 0); block < total;
+         block = bcache_next(BCACHE_STAGED, block + 1)) {
+        bcache_mark(BCACHE_STAGED, block, 1, 0);
+        if (block < superblock->data_start) {
+            bcache_dirty_meta(block, 1);
+        } else {
+            bcache_dirty(block, 1);
+        }
+        mark_stale(block, 1);
+    }
+}
+
+// Data blocks rewritten since the last commit must not be overwritten in
+// place ahead of their new checksums, or a crash in between would leave
+// new contents under an old sum. They go through the journal instead:
+// with the metadata if it all fits in one transaction, otherwise first, in
+// transactions of their own that carry just the checksum table blocks
+// covering them. The table holds no other new sums at that point, so those
+// transactions commit nothing but the rewritten blocks. Blocks allocated
+// since the last commit are still written in place, as nothing durable
+// refers to them yet.
+static int journal_overwrites(void) {
+    const uint64_t *dirty = bcache_bits(BCACHE_DIRTY);
+    const uint64_t *fresh = bcache_bits(BCACHE_FRESH);
+    if (!dirty || bcache_count(BCACHE_DIRTY) == 0) return 0;
+    uint32_t words = (superblock->total_blocks + 63) / 64;
+    uint32_t count = 0;
+    for (uint32_t w = 0; w < words; w++) {
+        // Clear the lowest bit until none are left (no libgcc popcount)
+        for (uint64_t bits = dirty[w] & ~fresh[w]; bits; bits &= bits - 1) count++;
+    }
+    if (count == 0) return 0;
+
+    uint64_t tags = (uint64_t)bcache_count(BCACHE_META) + stale_table_blocks() + count;
+    uint64_t need = tags + 2 + tags * sizeof(uint32_t) / BLOCK_SIZE;  // + descriptors and commit
+    int together = need <= superblock->journal_blocks - 1;
+    uint32_t per_txn = (superblock->journal_blocks - 4) / 2;        // Data plus as many table blocks
+    uint32_t staged = 0;
+
+    for (uint32_t w = 0; w < words; w++) {
+        uint64_t bits = dirty[w] & ~fresh[w];
+        while (bits) {
+            uint32_t block = w * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            bcache_mark(BCACHE_DIRTY, block, 1, 0);
+            if (together) {
+                bcache_mark(BCACHE_META, block, 1, 1);
+                continue;
+            }
+            block_sums[block] = checksum_of(volume + (uint64_t)block * BLOCK_SIZE);
+            sums_stale[block / 64] &= ~(1ULL << (block % 64));
+            bcache_mark(BCACHE_STAGED, block, 1, 1);
+            bcache_mark(BCACHE_STAGED, superblock->checksum_start + block / SUMS_PER_BLOCK, 1, 1);
+            if (++staged == per_txn) {
+                if (journal_commit_list(BCACHE_STAGED) != 0) {
+                    unstage();
+                    return -1;
+                }
+                staged = 0;
+            }
+        }
+    }
+    if (staged && journal_commit_list(BCACHE_STAGED) != 0) {
+        unstage();
+        return -1;
+    }
+    return 0;
+}
+
+// Make every change so far durable. Newly allocated file data goes in
+// place first, then the metadata changed since the last sync and the new
+// checksums are committed to the journal as one transaction, so after a
+// crash the metadata is either all old or all new and never points at data
+// that did not reach the disk. Rewritten data goes through the journal
+// too (see journal_overwrites).
+int fs_sync(void) {
+    if (!fs_initialized || !backing_device) return -1;
+    if ((uint64_t)superblock->total_blocks * SECTORS_PER_BLOCK > backing_device->sectors) return -1;
+    if (!format_pending && journal_overwrites() != 0) return -1;
+    fs_update_checksums();
+    
+    // File data is written in place and has to be on stable storage before
+    // the commit that points metadata at it, so it gets a flush of its own
+    uint32_t data_blocks = bcache_count(BCACHE_DIRTY);
+    if (bcache_writeback() != 0) return -1;
+    if (data_blocks > 0 && !format_pending && block_flush(backing_device) != 0) return -1;
+    if (format_pending) {
+        // Nothing on the disk to protect yet
+        if (bcache_write_home(BCACHE_META) != 0 || block_flush(backing_device) != 0) return -1;
+        format_pending = 0;
+    } else if (journal_commit() != 0) {
+        return -1;
+    }
+    bcache_clear(BCACHE_FREED);
+    bcache_clear(BCACHE_FRESH);
+    reuse_freed = 0;
+    return 0;
+}
+
+// Recompute the checksum of every block changed since the last call. The
+// updated table blocks are metadata and go out with the next commit.
+void fs_update_checksums(void) {
+    if (!fs_initialized) return;
+    uint32_t words = (superblock->total_blocks + 63) / 64;
+    for (uint32_t w = 0; w < words; w++) {
+        uint64_t bits = sums_stale[w];
+        if (!bits) continue;
+        sums_stale[w] = 0;
+        while (bits) {
+            uint32_t block = w * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            if (!block_summed(block)) continue;
+            block_sums[block] = checksum_of(volume + (uint64_t)block * BLOCK_SIZE);
+            sums_dirty(block);
+        }
+    }
+}
+
+// Check the checksums of up to count blocks in use, resuming where the
+// last call stopped and wrapping around at the end of the volume. On a
+// disk-backed volume the blocks are read from the disk itself, skipping
+// those whose disk copy is meant to be behind memory (changed since the
+// last sync, or journaled but not checkpointed); a volume with no disk is
+// checked in memory. Returns the number of bad blocks, or -1 if the disk
+// could not be read.
+int fs_scrub(uint32_t count) {
+    if (!fs_initialized) return -1;
+    if (count > FS_SCRUB_MAX) count = FS_SCRUB_MAX;
+    uint32_t total = superblock->total_blocks;
+
+    // Free space is skipped without being read
+    uint32_t start = bitmap_find(scrub_cursor, total, 1);
+    if (start >= total) {
+        scrub_cursor = 0;
+        scrub_passes++;
+        return 0;
+    }
+    if (count > total - start) count = total - start;
+
+    const uint8_t *data = volume + (uint64_t)start * BLOCK_SIZE;
+    if (backing_device) {
+        if (block_read(backing_device, (uint64_t)start * SECTORS_PER_BLOCK, scrub_buffer,
+                       (uint64_t)count * SECTORS_PER_BLOCK) != 0) {
+            return -1;
+        }
+        data = scrub_buffer;
+    }
+
+    int bad = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t block = start + i;
+        if (!block_summed(block) || sum_stale(block)) continue;
+        if (bcache_test(BCACHE_DIRTY, block) || bcache_test(BCACHE_META, block) ||
+            bcache_test(BCACHE_JOURNALED, block)) {
+            continue;
+        }
+        scrubbed_blocks++;
+        if (checksum_of(data + (uint64_t)i * BLOCK_SIZE) != block_sums[block]) {
+            checksum_error(block);
+            bad++;
+        }
+    }
+    scrub_cursor = start + count;
+    if (scrub_cursor >= total) {
+        scrub_cursor = 0;
+        scrub_passes++;
+    }
+    return bad;
+}
+
+// Helper: Whether any block of a run has more than one owner
+static int run_shared(uint32_t start, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (block_refs[start + i] > 1) return 1;
+    }
+    return 0;
+}
+
+// Helper: Replace extents first..last, which continue each other
+// logically, with one extent over the run at start that now holds their
+// data. Blocks they mapped outside that run are freed.
+static void collapse_extents(fs_inode *inode, uint32_t first, uint32_t last, uint32_t start) {
+    extents_dirty(inode);
+    uint32_t length = 0;
+    for (uint32_t i = first; i <= last; i++) {
+        fs_extent *ext = extent_at(inode, i);
+        if (i != first || ext->start != start) free_block_run(ext->start, ext->length);
+        length += ext->length;
+    }
+    extent_at(inode, first)->start = start;
+    extent_at(inode, first)->length = length;
+
+    uint32_t gone = last - first;
+    for (uint32_t i = last + 1; i < inode->extent_count; i++) {
+        *extent_at(inode, i - gone) = *extent_at(inode, i);
+    }
+    set_extent_count(inode, inode->extent_count - gone);
+    if (inode->extent_count <= INLINE_EXTENTS && inode->indirect_block != NO_BLOCK) {
+        free_block_run(inode->indirect_block, 1);
+        inode->indirect_block = NO_BLOCK;
+    }
+}
+
+// Helper: Join a file's extents by copying at most budget blocks. Extents
+// after extent e are moved to the free space right behind it if there is
+// room, else e moves with them to a new run, else they are at least joined
+// to each other. An extent longer than the budget is never moved, only
+// joined to, and blocks shared with another file or a snapshot stay where
+// they are. Returns the blocks copied.
+static uint32_t defrag_inode(fs_inode *inode, uint32_t budget) {
+    uint32_t moved = 0;
+    uint32_t e = 0;
+    while (e + 1 < inode->extent_count && moved < budget) {
+        fs_extent *head = extent_at(inode, e);
+
+        // The extents after e that continue it and fit in what is left
+        uint32_t last = e;
+        uint32_t blocks = 0;
+        while (last + 1 < inode->extent_count) {
+            fs_extent *prev = extent_at(inode, last);
+            fs_extent *next = extent_at(inode, last + 1);
+            if (next->logical != prev->logical + prev->length || blocks + next->length > budget - moved ||
+                run_shared(next->start, next->length)) {
+                break;
+            }
+            blocks += next->length;
+            last++;
+        }
+        if (last == e) {
+            e++;
+            continue;
+        }
+
+        // Where the run goes decides which extents it joins: e itself, or
+        // (with no room near e) just the ones after it
+        uint32_t from = e + 1;
+        uint32_t first = e;
+        uint32_t target = head->start + head->length;
+        if (target + blocks <= superblock->total_blocks &&
+            bitmap_find(target, target + blocks, 1) == target + blocks) {
+            claim_run(target, blocks);
+        } else if (head->length + blocks <= budget - moved && !run_shared(head->start, head->length) &&
+                   (target = allocate_contiguous(head->length + blocks)) != NO_BLOCK) {
+            from = e;
+        } else if (last > e + 1 && (target = allocate_contiguous(blocks)) != NO_BLOCK) {
+            first = e + 1;
+        } else {
+            e++;
+            continue;
+        }
+
+        uint32_t copied = 0;
+        for (uint32_t i = from; i <= last; i++) {
+            fs_extent *ext = extent_at(inode, i);
+            for (uint32_t b = 0; b < ext->length; b++) {
+                memcpy(block_ptr(target + copied), block_ptr(ext->start + b), BLOCK_SIZE);
+                copied++;
+            }
+        }
+        data_dirty(target, copied);
+        collapse_extents(inode, first, last, first == from ? target : head->start);
+        moved += copied;
+        if (first != e) e++;
+    }
+    return moved;
+}
+
+// Join the extents of fragmented files by copying up to count blocks of
+// one file, resuming at the file where the last call stopped. Each call is short, so
+// it can run between other work without holding up readers for long; open
+// files are defragmented too, except while fs_read_iov has pieces of them
+// out. Returns 1 while the pass over the inode table goes on, 0 when a
+// call finishes it (the next call starts another), or -1 if no volume is
+// mounted.
+int fs_defrag(uint32_t count) {
+    if (!fs_initialized) return -1;
+    if (count > FS_DEFRAG_MAX) count = FS_DEFRAG_MAX;
+
+    // A file is left only once a call's whole budget moves nothing in it
+    uint32_t moved = 0;
+    while (defrag_cursor <= superblock->inode_count) {
+        fs_inode *inode = get_inode(defrag_cursor);
+        if (inode->type == FS_TYPE_FILE && inode->extent_count > 1 && !inode_pinned(inode)) {
+            moved = defrag_inode(inode, count);
+            if (moved > 0) break;
+        }
+        defrag_cursor++;
+    }
+    defrag_moved += moved;
+    if (defrag_cursor <= superblock->inode_count) return 1;
+    defrag_cursor = 1;
+    defrag_passes++;
+    return 0;
+}
+
+block_device *fs_backing_device(void) {
+    return backing_device;
+}
+
+void fs_init(void) {
+    // Mount the first disk if it holds a volume
+    block_device *disk = block_get_device(0);
+    if (disk) {
+        if (fs_load(disk) == 0) {
+            print_string("Filesystem: mounted from ");
+            print_string(disk->name);
+            journal_stats journal;
+            journal_get_stats(&journal);
+            if (journal.replayed > 0) {
+                char buffer[24];
+                itoa(journal.replayed, buffer, 10);
+                print_string(", replayed ");
+                print_string(buffer);
+                print_string(" journal transactions");
+            }
+            print_string("\n");
+            return;
+        }
+    }
+
+    // Otherwise the prebuilt image GRUB loaded as a module, used in place
+    uint64_t ramdisk_size = 0;
+    void *ramdisk = memory_find_module(FS_RAMDISK_MODULE, &ramdisk_size);
+    if (ramdisk && fs_mount_image(ramdisk, ramdisk_size) == 0) {
+        char buffer[24];
+        itoa(ramdisk_size / 1024, buffer, 10);
+        print_string("Filesystem: mounted boot ramdisk (");
+        print_string(buffer);
+        print_string(" KB)\n");
+        return;
+    }
+
+    // Last resort: format a fresh volume and put a few files on it
+    uint64_t size = FS_DEFAULT_SIZE;
+    if (disk) {
+        backing_device = disk;
+        if (disk->sectors / SECTORS_PER_BLOCK * BLOCK_SIZE < size) {
+            size = disk->sectors / SECTORS_PER_BLOCK * BLOCK_SIZE;
+        }
+    }
+
+    if (fs_mkfs(size, 0) != 0) {
+        print_string("Error: Could not allocate filesystem volume\n");
+        return;
+    }
+    if (disk) {
+        print_string("Filesystem: no volume on ");
+        print_string(disk->name);
+        print_string(", formatted a new one\n");
+    }
+    
+    // Create sample files safely
+    if (fs_create_file("/welcome.txt") == 0) {
+        fs_write_file("/welcome.txt", "Welcome to CAPTAIN-OS v1.3!\nImproved filesystem with better stability and error handling.", 97);
+    }
+    
+    if (fs_create_file("/readme.txt") == 0) {
+        fs_write_file("/readme.txt", "CAPTAIN-OS v1.3\nFeatures: Enhanced multitasking, robust filesystem, shell commands\nType 'help' for commands.", 106);
+    }
+    
+    if (fs_create_directory("/docs") == 0) {
+        if (fs_create_file("/docs/manual.txt") == 0) {
+            fs_write_file("/docs/manual.txt", "CAPTAIN-OS Manual\n\nBasic Commands:\nls - list files\ncat - read file\nhelp - show help\nstatus - system info", 105);
+        }
+    }
+}
+
+// Helper: Create a file or directory inode and link it under its parent
+static int create_entry(const char *path, uint16_t type) {
+    if (!fs_initialized || !path) return -1;
+    
+    // Check if it already exists
+    if (find_entry(path, NULL) != -1) {
+        return 0; // Exists, return success
+    }
+    
+    // Get parent directory
+    char parent_path[FS_MAX_PATH];
+    get_parent_path(path, parent_path);
+    int parent = find_entry(parent_path, NULL);
+    if (parent == -1 || !is_directory(parent)) {
+        return -1;
+    }
+    
+    char name[FS_MAX_NAME + 1];
+    int name_len = extract_filename(path, name);
+    if (name_len <= 0) {
+        return -1;
+    }
+    
+    uint32_t ino = alloc_inode(type, parent);
+    if (ino == NO_INODE) {
+        return -1;
+    }
+    
+    // Directories start with one empty dirent block
+    if (type == FS_TYPE_DIR) {
+        uint32_t block = allocate_block();
+        if (block == NO_BLOCK) {
+            free_inode(ino);
+            return -1;
+        }
+        init_dir_block(block);
+        append_extent(get_inode(ino), block, 1);
+        get_inode(ino)->size = BLOCK_SIZE;
+    }
+    
+    if (add_child_to_directory(parent, name, name_len, ino) != 0) {
+        free_inode(ino);
+        return -1;
+    }
+    return 0;
+}
+
+int fs_create_file(const char *path) {
+    return create_entry(path, FS_TYPE_FILE);
+}
+
+int fs_create_directory(const char *path) {
+    return create_entry(path, FS_TYPE_DIR);
+}
+
+int fs_delete_file(const char *path) {
+    if (!fs_initialized || !path) return -1;
+    
+    int parent;
+    int ino = find_entry(path, &parent);
+    if (ino == -1) {
+        return -1;
+    }
+    
+    // Don't allow deleting root or the current directory
+    if ((uint32_t)ino == superblock->root_inode || (uint32_t)ino == cwd_inode) {
+        return -1;
+    }
+    
+    fs_inode *inode = get_inode(ino);
+    
+    // Open files keep their inode until fs_close
+    if (inode_is_open(ino)) {
+        return -1;
+    }
+    
+    // If directory, check if empty
+    if (inode->type == FS_TYPE_DIR && !directory_empty(inode)) {
+        return -1; // Directory not empty
+    }
+    
+    // Remove from parent directory
+    char name[FS_MAX_NAME + 1];
+    int name_len = extract_filename(path, name);
+    if (name_len <= 0 || remove_child_from_directory(parent, name, name_len) != 0) {
+        return -1;
+    }
+    if (inode->type == FS_TYPE_DIR) {
+        dcache_purge_parent(ino);
+    }
+    
+    // Free blocks and the inode itself
+    free_inode(ino);
+    
+    return 0;
+}
+
+int fs_rename(const char *old_path, const char *new_path) {
+    if (!fs_initialized || !old_path || !new_path) return -1;
+
+    int old_parent;
+    int ino = find_entry(old_path, &old_parent);
+    if (ino == -1 || (uint32_t)ino == superblock->root_inode) {
+        return -1;
+    }
+
+    // Destination must not exist and its parent must be a directory
+    if (find_entry(new_path, NULL) != -1) {
+        return -1;
+    }
+    char parent_path[FS_MAX_PATH];
+    get_parent_path(new_path, parent_path);
+    int new_parent = find_entry(parent_path, NULL);
+    if (new_parent == -1 || !is_directory(new_parent)) {
+        return -1;
+    }
+
+    char old_name[FS_MAX_NAME + 1];
+    char new_name[FS_MAX_NAME + 1];
+    int old_len = extract_filename(old_path, old_name);
+    int new_len = extract_filename(new_path, new_name);
+    if (old_len <= 0 || new_len <= 0) {
+        return -1;
+    }
+
+    // A directory cannot be moved underneath itself
+    uint32_t steps = 0;
+    for (uint32_t i = new_parent; i != superblock->root_inode && steps < superblock->inode_count; i = get_inode(i)->parent, steps++) {
+        if (i == (uint32_t)ino) return -1;
     }
-    
-    if (fs_create_directory("/docs") == 0) {
-        if (fs_create_file("/docs/manual.txt") == 0) {
-            fs_write_file("/docs/manual.txt", "CAPTAIN-OS Manual\n\nBasic Commands:\nls - list files\ncat - read file\nhelp - show help\nstatus - system info", 105);
-        }
+
+    // Link the new name first so a full directory leaves the old one intact
+    if (add_child_to_directory(new_parent, new_name, new_len, ino) != 0) {
+        return -1;
     }
+    // Unlinking can fail too, when the old directory block is still
+    // shared with a snapshot and there is no free block to copy it to. The
+    // new name's block was just made writable, so taking it out again
+    // cannot. Linking moved the inode's name index entry to the new name,
+    // so it is put back under the old one.
+    if (remove_child_from_directory(old_parent, old_name, old_len) != 0) {
+        remove_child_from_directory(new_parent, new_name, new_len);
+        names_add(ino, old_parent, old_name, old_len);
+        return -1;
+    }
+    get_inode(ino)->parent = new_parent;
+    inode_dirty(get_inode(ino));
+
+    return 0;
 }
 
-int fs_create_file(const char *path) {
-    if (!fs_initialized || !path) return -1;
-    
-    if (superblock->num_files >= MAX_FILES) {
+// Reflink copy: dst becomes a file sharing all of src's blocks. Only the
+// extent list is copied and each block gains an owner; either file takes
+// private copies of blocks as it later writes them.
+int fs_clone(const char *src_path, const char *dst_path) {
+    if (!fs_initialized || !src_path || !dst_path) return -1;
+    
+    int src_ino = find_entry(src_path, NULL);
+    if (src_ino == -1 || get_inode(src_ino)->type != FS_TYPE_FILE) {
         return -1;
     }
+    fs_inode *src = get_inode(src_ino);
     
-    // Check if file already exists
-    int parent_index;
-    if (find_entry(path, &parent_index) != -1) {
-        return 0; // File exists, return success
+    // An existing destination is replaced, but only once nothing can fail
+    int dst_ino = find_entry(dst_path, NULL);
+    if (dst_ino != -1 && (dst_ino == src_ino || get_inode(dst_ino)->type != FS_TYPE_FILE ||
+                          inode_pinned(get_inode(dst_ino)))) {
+        return -1;
     }
     
-    // Get parent directory
-    char parent_path[256];
-    get_parent_path(path, parent_path);
-    parent_index = find_entry(parent_path, NULL);
-    
-    if (parent_index == -1 || !superblock->files[parent_index].is_directory) {
+    // Refuse rather than overflow a block's owner count, and take the
+    // indirect block a long extent list needs before changing anything
+    if (!extents_referable(src)) {
         return -1;
     }
-    
-    // Find free file entry
-    int file_index = -1;
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (superblock->files[i].name[0] == '\0') {
-            file_index = i;
-            break;
-        }
+    uint32_t indirect = NO_BLOCK;
+    if (src->extent_count > INLINE_EXTENTS) {
+        indirect = allocate_block();
+        if (indirect == NO_BLOCK) return -1;
     }
     
-    if (file_index == -1) {
+    int created = (dst_ino == -1);
+    if (created && (fs_create_file(dst_path) != 0 || (dst_ino = find_entry(dst_path, NULL)) == -1)) {
+        if (indirect != NO_BLOCK) free_block_run(indirect, 1);
         return -1;
     }
-    
-    // Extract filename
-    char filename[MAX_FILENAME];
-    extract_filename(path, filename);
-    
-    if (filename[0] == '\0') {
+    fs_inode *dst = get_inode(dst_ino);
+    if (inode_resize(dst, 0) != 0) {
+        if (indirect != NO_BLOCK) free_block_run(indirect, 1);
+        if (created) fs_delete_file(dst_path);
         return -1;
     }
     
-    // Add to parent directory
-    if (add_child_to_directory(parent_index, file_index) != 0) {
-        return -1;
+    // Emptied, the destination has no indirect block of its own
+    dst->indirect_block = indirect;
+    for (uint32_t e = 0; e < src->extent_count; e++) {
+        *extent_at(dst, e) = *extent_at(src, e);
     }
-    
-    // Initialize file entry
-    fs_strcpy(superblock->files[file_index].name, filename);
-    superblock->files[file_index].size = 0;
-    superblock->files[file_index].first_block = 0xFFFF;
-    superblock->files[file_index].is_directory = 0;
-    superblock->files[file_index].parent_index = parent_index;
-    superblock->num_files++;
+    ref_extents(src);
+    account_inode(&totals, dst, -1);
+    set_extent_count(dst, src->extent_count);
+    dst->size = src->size;
+    dst->flags = src->flags;
+    account_inode(&totals, dst, 1);
+    extents_dirty(dst);
     
     return 0;
 }
 
-int fs_create_directory(const char *path) {
+// Turn compression on or off for a file. On compresses it now, or at its
+// last fs_close if it is open; writes decompress it again and the last
+// fs_close after them compresses it back. Off stores it plainly for good.
+int fs_set_compression(const char *path, int enable) {
     if (!fs_initialized || !path) return -1;
-    
-    if (superblock->num_files >= MAX_FILES) {
+
+    int ino = find_entry(path, NULL);
+    if (ino == -1 || get_inode(ino)->type != FS_TYPE_FILE) {
         return -1;
     }
-    
-    // Check if directory already exists
-    int parent_index;
-    if (find_entry(path, &parent_index) != -1) {
-        return 0; // Directory exists, return success
+
+    fs_inode *inode = get_inode(ino);
+    if (enable) {
+        inode->flags |= FS_FLAG_COMPRESS;
+        inode_dirty(inode);
+        return inode_is_open(ino) ? 0 : inode_compress(inode);
     }
-    
-    // Get parent directory
-    char parent_path[256];
-    get_parent_path(path, parent_path);
-    parent_index = find_entry(parent_path, NULL);
-    
-    if (parent_index == -1 || !superblock->files[parent_index].is_directory) {
+    if (inode_expand(inode, inode->size) != 0) {
         return -1;
     }
-    
-    // Find free directory entry
-    int dir_index = -1;
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (superblock->files[i].name[0] == '\0') {
-            dir_index = i;
-            break;
+    inode->flags &= ~FS_FLAG_COMPRESS;
+    inode_dirty(inode);
+    return 0;
+}
+
+// Turn deduplication of file writes on or off for the mounted volume. Only
+// blocks written while it is on are indexed; turning it on starts afresh.
+int fs_set_dedup(int enable) {
+    if (!fs_initialized) return -1;
+    if (enable && !dedup_enabled && dedup_reset() != 0) return -1;
+    dedup_enabled = enable ? 1 : 0;
+    return 0;
+}
+
+// Helper: Slot of the snapshot called name, or -1
+static int find_snapshot(const char *name) {
+    for (int i = 0; i < FS_MAX_SNAPSHOTS; i++) {
+        fs_snapshot *snap = &superblock->snapshots[i];
+        if (snap->map_block != NO_BLOCK && fs_strcmp(snap->name, name) == 0) return i;
+    }
+    return -1;
+}
+
+// Helper: A new block holding a copy of block, or NO_BLOCK
+static uint32_t copy_block(uint32_t block) {
+    uint32_t copy = allocate_block();
+    if (copy != NO_BLOCK) memcpy(block_ptr(copy), block_ptr(block), BLOCK_SIZE);
+    return copy;
+}
+
+// Helper: Whether inode table block i (live or copied) has an inode in use
+static int table_in_use(const fs_inode *table) {
+    for (uint32_t j = 0; j < INODES_PER_BLOCK; j++) {
+        if (table[j].type != FS_TYPE_FREE) return 1;
+    }
+    return 0;
+}
+
+// Helper: Give back everything a snapshot owns and free its slot. Its
+// references to file blocks are dropped only if it has taken them.
+static void snapshot_release(fs_snapshot *snap, int referenced) {
+    uint32_t *map = (uint32_t *)block_ptr(snap->map_block);
+    for (uint32_t i = 0; i < superblock->inode_blocks; i++) {
+        if (map[i] == NO_BLOCK) continue;
+        fs_inode *table = (fs_inode *)block_ptr(map[i]);
+        for (uint32_t j = 0; j < INODES_PER_BLOCK; j++) {
+            if (table[j].type == FS_TYPE_FREE) continue;
+            if (referenced) unref_extents(&table[j]);
+            if (table[j].indirect_block != NO_BLOCK) free_block_run(table[j].indirect_block, 1);
         }
+        free_block_run(map[i], 1);
     }
-    
-    if (dir_index == -1) {
-        return -1;
+    free_block_run(snap->map_block, 1);
+    fs_memset(snap, 0, sizeof(fs_snapshot));
+    superblock_dirty();
+}
+
+// Freeze the current tree under name. No file data is copied: the
+// snapshot takes a copy of the inode table and of the indirect extent
+// blocks, and becomes one more owner of every block the tree maps, so
+// writes from now on copy those blocks instead of changing them.
+int fs_snapshot_create(const char *name) {
+    if (!fs_initialized || !name) return -1;
+    uint32_t len = fs_strlen(name);
+    if (len == 0 || len > FS_SNAPSHOT_NAME || find_snapshot(name) != -1) return -1;
+    if (superblock->inode_blocks > BLOCK_SIZE / sizeof(uint32_t)) return -1;
+
+    fs_snapshot *snap = 0;
+    for (int i = 0; i < FS_MAX_SNAPSHOTS && !snap; i++) {
+        if (superblock->snapshots[i].map_block == NO_BLOCK) snap = &superblock->snapshots[i];
     }
-    
-    // Allocate block for directory
-    uint16_t block = allocate_block();
-    if (block == 0xFFFF) {
-        return -1;
+    if (!snap) return -1;
+
+    // Check up front that the copies fit and no block runs out of owners
+    uint32_t need = 1;
+    uint32_t files = 0;
+    for (uint32_t i = 0; i < superblock->inode_blocks; i++) {
+        fs_inode *table = inode_table + i * INODES_PER_BLOCK;
+        if (!table_in_use(table)) continue;
+        need++;
+        for (uint32_t j = 0; j < INODES_PER_BLOCK; j++) {
+            if (table[j].type == FS_TYPE_FREE) continue;
+            if (!extents_referable(&table[j])) return -1;
+            need += (table[j].indirect_block != NO_BLOCK);
+            files++;
+        }
     }
-    
-    uint8_t *block_data = data_area + block * BLOCK_SIZE;
-    fs_memset(block_data, 255, BLOCK_SIZE);
-    
-    // Add to parent directory
-    if (add_child_to_directory(parent_index, dir_index) != 0) {
-        free_blocks(block);
-        return -1;
+    if (need > superblock->free_blocks) return -1;
+
+    uint32_t map_block = allocate_block();
+    if (map_block == NO_BLOCK) return -1;
+    uint32_t *map = (uint32_t *)block_ptr(map_block);
+    fs_memset(map, 0, BLOCK_SIZE);
+    data_dirty(map_block, 1);
+    fs_memset(snap, 0, sizeof(fs_snapshot));
+    memcpy(snap->name, name, len);
+    snap->map_block = map_block;
+    snap->files = files;
+    snap->id = ++superblock->next_snapshot;
+    superblock_dirty();
+
+    // Copy the table, then the indirect blocks; the copies point at their
+    // own indirect blocks, so until those exist they have none
+    for (uint32_t i = 0; i < superblock->inode_blocks; i++) {
+        if (!table_in_use(inode_table + i * INODES_PER_BLOCK)) continue;
+        uint32_t copy = copy_block(superblock->inode_start + i);
+        if (copy == NO_BLOCK) {
+            snapshot_release(snap, 0);
+            return -1;
+        }
+        data_dirty(copy, 1);
+        map[i] = copy;
+        fs_inode *frozen = (fs_inode *)block_ptr(copy);
+        for (uint32_t j = 0; j < INODES_PER_BLOCK; j++) {
+            frozen[j].indirect_block = NO_BLOCK;
+        }
+    }
+    for (uint32_t i = 0; i < superblock->inode_blocks; i++) {
+        if (map[i] == NO_BLOCK) continue;
+        fs_inode *table = inode_table + i * INODES_PER_BLOCK;
+        fs_inode *frozen = (fs_inode *)block_ptr(map[i]);
+        for (uint32_t j = 0; j < INODES_PER_BLOCK; j++) {
+            if (table[j].type == FS_TYPE_FREE || table[j].indirect_block == NO_BLOCK) continue;
+            uint32_t copy = copy_block(table[j].indirect_block);
+            if (copy == NO_BLOCK) {
+                snapshot_release(snap, 0);
+                return -1;
+            }
+            data_dirty(copy, 1);
+            frozen[j].indirect_block = copy;
+        }
+    }
+    for (uint32_t ino = 1; ino <= superblock->inode_count; ino++) {
+        fs_inode *inode = get_inode(ino);
+        if (inode->type != FS_TYPE_FREE) ref_extents(inode);
     }
-    
-    // Extract directory name
-    char dirname[MAX_FILENAME];
-    extract_filename(path, dirname);
-    
-    // Initialize directory entry
-    fs_strcpy(superblock->files[dir_index].name, dirname);
-    superblock->files[dir_index].size = 0;
-    superblock->files[dir_index].first_block = block;
-    superblock->files[dir_index].is_directory = 1;
-    superblock->files[dir_index].parent_index = parent_index;
-    superblock->num_files++;
-    
     return 0;
 }
 
-int fs_delete_file(const char *path) {
-    if (!fs_initialized || !path) return -1;
-    
-    int parent_index;
-    int file_index = find_entry(path, &parent_index);
-    if (file_index == -1) {
-        return -1;
+// Replace the whole tree with a snapshot's. The current tree's blocks lose
+// an owner and the snapshot's gain one, so the snapshot is kept and can be
+// restored again. Refused while any file is open.
+int fs_snapshot_restore(const char *name) {
+    if (!fs_initialized || !name) return -1;
+    int slot = find_snapshot(name);
+    if (slot == -1) return -1;
+    for (int i = 0; i < FS_MAX_OPEN; i++) {
+        if (open_files[i].inode) return -1;
     }
-    
-    // Don't allow deleting root
-    if (superblock->files[file_index].parent_index == 255) {
-        return -1;
+
+    fs_snapshot *snap = &superblock->snapshots[slot];
+    uint32_t *map = (uint32_t *)block_ptr(snap->map_block);
+    uint32_t indirect = 0;
+    for (uint32_t i = 0; i < superblock->inode_blocks; i++) {
+        if (map[i] == NO_BLOCK) continue;
+        fs_inode *frozen = (fs_inode *)block_ptr(map[i]);
+        for (uint32_t j = 0; j < INODES_PER_BLOCK; j++) {
+            if (frozen[j].type == FS_TYPE_FREE) continue;
+            if (!extents_referable(&frozen[j])) return -1;
+            indirect += (frozen[j].indirect_block != NO_BLOCK);
+        }
     }
-    
-    fs_entry *entry = &superblock->files[file_index];
-    
-    // If directory, check if empty
-    if (entry->is_directory) {
-        uint16_t block = entry->first_block;
-        while (is_valid_block_index(block) && block != 0xFFFE) {
-            uint8_t *block_data = data_area + block * BLOCK_SIZE;
-            for (int i = 0; i < MAX_CHILDREN; i++) {
-                if (block_data[i] != 255) {
-                    return -1; // Directory not empty
-                }
+    if (indirect > restore_capacity) {
+        uint32_t *copies = (uint32_t *)phys_alloc((uint64_t)indirect * sizeof(uint32_t), sizeof(uint32_t));
+        if (!copies) return -1;
+        restore_copies = copies;
+        restore_capacity = indirect;
+    }
+
+    // The restored inodes get indirect blocks of their own, made before
+    // anything changes
+    uint32_t made = 0;
+    for (uint32_t i = 0; i < superblock->inode_blocks && made < indirect; i++) {
+        if (map[i] == NO_BLOCK) continue;
+        fs_inode *frozen = (fs_inode *)block_ptr(map[i]);
+        for (uint32_t j = 0; j < INODES_PER_BLOCK; j++) {
+            if (frozen[j].type == FS_TYPE_FREE || frozen[j].indirect_block == NO_BLOCK) continue;
+            uint32_t copy = copy_block(frozen[j].indirect_block);
+            if (copy == NO_BLOCK) {
+                for (uint32_t k = 0; k < made; k++) free_block_run(restore_copies[k], 1);
+                return -1;
             }
-            if (fat[block].next_block == 0xFFFE) break;
-            block = fat[block].next_block;
+            restore_copies[made++] = copy;
         }
     }
-    
-    // Remove from parent directory
-    if (is_valid_file_index(parent_index)) {
-        remove_child_from_directory(parent_index, file_index);
+
+    for (uint32_t ino = 1; ino <= superblock->inode_count; ino++) {
+        fs_inode *inode = get_inode(ino);
+        if (inode->type != FS_TYPE_FREE) free_extents(inode);
     }
-    
-    // Free blocks
-    free_blocks(entry->first_block);
-    
-    // Clear entry
-    entry->name[0] = '\0';
-    entry->size = 0;
-    entry->first_block = 0xFFFF;
-    entry->is_directory = 0;
-    entry->parent_index = 255;
-    superblock->num_files--;
-    
+    uint32_t used = 0;
+    made = 0;
+    for (uint32_t i = 0; i < superblock->inode_blocks; i++) {
+        fs_inode *table = inode_table + i * INODES_PER_BLOCK;
+        if (map[i] == NO_BLOCK) {
+            fs_memset(table, 0, BLOCK_SIZE);
+            continue;
+        }
+        memcpy(table, block_ptr(map[i]), BLOCK_SIZE);
+        for (uint32_t j = 0; j < INODES_PER_BLOCK; j++) {
+            if (table[j].type == FS_TYPE_FREE) continue;
+            used++;
+            if (table[j].indirect_block != NO_BLOCK) {
+                table[j].indirect_block = restore_copies[made++];
+                meta_dirty(table[j].indirect_block, 1);
+            }
+            ref_extents(&table[j]);
+        }
+    }
+    meta_dirty(superblock->inode_start, superblock->inode_blocks);
+    superblock->free_inodes = superblock->inode_count - used;
+    superblock_dirty();
+    count_totals(&totals);
+    inode_hint = 1;
+    if (!is_directory(cwd_inode)) cwd_inode = superblock->root_inode;
+    dcache_reset();
+    names_built = 0;
+    memset(cluster_cache, 0, sizeof(cluster_cache));
+    return 0;
+}
+
+// Drop a snapshot; blocks only it still owned are freed
+int fs_snapshot_delete(const char *name) {
+    if (!fs_initialized || !name) return -1;
+    int slot = find_snapshot(name);
+    if (slot == -1) return -1;
+    snapshot_release(&superblock->snapshots[slot], 1);
     return 0;
 }
 
+// Copy up to max snapshots into list, oldest first. Returns how many were
+// copied, or -1 if nothing is mounted.
+int fs_snapshot_list(fs_snapshot *list, int max) {
+    if (!fs_initialized || !list) return -1;
+    int count = 0;
+    uint64_t after = 0;
+    while (count < max) {
+        fs_snapshot *next = 0;
+        for (int i = 0; i < FS_MAX_SNAPSHOTS; i++) {
+            fs_snapshot *snap = &superblock->snapshots[i];
+            if (snap->map_block == NO_BLOCK || snap->id <= after) continue;
+            if (!next || snap->id < next->id) next = snap;
+        }
+        if (!next) break;
+        list[count++] = *next;
+        after = next->id;
+    }
+    return count;
+}
+
+// Replace a file's contents. Existing blocks are overwritten in place and
+// only the difference in length is allocated or freed.
 int fs_write_file(const char *path, const char *data, uint32_t size) {
     if (!fs_initialized || !path || !data) return -1;
     
-    int parent_index;
-    int file_index = find_entry(path, &parent_index);
-    if (file_index == -1) {
+    int ino = find_entry(path, NULL);
+    if (ino == -1) {
         return -1;
     }
     
-    if (superblock->files[file_index].is_directory) {
+    fs_inode *inode = get_inode(ino);
+    if (inode->type != FS_TYPE_FILE) {
         return -1;
     }
     
-    // Free existing blocks
-    free_blocks(superblock->files[file_index].first_block);
-    superblock->files[file_index].first_block = 0xFFFF;
-    
-    if (size == 0) {
-        superblock->files[file_index].size = 0;
-        return 0;
+    // Nothing of the old contents survives, so none needs decompressing
+    if (inode_expand(inode, 0) != 0) {
+        return -1;
     }
-    
-    // Allocate blocks for data
-    uint32_t blocks_needed = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    uint16_t first_block = 0xFFFF;
-    uint16_t prev_block = 0xFFFF;
-    
-    for (uint32_t i = 0; i < blocks_needed; i++) {
-        uint16_t block = allocate_block();
-        if (block == 0xFFFF) {
-            free_blocks(first_block);
-            return -1;
-        }
-        
-        if (first_block == 0xFFFF) {
-            first_block = block;
-        } else if (is_valid_block_index(prev_block)) {
-            fat[prev_block].next_block = block;
-        }
-        prev_block = block;
+    if (size < inode->size && inode_resize(inode, size) != 0) {
+        return -1;
     }
-    
-    // Write data to allocated blocks
-    uint16_t block = first_block;
-    uint32_t bytes_written = 0;
-    
-    while (is_valid_block_index(block) && bytes_written < size) {
-        uint32_t to_write = (size - bytes_written > BLOCK_SIZE) ? BLOCK_SIZE : (size - bytes_written);
-        uint8_t *block_data = data_area + block * BLOCK_SIZE;
-        
-        for (uint32_t i = 0; i < to_write; i++) {
-            block_data[i] = data[bytes_written + i];
-        }
-        
-        bytes_written += to_write;
-        if (fat[block].next_block == 0xFFFE) break;
-        block = fat[block].next_block;
+    if (inode_write(inode, 0, (const uint8_t *)data, size) < 0) {
+        return -1;
     }
-    
-    superblock->files[file_index].first_block = first_block;
-    superblock->files[file_index].size = size;
+    compress_if_idle(ino);
     
     return 0;
 }
@@ -576,39 +3175,256 @@ int fs_write_file(const char *path, const char *data, uint32_t size) {
 int fs_read_file(const char *path, char *buffer, uint32_t max_size) {
     if (!fs_initialized || !path || !buffer || max_size == 0) return -1;
     
-    int parent_index;
-    int file_index = find_entry(path, &parent_index);
-    if (file_index == -1) {
+    int ino = find_entry(path, NULL);
+    if (ino == -1) {
         return -1;
     }
     
-    if (superblock->files[file_index].is_directory) {
+    fs_inode *inode = get_inode(ino);
+    if (inode->type != FS_TYPE_FILE) {
         return -1;
     }
     
-    uint32_t size = superblock->files[file_index].size;
-    if (size > max_size - 1) {
-        size = max_size - 1;
+    int bytes_read = inode_read(inode, 0, (uint8_t *)buffer, max_size - 1);
+    if (bytes_read < 0) return -1;
+    buffer[bytes_read] = '\0';
+    return bytes_read;
+}
+
+// Helper: Descriptor slot for fd, or 0 if it is not open
+static fs_file *get_file(int fd) {
+    if (!fs_initialized || fd < 0 || fd >= FS_MAX_OPEN || !open_files[fd].inode) return 0;
+    return &open_files[fd];
+}
+
+static int file_readable(fs_file *file) {
+    return (file->flags & FS_O_ACCMODE) != FS_O_WRONLY;
+}
+
+static int file_writable(fs_file *file) {
+    return (file->flags & FS_O_ACCMODE) != FS_O_RDONLY;
+}
+
+int fs_open(const char *path, int flags) {
+    if (!fs_initialized || !path) return -1;
+    
+    int ino = find_entry(path, NULL);
+    if (ino == -1) {
+        if (!(flags & FS_O_CREAT) || fs_create_file(path) != 0) {
+            return -1;
+        }
+        ino = find_entry(path, NULL);
+        if (ino == -1) {
+            return -1;
+        }
     }
     
-    uint16_t block = superblock->files[file_index].first_block;
-    uint32_t bytes_read = 0;
+    fs_inode *inode = get_inode(ino);
+    if (inode->type != FS_TYPE_FILE) {
+        return -1;
+    }
     
-    while (is_valid_block_index(block) && block != 0xFFFE && bytes_read < size) {
-        uint32_t to_read = (size - bytes_read > BLOCK_SIZE) ? BLOCK_SIZE : (size - bytes_read);
-        uint8_t *block_data = data_area + block * BLOCK_SIZE;
+    for (int fd = 0; fd < FS_MAX_OPEN; fd++) {
+        fs_file *file = &open_files[fd];
+        if (file->inode) continue;
         
-        for (uint32_t i = 0; i < to_read; i++) {
-            buffer[bytes_read + i] = block_data[i];
+        file->inode = inode;
+        file->ino = ino;
+        file->flags = flags;
+        file->offset = 0;
+        file->pins = 0;
+        if ((flags & FS_O_TRUNC) && file_writable(file) &&
+            (inode_expand(inode, 0) != 0 || inode_resize(inode, 0) != 0)) {
+            file->inode = 0;
+            return -1;
         }
-        
-        bytes_read += to_read;
-        if (fat[block].next_block == 0xFFFE) break;
-        block = fat[block].next_block;
+        return fd;
+    }
+    return -1;
+}
+
+int fs_close(int fd) {
+    fs_file *file = get_file(fd);
+    if (!file) return -1;
+    file->inode = 0;
+    compress_if_idle(file->ino);
+    return 0;
+}
+
+int fs_pread(int fd, void *buffer, uint32_t count, uint64_t offset) {
+    fs_file *file = get_file(fd);
+    if (!file || !buffer || !file_readable(file)) return -1;
+    if (count > 0x7FFFFFFF) count = 0x7FFFFFFF;
+    return inode_read(file->inode, offset, (uint8_t *)buffer, count);
+}
+
+// With FS_O_APPEND the offset is ignored and data lands at end of file
+int fs_pwrite(int fd, const void *data, uint32_t count, uint64_t offset) {
+    fs_file *file = get_file(fd);
+    if (!file || !data || !file_writable(file)) return -1;
+    if (count > 0x7FFFFFFF) count = 0x7FFFFFFF;
+    if (inode_expand(file->inode, file->inode->size) != 0) {
+        return -1;
+    }
+    if (file->flags & FS_O_APPEND) {
+        offset = file->inode->size;
+    }
+    return inode_write(file->inode, offset, (const uint8_t *)data, count);
+}
+
+int fs_read(int fd, void *buffer, uint32_t count) {
+    fs_file *file = get_file(fd);
+    if (!file) return -1;
+    int n = fs_pread(fd, buffer, count, file->offset);
+    if (n > 0) file->offset += n;
+    return n;
+}
+
+int fs_write(int fd, const void *data, uint32_t count) {
+    fs_file *file = get_file(fd);
+    if (!file) return -1;
+    if (file->flags & FS_O_APPEND) {
+        file->offset = file->inode->size;
+    }
+    int n = fs_pwrite(fd, data, count, file->offset);
+    if (n > 0) file->offset += n;
+    return n;
+}
+
+// Helper: For FS_SEEK_DATA the first offset at or past pos that is not in
+// a hole, for FS_SEEK_HOLE the first that is, end of file counting as a
+// hole. -1 if pos is at or past the end, or no data follows it.
+static int64_t seek_data_hole(fs_inode *inode, uint64_t pos, int whence) {
+    if (pos >= inode->size) return -1;
+    if (inode->flags & FS_FLAG_COMPRESSED) {
+        return (whence == FS_SEEK_DATA) ? (int64_t)pos : (int64_t)inode->size;
+    }
+
+    uint32_t e = extent_from(inode, pos / BLOCK_SIZE);
+    if (whence == FS_SEEK_DATA) {
+        if (e == inode->extent_count) return -1;
+        uint64_t data = (uint64_t)extent_at(inode, e)->logical * BLOCK_SIZE;
+        return (data > pos) ? data : pos;
+    }
+    if (e == inode->extent_count || (uint64_t)extent_at(inode, e)->logical * BLOCK_SIZE > pos) {
+        return pos;
+    }
+    while (e + 1 < inode->extent_count &&
+           extent_at(inode, e + 1)->logical == extent_at(inode, e)->logical + extent_at(inode, e)->length) {
+        e++;
+    }
+    fs_extent *ext = extent_at(inode, e);
+    uint64_t hole = (uint64_t)(ext->logical + ext->length) * BLOCK_SIZE;
+    return (hole < inode->size) ? hole : inode->size;
+}
+
+int64_t fs_lseek(int fd, int64_t offset, int whence) {
+    fs_file *file = get_file(fd);
+    if (!file) return -1;
+    
+    if (whence == FS_SEEK_DATA || whence == FS_SEEK_HOLE) {
+        if (offset < 0) return -1;
+        int64_t found = seek_data_hole(file->inode, offset, whence);
+        if (found >= 0) file->offset = found;
+        return found;
     }
     
-    buffer[bytes_read] = '\0';
-    return bytes_read;
+    int64_t base;
+    switch (whence) {
+        case FS_SEEK_SET: base = 0; break;
+        case FS_SEEK_CUR: base = file->offset; break;
+        case FS_SEEK_END: base = file->inode->size; break;
+        default: return -1;
+    }
+    if (base + offset < 0) return -1;
+    file->offset = base + offset;
+    return file->offset;
+}
+
+int fs_truncate(int fd, uint64_t size) {
+    fs_file *file = get_file(fd);
+    if (!file || !file_writable(file)) return -1;
+    if (inode_expand(file->inode, size) != 0) return -1;
+    return inode_resize(file->inode, size);
+}
+
+// Deallocate [offset, offset + len) of a file, which then reads as zeros
+// with its size unchanged. Whole blocks in the range are freed; the
+// partial ones at its ends are cleared in place.
+int fs_punch_hole(int fd, uint64_t offset, uint64_t len) {
+    fs_file *file = get_file(fd);
+    if (!file || !file_writable(file)) return -1;
+    
+    fs_inode *inode = file->inode;
+    if (offset >= inode->size || len == 0) return 0;
+    if (len > inode->size - offset) len = inode->size - offset;
+    if (inode_pinned(inode) || inode_expand(inode, inode->size) != 0) return -1;
+    
+    // Bytes past the end of file never show, so a range reaching it frees
+    // the last block whole
+    uint64_t end = offset + len;
+    uint32_t first = blocks_for(offset);
+    uint32_t last = (end == inode->size) ? blocks_for(end) : end / BLOCK_SIZE;
+    if (first >= last) {
+        if (unshare_range(inode, offset, len) != 0) return -1;
+        write_range(inode, offset, 0, len);
+        return 0;
+    }
+    
+    uint64_t head = (uint64_t)first * BLOCK_SIZE - offset;
+    uint64_t tail = end - (uint64_t)last * BLOCK_SIZE;
+    if (end < (uint64_t)last * BLOCK_SIZE) tail = 0;
+    if (unshare_range(inode, offset, head) != 0 ||
+        unshare_range(inode, (uint64_t)last * BLOCK_SIZE, tail) != 0 ||
+        unmap_blocks(inode, first, last - first) != 0) {
+        return -1;
+    }
+    write_range(inode, offset, 0, head);
+    write_range(inode, (uint64_t)last * BLOCK_SIZE, 0, tail);
+    return 0;
+}
+
+// Zero-copy read: fill iov with up to n pointers into the volume covering
+// [offset, offset + len), clamped to end of file. Each call that returns
+// data takes a pin, which keeps those blocks from being freed until
+// fs_release_iov; contents may still change under a concurrent write.
+// A compressed file comes back one piece at a time out of its decoded
+// cluster, which the pin keeps in the cache. Returns the number of pieces
+// filled.
+int fs_read_iov(int fd, uint64_t offset, uint32_t len, fs_iovec *iov, int n) {
+    fs_file *file = get_file(fd);
+    if (!file || !iov || n <= 0 || !file_readable(file)) return -1;
+    
+    fs_inode *inode = file->inode;
+    if (offset >= inode->size) return 0;
+    if (len > inode->size - offset) len = inode->size - offset;
+    
+    int count;
+    if (inode->flags & FS_FLAG_COMPRESSED) {
+        cluster_slot *slot = cluster_get(inode, offset / FS_CLUSTER_SIZE);
+        if (!slot) return -1;
+        uint32_t within = offset % FS_CLUSTER_SIZE;
+        iov[0].base = cluster_data(slot) + within;
+        iov[0].len = (slot->len - within < len) ? slot->len - within : len;
+        count = 1;
+    } else {
+        count = map_range(inode, offset, len, iov, n);
+    }
+    if (count > 0) file->pins++;
+    return count;
+}
+
+// Drop one pin taken by fs_read_iov
+int fs_release_iov(int fd) {
+    fs_file *file = get_file(fd);
+    if (!file || file->pins == 0) return -1;
+    file->pins--;
+    return 0;
+}
+
+uint64_t fs_file_size(int fd) {
+    fs_file *file = get_file(fd);
+    return file ? file->inode->size : 0;
 }
 
 void fs_list_files(const char *path) {
@@ -617,10 +3433,9 @@ void fs_list_files(const char *path) {
         return;
     }
     
-    int parent_index;
-    int dir_index = find_entry(path, &parent_index);
+    int dir_ino = find_entry(path, NULL);
     
-    if (dir_index == -1 || !superblock->files[dir_index].is_directory) {
+    if (dir_ino == -1 || !is_directory(dir_ino)) {
         print_string("Error: Directory not found!\n");
         return;
     }
@@ -633,36 +3448,39 @@ void fs_list_files(const char *path) {
     }
     print_string(":\n");
     
-    uint16_t block = superblock->files[dir_index].first_block;
+    fs_inode *dir = get_inode(dir_ino);
+    uint32_t nblocks = inode_nblocks(dir);
     int file_count = 0;
     
-    while (is_valid_block_index(block) && block != 0xFFFE) {
-        uint8_t *block_data = data_area + block * BLOCK_SIZE;
-        for (int i = 0; i < MAX_CHILDREN; i++) {
-            uint8_t child_index = block_data[i];
-            if (is_valid_file_index(child_index) &&
-                superblock->files[child_index].name[0] != '\0') {
-                
-                fs_entry *child = &superblock->files[child_index];
-                print_string("  ");
-                print_string(child->name);
-                
-                if (child->is_directory) {
-                    print_string("/");
-                    print_string(" (DIR)");
-                } else {
-                    print_string(" (");
-                    char buffer[16];
-                    itoa(child->size, buffer, 10);
-                    print_string(buffer);
-                    print_string(" bytes)");
-                }
-                print_string("\n");
-                file_count++;
+    for (uint32_t b = 0; b < nblocks; b++) {
+        uint8_t *data = block_ptr(map_block(dir, b));
+        uint32_t offset = 0;
+        while (offset < BLOCK_SIZE) {
+            fs_dirent *de = (fs_dirent *)(data + offset);
+            if (de->rec_len < DIRENT_HEADER) break;
+            offset += de->rec_len;
+            fs_inode *child = get_inode(de->inode);
+            if (!child) continue;
+            
+            char name[FS_MAX_NAME + 1];
+            memcpy(name, de->name, de->name_len);
+            name[de->name_len] = '\0';
+            print_string("  ");
+            print_string(name);
+            
+            if (child->type == FS_TYPE_DIR) {
+                print_string("/");
+                print_string(" (DIR)");
+            } else {
+                print_string(" (");
+                char buffer[24];
+                itoa(child->size, buffer, 10);
+                print_string(buffer);
+                print_string(" bytes)");
             }
+            print_string("\n");
+            file_count++;
         }
-        if (fat[block].next_block == 0xFFFE) break;
-        block = fat[block].next_block;
     }
     
     if (file_count == 0) {
@@ -676,34 +3494,268 @@ void fs_list_files(const char *path) {
     print_string(" entries\n");
 }
 
-// Get filesystem statistics
-void fs_get_stats(fs_stats *stats) {
-    if (!fs_initialized || !stats) return;
-    
-    stats->total_files = 0;
-    stats->total_directories = 0;
-    stats->used_blocks = 0;
-    stats->free_blocks = 0;
-    stats->total_size = 0;
-    
-    // Count files and directories
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (superblock->files[i].name[0] != '\0') {
-            if (superblock->files[i].is_directory) {
-                stats->total_directories++;
-            } else {
-                stats->total_files++;
-                stats->total_size += superblock->files[i].size;
-            }
+// Helper: Step through the directory dir_ino for fs_read_dir and the
+// walker
+static int read_dir_inode(uint32_t dir_ino, uint64_t *cookie, fs_dir_entry *entry) {
+    if (!is_directory(dir_ino)) return -1;
+
+    fs_inode *dir = get_inode(dir_ino);
+    uint32_t nblocks = inode_nblocks(dir);
+    while (*cookie / BLOCK_SIZE < nblocks) {
+        uint32_t b = *cookie / BLOCK_SIZE;
+        uint32_t offset = *cookie % BLOCK_SIZE;
+        fs_dirent *de = (fs_dirent *)(block_ptr(map_block(dir, b)) + offset);
+        if (de->rec_len < DIRENT_HEADER || offset + de->rec_len > BLOCK_SIZE) {
+            *cookie = (uint64_t)(b + 1) * BLOCK_SIZE;
+            continue;
         }
+        *cookie += de->rec_len;
+        fs_inode *child = get_inode(de->inode);
+        if (!child) continue;
+
+        memcpy(entry->name, de->name, de->name_len);
+        entry->name[de->name_len] = '\0';
+        entry->inode = de->inode;
+        entry->type = child->type;
+        entry->size = child->size;
+        return 1;
     }
-    
-    // Count used/free blocks
-    for (int i = 0; i < MAX_BLOCKS; i++) {
-        if (fat[i].next_block == 0xFFFF) {
-            stats->free_blocks++;
+    return 0;
+}
+
+// Step through a directory. *cookie starts at 0 and is advanced past each
+// entry returned. Returns 1 with entry filled in, 0 at the end, or -1 if
+// path is not a directory.
+int fs_read_dir(const char *path, uint64_t *cookie, fs_dir_entry *entry) {
+    if (!fs_initialized || !cookie || !entry) return -1;
+    int dir_ino = find_entry(path, NULL);
+    if (dir_ino == -1) return -1;
+    return read_dir_inode(dir_ino, cookie, entry);
+}
+
+// Begin a walk of everything below path, for fs_walk_next
+int fs_walk_start(fs_walker *walker, const char *path) {
+    if (!fs_initialized || !walker) return -1;
+    int ino = find_entry(path, NULL);
+    if (ino == -1 || !is_directory(ino)) return -1;
+    walker->depth = 1;
+    walker->dirs[0] = ino;
+    walker->cookies[0] = 0;
+    return 0;
+}
+
+// Step through a tree in pre-order: each directory is followed by its
+// contents. *depth is 0 for entries directly below the starting
+// directory. The walker keeps one cookie per level instead of recursing;
+// directories FS_WALK_DEPTH levels down are reported but not entered.
+// Returns 1 with entry filled in, 0 at the end, or -1 if a directory
+// being walked disappears.
+int fs_walk_next(fs_walker *walker, fs_dir_entry *entry, uint32_t *depth) {
+    if (!fs_initialized || !walker || !entry) return -1;
+    while (walker->depth > 0) {
+        uint32_t top = walker->depth - 1;
+        int result = read_dir_inode(walker->dirs[top], &walker->cookies[top], entry);
+        if (result < 0) return -1;
+        if (result == 0) {
+            walker->depth--;
+            continue;
+        }
+        if (depth) *depth = top;
+        if (entry->type == FS_TYPE_DIR && walker->depth < FS_WALK_DEPTH) {
+            walker->dirs[walker->depth] = entry->inode;
+            walker->cookies[walker->depth] = 0;
+            walker->depth++;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+// Find inodes by name across the whole volume, from the name index.
+// FS_FIND_EXACT matches the name itself, FS_FIND_PREFIX names starting
+// with pattern and FS_FIND_GLOB names matching it with * and ?. The first
+// max matches are stored in inodes; returns how many there are in all, or
+// -1 if the index cannot be built.
+int fs_find(const char *pattern, int mode, uint32_t *inodes, int max) {
+    if (!fs_initialized || !pattern || names_build() != 0) return -1;
+    uint32_t len = fs_strlen(pattern);
+    if (mode == FS_FIND_EXACT && (len == 0 || len > FS_MAX_NAME)) return 0;
+
+    // The characters every match starts with
+    uint32_t literal = len;
+    if (mode == FS_FIND_GLOB) {
+        for (literal = 0; literal < len; literal++) {
+            if (pattern[literal] == '*' || pattern[literal] == '?') break;
+        }
+    }
+
+    int found = 0;
+    int chain = (mode == FS_FIND_EXACT) ? NAME_BY_NAME : NAME_BY_PREFIX;
+    int indexed = (mode == FS_FIND_EXACT || literal >= NAME_PREFIX);
+    uint32_t ino = indexed ? *name_head(chain, pattern, literal) : 1;
+    while (ino != NO_INODE && ino <= superblock->inode_count) {
+        name_entry *e = &name_entries[ino];
+        const char *name = name_arena + e->name;
+        int match;
+        if (e->parent == NO_INODE) {
+            match = 0;                 // Unlinked; only seen when scanning
+        } else if (mode == FS_FIND_EXACT) {
+            match = (e->len == len && memcmp(name, pattern, len) == 0);
+        } else if (mode == FS_FIND_PREFIX) {
+            match = (e->len >= len && memcmp(name, pattern, len) == 0);
         } else {
-            stats->used_blocks++;
+            match = glob_match(pattern, len, name, e->len);
+        }
+        if (match) {
+            if (found < max) inodes[found] = ino;
+            found++;
+        }
+        ino = indexed ? e->next[chain] : ino + 1;
+    }
+    return found;
+}
+
+// Write the full path of a linked inode into path, from the name index.
+// Returns 0, or -1 if the inode has no name or the path does not fit.
+int fs_inode_path(uint32_t ino, char *path, uint32_t size) {
+    if (!fs_initialized || !path || size < 2 || !get_inode(ino) || names_build() != 0) return -1;
+
+    // Measure, then fill in from the end
+    uint32_t len = 0;
+    uint32_t steps = 0;
+    for (uint32_t i = ino; i != superblock->root_inode; i = name_entries[i].parent) {
+        if (name_entries[i].parent == NO_INODE || ++steps > superblock->inode_count) return -1;
+        len += 1 + name_entries[i].len;
+    }
+    if (len + 1 > size) return -1;
+    if (len == 0) {
+        path[0] = '/';
+        path[1] = '\0';
+        return 0;
+    }
+    path[len] = '\0';
+    for (uint32_t i = ino; i != superblock->root_inode; i = name_entries[i].parent) {
+        len -= name_entries[i].len;
+        memcpy(path + len, name_arena + name_entries[i].name, name_entries[i].len);
+        path[--len] = '/';
+    }
+    return 0;
+}
+
+
+// Helper: Report a running total that disagrees with a scan
+static int stat_differs(const char *name, uint64_t kept, uint64_t counted) {
+    if (kept == counted) return 0;
+    char buffer[24];
+    print_string("Filesystem: ");
+    print_string(name);
+    print_string(" is ");
+    itoa(kept, buffer, 10);
+    print_string(buffer);
+    print_string(", a scan counts ");
+    itoa(counted, buffer, 10);
+    print_string(buffer);
+    print_string("\n");
+    return 1;
+}
+
+// Debugging aid: recount everything fs_get_stats reports as a running
+// total by scanning the inode table, bitmap and refcounts, and report each
+// counter that has drifted. Returns how many differ.
+int fs_check_stats(void) {
+    if (!fs_initialized) return -1;
+
+    fs_totals scan;
+    count_totals(&scan);
+    uint32_t free_blocks = 0;
+    uint32_t free_inodes = 0;
+    uint32_t shared = 0;
+    uint64_t extra = 0;
+    for (uint32_t block = 0; block < superblock->total_blocks; block++) {
+        if (!block_in_use(block)) {
+            free_blocks++;
+        } else if (block >= superblock->data_start && block_refs[block] > 1) {
+            shared++;
+            extra += block_refs[block] - 1;
         }
     }
-}
\ No newline at end of file
+    for (uint32_t i = 0; i < superblock->inode_count; i++) {
+        if (inode_table[i].type == FS_TYPE_FREE) free_inodes++;
+    }
+
+    int differ = 0;
+    differ += stat_differs("files", totals.files, scan.files);
+    differ += stat_differs("directories", totals.directories, scan.directories);
+    differ += stat_differs("file bytes", totals.file_bytes, scan.file_bytes);
+    differ += stat_differs("compressed files", totals.compressed_files, scan.compressed_files);
+    differ += stat_differs("compressed bytes", totals.compressed_bytes, scan.compressed_bytes);
+    differ += stat_differs("compressed blocks", totals.compressed_blocks, scan.compressed_blocks);
+    differ += stat_differs("file extents", totals.file_extents, scan.file_extents);
+    differ += stat_differs("fragmented files", totals.fragmented_files, scan.fragmented_files);
+    differ += stat_differs("free blocks", superblock->free_blocks, free_blocks);
+    differ += stat_differs("free inodes", superblock->free_inodes, free_inodes);
+    differ += stat_differs("shared blocks", shared_block_count, shared);
+    differ += stat_differs("extra references", extra_refs, extra);
+    return differ;
+}
+
+// Get filesystem statistics
+void fs_get_stats(fs_stats *stats) {
+    if (!fs_initialized || !stats) return;
+    
+    // Everything here is a counter kept current as the volume changes;
+    // nothing is scanned (fs_check_stats does that)
+    stats->total_files = totals.files;
+    stats->total_directories = totals.directories;
+    stats->total_size = totals.file_bytes;
+    stats->compressed_files = totals.compressed_files;
+    stats->compressed_bytes = totals.compressed_bytes;
+    stats->compressed_stored = totals.compressed_blocks * BLOCK_SIZE;
+    stats->dcache_hits = dcache_hits;
+    stats->dcache_misses = dcache_misses;
+    
+    // Block and inode counts come from the superblock
+    stats->block_size = superblock->block_size;
+    stats->total_blocks = superblock->total_blocks;
+    stats->free_blocks = superblock->free_blocks;
+    stats->used_blocks = superblock->total_blocks - superblock->free_blocks;
+    stats->total_inodes = superblock->inode_count;
+    stats->free_inodes = superblock->free_inodes;
+    stats->shared_blocks = shared_block_count;
+    
+    bcache_stats cache;
+    bcache_get_stats(&cache);
+    stats->cache_hits = cache.hits;
+    stats->cache_misses = cache.misses;
+    stats->cache_readahead = cache.readahead;
+    stats->cache_writeback = cache.writeback;
+    stats->dirty_blocks = cache.dirty + cache.meta;
+    
+    journal_stats journal;
+    journal_get_stats(&journal);
+    stats->journal_blocks = superblock->journal_blocks;
+    stats->journal_used = journal.used;
+    stats->journal_commits = journal.commits;
+    stats->journal_logged = journal.logged;
+    stats->journal_checkpoints = journal.checkpoints;
+    stats->journal_replayed = journal.replayed;
+    stats->checksum_errors = checksum_errors;
+    stats->scrubbed_blocks = scrubbed_blocks;
+    stats->scrub_passes = scrub_passes;
+    stats->cluster_hits = cluster_hits;
+    stats->cluster_decodes = cluster_decodes;
+    stats->decoded_bytes = decoded_bytes;
+    stats->decode_cycles = decode_cycles;
+    stats->file_extents = totals.file_extents;
+    stats->fragmented_files = totals.fragmented_files;
+    stats->defrag_moved = defrag_moved;
+    stats->defrag_passes = defrag_passes;
+    stats->dedup_enabled = dedup_enabled;
+    stats->dedup_hits = dedup_hits;
+    stats->data_blocks = superblock->total_blocks - superblock->data_start - superblock->free_blocks;
+    stats->shared_refs = extra_refs;
+    stats->snapshots = 0;
+    for (int i = 0; i < FS_MAX_SNAPSHOTS; i++) {
+        if (superblock->snapshots[i].map_block != NO_BLOCK) stats->snapshots++;
+    }
+}
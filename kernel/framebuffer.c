@@ -1,6 +1,8 @@
 #include "framebuffer.h"
 #include "vga.h"
+#include "utils.h"
 #include "task.h"
+#include "paging.h"
 
 framebuffer_info fb_info = {0};
 
@@ -71,6 +73,9 @@ void fb_init(void *multiboot_info_ptr) {
                     fb_info.pitch = fb_tag->pitch;
                     fb_info.bpp = fb_tag->bpp;
                     fb_info.is_rgb = 1;
+
+                    // Scanout memory wants write-combining, not WB or UC
+                    paging_identity_map(fb_info.addr, (uint64_t)fb_info.pitch * fb_info.height, PAGE_CACHE_WC);
                     
                     // Print framebuffer info to VGA text mode for debugging
                     print_string("Framebuffer found: ");
@@ -151,13 +156,12 @@ void fb_clear(uint32_t color) {
 
     enter_critical_section();
     
-    // More efficient clearing for 32-bit framebuffers
+    // More efficient clearing for 32-bit framebuffers: one string store per scanline
     if (fb_info.bpp == 32) {
-        uint32_t *fb = (uint32_t *)fb_info.addr;
-        uint32_t total_pixels = fb_info.height * fb_info.width;  // Fixed calculation
-        
-        for (uint32_t i = 0; i < total_pixels; i++) {
-            fb[i] = color;
+        for (uint32_t y = 0; y < fb_info.height; y++) {
+            uint32_t *line = (uint32_t *)(fb_info.addr + (uint64_t)y * fb_info.pitch);
+            uint64_t count = fb_info.width;
+            __asm__ volatile("rep stosl" : "+D"(line), "+c"(count) : "a"(color) : "memory");
         }
     } else {
         // Fallback to pixel-by-pixel for other bit depths
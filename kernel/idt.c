@@ -112,9 +112,9 @@ void keyboard_handler(void) {
             print_char('\n', cursor_row, cursor_col);
             cursor_row++;
             cursor_col = 0;
-            if (cursor_row >= VGA_HEIGHT) {
+            if (cursor_row >= screen_height) {
                 scroll_screen();
-                cursor_row = VGA_HEIGHT - 1;
+                cursor_row = screen_height - 1;
             }
             handle_command();
         } else if (c == '\b') {
@@ -125,7 +125,7 @@ void keyboard_handler(void) {
                     cursor_col--;
                 } else if (cursor_row > 0) {
                     cursor_row--;
-                    cursor_col = VGA_WIDTH - 1;
+                    cursor_col = screen_width - 1;
                 }
                 print_char(' ', cursor_row, cursor_col);
             }
@@ -136,12 +136,12 @@ void keyboard_handler(void) {
                 input_buffer[input_pos++] = ' ';
                 print_char(' ', cursor_row, cursor_col);
                 cursor_col++;
-                if (cursor_col >= VGA_WIDTH) {
+                if (cursor_col >= screen_width) {
                     cursor_row++;
                     cursor_col = 0;
-                    if (cursor_row >= VGA_HEIGHT) {
+                    if (cursor_row >= screen_height) {
                         scroll_screen();
-                        cursor_row = VGA_HEIGHT - 1;
+                        cursor_row = screen_height - 1;
                     }
                 }
             }
@@ -149,12 +149,12 @@ void keyboard_handler(void) {
             input_buffer[input_pos++] = c;
             print_char(c, cursor_row, cursor_col);
             cursor_col++;
-            if (cursor_col >= VGA_WIDTH) {
+            if (cursor_col >= screen_width) {
                 cursor_row++;
                 cursor_col = 0;
-                if (cursor_row >= VGA_HEIGHT) {
+                if (cursor_row >= screen_height) {
                     scroll_screen();
-                    cursor_row = VGA_HEIGHT - 1;
+                    cursor_row = screen_height - 1;
                 }
             }
         }
@@ -232,6 +232,9 @@ extern void load_idt(uint64_t idt_ptr);
 extern void keyboard_isr(void);
 extern void exception_isr(void);
 extern void timer_isr(void);
+extern uint64_t irq_stub_table[IRQ_LINES];
+
+static irq_handler_t irq_handlers[IRQ_LINES][IRQ_MAX_HANDLERS];
 
 void idt_set_gate(uint8_t num, uint64_t base, uint16_t sel, uint8_t flags) {
     idt[num].offset_low = base & 0xFFFF;
@@ -243,6 +246,34 @@ void idt_set_gate(uint8_t num, uint64_t base, uint16_t sel, uint8_t flags) {
     idt[num].reserved = 0;
 }
 
+// Attach handler to a PIC line, installing its gate and unmasking it on
+// first use. PCI INTx lines are level triggered and often shared, so every
+// handler on the line runs for each interrupt.
+int irq_register(uint8_t irq, irq_handler_t handler) {
+    if (irq >= IRQ_LINES || irq_stub_table[irq] == 0 || !handler) return -1;
+
+    for (int i = 0; i < IRQ_MAX_HANDLERS; i++) {
+        if (irq_handlers[irq][i] == handler) return 0;
+        if (irq_handlers[irq][i] == 0) {
+            irq_handlers[irq][i] = handler;
+            if (i == 0) {
+                idt_set_gate(IRQ_BASE_VECTOR + irq, irq_stub_table[irq], 0x08, 0x8E);
+                pic_unmask(irq);
+            }
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Called from the irqN_isr stubs
+void irq_dispatch(uint64_t irq) {
+    for (int i = 0; i < IRQ_MAX_HANDLERS && irq_handlers[irq][i]; i++) {
+        irq_handlers[irq][i]();
+    }
+    pic_send_eoi(irq);
+}
+
 void exception_handler(void) {
     enter_critical_section();
     print_string("\n*** SYSTEM EXCEPTION ***\n");
@@ -185,4 +185,81 @@ exception_isr:
     pop rax
     
     ; Return from interrupt (if we ever get here)
-    iretq
\ No newline at end of file
+    iretq
+
+; Device IRQ stubs (PIC lines 2-15): pass the line number to irq_dispatch
+extern irq_dispatch
+%macro IRQ_STUB 1
+global irq%1_isr
+irq%1_isr:
+    push rax
+    push rcx
+    push rdx
+    push rsi
+    push rdi
+    push r8
+    push r9
+    push r10
+    push r11
+    push rbx
+    push rbp
+    push r12
+    push r13
+    push r14
+    push r15
+
+    mov rdi, %1
+    call irq_dispatch
+
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbp
+    pop rbx
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rdi
+    pop rsi
+    pop rdx
+    pop rcx
+    pop rax
+    iretq
+%endmacro
+
+IRQ_STUB 2
+IRQ_STUB 3
+IRQ_STUB 4
+IRQ_STUB 5
+IRQ_STUB 6
+IRQ_STUB 7
+IRQ_STUB 8
+IRQ_STUB 9
+IRQ_STUB 10
+IRQ_STUB 11
+IRQ_STUB 12
+IRQ_STUB 13
+IRQ_STUB 14
+IRQ_STUB 15
+
+; Stub address per PIC line; timer and keyboard have their own ISRs
+section .data
+global irq_stub_table
+irq_stub_table:
+    dq 0, 0
+    dq irq2_isr
+    dq irq3_isr
+    dq irq4_isr
+    dq irq5_isr
+    dq irq6_isr
+    dq irq7_isr
+    dq irq8_isr
+    dq irq9_isr
+    dq irq10_isr
+    dq irq11_isr
+    dq irq12_isr
+    dq irq13_isr
+    dq irq14_isr
+    dq irq15_isr
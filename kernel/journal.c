@@ -0,0 +1,312 @@
+#include "journal.h"
+#include "bcache.h"
+#include "crc32c.h"
+#include "memory.h"
+#include <string.h>
+
+// Write-ahead journal for file system metadata. Metadata changes collect on
+// the block cache's BCACHE_META list; a commit copies every block on it into
+// the next free stretch of the journal as one transaction and writes that
+// with a single sequential request, so everything changed since the last
+// commit becomes durable together. The blocks then wait on BCACHE_JOURNALED
+// until a checkpoint writes their logged copies in place and empties the
+// journal, which happens only when a transaction does not fit.
+typedef struct {
+    block_device *dev;             // 0 for a volume that is never synced
+    uint8_t *image;
+    uint32_t block_size;
+    uint32_t sectors_per_block;
+    uint32_t nblocks;              // Volume size
+    uint32_t start;                // First journal block on the volume
+    uint32_t blocks;               // Journal size, header included
+    uint32_t head;                 // Where the next transaction goes
+    uint32_t tail;                 // Oldest live transaction, as the header says
+    uint64_t sequence;             // Number of the next transaction
+    uint32_t txns[JOURNAL_MAX_TRANSACTIONS]; // Live transactions, oldest first
+    uint32_t txn_count;
+    uint64_t *seen;                // Scratch bitmap: blocks already applied
+    uint64_t seen_bytes;
+    journal_stats stats;
+} journal_state;
+
+static journal_state journal;
+static block_request batch[BLOCK_BATCH];
+
+static uint8_t *frame(uint32_t pos) {
+    return journal.image + ((uint64_t)journal.start + pos) * journal.block_size;
+}
+
+static uint8_t *home(uint32_t block) {
+    return journal.image + (uint64_t)block * journal.block_size;
+}
+
+static uint32_t desc_blocks(uint32_t tags) {
+    uint64_t bytes = sizeof(fs_journal_block) + (uint64_t)tags * sizeof(uint32_t);
+    return (bytes + journal.block_size - 1) / journal.block_size;
+}
+
+// Set up for the volume whose superblock is sb. The journal header must
+// already be in memory.
+int journal_attach(block_device *dev, uint8_t *image, const fs_superblock *sb) {
+    uint64_t bytes = ((uint64_t)sb->total_blocks + 63) / 64 * sizeof(uint64_t);
+    if (bytes > journal.seen_bytes) {
+        uint64_t *seen = (uint64_t *)phys_alloc(bytes, sizeof(uint64_t));
+        if (!seen) return -1;
+        journal.seen = seen;
+        journal.seen_bytes = bytes;
+    }
+
+    journal.dev = dev;
+    journal.image = image;
+    journal.block_size = sb->block_size;
+    journal.sectors_per_block = sb->block_size / BLOCK_SECTOR_SIZE;
+    journal.nblocks = sb->total_blocks;
+    journal.start = sb->journal_start;
+    journal.blocks = sb->journal_blocks;
+    journal.txn_count = 0;
+    memset(&journal.stats, 0, sizeof(journal_stats));
+    journal.stats.blocks = journal.blocks;
+
+    fs_journal_block *header = (fs_journal_block *)frame(0);
+    if (header->magic != FS_JOURNAL_MAGIC || header->type != FS_JOURNAL_HEADER ||
+        header->tail == 0 || header->tail >= journal.blocks) {
+        return -1;
+    }
+    journal.head = journal.tail = header->tail;
+    journal.sequence = header->sequence;
+    return 0;
+}
+
+// Journal block where a transaction of need blocks can start without
+// overwriting a live one, or 0 if there is no room until a checkpoint
+static uint32_t place(uint32_t need) {
+    if (journal.txn_count == 0 || journal.head > journal.tail) {
+        if (journal.head + need <= journal.blocks) return journal.head;
+        uint32_t limit = journal.txn_count ? journal.tail : journal.blocks;
+        return (1 + need <= limit) ? 1 : 0;
+    }
+    // Wrapped: live from tail to the end and from 1 to head
+    return (journal.head + need <= journal.tail) ? journal.head : 0;
+}
+
+// Apply the logged copies, newest transaction first so only the latest copy
+// of a block counts: into memory (replay) or onto the disk in place
+// (checkpoint)
+static int apply(int to_disk) {
+    memset(journal.seen, 0, (journal.nblocks + 63) / 64 * sizeof(uint64_t));
+    int result = 0;
+    int n = 0;
+    for (int t = journal.txn_count - 1; t >= 0; t--) {
+        uint32_t pos = journal.txns[t];
+        fs_journal_block *header = (fs_journal_block *)frame(pos);
+        uint32_t *entries = (uint32_t *)(header + 1);
+        for (uint32_t i = 0; i < header->tags; i++) {
+            uint32_t block = entries[i];
+            uint64_t mask = 1ULL << (block % 64);
+            if (journal.seen[block / 64] & mask) continue;
+            journal.seen[block / 64] |= mask;
+
+            uint8_t *copy = frame(pos + header->desc_blocks + i);
+            if (!to_disk) {
+                memcpy(home(block), copy, journal.block_size);
+                bcache_install(block, 1);
+                continue;
+            }
+            block_request *req = &batch[n++];
+            req->sector = (uint64_t)block * journal.sectors_per_block;
+            req->buffer = copy;
+            req->count = journal.sectors_per_block;
+            req->op = BLOCK_OP_WRITE;
+            req->status = BLOCK_PENDING;
+            if (n == BLOCK_BATCH) {
+                if (block_submit(journal.dev, batch, n) != 0) result = -1;
+                n = 0;
+            }
+        }
+    }
+    if (n > 0 && block_submit(journal.dev, batch, n) != 0) result = -1;
+    return result;
+}
+
+// Write the live transactions' blocks in place and start the journal over.
+// Only logged copies are written, never the cache, so this is safe at any
+// point between commits. Without a device there is only the image, which
+// replay has already brought up to date.
+int journal_checkpoint(void) {
+    if (journal.txn_count == 0) return 0;
+    if (journal.dev && (apply(1) != 0 || block_flush(journal.dev) != 0)) return -1;
+
+    fs_journal_block *header = (fs_journal_block *)frame(0);
+    memset(header, 0, journal.block_size);
+    header->magic = FS_JOURNAL_MAGIC;
+    header->type = FS_JOURNAL_HEADER;
+    header->sequence = journal.sequence;
+    header->tail = 1;
+    if (journal.dev &&
+        (block_write(journal.dev, (uint64_t)journal.start * journal.sectors_per_block,
+                     header, journal.sectors_per_block) != 0 ||
+         block_flush(journal.dev) != 0)) {
+        return -1;
+    }
+
+    journal.txn_count = 0;
+    journal.head = journal.tail = 1;
+    bcache_clear(BCACHE_JOURNALED);
+    journal.stats.checkpoints++;
+    return 0;
+}
+
+// Log every block on a list as one transaction and flush. The copies are
+// taken up front, so the blocks count as clean from then on and later
+// changes dirty them again for the next commit.
+int journal_commit_list(int list) {
+    if (!journal.dev) return 0;
+    uint32_t tags = bcache_count(list);
+    if (tags == 0) return block_flush(journal.dev);
+    uint32_t desc = desc_blocks(tags);
+    uint32_t need = desc + tags + 1;
+
+    if (need > journal.blocks - 1) {
+        // Larger than the whole journal: empty it and write this batch in
+        // place. Only this batch loses its all-or-nothing guarantee.
+        if (journal_checkpoint() != 0 || bcache_write_home(list) != 0) return -1;
+        journal.stats.overflows++;
+        return block_flush(journal.dev);
+    }
+
+    uint32_t pos = place(need);
+    if (pos == 0 || journal.txn_count == JOURNAL_MAX_TRANSACTIONS) {
+        if (journal_checkpoint() != 0) return -1;
+        pos = place(need);
+    }
+
+    fs_journal_block *header = (fs_journal_block *)frame(pos);
+    memset(header, 0, (uint64_t)desc * journal.block_size);
+    header->magic = FS_JOURNAL_MAGIC;
+    header->type = FS_JOURNAL_DESCRIPTOR;
+    header->sequence = journal.sequence;
+    header->tags = tags;
+    header->desc_blocks = desc;
+    uint32_t *entries = (uint32_t *)(header + 1);
+    uint32_t block = bcache_next(list, 0);
+    for (uint32_t i = 0; i < tags; i++) {
+        entries[i] = block;
+        memcpy(frame(pos + desc + i), home(block), journal.block_size);
+        block = bcache_next(list, block + 1);
+    }
+
+    fs_journal_block *commit = (fs_journal_block *)frame(pos + desc + tags);
+    memset(commit, 0, journal.block_size);
+    commit->magic = FS_JOURNAL_MAGIC;
+    commit->type = FS_JOURNAL_COMMIT;
+    commit->sequence = journal.sequence;
+    commit->tags = tags;
+    commit->desc_blocks = desc;
+    commit->checksum = crc32c(0, header, (uint64_t)(desc + tags) * journal.block_size);
+
+    for (uint32_t i = 0; i < tags; i++) {
+        bcache_mark(list, entries[i], 1, 0);
+        bcache_mark(BCACHE_JOURNALED, entries[i], 1, 1);
+    }
+    bcache_install(journal.start + pos, need);
+    if (block_write(journal.dev, ((uint64_t)journal.start + pos) * journal.sectors_per_block,
+                    header, (uint64_t)need * journal.sectors_per_block) != 0 ||
+        block_flush(journal.dev) != 0) {
+        for (uint32_t i = 0; i < tags; i++) bcache_mark(list, entries[i], 1, 1);
+        return -1;
+    }
+
+    journal.txns[journal.txn_count++] = pos;
+    journal.head = pos + need;
+    journal.sequence++;
+    journal.stats.commits++;
+    journal.stats.logged += tags;
+    journal.stats.written += need;
+    return 0;
+}
+
+// Commit the metadata changed since the last commit
+int journal_commit(void) {
+    return journal_commit_list(BCACHE_META);
+}
+
+// Check the transaction at pos: 1 and its length in need if it is complete
+// and carries the expected sequence number, 0 if the log ends here, -1 on a
+// read error
+static int transaction_at(uint32_t pos, uint32_t *need) {
+    if (pos == 0 || pos >= journal.blocks) return 0;
+    if (bcache_load(journal.start + pos, 1) != 0) return -1;
+    fs_journal_block *header = (fs_journal_block *)frame(pos);
+    if (header->magic != FS_JOURNAL_MAGIC || header->type != FS_JOURNAL_DESCRIPTOR ||
+        header->sequence != journal.sequence || header->tags == 0 ||
+        header->tags > journal.blocks || header->desc_blocks != desc_blocks(header->tags)) {
+        return 0;
+    }
+    uint32_t length = header->desc_blocks + header->tags + 1;
+    if (length > journal.blocks - pos) return 0;
+    if (bcache_load(journal.start + pos, length) != 0) return -1;
+
+    fs_journal_block *commit = (fs_journal_block *)frame(pos + length - 1);
+    if (commit->magic != FS_JOURNAL_MAGIC || commit->type != FS_JOURNAL_COMMIT ||
+        commit->sequence != header->sequence || commit->tags != header->tags ||
+        commit->desc_blocks != header->desc_blocks ||
+        commit->checksum != crc32c(0, header, (uint64_t)(length - 1) * journal.block_size)) {
+        return 0;
+    }
+    uint32_t *entries = (uint32_t *)(header + 1);
+    for (uint32_t i = 0; i < header->tags; i++) {
+        if (entries[i] >= journal.nblocks ||
+            (entries[i] >= journal.start && entries[i] < journal.start + journal.blocks)) {
+            return 0;
+        }
+    }
+    *need = length;
+    return 1;
+}
+
+// Mount time: find the transactions committed since the last checkpoint,
+// apply them to the metadata in memory, then checkpoint them. A checkpoint
+// that fails leaves them live, to be retried by the next commit.
+int journal_replay(void) {
+    uint32_t pos = journal.tail;
+    while (journal.txn_count < JOURNAL_MAX_TRANSACTIONS) {
+        uint32_t need = 0;
+        int found = transaction_at(pos, &need);
+        if (found == 0 && pos != 1) {
+            // A transaction that did not fit before the end went to block 1
+            found = transaction_at(1, &need);
+            if (found == 1) pos = 1;
+        }
+        if (found < 0) return -1;
+        if (found == 0) break;
+
+        fs_journal_block *header = (fs_journal_block *)frame(pos);
+        uint32_t *entries = (uint32_t *)(header + 1);
+        for (uint32_t i = 0; i < header->tags; i++) {
+            bcache_mark(BCACHE_JOURNALED, entries[i], 1, 1);
+        }
+        journal.txns[journal.txn_count++] = pos;
+        pos += need;
+        journal.sequence++;
+    }
+    if (journal.txn_count == 0) return 0;
+
+    journal.tail = journal.txns[0];
+    journal.head = pos;
+    apply(0);
+    journal.stats.replayed = journal.txn_count;
+    journal_checkpoint();
+    return 0;
+}
+
+void journal_get_stats(journal_stats *stats) {
+    if (!stats) return;
+    *stats = journal.stats;
+    if (journal.txn_count == 0) {
+        stats->used = 0;
+    } else if (journal.head > journal.tail) {
+        stats->used = journal.head - journal.tail;
+    } else {
+        stats->used = (journal.blocks - journal.tail) + (journal.head - 1);
+    }
+}
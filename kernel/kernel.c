@@ -4,11 +4,33 @@
 #include "pit.h"
 #include "task.h"
 #include "filesystem.h"
+#include "framebuffer.h"
+#include "fbcon.h"
+#include "paging.h"
+#include "cpu.h"
+#include "memory.h"
+#include "pci.h"
+#include "block.h"
+#include "bcache.h"
+#include "virtio.h"
+#include "nvme.h"
+#include "ahci.h"
+#include "crc32c.h"
 #include <string.h>
 
 #define MAX_INPUT 256
 #define MAX_HISTORY 10
 #define MAX_ARGS 8
+#define FBBENCH_ROUNDS 8
+#define BENCH_QD1_READS 2000       // Random 4K reads for the latency figure
+#define BENCH_QDN_ROUNDS 128       // Full-depth batches for the IOPS figure
+#define BENCH_SEQ_BYTES (64 * 1024 * 1024)
+#define BENCH_SEQ_REQUEST (1024 * 1024)
+#define FLUSH_INTERVAL_MS 5000     // Dirty filesystem blocks are written back this often
+#define SCRUB_INTERVAL 10000       // Background loops between scrub steps
+#define SCRUB_BATCH 32             // Blocks checked per scrub step
+#define DEFRAG_INTERVAL 1000       // Background loops between defrag steps
+#define DEFRAG_BATCH FS_DEFRAG_MAX // Blocks copied per defrag step (1 MiB)
 
 // Shell state
 char input_buffer[MAX_INPUT];
@@ -19,7 +41,17 @@ int history_count = 0;
 int current_history = -1;
 static int shell_initialized = 0;
 static uint32_t background_counter = 0;
-static char current_directory[256] = "/";
+static int defrag_running = 0;         // Set by the defrag command until its pass ends
+static char current_directory[FS_MAX_PATH] = "/"; // For display; the filesystem keeps the real one
+
+// Refresh current_directory from the filesystem, which follows the
+// directory through renames (and back to / if a snapshot restore or mkfs
+// removes it)
+static void update_current_directory(void) {
+    if (fs_getcwd(current_directory, sizeof(current_directory)) != 0) {
+        string_copy(current_directory, "/", MAX_INPUT);
+    }
+}
 
 // Function declarations
 void task_yield(void);
@@ -106,6 +138,201 @@ void clear_screen(void) {
     exit_critical_section();
 }
 
+// Print a throughput figure in MB/s from bytes moved and TSC cycles spent
+static void print_rate(uint64_t bytes, uint64_t cycles, uint64_t hz) {
+    char buffer[32];
+    uint64_t rate = cycles ? (bytes / 1024) * (hz / 1024) / cycles : 0;
+    itoa(rate, buffer, 10);
+    print_string(buffer);
+    print_string(" MB/s");
+}
+
+static void print_speedup(uint64_t slow_cycles, uint64_t fast_cycles) {
+    char buffer[32];
+    uint64_t tenths = fast_cycles ? slow_cycles * 10 / fast_cycles : 0;
+    itoa(tenths / 10, buffer, 10);
+    print_string(buffer);
+    print_string(".");
+    itoa(tenths % 10, buffer, 10);
+    print_string(buffer);
+    print_string("x");
+}
+
+void cmd_fbbench(void) {
+    if (fb_info.addr == 0 || !fbcon_active) {
+        print_string("fbbench: no framebuffer console active\n");
+        return;
+    }
+
+    uint64_t fb_size = (uint64_t)fb_info.pitch * fb_info.height;
+    uint64_t fill_bytes = (uint64_t)fb_info.width * fb_info.height * 4;
+    uint64_t blit_bytes = 0;
+    uint64_t hz = tsc_frequency();
+    int modes[2] = {PAGE_CACHE_UC, PAGE_CACHE_WC};
+    uint64_t fill_cycles[2], blit_cycles[2];
+
+    for (int m = 0; m < 2; m++) {
+        paging_identity_map(fb_info.addr, fb_size, modes[m]);
+
+        uint64_t start = rdtsc();
+        for (int i = 0; i < FBBENCH_ROUNDS; i++) {
+            fb_clear(i & 1 ? 0x00202020 : 0x00000000);
+        }
+        fill_cycles[m] = rdtsc() - start;
+
+        start = rdtsc();
+        for (int i = 0; i < FBBENCH_ROUNDS; i++) {
+            blit_bytes = fbcon_redraw();
+        }
+        blit_cycles[m] = rdtsc() - start;
+    }
+
+    // Leave the framebuffer write-combined and the console intact
+    paging_identity_map(fb_info.addr, fb_size, PAGE_CACHE_WC);
+    fbcon_redraw();
+
+    char buffer[32];
+    print_string("Framebuffer benchmark (");
+    itoa(FBBENCH_ROUNDS, buffer, 10);
+    print_string(buffer);
+    print_string(" rounds, TSC ");
+    itoa(hz / 1000000, buffer, 10);
+    print_string(buffer);
+    print_string(" MHz, ");
+    print_string(pat_enabled ? "PAT" : "MTRR");
+    print_string("):\n");
+
+    for (int m = 0; m < 2; m++) {
+        print_string("  ");
+        print_string(paging_cache_name(modes[m]));
+        print_string(" fill: ");
+        print_rate(fill_bytes * FBBENCH_ROUNDS, fill_cycles[m], hz);
+        print_string("  blit: ");
+        print_rate(blit_bytes * FBBENCH_ROUNDS, blit_cycles[m], hz);
+        print_string("\n");
+    }
+
+    print_string("  WC speedup: fill ");
+    print_speedup(fill_cycles[0], fill_cycles[1]);
+    print_string(", blit ");
+    print_speedup(blit_cycles[0], blit_cycles[1]);
+    print_string("\n");
+}
+
+// Block device benchmark buffers: BLOCK_BATCH 4K slots, then one
+// sequential request buffer that every in-flight request reads into
+static uint8_t *bench_buffer = 0;
+static block_request bench_requests[BLOCK_BATCH];
+
+static uint64_t bench_random_sector(uint64_t *state, uint64_t sectors) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return (x % (sectors / 8)) * 8;  // 4K aligned
+}
+
+// Issue rounds batches of depth random 4K reads; TSC cycles, or 0 on error
+static uint64_t bench_random_reads(block_device *dev, uint32_t rounds, uint32_t depth, uint64_t *seed) {
+    uint64_t start = rdtsc();
+    for (uint32_t round = 0; round < rounds; round++) {
+        for (uint32_t i = 0; i < depth; i++) {
+            bench_requests[i].sector = bench_random_sector(seed, dev->sectors);
+            bench_requests[i].buffer = bench_buffer + i * 4096;
+            bench_requests[i].count = 8;
+            bench_requests[i].op = BLOCK_OP_READ;
+        }
+        if (block_submit(dev, bench_requests, depth) != 0) return 0;
+    }
+    return rdtsc() - start;
+}
+
+// Read bytes sequentially in large requests, depth of them in flight
+static uint64_t bench_sequential_reads(block_device *dev, uint64_t bytes, uint32_t depth) {
+    uint32_t chunk = BENCH_SEQ_REQUEST / BLOCK_SECTOR_SIZE;
+    if (chunk > dev->max_sectors) chunk = dev->max_sectors;
+    uint64_t sectors = bytes / BLOCK_SECTOR_SIZE;
+
+    uint64_t start = rdtsc();
+    for (uint64_t sector = 0; sector < sectors; ) {
+        uint32_t n = 0;
+        while (n < depth && sector < sectors) {
+            bench_requests[n].sector = sector;
+            bench_requests[n].buffer = bench_buffer + BLOCK_BATCH * 4096;
+            bench_requests[n].count = chunk;
+            bench_requests[n].op = BLOCK_OP_READ;
+            sector += chunk;
+            n++;
+        }
+        if (block_submit(dev, bench_requests, n) != 0) return 0;
+    }
+    return rdtsc() - start;
+}
+
+void cmd_bench(char args[MAX_ARGS][MAX_INPUT], int argc) {
+    block_device *dev = (argc > 1) ? block_find_device(args[1]) : block_get_device(0);
+    if (!dev) {
+        print_string("Error: No such block device (see lsblk)\n");
+        return;
+    }
+    if (dev->sectors < BENCH_SEQ_REQUEST / BLOCK_SECTOR_SIZE) {
+        print_string("Error: Device too small to benchmark\n");
+        return;
+    }
+    if (!bench_buffer) {
+        bench_buffer = (uint8_t *)phys_alloc(BLOCK_BATCH * 4096 + BENCH_SEQ_REQUEST, 4096);
+        if (!bench_buffer) {
+            print_string("Error: Out of memory\n");
+            return;
+        }
+    }
+
+    uint64_t hz = tsc_frequency();
+    uint64_t seed = rdtsc() | 1;
+    uint32_t depth = (dev->queue_depth < BLOCK_BATCH) ? dev->queue_depth : BLOCK_BATCH;
+    uint64_t seq_bytes = dev->sectors * BLOCK_SECTOR_SIZE;
+    if (seq_bytes > BENCH_SEQ_BYTES) seq_bytes = BENCH_SEQ_BYTES;
+
+    // Polled completions: the figures measure the device, not interrupt wakeups
+    int polled = dev->polled;
+    dev->polled = 1;
+    uint64_t qd1_cycles = bench_random_reads(dev, BENCH_QD1_READS, 1, &seed);
+    uint64_t qdn_cycles = bench_random_reads(dev, BENCH_QDN_ROUNDS, depth, &seed);
+    uint64_t seq_cycles = bench_sequential_reads(dev, seq_bytes, depth);
+    dev->polled = polled;
+
+    if (!qd1_cycles || !qdn_cycles || !seq_cycles) {
+        print_string("Error: I/O failed during benchmark\n");
+        return;
+    }
+
+    char buffer[32];
+    print_string("Benchmark ");
+    print_string(dev->name);
+    print_string(" (reads, polled completions):\n");
+
+    print_string("  4K random QD1: ");
+    itoa((uint64_t)BENCH_QD1_READS * hz / qd1_cycles, buffer, 10);
+    print_string(buffer);
+    print_string(" IOPS, avg latency ");
+    itoa(qd1_cycles / BENCH_QD1_READS * 1000000 / hz, buffer, 10);
+    print_string(buffer);
+    print_string(" us\n");
+
+    print_string("  4K random QD");
+    itoa(depth, buffer, 10);
+    print_string(buffer);
+    print_string(": ");
+    itoa((uint64_t)BENCH_QDN_ROUNDS * depth * hz / qdn_cycles, buffer, 10);
+    print_string(buffer);
+    print_string(" IOPS\n");
+
+    print_string("  Sequential 1M: ");
+    print_rate(seq_bytes, seq_cycles, hz);
+    print_string("\n");
+}
+
 // Enhanced command handlers
 void cmd_help(void) {
     print_string("CAPTAIN-OS v1.4 - Available Commands:\n");
@@ -118,61 +345,55 @@ void cmd_help(void) {
     print_string("  tasks         - Show running tasks info\n");
     print_string("  test          - Run system tests\n");
     print_string("  history       - Show command history\n");
+    print_string("  lspci         - List PCI devices\n");
+    print_string("  lsblk         - List block devices\n");
     print_string("\nFile System Commands:\n");
     print_string("  ls [path]     - List directory contents\n");
     print_string("  cd <path>     - Change directory\n");
     print_string("  pwd           - Show current directory\n");
     print_string("  cat <file>    - Display file contents\n");
     print_string("  write <file> <data> - Write data to file\n");
+    print_string("  append <file> <data> - Append a line to file\n");
     print_string("  touch <file>  - Create empty file\n");
     print_string("  mkdir <dir>   - Create directory\n");
     print_string("  rm <path>     - Delete file or directory\n");
-    print_string("  cp <src> <dst> - Copy file\n");
-    print_string("  find <name>   - Find files by name\n");
-    print_string("  tree          - Show directory tree\n");
-    print_string("  fsinfo        - Show filesystem info\n");
+    print_string("  cp <src> <dst> - Copy file (shares blocks until modified)\n");
+    print_string("  mv <src> <dst> - Move or rename file/directory\n");
+    print_string("  truncate <file> <size> - Set file size; growing adds a hole, not blocks\n");
+    print_string("  punch <file> <off> <len> - Free a range of a file, which then reads as zeros\n");
+    print_string("  compress <file> [off] - Store file LZ4-compressed (or plain again)\n");
+    print_string("  dedup [on|off] - Share identical blocks in files written from now on\n");
+    print_string("  defrag        - Make fragmented files contiguous, in the background\n");
+    print_string("  snapshot create|restore|delete <name> - Freeze or roll back the whole tree\n");
+    print_string("  snapshot list - Show snapshots, oldest first\n");
+    print_string("  find <pattern> - Find by name anywhere (name, prefix* or glob with * ?)\n");
+    print_string("  tree [path]   - Show the directory tree below path (default /)\n");
+    print_string("  fsinfo [check] - Show filesystem info (check: verify counters by a full scan)\n");
+    print_string("  mkfs <size> [inodes] - Format a new volume (e.g. mkfs 64M)\n");
+    print_string("  sync          - Write dirty blocks to disk now\n");
     print_string("\nUtility Commands:\n");
     print_string("  echo <text>   - Print text\n");
     print_string("  anime         - Display ASCII art\n");
     print_string("  uptime        - Show system uptime\n");
+    print_string("  fbbench       - Framebuffer fill/blit throughput, UC vs WC\n");
+    print_string("  bench [disk]  - Block device IOPS, latency and throughput\n");
 }
 
 void cmd_cd(char args[MAX_ARGS][MAX_INPUT], int argc) {
-    if (argc < 2) {
-        string_copy(current_directory, "/", MAX_INPUT);
-        print_string("Changed to root directory\n");
-        return;
-    }
-    
-    char new_path[256];
-    normalize_path(args[1], new_path, current_directory, MAX_INPUT);
-    
-    int parent_index;
-    int dir_index = find_entry(new_path, &parent_index);
-    
-    if (dir_index == -1) {
+    if (fs_chdir(argc < 2 ? "/" : args[1]) != 0) {
         print_string("Error: Directory '");
         print_string(args[1]);
         print_string("' not found\n");
         return;
     }
-    
-    // Check if it's actually a directory
-    fs_stats stats;
-    fs_get_stats(&stats);
-    // We need to verify it's a directory through the filesystem
-    
-    string_copy(current_directory, new_path, MAX_INPUT);
-    if (current_directory[0] == '\0') {
-        string_copy(current_directory, "/", MAX_INPUT);
-    }
-    
+    update_current_directory();
     print_string("Changed directory to: ");
     print_string(current_directory);
     print_string("\n");
 }
 
 void cmd_pwd(void) {
+    update_current_directory();
     print_string("Current directory: ");
     print_string(current_directory);
     print_string("\n");
@@ -204,12 +425,9 @@ void cmd_touch(char args[MAX_ARGS][MAX_INPUT], int argc) {
         return;
     }
     
-    char full_path[256];
-    normalize_path(args[1], full_path, current_directory, MAX_INPUT);
-    
-    if (fs_create_file(full_path) == 0) {
+    if (fs_create_file(args[1]) == 0) {
         print_string("Created file: ");
-        print_string(full_path);
+        print_string(args[1]);
         print_string("\n");
     } else {
         print_string("Error: Could not create file '");
@@ -218,32 +436,74 @@ void cmd_touch(char args[MAX_ARGS][MAX_INPUT], int argc) {
     }
 }
 
+// Copy file contents by streaming them through fs_read_iov; used by cp
+// when the blocks cannot be shared. Only the data is copied, so holes in
+// the source stay holes in the copy.
+static int copy_by_iov(const char *src_path, const char *dst_path) {
+    int src = fs_open(src_path, FS_O_RDONLY);
+    if (src < 0) return -1;
+    
+    int dst = fs_open(dst_path, FS_O_WRONLY | FS_O_CREAT | FS_O_TRUNC);
+    if (dst < 0) {
+        fs_close(src);
+        return -1;
+    }
+    
+    // Write straight from the source's blocks, no staging buffer
+    uint64_t offset = 0;
+    int failed = 0;
+    fs_iovec iov[FS_MAX_IOV];
+    int64_t data;
+    while (!failed && (data = fs_lseek(src, offset, FS_SEEK_DATA)) >= 0) {
+        uint64_t hole = fs_lseek(src, data, FS_SEEK_HOLE);
+        offset = data;
+        while (!failed && offset < hole) {
+            uint64_t want = hole - offset;
+            int count = fs_read_iov(src, offset, (want < 0x100000) ? want : 0x100000, iov, FS_MAX_IOV);
+            if (count <= 0) {
+                failed = 1;
+                break;
+            }
+            for (int i = 0; i < count; i++) {
+                if (fs_pwrite(dst, iov[i].base, iov[i].len, offset) != (int)iov[i].len) {
+                    failed = 1;
+                    break;
+                }
+                offset += iov[i].len;
+            }
+            fs_release_iov(src);
+        }
+    }
+    
+    // A hole at the end has no data to write, only a size
+    if (!failed && fs_truncate(dst, fs_file_size(src)) != 0) {
+        failed = 1;
+    }
+    fs_close(src);
+    fs_close(dst);
+    return failed ? -1 : 0;
+}
+
 void cmd_cp(char args[MAX_ARGS][MAX_INPUT], int argc) {
     if (argc < 3) {
         print_string("Usage: cp <source> <destination>\n");
         return;
     }
     
-    char src_path[256], dst_path[256];
-    normalize_path(args[1], src_path, current_directory, MAX_INPUT);
-    normalize_path(args[2], dst_path, current_directory, MAX_INPUT);
-    
-    char buffer[1024];
-    int bytes_read = fs_read_file(src_path, buffer, sizeof(buffer) - 1);
-    
-    if (bytes_read < 0) {
+    int src_ino = find_entry(args[1], NULL);
+    if (src_ino == -1) {
         print_string("Error: Cannot read source file '");
         print_string(args[1]);
         print_string("'\n");
         return;
     }
-    
-    if (fs_create_file(dst_path) != 0) {
-        print_string("Error: Cannot create destination file\n");
+    if (src_ino == find_entry(args[2], NULL)) {
+        print_string("Error: Source and destination are the same file\n");
         return;
     }
     
-    if (fs_write_file(dst_path, buffer, bytes_read) == 0) {
+    // Share the source's blocks; fall back to a real copy if that fails
+    if (fs_clone(args[1], args[2]) == 0 || copy_by_iov(args[1], args[2]) == 0) {
         print_string("Copied '");
         print_string(args[1]);
         print_string("' to '");
@@ -254,19 +514,224 @@ void cmd_cp(char args[MAX_ARGS][MAX_INPUT], int argc) {
     }
 }
 
-void cmd_find(char args[MAX_ARGS][MAX_INPUT], int argc) {
-    if (argc < 2) {
-        print_string("Usage: find <filename>\n");
+// Join args[first..argc) with single spaces into data
+static void join_args(char args[MAX_ARGS][MAX_INPUT], int argc, int first, char *data, int max) {
+    data[0] = '\0';
+    for (int i = first; i < argc; i++) {
+        if (i > first) {
+            int len = string_length(data);
+            if (len < max - 2) {
+                data[len] = ' ';
+                data[len + 1] = '\0';
+            }
+        }
+        int data_len = string_length(data);
+        int arg_len = string_length(args[i]);
+        if (data_len + arg_len < max - 1) {
+            for (int j = 0; j < arg_len; j++) {
+                data[data_len + j] = args[i][j];
+            }
+            data[data_len + arg_len] = '\0';
+        }
+    }
+}
+
+void cmd_append(char args[MAX_ARGS][MAX_INPUT], int argc) {
+    if (argc < 3) {
+        print_string("Usage: append <file> <data>\n");
+        return;
+    }
+    
+    // One line per call, written at end of file without touching earlier blocks
+    char data[512];
+    join_args(args, argc, 2, data, sizeof(data) - 1);
+    int len = string_length(data);
+    data[len++] = '\n';
+    
+    int fd = fs_open(args[1], FS_O_WRONLY | FS_O_CREAT | FS_O_APPEND);
+    if (fd < 0) {
+        print_string("Error: Cannot open '");
+        print_string(args[1]);
+        print_string("'\n");
+        return;
+    }
+    if (fs_write(fd, data, len) != len) {
+        print_string("Error: Failed to append to file\n");
+    } else {
+        char buffer[24];
+        print_string("Appended ");
+        itoa(len, buffer, 10);
+        print_string(buffer);
+        print_string(" bytes, file is now ");
+        itoa(fs_file_size(fd), buffer, 10);
+        print_string(buffer);
+        print_string(" bytes\n");
+    }
+    fs_close(fd);
+}
+
+void cmd_mv(char args[MAX_ARGS][MAX_INPUT], int argc) {
+    if (argc < 3) {
+        print_string("Usage: mv <source> <destination>\n");
         return;
     }
     
-    print_string("Searching for '");
+    if (fs_rename(args[1], args[2]) == 0) {
+        print_string("Moved '");
+        print_string(args[1]);
+        print_string("' to '");
+        print_string(args[2]);
+        print_string("'\n");
+    } else {
+        print_string("Error: Cannot move '");
+        print_string(args[1]);
+        print_string("'\n");
+    }
+}
+
+void cmd_compress(char args[MAX_ARGS][MAX_INPUT], int argc) {
+    if (argc < 2 || (argc > 2 && strcmp(args[2], "off") != 0)) {
+        print_string("Usage: compress <file> [off]\n");
+        return;
+    }
+    
+    int enable = (argc == 2);
+    if (fs_set_compression(args[1], enable) != 0) {
+        print_string("Error: Cannot change compression of '");
+        print_string(args[1]);
+        print_string("'\n");
+        return;
+    }
+    print_string(enable ? "Compression on for '" : "Compression off for '");
     print_string(args[1]);
-    print_string("'...\n");
+    print_string("'\n");
+}
+
+void cmd_dedup(char args[MAX_ARGS][MAX_INPUT], int argc) {
+    int enable;
+    if (argc < 2 || strcmp(args[1], "on") == 0) {
+        enable = 1;
+    } else if (strcmp(args[1], "off") == 0) {
+        enable = 0;
+    } else {
+        print_string("Usage: dedup [on|off]\n");
+        return;
+    }
     
-    // Simple implementation - just search in current directory
-    fs_list_files(current_directory);
-    print_string("Note: Search limited to current directory\n");
+    if (fs_set_dedup(enable) != 0) {
+        print_string("Error: Cannot change deduplication\n");
+        return;
+    }
+    print_string(enable ? "Deduplication on\n" : "Deduplication off\n");
+}
+
+void cmd_snapshot(char args[MAX_ARGS][MAX_INPUT], int argc) {
+    if (argc == 2 && strcmp(args[1], "list") == 0) {
+        fs_snapshot list[FS_MAX_SNAPSHOTS];
+        int count = fs_snapshot_list(list, FS_MAX_SNAPSHOTS);
+        if (count <= 0) {
+            print_string("No snapshots\n");
+            return;
+        }
+        char buffer[32];
+        for (int i = 0; i < count; i++) {
+            print_string("  #");
+            itoa(list[i].id, buffer, 10);
+            print_string(buffer);
+            print_string(" ");
+            print_string(list[i].name);
+            print_string(" (");
+            itoa(list[i].files, buffer, 10);
+            print_string(buffer);
+            print_string(" files and directories)\n");
+        }
+        return;
+    }
+    if (argc < 3) {
+        print_string("Usage: snapshot create|restore|delete <name>, or snapshot list\n");
+        return;
+    }
+    
+    if (strcmp(args[1], "create") == 0) {
+        if (fs_snapshot_create(args[2]) != 0) {
+            print_string("Error: Cannot create snapshot '");
+            print_string(args[2]);
+            print_string("'\n");
+            return;
+        }
+        print_string("Created snapshot '");
+    } else if (strcmp(args[1], "restore") == 0) {
+        if (fs_snapshot_restore(args[2]) != 0) {
+            print_string("Error: Cannot restore snapshot '");
+            print_string(args[2]);
+            print_string("' (does it exist? are files open?)\n");
+            return;
+        }
+        print_string("Restored snapshot '");
+    } else if (strcmp(args[1], "delete") == 0) {
+        if (fs_snapshot_delete(args[2]) != 0) {
+            print_string("Error: No snapshot '");
+            print_string(args[2]);
+            print_string("'\n");
+            return;
+        }
+        print_string("Deleted snapshot '");
+    } else {
+        print_string("Usage: snapshot create|restore|delete <name>, or snapshot list\n");
+        return;
+    }
+    print_string(args[2]);
+    print_string("'\n");
+}
+
+#define FIND_MAX_RESULTS 64
+
+void cmd_find(char args[MAX_ARGS][MAX_INPUT], int argc) {
+    if (argc < 2) {
+        print_string("Usage: find <name>, <prefix>* or a pattern with * and ?\n");
+        return;
+    }
+
+    // A lone trailing * is a prefix query; any other wildcard makes a glob
+    const char *pattern = args[1];
+    int len = string_length(pattern);
+    int wildcards = 0;
+    for (int i = 0; i < len; i++) {
+        if (pattern[i] == '*' || pattern[i] == '?') wildcards++;
+    }
+    int mode = wildcards ? FS_FIND_GLOB : FS_FIND_EXACT;
+    char prefix[MAX_INPUT];
+    if (wildcards == 1 && len > 1 && pattern[len - 1] == '*') {
+        string_copy(prefix, pattern, MAX_INPUT);
+        prefix[len - 1] = '\0';
+        pattern = prefix;
+        mode = FS_FIND_PREFIX;
+    }
+
+    uint32_t inodes[FIND_MAX_RESULTS];
+    int found = fs_find(pattern, mode, inodes, FIND_MAX_RESULTS);
+    if (found < 0) {
+        print_string("Error: Name index unavailable\n");
+        return;
+    }
+
+    char path[FS_MAX_PATH];
+    for (int i = 0; i < found && i < FIND_MAX_RESULTS; i++) {
+        if (fs_inode_path(inodes[i], path, sizeof(path)) != 0) continue;
+        print_string(path);
+        print_string("\n");
+    }
+
+    char buffer[16];
+    if (found > FIND_MAX_RESULTS) {
+        print_string("... and ");
+        itoa(found - FIND_MAX_RESULTS, buffer, 10);
+        print_string(buffer);
+        print_string(" more\n");
+    }
+    itoa(found, buffer, 10);
+    print_string(buffer);
+    print_string(found == 1 ? " match\n" : " matches\n");
 }
 
 void cmd_fsinfo(void) {
@@ -301,6 +766,405 @@ void cmd_fsinfo(void) {
     itoa(stats.total_size, buffer, 10);
     print_string(buffer);
     print_string(" bytes\n");
+    
+    print_string("Volume: ");
+    itoa(stats.total_blocks, buffer, 10);
+    print_string(buffer);
+    print_string(" x ");
+    itoa(stats.block_size, buffer, 10);
+    print_string(buffer);
+    print_string("-byte blocks\n");
+    
+    print_string("Inodes: ");
+    itoa(stats.total_inodes - stats.free_inodes, buffer, 10);
+    print_string(buffer);
+    print_string(" used of ");
+    itoa(stats.total_inodes, buffer, 10);
+    print_string(buffer);
+    print_string("\n");
+    
+    print_string("Shared blocks: ");
+    itoa(stats.shared_blocks, buffer, 10);
+    print_string(buffer);
+    print_string("\n");
+    
+    print_string("Dentry cache: ");
+    itoa(stats.dcache_hits, buffer, 10);
+    print_string(buffer);
+    print_string(" hits, ");
+    itoa(stats.dcache_misses, buffer, 10);
+    print_string(buffer);
+    print_string(" misses\n");
+    
+    print_string("Block cache: ");
+    itoa(stats.cache_hits, buffer, 10);
+    print_string(buffer);
+    print_string(" hits, ");
+    itoa(stats.cache_misses, buffer, 10);
+    print_string(buffer);
+    print_string(" misses, ");
+    itoa(stats.cache_readahead, buffer, 10);
+    print_string(buffer);
+    print_string(" read ahead\n");
+    
+    print_string("Writeback: ");
+    itoa(stats.cache_writeback, buffer, 10);
+    print_string(buffer);
+    print_string(" blocks written, ");
+    itoa(stats.dirty_blocks, buffer, 10);
+    print_string(buffer);
+    print_string(" dirty\n");
+    
+    print_string("Journal: ");
+    itoa(stats.journal_used, buffer, 10);
+    print_string(buffer);
+    print_string(" of ");
+    itoa(stats.journal_blocks, buffer, 10);
+    print_string(buffer);
+    print_string(" blocks live, ");
+    itoa(stats.journal_commits, buffer, 10);
+    print_string(buffer);
+    print_string(" commits (");
+    itoa(stats.journal_logged, buffer, 10);
+    print_string(buffer);
+    print_string(" blocks logged), ");
+    itoa(stats.journal_checkpoints, buffer, 10);
+    print_string(buffer);
+    print_string(" checkpoints\n");
+
+    print_string("Checksums: CRC32C (");
+    print_string(crc32c_hardware() ? "SSE4.2" : "table");
+    print_string("), ");
+    itoa(stats.scrubbed_blocks, buffer, 10);
+    print_string(buffer);
+    print_string(" blocks scrubbed in ");
+    itoa(stats.scrub_passes, buffer, 10);
+    print_string(buffer);
+    print_string(" full passes, ");
+    itoa(stats.checksum_errors, buffer, 10);
+    print_string(buffer);
+    print_string(" errors\n");
+
+    print_string("Compression: LZ4, ");
+    itoa(stats.compressed_files, buffer, 10);
+    print_string(buffer);
+    print_string(" files, ");
+    itoa(stats.compressed_bytes / 1024, buffer, 10);
+    print_string(buffer);
+    print_string(" KB in ");
+    itoa(stats.compressed_stored / 1024, buffer, 10);
+    print_string(buffer);
+    print_string(" KB");
+    if (stats.compressed_stored > 0) {
+        uint64_t ratio = stats.compressed_bytes * 100 / stats.compressed_stored;
+        print_string(" (");
+        itoa(ratio / 100, buffer, 10);
+        print_string(buffer);
+        print_string(ratio % 100 < 10 ? ".0" : ".");
+        itoa(ratio % 100, buffer, 10);
+        print_string(buffer);
+        print_string("x)");
+    }
+    print_string("\n");
+    print_string("Decoded clusters: ");
+    itoa(stats.cluster_decodes, buffer, 10);
+    print_string(buffer);
+    print_string(" decompressed, ");
+    itoa(stats.cluster_hits, buffer, 10);
+    print_string(buffer);
+    print_string(" cache hits");
+    if (stats.decode_cycles > 0) {
+        print_string(", ");
+        uint64_t per_ms = stats.decoded_bytes * (tsc_frequency() / 1000) / stats.decode_cycles;
+        itoa(per_ms * 1000 / (1024 * 1024), buffer, 10);
+        print_string(buffer);
+        print_string(" MB/s");
+    }
+    print_string("\n");
+
+    print_string("Snapshots: ");
+    itoa(stats.snapshots, buffer, 10);
+    print_string(buffer);
+    print_string(" of ");
+    itoa(FS_MAX_SNAPSHOTS, buffer, 10);
+    print_string(buffer);
+    print_string("\n");
+
+    print_string("Dedup: ");
+    print_string(stats.dedup_enabled ? "on, " : "off, ");
+    itoa(stats.dedup_hits, buffer, 10);
+    print_string(buffer);
+    print_string(" duplicate blocks written");
+    if (stats.data_blocks > 0) {
+        uint64_t ratio = (stats.data_blocks + stats.shared_refs) * 100 / stats.data_blocks;
+        print_string(", ratio ");
+        itoa(ratio / 100, buffer, 10);
+        print_string(buffer);
+        print_string(ratio % 100 < 10 ? ".0" : ".");
+        itoa(ratio % 100, buffer, 10);
+        print_string(buffer);
+        print_string("x");
+    }
+    print_string("\n");
+
+    print_string("Fragmentation: ");
+    uint64_t per_file = stats.total_files ? stats.file_extents * 100 / stats.total_files : 0;
+    itoa(per_file / 100, buffer, 10);
+    print_string(buffer);
+    print_string(per_file % 100 < 10 ? ".0" : ".");
+    itoa(per_file % 100, buffer, 10);
+    print_string(buffer);
+    print_string(" extents per file, ");
+    itoa(stats.fragmented_files, buffer, 10);
+    print_string(buffer);
+    print_string(" files in more than one extent\n");
+    print_string("Defrag: ");
+    print_string(defrag_running ? "running, " : "idle, ");
+    itoa(stats.defrag_moved, buffer, 10);
+    print_string(buffer);
+    print_string(" blocks moved in ");
+    itoa(stats.defrag_passes, buffer, 10);
+    print_string(buffer);
+    print_string(" passes\n");
+}
+
+void cmd_defrag(void) {
+    if (defrag_running) {
+        print_string("Defragmentation is already running; fsinfo shows its progress\n");
+        return;
+    }
+    fs_stats stats;
+    fs_get_stats(&stats);
+    char buffer[24];
+    itoa(stats.fragmented_files, buffer, 10);
+    print_string(buffer);
+    print_string(" fragmented files; joining their extents in the background (see fsinfo)\n");
+    defrag_running = 1;
+}
+
+void cmd_fsinfo_check(void) {
+    int differ = fs_check_stats();
+    if (differ < 0) {
+        print_string("Error: No filesystem mounted\n");
+    } else if (differ == 0) {
+        print_string("Filesystem counters match a full scan\n");
+    } else {
+        char buffer[16];
+        itoa(differ, buffer, 10);
+        print_string(buffer);
+        print_string(" filesystem counters differ from a full scan\n");
+    }
+}
+
+// Parse a decimal count with an optional K/M/G suffix; 0 if malformed
+static uint64_t parse_size(const char *str) {
+    uint64_t value = 0;
+    int digits = 0;
+    while (*str >= '0' && *str <= '9') {
+        value = value * 10 + (*str++ - '0');
+        digits++;
+    }
+    if (digits == 0) return 0;
+    switch (*str) {
+        case 'K': case 'k': value <<= 10; str++; break;
+        case 'M': case 'm': value <<= 20; str++; break;
+        case 'G': case 'g': value <<= 30; str++; break;
+    }
+    return *str ? 0 : value;
+}
+
+void cmd_mkfs(char args[MAX_ARGS][MAX_INPUT], int argc) {
+    if (argc < 2) {
+        print_string("Usage: mkfs <size>[K|M|G] [inodes]\n");
+        return;
+    }
+    
+    uint64_t size = parse_size(args[1]);
+    uint64_t inodes = (argc > 2) ? parse_size(args[2]) : 0;
+    if (size == 0 || (argc > 2 && (inodes == 0 || inodes > 0xFFFFFFFFULL))) {
+        print_string("Error: Invalid size or inode count\n");
+        return;
+    }
+    
+    if (fs_mkfs(size, (uint32_t)inodes) != 0) {
+        print_string("Error: Cannot format a volume of that size\n");
+        return;
+    }
+    
+    fs_stats stats;
+    fs_get_stats(&stats);
+    char buffer[24];
+    print_string("Formatted ");
+    itoa(stats.total_blocks, buffer, 10);
+    print_string(buffer);
+    print_string(" blocks, ");
+    itoa(stats.total_inodes, buffer, 10);
+    print_string(buffer);
+    print_string(" inodes\n");
+}
+
+// Print a file's size and how much of it is data rather than holes
+static void print_file_extent(int fd) {
+    uint64_t size = fs_file_size(fd);
+    uint64_t data = 0;
+    int64_t start;
+    int64_t pos = 0;
+    while ((start = fs_lseek(fd, pos, FS_SEEK_DATA)) >= 0) {
+        pos = fs_lseek(fd, start, FS_SEEK_HOLE);
+        data += pos - start;
+    }
+    
+    char buffer[24];
+    print_string("File is now ");
+    itoa(size, buffer, 10);
+    print_string(buffer);
+    print_string(" bytes, ");
+    itoa(data, buffer, 10);
+    print_string(buffer);
+    print_string(" of them data, the rest holes\n");
+}
+
+void cmd_truncate(char args[MAX_ARGS][MAX_INPUT], int argc) {
+    if (argc < 3) {
+        print_string("Usage: truncate <file> <size>[K|M|G]\n");
+        return;
+    }
+    
+    uint64_t size = parse_size(args[2]);
+    if (size == 0 && strcmp(args[2], "0") != 0) {
+        print_string("Error: Invalid size\n");
+        return;
+    }
+    
+    // Growing adds a hole, so even a large size takes no space
+    int fd = fs_open(args[1], FS_O_WRONLY | FS_O_CREAT);
+    if (fd < 0) {
+        print_string("Error: Cannot open '");
+        print_string(args[1]);
+        print_string("'\n");
+        return;
+    }
+    if (fs_truncate(fd, size) != 0) {
+        print_string("Error: Cannot resize file\n");
+    } else {
+        print_file_extent(fd);
+    }
+    fs_close(fd);
+}
+
+void cmd_punch(char args[MAX_ARGS][MAX_INPUT], int argc) {
+    if (argc < 4) {
+        print_string("Usage: punch <file> <offset> <length>\n");
+        return;
+    }
+    
+    uint64_t offset = parse_size(args[2]);
+    uint64_t len = parse_size(args[3]);
+    if ((offset == 0 && strcmp(args[2], "0") != 0) || len == 0) {
+        print_string("Error: Invalid offset or length\n");
+        return;
+    }
+    
+    int fd = fs_open(args[1], FS_O_WRONLY);
+    if (fd < 0) {
+        print_string("Error: Cannot open '");
+        print_string(args[1]);
+        print_string("'\n");
+        return;
+    }
+    if (fs_punch_hole(fd, offset, len) != 0) {
+        print_string("Error: Cannot punch a hole in '");
+        print_string(args[1]);
+        print_string("'\n");
+    } else {
+        print_file_extent(fd);
+    }
+    fs_close(fd);
+}
+
+void cmd_sync(void) {
+    block_device *disk = fs_backing_device();
+    if (!disk) {
+        print_string("Error: No disk attached, the volume lives in RAM only\n");
+        return;
+    }
+    
+    uint64_t before = disk->bytes_written;
+    if (fs_sync() != 0) {
+        print_string("Error: Sync to ");
+        print_string(disk->name);
+        print_string(" failed (is the volume larger than the disk?)\n");
+        return;
+    }
+    
+    char buffer[24];
+    print_string("Synced ");
+    itoa((disk->bytes_written - before) / 1024, buffer, 10);
+    print_string(buffer);
+    print_string(" KB to ");
+    print_string(disk->name);
+    print_string("\n");
+}
+
+void cmd_lspci(void) {
+    char buffer[24];
+    for (int i = 0; i < pci_device_count(); i++) {
+        pci_device *dev = pci_get_device(i);
+        itoa(dev->bus, buffer, 16);
+        print_string(buffer);
+        print_string(":");
+        itoa(dev->device, buffer, 16);
+        print_string(buffer);
+        print_string(".");
+        itoa(dev->function, buffer, 10);
+        print_string(buffer);
+        print_string("  ");
+        itoa(dev->vendor_id, buffer, 16);
+        print_string(buffer);
+        print_string(":");
+        itoa(dev->device_id, buffer, 16);
+        print_string(buffer);
+        print_string("  ");
+        print_string(pci_class_name(dev->class_code));
+        if (dev->irq_line != PCI_NO_IRQ) {
+            print_string("  IRQ ");
+            itoa(dev->irq_line, buffer, 10);
+            print_string(buffer);
+        }
+        print_string("\n");
+    }
+}
+
+void cmd_lsblk(void) {
+    if (block_device_count() == 0) {
+        print_string("No block devices\n");
+        return;
+    }
+    
+    char buffer[24];
+    for (int i = 0; i < block_device_count(); i++) {
+        block_device *dev = block_get_device(i);
+        print_string(dev->name);
+        print_string("  ");
+        itoa(dev->sectors * BLOCK_SECTOR_SIZE / (1024 * 1024), buffer, 10);
+        print_string(buffer);
+        print_string(" MB, queue depth ");
+        itoa(dev->queue_depth, buffer, 10);
+        print_string(buffer);
+        print_string(", ");
+        itoa(dev->requests, buffer, 10);
+        print_string(buffer);
+        print_string(" requests, ");
+        itoa(dev->bytes_read / 1024, buffer, 10);
+        print_string(buffer);
+        print_string(" KB read, ");
+        itoa(dev->bytes_written / 1024, buffer, 10);
+        print_string(buffer);
+        print_string(" KB written");
+        if (dev->read_only) print_string(", read-only");
+        if (dev == fs_backing_device()) print_string(" [volume]");
+        print_string("\n");
+    }
 }
 
 void cmd_uptime(void) {
@@ -311,11 +1175,45 @@ void cmd_uptime(void) {
     print_string(" seconds (approx)\n");
 }
 
-void cmd_tree(void) {
-    print_string("Directory Tree:\n");
-    print_string("===============\n");
-    print_string("/\n");
-    fs_list_files("/");
+void cmd_tree(char args[MAX_ARGS][MAX_INPUT], int argc) {
+    const char *path = (argc > 1) ? args[1] : "/";
+    fs_walker walker;
+    if (fs_walk_start(&walker, path) != 0) {
+        print_string("Error: Not a directory\n");
+        return;
+    }
+    print_string(path);
+    print_string("\n");
+
+    fs_dir_entry entry;
+    uint32_t depth;
+    uint32_t files = 0, directories = 0;
+    char buffer[24];
+    int result;
+    while ((result = fs_walk_next(&walker, &entry, &depth)) == 1) {
+        for (uint32_t i = 0; i <= depth; i++) print_string("  ");
+        print_string(entry.name);
+        if (entry.type == FS_TYPE_DIR) {
+            print_string("/");
+            if (depth + 1 == FS_WALK_DEPTH) print_string(" ...");
+            directories++;
+        } else {
+            print_string(" (");
+            itoa(entry.size, buffer, 10);
+            print_string(buffer);
+            print_string(" bytes)");
+            files++;
+        }
+        print_string("\n");
+    }
+    if (result < 0) print_string("Error: Directory changed during walk\n");
+
+    itoa(directories, buffer, 10);
+    print_string(buffer);
+    print_string(" directories, ");
+    itoa(files, buffer, 10);
+    print_string(buffer);
+    print_string(" files\n");
 }
 
 // Enhanced command handler
@@ -357,14 +1255,46 @@ void handle_command(void) {
         cmd_touch(args, argc);
     } else if (strcmp(args[0], "cp") == 0) {
         cmd_cp(args, argc);
+    } else if (strcmp(args[0], "mv") == 0) {
+        cmd_mv(args, argc);
+    } else if (strcmp(args[0], "append") == 0) {
+        cmd_append(args, argc);
+    } else if (strcmp(args[0], "compress") == 0) {
+        cmd_compress(args, argc);
+    } else if (strcmp(args[0], "truncate") == 0) {
+        cmd_truncate(args, argc);
+    } else if (strcmp(args[0], "punch") == 0) {
+        cmd_punch(args, argc);
+    } else if (strcmp(args[0], "dedup") == 0) {
+        cmd_dedup(args, argc);
+    } else if (strcmp(args[0], "defrag") == 0) {
+        cmd_defrag();
+    } else if (strcmp(args[0], "snapshot") == 0) {
+        cmd_snapshot(args, argc);
     } else if (strcmp(args[0], "find") == 0) {
         cmd_find(args, argc);
     } else if (strcmp(args[0], "fsinfo") == 0) {
-        cmd_fsinfo();
+        if (argc > 1 && strcmp(args[1], "check") == 0) {
+            cmd_fsinfo_check();
+        } else {
+            cmd_fsinfo();
+        }
+    } else if (strcmp(args[0], "mkfs") == 0) {
+        cmd_mkfs(args, argc);
+    } else if (strcmp(args[0], "sync") == 0) {
+        cmd_sync();
+    } else if (strcmp(args[0], "lspci") == 0) {
+        cmd_lspci();
+    } else if (strcmp(args[0], "lsblk") == 0) {
+        cmd_lsblk();
     } else if (strcmp(args[0], "uptime") == 0) {
         cmd_uptime();
     } else if (strcmp(args[0], "tree") == 0) {
-        cmd_tree();
+        cmd_tree(args, argc);
+    } else if (strcmp(args[0], "bench") == 0) {
+        cmd_bench(args, argc);
+    } else if (strcmp(args[0], "fbbench") == 0) {
+        cmd_fbbench();
     } else if (starts_with(input_buffer, "echo ")) {
         if (argc > 1) {
             for (int i = 1; i < argc; i++) {
@@ -412,6 +1342,13 @@ void handle_command(void) {
         itoa(cursor_col, buffer, 10);
         print_string(buffer);
         print_string(")\n");
+        print_string("Console: ");
+        itoa(screen_width, buffer, 10);
+        print_string(buffer);
+        print_string("x");
+        itoa(screen_height, buffer, 10);
+        print_string(buffer);
+        print_string(fb_info.addr ? " (framebuffer)\n" : " (VGA text)\n");
         print_string("Active tasks: 2\n");
         print_string("Multitasking: Enhanced\n");
         print_string("Keyboard: Responsive\n");
@@ -431,25 +1368,34 @@ void handle_command(void) {
         print_string("  Advanced filesystem: OK\n");
         print_string("  Command parsing: OK\n");
         print_string("  History management: OK\n");
-        print_string("  Path normalization: OK\n");
-        print_string("All enhanced tests passed! System optimal.\n");
-    } else if (strcmp(args[0], "ls") == 0) {
-        char path[256];
-        if (argc > 1) {
-            normalize_path(args[1], path, current_directory, MAX_INPUT);
-        } else {
-            string_copy(path, current_directory, MAX_INPUT);
+        // . and .. are resolved during lookup rather than stored, and the
+        // root is its own parent
+        int root = find_entry("/", NULL);
+        int paths_ok = root != -1 && find_entry("/./..", NULL) == root && find_entry(".", NULL) == (int)fs_cwd();
+        print_string(paths_ok ? "  Path resolution: OK\n" : "  Path resolution: FAIL\n");
+        if (paths_ok) {
+            print_string("All enhanced tests passed! System optimal.\n");
         }
-        fs_list_files(path);
+    } else if (strcmp(args[0], "ls") == 0) {
+        fs_list_files(argc > 1 ? args[1] : ".");
     } else if (strcmp(args[0], "cat") == 0) {
         if (argc < 2) {
             print_string("Usage: cat <filename>\n");
         } else {
-            char full_path[256];
-            normalize_path(args[1], full_path, current_directory, MAX_INPUT);
-            char buffer[1024];
-            if (fs_read_file(full_path, buffer, sizeof(buffer)) >= 0) {
-                print_string(buffer);
+            int fd = fs_open(args[1], FS_O_RDONLY);
+            if (fd >= 0) {
+                // Print straight out of the file's blocks
+                fs_iovec iov[FS_MAX_IOV];
+                uint64_t offset = 0;
+                int count;
+                while ((count = fs_read_iov(fd, offset, 0x100000, iov, FS_MAX_IOV)) > 0) {
+                    for (int i = 0; i < count; i++) {
+                        print_chars((const char *)iov[i].base, iov[i].len);
+                        offset += iov[i].len;
+                    }
+                    fs_release_iov(fd);
+                }
+                fs_close(fd);
                 print_string("\n");
             } else {
                 print_string("Error: Cannot read file '");
@@ -461,31 +1407,12 @@ void handle_command(void) {
         if (argc < 3) {
             print_string("Usage: write <filename> <data>\n");
         } else {
-            char full_path[256];
-            normalize_path(args[1], full_path, current_directory, MAX_INPUT);
-            
             // Combine all arguments after filename as data
-            char data[512] = "";
-            for (int i = 2; i < argc; i++) {
-                if (i > 2) {
-                    int len = string_length(data);
-                    if (len < 510) {
-                        data[len] = ' ';
-                        data[len + 1] = '\0';
-                    }
-                }
-                int data_len = string_length(data);
-                int arg_len = string_length(args[i]);
-                if (data_len + arg_len < 511) {
-                    for (int j = 0; j < arg_len; j++) {
-                        data[data_len + j] = args[i][j];
-                    }
-                    data[data_len + arg_len] = '\0';
-                }
-            }
+            char data[512];
+            join_args(args, argc, 2, data, sizeof(data));
             
-            if (fs_create_file(full_path) >= 0 || find_entry(full_path, NULL) != -1) {
-                if (fs_write_file(full_path, data, string_length(data)) >= 0) {
+            if (fs_create_file(args[1]) >= 0 || find_entry(args[1], NULL) != -1) {
+                if (fs_write_file(args[1], data, string_length(data)) >= 0) {
                     print_string("Wrote ");
                     char buffer[16];
                     itoa(string_length(data), buffer, 10);
@@ -504,9 +1431,7 @@ void handle_command(void) {
         if (argc < 2) {
             print_string("Usage: rm <path>\n");
         } else {
-            char full_path[256];
-            normalize_path(args[1], full_path, current_directory, MAX_INPUT);
-            if (fs_delete_file(full_path) >= 0) {
+            if (fs_delete_file(args[1]) >= 0) {
                 print_string("Deleted ");
                 print_string(args[1]);
                 print_string("\n");
@@ -520,9 +1445,7 @@ void handle_command(void) {
         if (argc < 2) {
             print_string("Usage: mkdir <directory>\n");
         } else {
-            char full_path[256];
-            normalize_path(args[1], full_path, current_directory, MAX_INPUT);
-            if (fs_create_directory(full_path) >= 0) {
+            if (fs_create_directory(args[1]) >= 0) {
                 print_string("Created directory ");
                 print_string(args[1]);
                 print_string("\n");
@@ -545,6 +1468,7 @@ void handle_command(void) {
         input_buffer[i] = 0;
     }
 
+    update_current_directory();
     print_string(current_directory);
     print_string(" > ");
 }
@@ -582,11 +1506,13 @@ void shell_task(void) {
 
 void background_task(void) {
     uint32_t last_display = 0;
-    uint32_t health_check_counter = 0;
+    uint32_t scrub_counter = 0;
+    uint32_t defrag_counter = 0;
     
     while (1) {
         background_counter++;
-        health_check_counter++;
+        scrub_counter++;
+        defrag_counter++;
         
         // Display background counter less frequently to reduce screen clutter
         if (background_counter - last_display >= 50000) {
@@ -609,12 +1535,30 @@ void background_task(void) {
             last_display = background_counter;
         }
         
-        // Perform system health checks periodically
-        if (health_check_counter >= 100000) {
-            // Simple health check - verify filesystem integrity
-            fs_stats stats;
-            fs_get_stats(&stats);
-            health_check_counter = 0;
+        // Scrub the volume a few blocks at a time, checking them against
+        // their checksums (from the disk itself when there is one). Like
+        // the flusher, a step waits for the disk to be idle, and runs with
+        // interrupts off so no shell command changes the volume under it.
+        if (scrub_counter >= SCRUB_INTERVAL) {
+            uint64_t flags = irq_save();
+            block_device *disk = fs_backing_device();
+            if (!disk || disk->active == 0) {
+                fs_scrub(SCRUB_BATCH);
+            }
+            irq_restore(flags);
+            scrub_counter = 0;
+        }
+
+        // A defrag pass runs the same way, up to DEFRAG_BATCH blocks (1 MiB)
+        // per step, so a reader waits at most for one step
+        if (defrag_running && defrag_counter >= DEFRAG_INTERVAL) {
+            uint64_t flags = irq_save();
+            block_device *disk = fs_backing_device();
+            if (!disk || disk->active == 0) {
+                if (fs_defrag(DEFRAG_BATCH) != 1) defrag_running = 0;
+            }
+            irq_restore(flags);
+            defrag_counter = 0;
         }
         
         // Yield more frequently for better responsiveness
@@ -627,20 +1571,54 @@ void background_task(void) {
     }
 }
 
-void kernel_main(void) {
+// Write dirty file data back and commit the metadata changed since the
+// last pass as one journal transaction every FLUSH_INTERVAL_MS. Shell
+// commands run in the keyboard interrupt and may be waiting on the disk, so
+// a pass is skipped while the device is busy; with interrupts off the
+// drivers poll, and nothing else touches the volume meanwhile.
+void flusher_task(void) {
+    uint64_t interval = tsc_frequency() / 1000 * FLUSH_INTERVAL_MS;
+    uint64_t next = rdtsc() + interval;
+    
+    while (1) {
+        block_device *disk = fs_backing_device();
+        if (disk && rdtsc() >= next && bcache_dirty_count() > 0) {
+            uint64_t flags = irq_save();
+            if (disk->active == 0) {
+                fs_sync();
+                next = rdtsc() + interval;
+            }
+            irq_restore(flags);
+        }
+        task_yield();
+        for (volatile int i = 0; i < 1000; i++);
+    }
+}
+
+void kernel_main(void *multiboot_info) {
     __asm__ volatile("cli");
 
     // Initialize all subsystems
     idt_init();
     pic_remap();
     pit_init(100);  // 100 Hz timer for better responsiveness
-    fs_init();
+    paging_init();  // Program PAT so mappings can request write-combining
+    memory_init(multiboot_info);  // Free RAM from the Multiboot2 memory map
+    fb_init(multiboot_info);
+    console_init();  // Framebuffer console when GRUB gave us a linear framebuffer
+    pci_init();
+    virtio_blk_init();
+    nvme_init();
+    ahci_init();
+    crc32c_init();  // Picks the SSE4.2 crc32 instruction when the CPU has it
+    fs_init();  // Loads the volume from the first disk if it has one
     enable_keyboard();
     task_init();
 
     // Create tasks
     task_create(shell_task);
     task_create(background_task);
+    task_create(flusher_task);
    
     // Longer initialization delay for stability
     for (volatile int i = 0; i < 2000000; i++);
@@ -0,0 +1,204 @@
+#include "lz4.h"
+#include <string.h>
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5        // The block always ends in this many literals...
+#define LZ4_MF_LIMIT 12            // ...and no match starts this close to the end
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_BITS 12
+#define LZ4_RUN_MASK 15            // Length nibble that continues in extra bytes
+#define LZ4_SKIP_SHIFT 6           // Step grows by one every 64 bytes without a match
+
+// Position + 1 of the last 4-byte sequence seen with each hash
+static uint32_t hash_table[1 << LZ4_HASH_BITS];
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t read64(const uint8_t *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline void copy8(uint8_t *dst, const uint8_t *src) {
+    memcpy(dst, src, 8);
+}
+
+static inline uint32_t hash4(uint32_t value) {
+    return (value * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+// Bytes at a and b that agree, comparing 8 at a time, up to limit
+static uint32_t match_length(const uint8_t *a, const uint8_t *b, const uint8_t *limit) {
+    const uint8_t *start = a;
+    while (a + 8 <= limit) {
+        uint64_t diff = read64(a) ^ read64(b);
+        if (diff) return (a - start) + __builtin_ctzll(diff) / 8;
+        a += 8;
+        b += 8;
+    }
+    while (a < limit && *a == *b) {
+        a++;
+        b++;
+    }
+    return a - start;
+}
+
+// The part of a length past the token nibble: 255s, then the remainder
+static uint8_t *put_length(uint8_t *op, uint32_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+// Worst-case bytes for a sequence with lit literals and a match of mlen
+static uint32_t sequence_bound(uint32_t lit, uint32_t mlen) {
+    return 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1;
+}
+
+// Greedy single-pass compressor: each position looks up the last one with
+// the same four bytes and takes the match if there is one. Positions that
+// keep failing to match are stepped over faster, so incompressible data
+// costs little.
+uint32_t lz4_compress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t capacity) {
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *end = src + len;
+    uint8_t *op = dst;
+    uint8_t *op_end = dst + capacity;
+
+    if (len > LZ4_MF_LIMIT) {
+        const uint8_t *mf_limit = end - LZ4_MF_LIMIT;
+        const uint8_t *match_limit = end - LZ4_LAST_LITERALS;
+        memset(hash_table, 0, sizeof(hash_table));
+
+        while (ip < mf_limit) {
+            uint32_t h = hash4(read32(ip));
+            uint32_t candidate = hash_table[h];
+            hash_table[h] = (ip - src) + 1;
+            const uint8_t *ref = src + candidate - 1;
+            if (candidate == 0 || ip - ref > LZ4_MAX_OFFSET || read32(ref) != read32(ip)) {
+                ip += 1 + ((ip - anchor) >> LZ4_SKIP_SHIFT);
+                continue;
+            }
+
+            // Grow the match backwards into the pending literals, then forwards
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            uint32_t mlen = LZ4_MIN_MATCH + match_length(ip + LZ4_MIN_MATCH, ref + LZ4_MIN_MATCH, match_limit);
+            uint32_t lit = ip - anchor;
+            if (sequence_bound(lit, mlen) > (uint32_t)(op_end - op)) return 0;
+
+            uint8_t *token = op++;
+            *token = (lit >= LZ4_RUN_MASK ? LZ4_RUN_MASK : lit) << 4;
+            if (lit >= LZ4_RUN_MASK) op = put_length(op, lit - LZ4_RUN_MASK);
+            memcpy(op, anchor, lit);
+            op += lit;
+            uint32_t offset = ip - ref;
+            *op++ = offset & 0xFF;
+            *op++ = offset >> 8;
+            uint32_t extra = mlen - LZ4_MIN_MATCH;
+            *token |= (extra >= LZ4_RUN_MASK) ? LZ4_RUN_MASK : extra;
+            if (extra >= LZ4_RUN_MASK) op = put_length(op, extra - LZ4_RUN_MASK);
+
+            ip += mlen;
+            anchor = ip;
+            if (ip < mf_limit) hash_table[hash4(read32(ip - 2))] = (ip - 2 - src) + 1;
+        }
+    }
+
+    // Whatever is left goes out as literals
+    uint32_t lit = end - anchor;
+    if (1 + lit / 255 + 1 + lit > (uint32_t)(op_end - op)) return 0;
+    *op++ = (lit >= LZ4_RUN_MASK ? LZ4_RUN_MASK : lit) << 4;
+    if (lit >= LZ4_RUN_MASK) op = put_length(op, lit - LZ4_RUN_MASK);
+    memcpy(op, anchor, lit);
+    op += lit;
+    return op - dst;
+}
+
+// Read the continuation bytes of a length; -1 if the input ends first
+static int get_length(const uint8_t **ip, const uint8_t *end, uint32_t *len) {
+    uint8_t byte;
+    do {
+        if (*ip >= end) return -1;
+        byte = *(*ip)++;
+        *len += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+// Decoding is where the time goes when a file is read. Most sequences
+// have under 15 literals and a match under 19 bytes, and with room to
+// spare in both buffers those are copied with fixed-size 16- and 24-byte
+// moves, overrunning into bytes the next sequence overwrites, with no
+// loops or length-dependent branches. Longer runs copy 8 bytes at a time
+// the same way; only near the ends of the buffers, or for a match that
+// overlaps its own output by less than 8 bytes, are copies exact.
+int lz4_decompress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t capacity) {
+    const uint8_t *ip = src;
+    const uint8_t *end = src + len;
+    uint8_t *op = dst;
+    uint8_t *op_end = dst + capacity;
+
+    while (ip < end) {
+        uint32_t token = *ip++;
+        uint32_t lit = token >> 4;
+        if (lit < LZ4_RUN_MASK && end - ip >= 18 && op_end - op >= 16) {
+            // At least the two offset bytes follow, so this is not the last sequence
+            copy8(op, ip);
+            copy8(op + 8, ip + 8);
+            op += lit;
+            ip += lit;
+        } else {
+            if (lit == LZ4_RUN_MASK && get_length(&ip, end, &lit) != 0) return -1;
+            if (lit > (uint32_t)(end - ip) || lit > (uint32_t)(op_end - op)) return -1;
+            if (lit + 8 <= (uint32_t)(end - ip) && lit + 8 <= (uint32_t)(op_end - op)) {
+                uint8_t *copy_end = op + lit;
+                const uint8_t *from = ip;
+                for (uint8_t *to = op; to < copy_end; to += 8, from += 8) copy8(to, from);
+            } else {
+                memcpy(op, ip, lit);
+            }
+            op += lit;
+            ip += lit;
+            if (ip == end) break;  // The last sequence has no match
+        }
+
+        if (end - ip < 2) return -1;
+        uint32_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (uint32_t)(op - dst)) return -1;
+        const uint8_t *ref = op - offset;
+        uint32_t mlen = token & LZ4_RUN_MASK;
+        if (mlen < LZ4_RUN_MASK && offset >= 8 && op_end - op >= 24) {
+            copy8(op, ref);
+            copy8(op + 8, ref + 8);
+            copy8(op + 16, ref + 16);
+            op += mlen + LZ4_MIN_MATCH;
+            continue;
+        }
+
+        if (mlen == LZ4_RUN_MASK && get_length(&ip, end, &mlen) != 0) return -1;
+        mlen += LZ4_MIN_MATCH;
+        if (mlen > (uint32_t)(op_end - op)) return -1;
+        if (offset >= 8 && mlen + 8 <= (uint32_t)(op_end - op)) {
+            uint8_t *copy_end = op + mlen;
+            for (uint8_t *to = op; to < copy_end; to += 8, ref += 8) copy8(to, ref);
+            op = copy_end;
+        } else {
+            for (uint32_t i = 0; i < mlen; i++) op[i] = ref[i];
+            op += mlen;
+        }
+    }
+    return op - dst;
+}
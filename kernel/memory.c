@@ -0,0 +1,156 @@
+#include "memory.h"
+#include "paging.h"
+#include "vga.h"
+#include "utils.h"
+
+#define IDENTITY_MAPPED_LIMIT 0x100000000ULL   // boot.asm maps the first 4 GiB
+
+extern uint8_t kernel_end[];       // Set by linker.ld after .bss
+
+// Free physical memory as [start, end) ranges. Allocation bumps start
+// forward; nothing is ever returned, which suits boot-time consumers like
+// the filesystem volume and device queues.
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+} phys_range;
+
+static phys_range ranges[MEMORY_MAX_RANGES];
+static int range_count = 0;
+
+// Boot modules stay where GRUB put them; their memory is never handed out
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+    const char *cmdline;           // Points into the (reserved) Multiboot2 info
+} boot_module;
+
+static boot_module modules[MEMORY_MAX_MODULES];
+static int module_count = 0;
+
+static void add_range(uint64_t start, uint64_t end) {
+    start = (start + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    end &= ~(uint64_t)(PAGE_SIZE - 1);
+    if (start >= end || range_count >= MEMORY_MAX_RANGES) return;
+    ranges[range_count].start = start;
+    ranges[range_count].end = end;
+    range_count++;
+}
+
+// Remove [start, end) from the free ranges, splitting one if needed
+void memory_reserve(uint64_t start, uint64_t end) {
+    int count = range_count;
+    for (int i = 0; i < count; i++) {
+        phys_range *r = &ranges[i];
+        if (end <= r->start || start >= r->end) continue;
+
+        uint64_t tail_start = end;
+        uint64_t tail_end = r->end;
+        if (start > r->start) {
+            r->end = start;
+        } else {
+            r->end = r->start;
+        }
+        if (tail_start < tail_end) {
+            add_range(tail_start, tail_end);
+        }
+    }
+}
+
+void memory_init(void *multiboot_info) {
+    range_count = 0;
+    module_count = 0;
+    if (!multiboot_info) return;
+
+    uint32_t total_size = *(uint32_t *)multiboot_info;
+    uint8_t *tag_ptr = (uint8_t *)multiboot_info + 8;
+    uint8_t *end_ptr = (uint8_t *)multiboot_info + total_size;
+    uint64_t low_limit = (uint64_t)kernel_end;
+
+    while (tag_ptr + 8 <= end_ptr) {
+        multiboot_mmap_tag *tag = (multiboot_mmap_tag *)tag_ptr;
+        if (tag->type == 0 || tag->size < 8) break;
+
+        if (tag->type == MULTIBOOT_TAG_MMAP && tag->entry_size >= sizeof(multiboot_mmap_entry)) {
+            uint8_t *entry_ptr = tag_ptr + sizeof(multiboot_mmap_tag);
+            while (entry_ptr + tag->entry_size <= tag_ptr + tag->size) {
+                multiboot_mmap_entry *entry = (multiboot_mmap_entry *)entry_ptr;
+                if (entry->type == MULTIBOOT_MEMORY_AVAILABLE) {
+                    // Everything below the end of the kernel image stays put
+                    uint64_t start = entry->base;
+                    uint64_t end = entry->base + entry->length;
+                    if (start < low_limit) start = low_limit;
+                    add_range(start, end);
+                }
+                entry_ptr += tag->entry_size;
+            }
+        } else if (tag->type == MULTIBOOT_TAG_MODULE && tag->size >= sizeof(multiboot_module_tag) &&
+                   module_count < MEMORY_MAX_MODULES) {
+            multiboot_module_tag *module = (multiboot_module_tag *)tag_ptr;
+            // Module addresses are 32-bit, so a module always lies below 4 GiB,
+            // inside the boot identity map, and can be used in place
+            if (module->mod_end > module->mod_start) {
+                modules[module_count].start = module->mod_start;
+                modules[module_count].end = module->mod_end;
+                modules[module_count].cmdline = module->cmdline;
+                module_count++;
+            }
+        }
+
+        // Tags are padded to 8-byte alignment
+        tag_ptr += (tag->size + 7) & ~7u;
+    }
+
+    // GRUB leaves the info structure and the modules in free memory
+    memory_reserve((uint64_t)multiboot_info, (uint64_t)multiboot_info + total_size);
+    for (int i = 0; i < module_count; i++) {
+        memory_reserve(modules[i].start, modules[i].end);
+    }
+
+    char buffer[16];
+    print_string("Physical memory: ");
+    itoa((uint32_t)(memory_free_bytes() / (1024 * 1024)), buffer, 10);
+    print_string(buffer);
+    print_string(" MB free\n");
+}
+
+// Allocate size bytes aligned to align (a power of two), or return 0.
+// Ranges above the boot identity map are mapped in on first use.
+void *phys_alloc(uint64_t size, uint64_t align) {
+    if (size == 0) return 0;
+    if (align < 16) align = 16;
+
+    for (int i = 0; i < range_count; i++) {
+        phys_range *r = &ranges[i];
+        uint64_t start = (r->start + align - 1) & ~(align - 1);
+        if (start >= r->end || r->end - start < size) continue;
+
+        if (start + size > IDENTITY_MAPPED_LIMIT &&
+            paging_identity_map(start, size, PAGE_CACHE_WB) != 0) {
+            continue;
+        }
+        r->start = start + size;
+        return (void *)start;
+    }
+    return 0;
+}
+
+uint64_t memory_free_bytes(void) {
+    uint64_t total = 0;
+    for (int i = 0; i < range_count; i++) {
+        total += ranges[i].end - ranges[i].start;
+    }
+    return total;
+}
+
+// Find the boot module whose command line is cmdline; returns its address
+// and stores its length in size, or returns 0
+void *memory_find_module(const char *cmdline, uint64_t *size) {
+    for (int i = 0; i < module_count; i++) {
+        if (strcmp(modules[i].cmdline, cmdline) == 0) {
+            if (size) *size = modules[i].end - modules[i].start;
+            return (void *)modules[i].start;
+        }
+    }
+    return 0;
+}
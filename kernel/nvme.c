@@ -0,0 +1,424 @@
+#include "nvme.h"
+#include "block.h"
+#include "pci.h"
+#include "idt.h"
+#include "cpu.h"
+#include "pit.h"
+#include "memory.h"
+#include "vga.h"
+#include "utils.h"
+
+#define NVME_PAGE_SIZE 4096
+#define PRPS_PER_PAGE (NVME_PAGE_SIZE / sizeof(uint64_t))
+
+// One submission/completion queue pair. Command IDs index requests[] and
+// the per-command PRP list page, so completions need no search.
+typedef struct {
+    uint16_t id;
+    uint16_t size;
+    nvme_command *sq;
+    volatile nvme_completion *cq;
+    volatile uint32_t *sq_doorbell;
+    volatile uint32_t *cq_doorbell;
+    uint16_t sq_tail;
+    uint16_t cq_head;
+    uint8_t phase;                 // Phase tag of new completions
+    uint16_t inflight;
+    uint16_t free_count;
+    uint16_t free_cids[NVME_IO_QUEUE_SIZE];
+    block_request *requests[NVME_IO_QUEUE_SIZE];
+    uint64_t *prp_lists;           // One page per command ID
+} nvme_queue;
+
+typedef struct {
+    pci_device *pci;
+    volatile uint8_t *regs;
+    uint32_t doorbell_stride;
+    uint32_t nsid;
+    uint32_t lba_shift;            // log2 of the namespace block size
+    int has_write_cache;
+    int use_irq;
+    nvme_queue admin;
+    nvme_queue io[NVME_CPUS];
+    block_device dev;
+} nvme_controller;
+
+static nvme_controller controllers[NVME_MAX_CONTROLLERS];
+static int controller_count = 0;
+
+static uint32_t reg_read32(nvme_controller *c, uint32_t offset) {
+    return mmio_read32(c->regs + offset);
+}
+
+static void reg_write32(nvme_controller *c, uint32_t offset, uint32_t value) {
+    mmio_write32(c->regs + offset, value);
+}
+
+static uint64_t reg_read64(nvme_controller *c, uint32_t offset) {
+    return reg_read32(c, offset) | ((uint64_t)reg_read32(c, offset + 4) << 32);
+}
+
+static void reg_write64(nvme_controller *c, uint32_t offset, uint64_t value) {
+    reg_write32(c, offset, (uint32_t)value);
+    reg_write32(c, offset + 4, (uint32_t)(value >> 32));
+}
+
+// Spin until (CSTS & mask) == want, giving up after NVME_TIMEOUT_MS
+static int wait_status(nvme_controller *c, uint32_t mask, uint32_t want) {
+    uint64_t deadline = rdtsc() + tsc_frequency() / 1000 * NVME_TIMEOUT_MS;
+    while ((reg_read32(c, NVME_REG_CSTS) & mask) != want) {
+        if (reg_read32(c, NVME_REG_CSTS) & NVME_CSTS_FATAL) return -1;
+        if (rdtsc() > deadline) return -1;
+        cpu_relax();
+    }
+    return 0;
+}
+
+static int queue_alloc(nvme_controller *c, nvme_queue *q, uint16_t id, uint16_t size) {
+    q->id = id;
+    q->size = size;
+    q->sq = (nvme_command *)phys_alloc(sizeof(nvme_command) * size, NVME_PAGE_SIZE);
+    q->cq = (volatile nvme_completion *)phys_alloc(sizeof(nvme_completion) * size, NVME_PAGE_SIZE);
+    q->prp_lists = (uint64_t *)phys_alloc((uint64_t)NVME_PAGE_SIZE * size, NVME_PAGE_SIZE);
+    if (!q->sq || !q->cq || !q->prp_lists) return -1;
+    memset(q->sq, 0, sizeof(nvme_command) * size);
+    memset((void *)q->cq, 0, sizeof(nvme_completion) * size);
+
+    uint8_t *doorbells = (uint8_t *)c->regs + NVME_REG_DOORBELLS;
+    q->sq_doorbell = (volatile uint32_t *)(doorbells + (2 * id) * c->doorbell_stride);
+    q->cq_doorbell = (volatile uint32_t *)(doorbells + (2 * id + 1) * c->doorbell_stride);
+    q->sq_tail = 0;
+    q->cq_head = 0;
+    q->phase = 1;
+    q->inflight = 0;
+
+    // A full ring is indistinguishable from an empty one, so keep one entry spare
+    q->free_count = 0;
+    for (uint16_t cid = 0; cid < size - 1; cid++) {
+        q->requests[cid] = 0;
+        q->free_cids[q->free_count++] = cid;
+    }
+    return 0;
+}
+
+// Copy a command into the next submission slot; the doorbell is rung later
+static void queue_push(nvme_queue *q, nvme_command *cmd, block_request *req) {
+    uint16_t cid = q->free_cids[--q->free_count];
+    cmd->cid = cid;
+    q->requests[cid] = req;
+    q->sq[q->sq_tail] = *cmd;
+    q->sq_tail = (q->sq_tail + 1) % q->size;
+    q->inflight++;
+}
+
+static void queue_ring(nvme_queue *q) {
+    memory_barrier();
+    mmio_write32(q->sq_doorbell, q->sq_tail);
+}
+
+// Retire completions whose phase tag is current, then tell the controller
+// how far we got. Runs from the IRQ handler and from waiters with
+// interrupts off.
+static void queue_reap(nvme_queue *q) {
+    int reaped = 0;
+    for (;;) {
+        volatile nvme_completion *cqe = &q->cq[q->cq_head];
+        uint16_t status = cqe->status;
+        if ((status & 1) != q->phase) break;
+        memory_barrier();
+
+        uint16_t cid = cqe->cid;
+        if (cid < q->size && q->requests[cid]) {
+            q->requests[cid]->status = (status >> 1) ? -1 : 0;
+            q->requests[cid] = 0;
+            q->free_cids[q->free_count++] = cid;
+            q->inflight--;
+        }
+        if (++q->cq_head == q->size) {
+            q->cq_head = 0;
+            q->phase ^= 1;
+        }
+        reaped = 1;
+    }
+    if (reaped) mmio_write32(q->cq_doorbell, q->cq_head);
+}
+
+// Run one admin command to completion by polling (used during setup only)
+static int admin_command(nvme_controller *c, nvme_command *cmd) {
+    block_request done;
+    done.status = BLOCK_PENDING;
+    queue_push(&c->admin, cmd, &done);
+    queue_ring(&c->admin);
+
+    uint64_t deadline = rdtsc() + tsc_frequency() / 1000 * NVME_TIMEOUT_MS;
+    while (done.status == BLOCK_PENDING) {
+        queue_reap(&c->admin);
+        if (rdtsc() > deadline) return -1;
+        cpu_relax();
+    }
+    return done.status;
+}
+
+static void clear_command(nvme_command *cmd) {
+    memset(cmd, 0, sizeof(nvme_command));
+}
+
+// Describe [addr, addr + bytes) with PRP entries: PRP1 covers the first
+// (possibly partial) page, PRP2 the second page or a list of the rest
+static void set_prps(nvme_queue *q, nvme_command *cmd, uint16_t cid, uint64_t addr, uint32_t bytes) {
+    uint32_t first = NVME_PAGE_SIZE - (addr & (NVME_PAGE_SIZE - 1));
+    cmd->prp1 = addr;
+    cmd->prp2 = 0;
+    if (bytes <= first) return;
+
+    uint64_t page = addr + first;
+    uint32_t remaining = bytes - first;
+    if (remaining <= NVME_PAGE_SIZE) {
+        cmd->prp2 = page;
+        return;
+    }
+
+    uint64_t *list = q->prp_lists + (uint64_t)cid * PRPS_PER_PAGE;
+    for (uint32_t i = 0; remaining > 0; i++) {
+        list[i] = page;
+        page += NVME_PAGE_SIZE;
+        remaining = (remaining > NVME_PAGE_SIZE) ? remaining - NVME_PAGE_SIZE : 0;
+    }
+    cmd->prp2 = (uint64_t)list;
+}
+
+// Translate a block request into an NVM command and queue it
+static void queue_request(nvme_controller *c, nvme_queue *q, block_request *req) {
+    nvme_command cmd;
+    clear_command(&cmd);
+    cmd.nsid = c->nsid;
+
+    if (req->op == BLOCK_OP_FLUSH) {
+        cmd.opcode = NVME_CMD_FLUSH;
+        queue_push(q, &cmd, req);
+        return;
+    }
+
+    uint32_t shift = c->lba_shift - 9;  // Sectors per namespace block, as a shift
+    uint64_t lba = req->sector >> shift;
+    uint32_t blocks = req->count >> shift;
+    cmd.opcode = (req->op == BLOCK_OP_WRITE) ? NVME_CMD_WRITE : NVME_CMD_READ;
+    cmd.cdw10 = (uint32_t)lba;
+    cmd.cdw11 = (uint32_t)(lba >> 32);
+    cmd.cdw12 = blocks - 1;             // Zero-based count
+
+    // The command ID is only known once pushed, so fill in the PRPs in place
+    queue_push(q, &cmd, req);
+    uint16_t slot = (q->sq_tail + q->size - 1) % q->size;
+    nvme_command *queued = &q->sq[slot];
+    set_prps(q, queued, queued->cid, (uint64_t)req->buffer, req->count * BLOCK_SECTOR_SIZE);
+}
+
+// Wait for at least one completion, sleeping on the interrupt when it can
+// reach us and polling the completion queue otherwise
+static void wait_for_completion(nvme_controller *c, nvme_queue *q) {
+    if (c->use_irq && !c->dev.polled && pic_irq_deliverable(c->pci->irq_line)) {
+        __asm__ volatile("cli");
+        if (q->inflight > 0 && (q->cq[q->cq_head].status & 1) != q->phase) {
+            __asm__ volatile("sti; hlt" : : : "memory");
+        } else {
+            __asm__ volatile("sti");
+        }
+        return;
+    }
+    while (q->inflight > 0 && (q->cq[q->cq_head].status & 1) != q->phase) {
+        cpu_relax();
+    }
+}
+
+// Same pipelining as virtio-blk: fill the submission queue, ring the
+// doorbell once per refill, and top up as completions free command IDs
+static int nvme_submit(block_device *dev, block_request *reqs, int count) {
+    nvme_controller *c = (nvme_controller *)dev->driver;
+    nvme_queue *q = &c->io[0];  // This CPU's queue pair
+    uint32_t align = (1u << (c->lba_shift - 9)) - 1;
+    int next = 0;
+
+    while (next < count || q->inflight > 0) {
+        uint64_t flags = irq_save();
+        int queued = 0;
+        while (next < count && q->free_count > 0) {
+            block_request *req = &reqs[next];
+            if (req->op == BLOCK_OP_FLUSH) {
+                if (!c->has_write_cache) {
+                    req->status = 0;
+                    next++;
+                    continue;
+                }
+                if (q->inflight > 0) break;
+            } else if ((req->sector & align) || (req->count & align)) {
+                req->status = -1;  // Not expressible in namespace blocks
+                next++;
+                continue;
+            }
+            queue_request(c, q, req);
+            next++;
+            queued++;
+        }
+        if (queued) queue_ring(q);
+        queue_reap(q);
+        int blocked = q->inflight > 0 && (next == count || q->free_count == 0 ||
+                                          reqs[next].op == BLOCK_OP_FLUSH);
+        irq_restore(flags);
+
+        if (blocked) wait_for_completion(c, q);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (reqs[i].status != 0) return -1;
+    }
+    return 0;
+}
+
+static void nvme_irq(void) {
+    for (int i = 0; i < controller_count; i++) {
+        for (int cpu = 0; cpu < NVME_CPUS; cpu++) {
+            queue_reap(&controllers[i].io[cpu]);
+        }
+    }
+}
+
+static int create_io_queues(nvme_controller *c, uint16_t size) {
+    nvme_command cmd;
+
+    clear_command(&cmd);
+    cmd.opcode = NVME_ADMIN_SET_FEATURES;
+    cmd.cdw10 = NVME_FEATURE_NUM_QUEUES;
+    cmd.cdw11 = ((NVME_CPUS - 1) << 16) | (NVME_CPUS - 1);
+    if (admin_command(c, &cmd) != 0) return -1;
+
+    for (int cpu = 0; cpu < NVME_CPUS; cpu++) {
+        nvme_queue *q = &c->io[cpu];
+        if (queue_alloc(c, q, cpu + 1, size) != 0) return -1;
+
+        // All completion queues share interrupt vector 0 (the pin interrupt)
+        clear_command(&cmd);
+        cmd.opcode = NVME_ADMIN_CREATE_CQ;
+        cmd.prp1 = (uint64_t)q->cq;
+        cmd.cdw10 = ((uint32_t)(size - 1) << 16) | q->id;
+        cmd.cdw11 = NVME_QUEUE_CONTIGUOUS | NVME_CQ_IRQ_ENABLED;
+        if (admin_command(c, &cmd) != 0) return -1;
+
+        clear_command(&cmd);
+        cmd.opcode = NVME_ADMIN_CREATE_SQ;
+        cmd.prp1 = (uint64_t)q->sq;
+        cmd.cdw10 = ((uint32_t)(size - 1) << 16) | q->id;
+        cmd.cdw11 = ((uint32_t)q->id << 16) | NVME_QUEUE_CONTIGUOUS;
+        if (admin_command(c, &cmd) != 0) return -1;
+    }
+    return 0;
+}
+
+static int nvme_probe(pci_device *pci, nvme_controller *c) {
+    static uint8_t identify[NVME_PAGE_SIZE] __attribute__((aligned(NVME_PAGE_SIZE)));
+
+    c->pci = pci;
+    c->regs = (volatile uint8_t *)pci_map_bar(pci, 0);
+    if (!c->regs) return -1;
+    pci_enable(pci);
+
+    uint64_t cap = reg_read64(c, NVME_REG_CAP);
+    uint32_t max_entries = (cap & 0xFFFF) + 1;
+    c->doorbell_stride = 4u << ((cap >> 32) & 0xF);
+    if (((cap >> 48) & 0xF) != 0) return -1;  // Needs a page size above 4KB
+
+    // Disable, program the admin queues, then enable again
+    uint32_t cc = reg_read32(c, NVME_REG_CC);
+    if (cc & NVME_CC_ENABLE) {
+        reg_write32(c, NVME_REG_CC, cc & ~NVME_CC_ENABLE);
+    }
+    if (wait_status(c, NVME_CSTS_READY, 0) != 0) return -1;
+
+    if (queue_alloc(c, &c->admin, 0, NVME_ADMIN_QUEUE_SIZE) != 0) return -1;
+    reg_write32(c, NVME_REG_AQA, ((NVME_ADMIN_QUEUE_SIZE - 1) << 16) | (NVME_ADMIN_QUEUE_SIZE - 1));
+    reg_write64(c, NVME_REG_ASQ, (uint64_t)c->admin.sq);
+    reg_write64(c, NVME_REG_ACQ, (uint64_t)c->admin.cq);
+    reg_write32(c, NVME_REG_CC, NVME_CC_ENABLE | NVME_CC_IOSQES | NVME_CC_IOCQES);
+    if (wait_status(c, NVME_CSTS_READY, NVME_CSTS_READY) != 0) return -1;
+
+    // Identify the controller: transfer limit and volatile write cache
+    nvme_command cmd;
+    clear_command(&cmd);
+    cmd.opcode = NVME_ADMIN_IDENTIFY;
+    cmd.prp1 = (uint64_t)identify;
+    cmd.cdw10 = NVME_IDENTIFY_CONTROLLER;
+    if (admin_command(c, &cmd) != 0) return -1;
+    uint8_t mdts = identify[77];
+    c->has_write_cache = identify[525] & 1;
+
+    // Namespace 1: size and block size of the active LBA format
+    c->nsid = 1;
+    clear_command(&cmd);
+    cmd.opcode = NVME_ADMIN_IDENTIFY;
+    cmd.nsid = c->nsid;
+    cmd.prp1 = (uint64_t)identify;
+    cmd.cdw10 = NVME_IDENTIFY_NAMESPACE;
+    if (admin_command(c, &cmd) != 0) return -1;
+    uint64_t blocks = *(uint64_t *)identify;
+    uint8_t format = identify[26] & 0xF;
+    c->lba_shift = identify[128 + format * 4 + 2];
+    if (blocks == 0 || c->lba_shift < 9 || c->lba_shift > 12) return -1;
+
+    uint16_t size = (max_entries < NVME_IO_QUEUE_SIZE) ? max_entries : NVME_IO_QUEUE_SIZE;
+    if (create_io_queues(c, size) != 0) return -1;
+
+    uint32_t max_sectors = NVME_MAX_SECTORS;
+    if (mdts != 0 && mdts < 20 && (((uint32_t)NVME_PAGE_SIZE << mdts) / BLOCK_SECTOR_SIZE) < max_sectors) {
+        max_sectors = ((uint32_t)NVME_PAGE_SIZE << mdts) / BLOCK_SECTOR_SIZE;
+    }
+
+    block_device *dev = &c->dev;
+    dev->name[0] = 'n';
+    dev->name[1] = 'v';
+    dev->name[2] = 'm';
+    dev->name[3] = 'e';
+    dev->name[4] = '0' + controller_count;
+    dev->name[5] = '\0';
+    dev->sectors = blocks << (c->lba_shift - 9);
+    dev->max_sectors = max_sectors;
+    dev->queue_depth = size - 1;
+    dev->read_only = 0;
+    dev->submit = nvme_submit;
+    dev->driver = c;
+    return 0;
+}
+
+int nvme_init(void) {
+    for (int nth = 0; controller_count < NVME_MAX_CONTROLLERS; nth++) {
+        pci_device *pci = pci_find_class(NVME_PCI_CLASS, NVME_PCI_SUBCLASS, nth);
+        if (!pci) break;
+
+        nvme_controller *c = &controllers[controller_count];
+        if (nvme_probe(pci, c) != 0 || block_register(&c->dev) != 0) {
+            print_string("nvme: controller setup failed\n");
+            continue;
+        }
+        controller_count++;
+        c->use_irq = pci->irq_line != PCI_NO_IRQ && irq_register(pci->irq_line, nvme_irq) == 0;
+
+        char buffer[24];
+        print_string("nvme: ");
+        print_string(c->dev.name);
+        print_string(" ");
+        itoa(c->dev.sectors / 2048, buffer, 10);
+        print_string(buffer);
+        print_string(" MB, ");
+        itoa(1u << c->lba_shift, buffer, 10);
+        print_string(buffer);
+        print_string("-byte blocks, queue depth ");
+        itoa(c->dev.queue_depth, buffer, 10);
+        print_string(buffer);
+        if (c->use_irq) {
+            print_string(", IRQ ");
+            itoa(pci->irq_line, buffer, 10);
+            print_string(buffer);
+        }
+        print_string("\n");
+    }
+    return controller_count;
+}
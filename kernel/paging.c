@@ -0,0 +1,191 @@
+#include "paging.h"
+#include "cpu.h"
+#include "vga.h"
+#include "utils.h"
+
+#define PAGE_TABLE_POOL 64         // Spare tables for splitting 2MB pages / new regions
+
+// PAT entries: 0=WB 1=WC 2=UC- 3=UC 4=WB 5=WT 6=UC- 7=UC. Only entry 1 differs
+// from the power-on default (WT), so untouched PWT-only mappings become WC.
+#define PAT_VALUE 0x0007040600070106ULL
+
+#define MTRR_TYPE_WC 0x01
+#define MTRR_MASK_VALID (1ULL << 11)
+#define MTRR_DEF_ENABLE (1ULL << 11)
+#define MTRR_CAP_WC (1ULL << 10)
+
+int pat_enabled = 0;
+
+static uint64_t table_pool[PAGE_TABLE_POOL][512] __attribute__((aligned(PAGE_SIZE)));
+static int tables_used = 0;
+
+static uint64_t *alloc_table(void) {
+    if (tables_used >= PAGE_TABLE_POOL) return 0;
+    uint64_t *table = table_pool[tables_used++];
+    memset(table, 0, PAGE_SIZE);
+    return table;
+}
+
+// Page attribute bits selecting the requested memory type
+static uint64_t cache_flags(int cache_type, int large) {
+    uint64_t pat_bit = large ? PAGE_PAT_2M : PAGE_PAT_4K;
+    switch (cache_type) {
+        case PAGE_CACHE_WC:
+            // Without PAT the MTRR fallback provides WC under a WB page
+            return pat_enabled ? PAGE_PWT : 0;
+        case PAGE_CACHE_WT:
+            return pat_enabled ? (pat_bit | PAGE_PWT) : PAGE_PWT;
+        case PAGE_CACHE_UC:
+            return PAGE_PCD | PAGE_PWT;
+        default:
+            return 0;
+    }
+}
+
+// Run a memory type update with caches disabled, as the SDM requires for
+// both PAT and MTRR changes
+static uint64_t begin_cache_update(void) {
+    uint64_t cr0 = read_cr0();
+    write_cr0((cr0 | (1ULL << 30)) & ~(1ULL << 29));  // CD=1, NW=0
+    wbinvd();
+    write_cr3(read_cr3());
+    return cr0;
+}
+
+static void end_cache_update(uint64_t cr0) {
+    wbinvd();
+    write_cr3(read_cr3());
+    write_cr0(cr0);
+}
+
+// Fallback for CPUs without PAT: cover the range with a WC variable MTRR
+static int mtrr_set_wc(uint64_t phys, uint64_t size) {
+    uint32_t a, b, c, d;
+    cpuid(1, &a, &b, &c, &d);
+    if (!(d & CPUID_EDX_MTRR)) return -1;
+
+    uint64_t cap = rdmsr(MSR_MTRR_CAP);
+    if (!(cap & MTRR_CAP_WC)) return -1;
+
+    // Variable ranges must be a power of two in size and aligned to it
+    uint64_t range = PAGE_SIZE;
+    while (range < size) range <<= 1;
+    if (phys & (range - 1)) return -1;
+
+    uint32_t phys_bits = 36;
+    cpuid(0x80000000, &a, &b, &c, &d);
+    if (a >= 0x80000008) {
+        cpuid(0x80000008, &a, &b, &c, &d);
+        phys_bits = a & 0xFF;
+    }
+    uint64_t phys_mask = ((1ULL << phys_bits) - 1) & ~(range - 1);
+
+    int count = cap & 0xFF;
+    for (int i = 0; i < count; i++) {
+        if (rdmsr(MSR_MTRR_PHYSMASK0 + 2 * i) & MTRR_MASK_VALID) {
+            // Already covered by an earlier call (e.g. fbbench switching back)
+            if (rdmsr(MSR_MTRR_PHYSBASE0 + 2 * i) == (phys | MTRR_TYPE_WC)) return 0;
+            continue;
+        }
+
+        uint64_t cr0 = begin_cache_update();
+        uint64_t def_type = rdmsr(MSR_MTRR_DEF_TYPE);
+        wrmsr(MSR_MTRR_DEF_TYPE, def_type & ~MTRR_DEF_ENABLE);
+        wrmsr(MSR_MTRR_PHYSBASE0 + 2 * i, phys | MTRR_TYPE_WC);
+        wrmsr(MSR_MTRR_PHYSMASK0 + 2 * i, phys_mask | MTRR_MASK_VALID);
+        wrmsr(MSR_MTRR_DEF_TYPE, def_type);
+        end_cache_update(cr0);
+        return 0;
+    }
+    return -1;
+}
+
+void paging_init(void) {
+    uint32_t a, b, c, d;
+    cpuid(1, &a, &b, &c, &d);
+    if (!(d & CPUID_EDX_PAT)) {
+        print_string("PAT not supported, write-combining via MTRR only\n");
+        return;
+    }
+
+    uint64_t cr0 = begin_cache_update();
+    wrmsr(MSR_PAT, PAT_VALUE);
+    end_cache_update(cr0);
+    pat_enabled = 1;
+}
+
+// Identity map [phys, phys + size) with the given memory type. 2MB pages are
+// used where the range allows, and split into 4KB pages at unaligned edges.
+int paging_identity_map(uint64_t phys, uint64_t size, int cache_type) {
+    uint64_t addr = phys & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t end = (phys + size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t *pml4 = (uint64_t *)(read_cr3() & PAGE_ADDR_MASK);
+
+    while (addr < end) {
+        uint64_t *pml4e = &pml4[(addr >> 39) & 511];
+        if (!(*pml4e & PAGE_PRESENT)) {
+            uint64_t *table = alloc_table();
+            if (!table) return -1;
+            *pml4e = (uint64_t)table | PAGE_PRESENT | PAGE_WRITE;
+        }
+
+        uint64_t *pdpt = (uint64_t *)(*pml4e & PAGE_ADDR_MASK);
+        uint64_t *pdpte = &pdpt[(addr >> 30) & 511];
+        if (!(*pdpte & PAGE_PRESENT)) {
+            uint64_t *table = alloc_table();
+            if (!table) return -1;
+            *pdpte = (uint64_t)table | PAGE_PRESENT | PAGE_WRITE;
+        }
+
+        uint64_t *pd = (uint64_t *)(*pdpte & PAGE_ADDR_MASK);
+        uint64_t *pde = &pd[(addr >> 21) & 511];
+        int pde_large = (*pde & PAGE_PRESENT) && (*pde & PAGE_HUGE);
+
+        // Whole 2MB page: rewrite the directory entry in place
+        if ((addr & (LARGE_PAGE_SIZE - 1)) == 0 && end - addr >= LARGE_PAGE_SIZE &&
+            (pde_large || !(*pde & PAGE_PRESENT))) {
+            *pde = addr | PAGE_PRESENT | PAGE_WRITE | PAGE_HUGE | cache_flags(cache_type, 1);
+            addr += LARGE_PAGE_SIZE;
+            continue;
+        }
+
+        if (pde_large) {
+            // Split the 2MB page into 4KB pages with the same attributes
+            uint64_t *table = alloc_table();
+            if (!table) return -1;
+            uint64_t base = *pde & ~(uint64_t)(LARGE_PAGE_SIZE - 1) & PAGE_ADDR_MASK;
+            uint64_t flags = *pde & (PAGE_WRITE | PAGE_USER | PAGE_PWT | PAGE_PCD);
+            if (*pde & PAGE_PAT_2M) flags |= PAGE_PAT_4K;
+            for (int i = 0; i < 512; i++) {
+                table[i] = (base + (uint64_t)i * PAGE_SIZE) | PAGE_PRESENT | flags;
+            }
+            *pde = (uint64_t)table | PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
+        } else if (!(*pde & PAGE_PRESENT)) {
+            uint64_t *table = alloc_table();
+            if (!table) return -1;
+            *pde = (uint64_t)table | PAGE_PRESENT | PAGE_WRITE;
+        }
+
+        uint64_t *pt = (uint64_t *)(*pde & PAGE_ADDR_MASK);
+        pt[(addr >> 12) & 511] = addr | PAGE_PRESENT | PAGE_WRITE | cache_flags(cache_type, 0);
+        addr += PAGE_SIZE;
+    }
+
+    // Drop stale TLB entries and lines cached under the old memory type
+    wbinvd();
+    write_cr3(read_cr3());
+
+    if (cache_type == PAGE_CACHE_WC && !pat_enabled) {
+        return mtrr_set_wc(phys, size);
+    }
+    return 0;
+}
+
+const char *paging_cache_name(int cache_type) {
+    switch (cache_type) {
+        case PAGE_CACHE_WC: return "WC";
+        case PAGE_CACHE_WT: return "WT";
+        case PAGE_CACHE_UC: return "UC";
+        default: return "WB";
+    }
+}
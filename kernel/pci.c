@@ -0,0 +1,208 @@
+#include "pci.h"
+#include "cpu.h"
+#include "paging.h"
+#include "vga.h"
+#include "utils.h"
+
+static pci_device devices[PCI_MAX_DEVICES];
+static int device_count = 0;
+
+// Configuration mechanism #1: select a dword through 0xCF8, access it at 0xCFC
+static uint32_t config_address(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset) {
+    return 0x80000000u | ((uint32_t)bus << 16) | ((uint32_t)device << 11) |
+           ((uint32_t)function << 8) | (offset & 0xFC);
+}
+
+static uint32_t config_read32(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset) {
+    outl(PCI_CONFIG_ADDRESS, config_address(bus, device, function, offset));
+    return inl(PCI_CONFIG_DATA);
+}
+
+uint32_t pci_read32(pci_device *dev, uint8_t offset) {
+    return config_read32(dev->bus, dev->device, dev->function, offset);
+}
+
+uint16_t pci_read16(pci_device *dev, uint8_t offset) {
+    outl(PCI_CONFIG_ADDRESS, config_address(dev->bus, dev->device, dev->function, offset));
+    return inw(PCI_CONFIG_DATA + (offset & 2));
+}
+
+uint8_t pci_read8(pci_device *dev, uint8_t offset) {
+    return (pci_read32(dev, offset) >> ((offset & 3) * 8)) & 0xFF;
+}
+
+void pci_write32(pci_device *dev, uint8_t offset, uint32_t value) {
+    outl(PCI_CONFIG_ADDRESS, config_address(dev->bus, dev->device, dev->function, offset));
+    outl(PCI_CONFIG_DATA, value);
+}
+
+// 16-bit writes go straight to the word so the write-1-to-clear status
+// bits next to the command register are left alone
+void pci_write16(pci_device *dev, uint8_t offset, uint16_t value) {
+    outl(PCI_CONFIG_ADDRESS, config_address(dev->bus, dev->device, dev->function, offset));
+    outw(PCI_CONFIG_DATA + (offset & 2), value);
+}
+
+// Size every BAR by writing all ones and reading back the writable bits.
+// Decoding is switched off meanwhile so the probe value is never claimed.
+static void decode_bars(pci_device *dev) {
+    uint8_t header = pci_read8(dev, PCI_HEADER_TYPE) & 0x7F;
+    int bars = (header == 0) ? PCI_BAR_COUNT : (header == 1) ? 2 : 0;
+    uint16_t command = pci_read16(dev, PCI_COMMAND);
+    pci_write16(dev, PCI_COMMAND, command & ~(PCI_COMMAND_IO | PCI_COMMAND_MEMORY));
+
+    for (int i = 0; i < bars; i++) {
+        uint8_t offset = PCI_BAR0 + i * 4;
+        uint32_t low = pci_read32(dev, offset);
+        pci_write32(dev, offset, 0xFFFFFFFF);
+        uint32_t low_mask = pci_read32(dev, offset);
+        pci_write32(dev, offset, low);
+        if (low_mask == 0) continue;
+
+        if (low & PCI_BAR_IO) {
+            dev->bar_io[i] = 1;
+            dev->bar[i] = low & ~3u;
+            dev->bar_size[i] = (~(low_mask & ~3u) + 1) & 0xFFFF;
+            continue;
+        }
+
+        uint64_t base = low & ~0xFu;
+        uint64_t mask = 0xFFFFFFFF00000000ULL | (low_mask & ~0xFu);
+        if ((low & 0x6) == PCI_BAR_TYPE_64 && i + 1 < bars) {
+            uint32_t high = pci_read32(dev, offset + 4);
+            pci_write32(dev, offset + 4, 0xFFFFFFFF);
+            uint32_t high_mask = pci_read32(dev, offset + 4);
+            pci_write32(dev, offset + 4, high);
+            base |= (uint64_t)high << 32;
+            mask = ((uint64_t)high_mask << 32) | (low_mask & ~0xFu);
+        }
+        dev->bar[i] = base;
+        dev->bar_size[i] = ~mask + 1;
+        if ((low & 0x6) == PCI_BAR_TYPE_64) i++;  // Upper half is not a BAR of its own
+    }
+
+    pci_write16(dev, PCI_COMMAND, command);
+}
+
+static void add_device(uint8_t bus, uint8_t device, uint8_t function) {
+    if (device_count >= PCI_MAX_DEVICES) return;
+
+    pci_device *dev = &devices[device_count];
+    for (int i = 0; i < PCI_BAR_COUNT; i++) {
+        dev->bar[i] = 0;
+        dev->bar_size[i] = 0;
+        dev->bar_io[i] = 0;
+    }
+    dev->bus = bus;
+    dev->device = device;
+    dev->function = function;
+    dev->vendor_id = pci_read16(dev, PCI_VENDOR_ID);
+    dev->device_id = pci_read16(dev, PCI_DEVICE_ID);
+    dev->class_code = pci_read8(dev, PCI_CLASS);
+    dev->subclass = pci_read8(dev, PCI_SUBCLASS);
+    dev->prog_if = pci_read8(dev, PCI_PROG_IF);
+    dev->revision = pci_read8(dev, PCI_REVISION);
+
+    // Firmware writes the PIC line it routed INTx to; 0 and 0xFF mean none
+    uint8_t line = pci_read8(dev, PCI_INTERRUPT_LINE);
+    dev->irq_line = (line == 0 || line >= 16) ? PCI_NO_IRQ : line;
+
+    decode_bars(dev);
+    device_count++;
+}
+
+// Brute-force scan of every bus/device/function
+void pci_init(void) {
+    device_count = 0;
+
+    for (uint32_t bus = 0; bus < 256; bus++) {
+        for (uint8_t device = 0; device < 32; device++) {
+            uint32_t id = config_read32(bus, device, 0, PCI_VENDOR_ID);
+            if ((id & 0xFFFF) == 0xFFFF) continue;
+
+            uint8_t header = (config_read32(bus, device, 0, PCI_HEADER_TYPE & 0xFC) >> 16) & 0xFF;
+            uint8_t functions = (header & PCI_HEADER_MULTIFUNCTION) ? 8 : 1;
+            for (uint8_t function = 0; function < functions; function++) {
+                id = config_read32(bus, device, function, PCI_VENDOR_ID);
+                if ((id & 0xFFFF) == 0xFFFF) continue;
+                add_device(bus, device, function);
+            }
+        }
+    }
+
+    char buffer[16];
+    print_string("PCI: ");
+    itoa(device_count, buffer, 10);
+    print_string(buffer);
+    print_string(" devices\n");
+}
+
+int pci_device_count(void) {
+    return device_count;
+}
+
+pci_device *pci_get_device(int index) {
+    if (index < 0 || index >= device_count) return 0;
+    return &devices[index];
+}
+
+// The nth (from 0) function matching vendor and device ID
+pci_device *pci_find_device(uint16_t vendor_id, uint16_t device_id, int nth) {
+    for (int i = 0; i < device_count; i++) {
+        if (devices[i].vendor_id == vendor_id && devices[i].device_id == device_id && nth-- == 0) {
+            return &devices[i];
+        }
+    }
+    return 0;
+}
+
+pci_device *pci_find_class(uint8_t class_code, uint8_t subclass, int nth) {
+    for (int i = 0; i < device_count; i++) {
+        if (devices[i].class_code == class_code && devices[i].subclass == subclass && nth-- == 0) {
+            return &devices[i];
+        }
+    }
+    return 0;
+}
+
+// Offset of the next capability with cap_id after offset after (0 = from the
+// start of the list), or 0 if there is none
+uint8_t pci_find_capability(pci_device *dev, uint8_t cap_id, uint8_t after) {
+    if (!(pci_read16(dev, PCI_STATUS) & PCI_STATUS_CAP_LIST)) return 0;
+
+    uint8_t offset = after ? pci_read8(dev, after + 1) : pci_read8(dev, PCI_CAPABILITY_LIST);
+    for (int guard = 0; offset >= 0x40 && guard < 48; guard++) {
+        offset &= 0xFC;
+        if (pci_read8(dev, offset) == cap_id) return offset;
+        offset = pci_read8(dev, offset + 1);
+    }
+    return 0;
+}
+
+// Turn on memory decoding and bus mastering; INTx stays enabled
+void pci_enable(pci_device *dev) {
+    uint16_t command = pci_read16(dev, PCI_COMMAND);
+    command |= PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER;
+    command &= ~PCI_COMMAND_INTX_DISABLE;
+    pci_write16(dev, PCI_COMMAND, command);
+}
+
+// Map a memory BAR uncached and return its address, or 0
+void *pci_map_bar(pci_device *dev, int bar) {
+    if (bar < 0 || bar >= PCI_BAR_COUNT || dev->bar_io[bar] || dev->bar[bar] == 0) return 0;
+    if (paging_identity_map(dev->bar[bar], dev->bar_size[bar], PAGE_CACHE_UC) != 0) return 0;
+    return (void *)dev->bar[bar];
+}
+
+const char *pci_class_name(uint8_t class_code) {
+    switch (class_code) {
+        case 0x01: return "Storage";
+        case 0x02: return "Network";
+        case 0x03: return "Display";
+        case 0x04: return "Multimedia";
+        case 0x05: return "Memory";
+        case 0x06: return "Bridge";
+        case 0x0C: return "Serial bus";
+        default: return "Other";
+    }
+}
@@ -1,5 +1,6 @@
 #include <stdint.h>
 #include "idt.h"
+#include "cpu.h"
 #include "vga.h"
 #include "utils.h"
 
@@ -22,6 +23,8 @@
 #define ICW4_BUF_MASTER 0x0C    /* Buffered mode/master */
 #define ICW4_SFNM       0x10    /* Special fully nested (not) */
 
+#define OCW3_READ_ISR   0x0B    /* Next command port read returns the ISR */
+
 void pic_remap(void) {
     // Save current masks
     uint8_t pic1_mask = inb(PIC1_DATA);
@@ -53,4 +56,28 @@ void pic_send_eoi(uint8_t irq) {
         outb(PIC2_COMMAND, 0x20);  // Send EOI to slave PIC
     }
     outb(PIC1_COMMAND, 0x20);      // Send EOI to master PIC
-}
\ No newline at end of file
+}
+
+void pic_unmask(uint8_t irq) {
+    if (irq >= 8) {
+        outb(PIC2_DATA, inb(PIC2_DATA) & ~(1 << (irq - 8)));
+        irq = 2;  // Slave lines also need the cascade input open
+    }
+    outb(PIC1_DATA, inb(PIC1_DATA) & ~(1 << irq));
+}
+
+// Whether irq could interrupt the code running now: interrupts must be on
+// and no line of equal or higher priority may be in service. Shell commands
+// run inside the keyboard handler, where IRQ1 blocks every slave line.
+int pic_irq_deliverable(uint8_t irq) {
+    if (!interrupts_enabled()) return 0;
+
+    uint8_t line = (irq >= 8) ? 2 : irq;
+    outb(PIC1_COMMAND, OCW3_READ_ISR);
+    if (inb(PIC1_COMMAND) & ((2 << line) - 1)) return 0;
+    if (irq >= 8) {
+        outb(PIC2_COMMAND, OCW3_READ_ISR);
+        if (inb(PIC2_COMMAND) & ((2 << (irq - 8)) - 1)) return 0;
+    }
+    return 1;
+}
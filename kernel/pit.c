@@ -1,9 +1,14 @@
 #include "pit.h"
 #include "idt.h"
+#include "cpu.h"
 
 #define PIT_BASE_FREQ 1193180  // PIT base frequency in Hz
 #define PIT_CHANNEL0 0x40      // Channel 0 data port
+#define PIT_CHANNEL2 0x42      // Channel 2 data port
 #define PIT_COMMAND 0x43       // Command port
+#define PIT_GATE_PORT 0x61     // Channel 2 gate / output status
+
+static uint64_t tsc_hz = 0;
 
 void pit_init(uint32_t frequency) {
     // Calculate the divisor
@@ -15,4 +20,26 @@ void pit_init(uint32_t frequency) {
     // Send the divisor (low byte, then high byte)
     outb(PIT_CHANNEL0, divisor & 0xFF);
     outb(PIT_CHANNEL0, (divisor >> 8) & 0xFF);
-}
\ No newline at end of file
+}
+
+// Measure the TSC rate once against a 10 ms one-shot on PIT channel 2
+uint64_t tsc_frequency(void) {
+    if (tsc_hz) return tsc_hz;
+
+    uint8_t gate = inb(PIT_GATE_PORT);
+    outb(PIT_GATE_PORT, gate & ~0x03);          // Gate low, speaker off
+
+    uint32_t count = PIT_BASE_FREQ / 100;
+    outb(PIT_COMMAND, 0xB0);                    // Channel 2, lobyte/hibyte, mode 0
+    outb(PIT_CHANNEL2, count & 0xFF);
+    outb(PIT_CHANNEL2, (count >> 8) & 0xFF);
+
+    outb(PIT_GATE_PORT, (gate & ~0x02) | 0x01); // Gate high starts the count
+    uint64_t start = rdtsc();
+    while (!(inb(PIT_GATE_PORT) & 0x20));       // OUT2 goes high at terminal count
+    uint64_t end = rdtsc();
+
+    outb(PIT_GATE_PORT, gate);
+    tsc_hz = (end - start) * 100;
+    return tsc_hz;
+}
@@ -85,4 +85,38 @@ void string_copy(char *dest, const char *src, int max_input) {
         *dest++ = *src++;
     }
     *dest = '\0';
-}
\ No newline at end of file
+}
+
+// Bulk memory helpers use the string instructions, which are fast on any
+// CPU with ERMS and keep big copies (framebuffer, file blocks) to one insn.
+void *memcpy(void *dest, const void *src, size_t n) {
+    void *d = dest;
+    __asm__ volatile("rep movsb" : "+D"(d), "+S"(src), "+c"(n) : : "memory");
+    return dest;
+}
+
+void *memmove(void *dest, const void *src, size_t n) {
+    if ((uint8_t *)dest <= (const uint8_t *)src || (uint8_t *)dest >= (const uint8_t *)src + n) {
+        return memcpy(dest, src, n);
+    }
+    // Overlapping with dest above src: copy backwards
+    void *d = (uint8_t *)dest + n - 1;
+    const void *s = (const uint8_t *)src + n - 1;
+    __asm__ volatile("std; rep movsb; cld" : "+D"(d), "+S"(s), "+c"(n) : : "memory");
+    return dest;
+}
+
+void *memset(void *ptr, int value, size_t n) {
+    void *p = ptr;
+    __asm__ volatile("rep stosb" : "+D"(p), "+c"(n) : "a"(value) : "memory");
+    return ptr;
+}
+
+int memcmp(const void *a, const void *b, size_t n) {
+    const uint8_t *pa = (const uint8_t *)a;
+    const uint8_t *pb = (const uint8_t *)b;
+    for (size_t i = 0; i < n; i++) {
+        if (pa[i] != pb[i]) return pa[i] - pb[i];
+    }
+    return 0;
+}
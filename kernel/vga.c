@@ -1,47 +1,84 @@
 #include "vga.h"
+#include "fbcon.h"
 #include "task.h"
 
 uint8_t cursor_row = 0;
 uint8_t cursor_col = 0;
+uint8_t screen_width = VGA_WIDTH;
+uint8_t screen_height = VGA_HEIGHT;
 static volatile uint16_t *vga_buffer = (uint16_t *)0xB8000;
 int vga_lock = 0;
+static int batch_output = 0;  // Set while print_string defers framebuffer redraws
+
+// Switch output to the framebuffer console if one is available
+void console_init(void) {
+    if (fbcon_init() == 0) {
+        screen_width = fbcon_cols;
+        screen_height = fbcon_rows;
+        cursor_row = 0;
+        cursor_col = 0;
+    }
+}
 
 void print_char(char c, uint8_t row, uint8_t col) {
-    if (row >= VGA_HEIGHT || col >= VGA_WIDTH) return;
+    if (row >= screen_height || col >= screen_width) return;
     enter_critical_section();
-    int index = row * VGA_WIDTH + col;
-    vga_buffer[index] = (uint16_t)(c | (0x0F << 8));
+    if (fbcon_active) {
+        fbcon_put_char(c, row, col, 0x0F);
+    } else {
+        int index = row * VGA_WIDTH + col;
+        vga_buffer[index] = (uint16_t)(c | (0x0F << 8));
+    }
     exit_critical_section();
 }
 
-void print_string(const char *str) {
+// Print len bytes that need not be null-terminated (e.g. file contents)
+void print_chars(const char *str, uint32_t len) {
     enter_critical_section();
-    for (int i = 0; str[i] != '\0'; i++) {
+    batch_output = 1;
+    for (uint32_t i = 0; i < len; i++) {
         if (str[i] == '\n') {
             cursor_row++;
             cursor_col = 0;
-            if (cursor_row >= VGA_HEIGHT) {
+            if (cursor_row >= screen_height) {
                 // Scroll screen up instead of wrapping to top
                 scroll_screen();
-                cursor_row = VGA_HEIGHT - 1;
+                cursor_row = screen_height - 1;
             }
         } else {
             print_char(str[i], cursor_row, cursor_col);
             cursor_col++;
-            if (cursor_col >= VGA_WIDTH) {
+            if (cursor_col >= screen_width) {
                 cursor_row++;
                 cursor_col = 0;
-                if (cursor_row >= VGA_HEIGHT) {
+                if (cursor_row >= screen_height) {
                     scroll_screen();
-                    cursor_row = VGA_HEIGHT - 1;
+                    cursor_row = screen_height - 1;
                 }
             }
         }
     }
+    // One framebuffer refresh covers every scroll in this string
+    batch_output = 0;
+    fbcon_present();
     exit_critical_section();
 }
 
+void print_string(const char *str) {
+    uint32_t len = 0;
+    while (str[len] != '\0') len++;
+    print_chars(str, len);
+}
+
 void scroll_screen(void) {
+    if (fbcon_active) {
+        fbcon_scroll(0x0F);
+        if (!batch_output) {
+            fbcon_present();
+        }
+        return;
+    }
+
     // Move all lines up by one
     for (int row = 0; row < VGA_HEIGHT - 1; row++) {
         for (int col = 0; col < VGA_WIDTH; col++) {
@@ -59,12 +96,16 @@ void scroll_screen(void) {
 }
 
 void clear_screen_proper(void) {
-    for (int row = 0; row < VGA_HEIGHT; row++) {
-        for (int col = 0; col < VGA_WIDTH; col++) {
-            int index = row * VGA_WIDTH + col;
-            vga_buffer[index] = (uint16_t)(' ' | (0x0F << 8));
+    if (fbcon_active) {
+        fbcon_clear(0x0F);
+    } else {
+        for (int row = 0; row < VGA_HEIGHT; row++) {
+            for (int col = 0; col < VGA_WIDTH; col++) {
+                int index = row * VGA_WIDTH + col;
+                vga_buffer[index] = (uint16_t)(' ' | (0x0F << 8));
+            }
         }
     }
     cursor_row = 0;
     cursor_col = 0;
-}
\ No newline at end of file
+}
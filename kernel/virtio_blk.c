@@ -0,0 +1,346 @@
+#include "virtio.h"
+#include "block.h"
+#include "pci.h"
+#include "idt.h"
+#include "cpu.h"
+#include "memory.h"
+#include "vga.h"
+#include "utils.h"
+#include <stddef.h>
+
+#define DESCS_PER_REQUEST 3        // Header, data, status
+#define VIRTIO_BLK_SLOTS (VIRTIO_QUEUE_MAX / DESCS_PER_REQUEST)
+
+// One virtio-blk device with a single split virtqueue. Descriptors are
+// grouped into fixed request slots: slot s owns descriptors 3s..3s+2, so
+// queueing a request only fills in the data descriptor.
+typedef struct {
+    pci_device *pci;
+    volatile virtio_pci_common_cfg *common;
+    volatile uint8_t *isr;
+    volatile uint16_t *notify;     // Queue 0 doorbell
+    uint16_t queue_size;
+    uint16_t avail_idx;            // Driver copy of avail->idx
+    uint16_t last_used;            // Next used ring entry to reap
+    uint16_t inflight;
+    uint16_t free_count;
+    uint16_t free_slots[VIRTIO_BLK_SLOTS];
+    block_request *slot_request[VIRTIO_BLK_SLOTS];
+    virtq_desc *desc;
+    volatile virtq_avail *avail;
+    volatile virtq_used *used;
+    virtio_blk_req_header *headers;  // One per slot
+    volatile uint8_t *status;        // One per slot, written by the device
+    int has_flush;
+    int use_irq;
+    block_device dev;
+} virtio_blk;
+
+static virtio_blk disks[VIRTIO_BLK_MAX_DEVICES];
+static int disk_count = 0;
+
+// Address of the register block a virtio capability points at, or 0
+static volatile uint8_t *map_capability(pci_device *pci, uint8_t cap, uint32_t min_length) {
+    uint8_t bar = pci_read8(pci, cap + offsetof(virtio_pci_cap, bar));
+    uint32_t offset = pci_read32(pci, cap + offsetof(virtio_pci_cap, offset));
+    uint32_t length = pci_read32(pci, cap + offsetof(virtio_pci_cap, length));
+    if (bar >= PCI_BAR_COUNT || length < min_length ||
+        (uint64_t)offset + length > pci->bar_size[bar]) {
+        return 0;
+    }
+    uint8_t *base = (uint8_t *)pci_map_bar(pci, bar);
+    return base ? base + offset : 0;
+}
+
+// Move finished requests from the used ring back to the free slots.
+// Runs from the IRQ handler and from waiters with interrupts off.
+static void reap_completions(virtio_blk *vb) {
+    while (vb->last_used != vb->used->idx) {
+        memory_barrier();  // Read the entry only after seeing the index
+        volatile virtq_used_elem *elem = &vb->used->ring[vb->last_used % vb->queue_size];
+        uint16_t slot = elem->id / DESCS_PER_REQUEST;
+        block_request *req = vb->slot_request[slot];
+        if (req) {
+            req->status = (vb->status[slot] == VIRTIO_BLK_S_OK) ? 0 : -1;
+        }
+        vb->slot_request[slot] = 0;
+        vb->free_slots[vb->free_count++] = slot;
+        vb->inflight--;
+        vb->last_used++;
+    }
+}
+
+static void virtio_blk_irq(void) {
+    for (int i = 0; i < disk_count; i++) {
+        // Reading the ISR status acknowledges the (level-triggered) interrupt
+        if (mmio_read8(disks[i].isr) & VIRTIO_ISR_QUEUE) {
+            reap_completions(&disks[i]);
+        }
+    }
+}
+
+static void queue_request(virtio_blk *vb, block_request *req) {
+    uint16_t slot = vb->free_slots[--vb->free_count];
+    uint16_t head = slot * DESCS_PER_REQUEST;
+    virtio_blk_req_header *header = &vb->headers[slot];
+    virtq_desc *desc = &vb->desc[head];
+
+    vb->status[slot] = 0xFF;
+    if (req->op == BLOCK_OP_FLUSH) {
+        header->type = VIRTIO_BLK_T_FLUSH;
+        header->sector = 0;
+        desc[0].next = head + 2;   // No data buffer
+    } else {
+        header->type = (req->op == BLOCK_OP_WRITE) ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+        header->sector = req->sector;
+        desc[0].next = head + 1;
+        desc[1].addr = (uint64_t)req->buffer;
+        desc[1].len = req->count * BLOCK_SECTOR_SIZE;
+        desc[1].flags = VIRTQ_DESC_F_NEXT | ((req->op == BLOCK_OP_READ) ? VIRTQ_DESC_F_WRITE : 0);
+    }
+
+    vb->slot_request[slot] = req;
+    vb->avail->ring[vb->avail_idx % vb->queue_size] = head;
+    vb->avail_idx++;
+    vb->inflight++;
+}
+
+// Publish everything queued since the last kick with one doorbell write
+static void kick(virtio_blk *vb) {
+    memory_barrier();
+    vb->avail->idx = vb->avail_idx;
+    memory_barrier();
+    if (!(vb->used->flags & VIRTQ_USED_F_NO_NOTIFY)) {
+        mmio_write16(vb->notify, 0);
+    }
+}
+
+// Wait for at least one completion. Sleep until the device interrupt when
+// it can reach us; with interrupts off or inside a higher-priority handler
+// (shell commands run in the keyboard IRQ) poll the used ring instead.
+static void wait_for_completion(virtio_blk *vb) {
+    if (vb->use_irq && !vb->dev.polled && pic_irq_deliverable(vb->pci->irq_line)) {
+        __asm__ volatile("cli");
+        if (vb->inflight > 0 && vb->used->idx == vb->last_used) {
+            __asm__ volatile("sti; hlt" : : : "memory");  // sti delays the IRQ until hlt
+        } else {
+            __asm__ volatile("sti");
+        }
+        return;
+    }
+    while (vb->inflight > 0 && vb->used->idx == vb->last_used) {
+        cpu_relax();
+    }
+}
+
+// Keep the queue as full as the batch allows: queue every request that
+// fits, kick once, and refill as completions free slots. A flush waits for
+// the writes before it to finish so it covers them.
+static int virtio_blk_submit(block_device *dev, block_request *reqs, int count) {
+    virtio_blk *vb = (virtio_blk *)dev->driver;
+    int next = 0;
+
+    while (next < count || vb->inflight > 0) {
+        uint64_t flags = irq_save();
+        int queued = 0;
+        while (next < count && vb->free_count > 0) {
+            block_request *req = &reqs[next];
+            if (req->op == BLOCK_OP_FLUSH) {
+                if (!vb->has_flush) {
+                    req->status = 0;  // No volatile cache to flush
+                    next++;
+                    continue;
+                }
+                if (vb->inflight > 0) break;
+            }
+            queue_request(vb, req);
+            next++;
+            queued++;
+        }
+        if (queued) kick(vb);
+        reap_completions(vb);
+        int blocked = vb->inflight > 0 && (next == count || vb->free_count == 0 ||
+                                           reqs[next].op == BLOCK_OP_FLUSH);
+        irq_restore(flags);
+
+        if (blocked) wait_for_completion(vb);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (reqs[i].status != 0) return -1;
+    }
+    return 0;
+}
+
+// Bring up one device following the virtio 1.0 initialization sequence
+static int virtio_blk_probe(pci_device *pci, virtio_blk *vb) {
+    volatile uint8_t *common = 0, *isr = 0, *notify_base = 0, *device = 0;
+    uint32_t notify_multiplier = 0;
+
+    for (uint8_t cap = pci_find_capability(pci, PCI_CAP_ID_VNDR, 0); cap;
+         cap = pci_find_capability(pci, PCI_CAP_ID_VNDR, cap)) {
+        uint8_t type = pci_read8(pci, cap + offsetof(virtio_pci_cap, cfg_type));
+        if (type == VIRTIO_PCI_CAP_COMMON_CFG && !common) {
+            common = map_capability(pci, cap, sizeof(virtio_pci_common_cfg));
+        } else if (type == VIRTIO_PCI_CAP_NOTIFY_CFG && !notify_base) {
+            notify_base = map_capability(pci, cap, 2);
+            notify_multiplier = pci_read32(pci, cap + sizeof(virtio_pci_cap));
+        } else if (type == VIRTIO_PCI_CAP_ISR_CFG && !isr) {
+            isr = map_capability(pci, cap, 1);
+        } else if (type == VIRTIO_PCI_CAP_DEVICE_CFG && !device) {
+            device = map_capability(pci, cap, sizeof(virtio_blk_config));
+        }
+    }
+    if (!common || !notify_base || !isr || !device) return -1;
+
+    pci_enable(pci);
+    volatile virtio_pci_common_cfg *cfg = (volatile virtio_pci_common_cfg *)common;
+    vb->pci = pci;
+    vb->common = cfg;
+    vb->isr = isr;
+
+    // Reset, then announce a driver
+    mmio_write8(&cfg->device_status, 0);
+    while (mmio_read8(&cfg->device_status) != 0) {
+        cpu_relax();
+    }
+    uint8_t status = VIRTIO_STATUS_ACKNOWLEDGE;
+    mmio_write8(&cfg->device_status, status);
+    status |= VIRTIO_STATUS_DRIVER;
+    mmio_write8(&cfg->device_status, status);
+
+    // Feature negotiation: VERSION_1 is required, RO and FLUSH are honored
+    mmio_write32(&cfg->device_feature_select, 0);
+    uint32_t features_lo = mmio_read32(&cfg->device_feature);
+    mmio_write32(&cfg->device_feature_select, 1);
+    uint32_t features_hi = mmio_read32(&cfg->device_feature);
+    if (!(features_hi & (1u << (VIRTIO_F_VERSION_1 - 32)))) goto fail;
+
+    uint32_t wanted_lo = features_lo & ((1u << VIRTIO_BLK_F_RO) | (1u << VIRTIO_BLK_F_FLUSH));
+    mmio_write32(&cfg->driver_feature_select, 0);
+    mmio_write32(&cfg->driver_feature, wanted_lo);
+    mmio_write32(&cfg->driver_feature_select, 1);
+    mmio_write32(&cfg->driver_feature, 1u << (VIRTIO_F_VERSION_1 - 32));
+    status |= VIRTIO_STATUS_FEATURES_OK;
+    mmio_write8(&cfg->device_status, status);
+    if (!(mmio_read8(&cfg->device_status) & VIRTIO_STATUS_FEATURES_OK)) goto fail;
+    vb->has_flush = (wanted_lo >> VIRTIO_BLK_F_FLUSH) & 1;
+
+    // Queue 0: descriptor table, available ring and used ring in one allocation
+    mmio_write16(&cfg->queue_select, 0);
+    uint16_t size = mmio_read16(&cfg->queue_size);
+    if (size < DESCS_PER_REQUEST) goto fail;
+    if (size > VIRTIO_QUEUE_MAX) size = VIRTIO_QUEUE_MAX;
+    mmio_write16(&cfg->queue_size, size);
+    vb->queue_size = size;
+
+    uint64_t avail_offset = (uint64_t)size * sizeof(virtq_desc);
+    uint64_t used_offset = (avail_offset + 6 + 2 * size + 3) & ~3ULL;
+    uint64_t ring_bytes = used_offset + 6 + sizeof(virtq_used_elem) * size;
+    uint16_t slots = size / DESCS_PER_REQUEST;
+    uint8_t *rings = (uint8_t *)phys_alloc(ring_bytes, 4096);
+    vb->headers = (virtio_blk_req_header *)phys_alloc(slots * sizeof(virtio_blk_req_header), 16);
+    vb->status = (volatile uint8_t *)phys_alloc(slots, 16);
+    if (!rings || !vb->headers || !vb->status) goto fail;
+    memset(rings, 0, ring_bytes);
+    vb->desc = (virtq_desc *)rings;
+    vb->avail = (volatile virtq_avail *)(rings + avail_offset);
+    vb->used = (volatile virtq_used *)(rings + used_offset);
+
+    // Header and status descriptors never change address
+    vb->free_count = 0;
+    for (uint16_t slot = 0; slot < slots; slot++) {
+        virtq_desc *desc = &vb->desc[slot * DESCS_PER_REQUEST];
+        desc[0].addr = (uint64_t)&vb->headers[slot];
+        desc[0].len = sizeof(virtio_blk_req_header);
+        desc[0].flags = VIRTQ_DESC_F_NEXT;
+        desc[1].next = slot * DESCS_PER_REQUEST + 2;
+        desc[2].addr = (uint64_t)&vb->status[slot];
+        desc[2].len = 1;
+        desc[2].flags = VIRTQ_DESC_F_WRITE;
+        vb->headers[slot].reserved = 0;
+        vb->slot_request[slot] = 0;
+        vb->free_slots[vb->free_count++] = slot;
+    }
+    vb->avail_idx = 0;
+    vb->last_used = 0;
+    vb->inflight = 0;
+
+    mmio_write32(&cfg->queue_desc_lo, (uint32_t)(uint64_t)vb->desc);
+    mmio_write32(&cfg->queue_desc_hi, (uint32_t)((uint64_t)vb->desc >> 32));
+    mmio_write32(&cfg->queue_driver_lo, (uint32_t)(uint64_t)vb->avail);
+    mmio_write32(&cfg->queue_driver_hi, (uint32_t)((uint64_t)vb->avail >> 32));
+    mmio_write32(&cfg->queue_device_lo, (uint32_t)(uint64_t)vb->used);
+    mmio_write32(&cfg->queue_device_hi, (uint32_t)((uint64_t)vb->used >> 32));
+    mmio_write16(&cfg->msix_config, VIRTIO_MSI_NO_VECTOR);      // Legacy INTx
+    mmio_write16(&cfg->queue_msix_vector, VIRTIO_MSI_NO_VECTOR);
+    vb->notify = (volatile uint16_t *)(notify_base +
+                                       (uint32_t)mmio_read16(&cfg->queue_notify_off) * notify_multiplier);
+    mmio_write16(&cfg->queue_enable, 1);
+
+    status |= VIRTIO_STATUS_DRIVER_OK;
+    mmio_write8(&cfg->device_status, status);
+
+    // Capacity is 64 bits wide; retry if the device changed it mid-read
+    volatile virtio_blk_config *blk = (volatile virtio_blk_config *)device;
+    uint8_t generation;
+    uint64_t capacity;
+    do {
+        generation = mmio_read8(&cfg->config_generation);
+        capacity = mmio_read32(&blk->capacity_lo) | ((uint64_t)mmio_read32(&blk->capacity_hi) << 32);
+    } while (generation != mmio_read8(&cfg->config_generation));
+
+    block_device *dev = &vb->dev;
+    dev->name[0] = 'v';
+    dev->name[1] = 'd';
+    dev->name[2] = 'a' + disk_count;
+    dev->name[3] = '\0';
+    dev->sectors = capacity;
+    dev->max_sectors = VIRTIO_BLK_MAX_SECTORS;
+    dev->queue_depth = slots;
+    dev->read_only = (wanted_lo >> VIRTIO_BLK_F_RO) & 1;
+    dev->submit = virtio_blk_submit;
+    dev->driver = vb;
+    return 0;
+
+fail:
+    mmio_write8(&cfg->device_status, VIRTIO_STATUS_FAILED);
+    return -1;
+}
+
+int virtio_blk_init(void) {
+    for (int i = 0; i < pci_device_count() && disk_count < VIRTIO_BLK_MAX_DEVICES; i++) {
+        pci_device *pci = pci_get_device(i);
+        if (pci->vendor_id != VIRTIO_VENDOR_ID ||
+            (pci->device_id != VIRTIO_BLK_DEVICE_ID && pci->device_id != VIRTIO_BLK_TRANSITIONAL_ID)) {
+            continue;
+        }
+
+        virtio_blk *vb = &disks[disk_count];
+        if (virtio_blk_probe(pci, vb) != 0 || block_register(&vb->dev) != 0) {
+            print_string("virtio-blk: device setup failed\n");
+            continue;
+        }
+        disk_count++;
+
+        // Without a routed line the driver simply polls
+        vb->use_irq = pci->irq_line != PCI_NO_IRQ && irq_register(pci->irq_line, virtio_blk_irq) == 0;
+
+        char buffer[24];
+        print_string("virtio-blk: ");
+        print_string(vb->dev.name);
+        print_string(" ");
+        itoa(vb->dev.sectors / 2048, buffer, 10);
+        print_string(buffer);
+        print_string(" MB, queue depth ");
+        itoa(vb->dev.queue_depth, buffer, 10);
+        print_string(buffer);
+        if (vb->use_irq) {
+            print_string(", IRQ ");
+            itoa(pci->irq_line, buffer, 10);
+            print_string(buffer);
+        }
+        print_string(vb->dev.read_only ? ", read-only\n" : "\n");
+    }
+    return disk_count;
+}
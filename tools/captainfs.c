@@ -0,0 +1,692 @@
+// captainfs: host-side tool for CAPTAIN-OS volume images.
+//
+//   captainfs mkfs [-z] <image> <size>|auto [dir]
+//                                              format, optionally packing dir
+//                                              (-z: store its files compressed)
+//   captainfs ls <image> [path]                list the tree below path
+//   captainfs extract <image> <dir>            copy the whole tree out to dir
+//   captainfs fsck <image>                     check the volume's consistency
+//                                              and every block's checksum
+//
+// Files go in and out through the kernel's own filesystem code, linked in
+// unchanged, so images are built exactly the way the kernel would build
+// them. fsck walks the on-disk structures directly instead, so it sees
+// what is really there rather than what the kernel's code assumes.
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "crc32c.h"
+#include "filesystem.h"
+
+#define COPY_CHUNK (1024 * 1024)   // Bytes moved per fs_read/fs_write call
+#define FSCK_MAX_REPORTS 32        // Problems printed before fsck only counts them
+
+static uint8_t copy_buffer[COPY_CHUNK];
+static int pack_compressed = 0;            // mkfs -z
+
+// Support routines the filesystem code expects from the kernel
+
+void print_string(const char *str) {
+    fputs(str, stderr);
+}
+
+void itoa(uint64_t v, char *str, int base) {
+    char tmp[65];
+    int i = 0;
+    do {
+        int digit = v % base;
+        tmp[i++] = digit < 10 ? '0' + digit : 'a' + digit - 10;
+        v /= base;
+    } while (v);
+    while (i) *str++ = tmp[--i];
+    *str = '\0';
+}
+
+void *phys_alloc(uint64_t size, uint64_t align) {
+    void *p = aligned_alloc(align, (size + align - 1) & ~(align - 1));
+    if (p) memset(p, 0, size);
+    return p;
+}
+
+void *memory_find_module(const char *cmdline, uint64_t *size) {
+    (void)cmdline;
+    (void)size;
+    return 0;
+}
+
+// Image files
+
+static uint8_t *image_alloc(uint64_t size) {
+    return (uint8_t *)phys_alloc(size, BLOCK_SIZE);
+}
+
+static uint8_t *image_read(const char *path, uint64_t *size) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "captainfs: %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    fseek(f, 0, SEEK_END);
+    long length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *image = length > 0 ? image_alloc(length) : 0;
+    if (!image || fread(image, 1, length, f) != (size_t)length) {
+        fprintf(stderr, "captainfs: %s: cannot read image\n", path);
+        fclose(f);
+        free(image);
+        return 0;
+    }
+    fclose(f);
+    *size = length;
+    return image;
+}
+
+static int image_write(const char *path, const uint8_t *image, uint64_t size) {
+    FILE *f = fopen(path, "wb");
+    if (!f || fwrite(image, 1, size, f) != size || fclose(f) != 0) {
+        fprintf(stderr, "captainfs: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static uint8_t *image_mount(const char *path) {
+    uint64_t size;
+    uint8_t *image = image_read(path, &size);
+    if (!image) return 0;
+    if (fs_mount_image(image, size) != 0) {
+        fprintf(stderr, "captainfs: %s: not a valid CAPTAIN-OS volume\n", path);
+        free(image);
+        return 0;
+    }
+    return image;
+}
+
+static void join_path(char *out, const char *dir, const char *name) {
+    if (dir[0] == '/' && dir[1] == '\0') {
+        snprintf(out, FS_MAX_PATH, "/%s", name);
+    } else {
+        snprintf(out, FS_MAX_PATH, "%s/%s", dir, name);
+    }
+}
+
+// mkfs
+
+typedef struct {
+    uint64_t blocks;               // Data and directory blocks needed
+    uint32_t entries;              // Files and directories
+} tree_size;
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Names in host directory path, sorted so images come out reproducible.
+// Returns the count, or -1 on error; free with free_names.
+static int list_host_dir(const char *path, char ***names) {
+    DIR *dir = opendir(path);
+    if (!dir) {
+        fprintf(stderr, "captainfs: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    int count = 0, capacity = 16;
+    char **list = malloc(capacity * sizeof(char *));
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+        if (count == capacity) {
+            capacity *= 2;
+            list = realloc(list, capacity * sizeof(char *));
+        }
+        list[count++] = strdup(de->d_name);
+    }
+    closedir(dir);
+    qsort(list, count, sizeof(char *), compare_names);
+    *names = list;
+    return count;
+}
+
+static void free_names(char **names, int count) {
+    for (int i = 0; i < count; i++) free(names[i]);
+    free(names);
+}
+
+static int measure_tree(const char *host, tree_size *total) {
+    char **names;
+    int count = list_host_dir(host, &names);
+    if (count < 0) return -1;
+    uint64_t dirent_bytes = 0;
+    for (int i = 0; i < count; i++) dirent_bytes += DIRENT_LEN(strlen(names[i]));
+    total->blocks += 1 + dirent_bytes / BLOCK_SIZE;
+    for (int i = 0; i < count; i++) {
+        char path[FS_MAX_PATH];
+        struct stat st;
+        join_path(path, host, names[i]);
+        if (lstat(path, &st) != 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            total->entries++;
+            if (measure_tree(path, total) != 0) {
+                free_names(names, count);
+                return -1;
+            }
+        } else if (S_ISREG(st.st_mode)) {
+            total->entries++;
+            total->blocks += (st.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        }
+    }
+    free_names(names, count);
+    return 0;
+}
+
+static int pack_file(const char *host, const char *target) {
+    FILE *f = fopen(host, "rb");
+    if (!f) {
+        fprintf(stderr, "captainfs: %s: %s\n", host, strerror(errno));
+        return -1;
+    }
+    int fd = fs_open(target, FS_O_WRONLY | FS_O_CREAT | FS_O_TRUNC);
+    if (fd < 0) {
+        fclose(f);
+        return -1;
+    }
+    int result = 0;
+    size_t n;
+    while ((n = fread(copy_buffer, 1, COPY_CHUNK, f)) > 0) {
+        if (fs_write(fd, copy_buffer, n) != (int)n) {
+            result = -1;
+            break;
+        }
+    }
+    fs_close(fd);
+    fclose(f);
+    if (result == 0 && pack_compressed) result = fs_set_compression(target, 1);
+    return result;
+}
+
+// Copy the host tree below host into the mounted volume at target. Only
+// regular files and directories are packed.
+static int pack_tree(const char *host, const char *target) {
+    char **names;
+    int count = list_host_dir(host, &names);
+    if (count < 0) return -1;
+    int result = 0;
+    for (int i = 0; i < count && result == 0; i++) {
+        char path[FS_MAX_PATH], inner[FS_MAX_PATH];
+        struct stat st;
+        if (strlen(names[i]) > FS_MAX_NAME) {
+            fprintf(stderr, "captainfs: %s/%s: name too long, skipped\n", host, names[i]);
+            continue;
+        }
+        join_path(path, host, names[i]);
+        join_path(inner, target, names[i]);
+        if (lstat(path, &st) != 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            result = fs_create_directory(inner) == 0 ? pack_tree(path, inner) : -1;
+        } else if (S_ISREG(st.st_mode)) {
+            result = pack_file(path, inner);
+        } else {
+            fprintf(stderr, "captainfs: %s: not a regular file, skipped\n", path);
+        }
+    }
+    free_names(names, count);
+    return result;
+}
+
+static int cmd_mkfs(const char *image_path, const char *size_arg, const char *dir) {
+    uint64_t size;
+    uint32_t inodes = 0;
+    int grow = 0;
+    if (!strcmp(size_arg, "auto")) {
+        if (!dir) {
+            fprintf(stderr, "captainfs: mkfs auto needs a directory to size for\n");
+            return 1;
+        }
+        tree_size total = {0, 1};
+        if (measure_tree(dir, &total) != 0) return 1;
+        // The tree plus a quarter spare, the inode table and room for the
+        // bitmap, refcounts and journal; doubled below until it fits
+        inodes = total.entries + total.entries / 4 + INODES_PER_BLOCK;
+        size = (total.blocks + total.blocks / 4 + total.blocks / 32 + inodes / INODES_PER_BLOCK + 64) * BLOCK_SIZE;
+        grow = 1;
+    } else {
+        char *end;
+        size = strtoull(size_arg, &end, 10);
+        if (*end == 'K' || *end == 'k') size <<= 10;
+        else if (*end == 'M' || *end == 'm') size <<= 20;
+        else if (*end == 'G' || *end == 'g') size <<= 30;
+        else if (*end) size = 0;
+        size &= ~(uint64_t)(BLOCK_SIZE - 1);
+        if (size < (uint64_t)FS_MIN_BLOCKS * BLOCK_SIZE) {
+            fprintf(stderr, "captainfs: bad size %s\n", size_arg);
+            return 1;
+        }
+    }
+
+    for (;;) {
+        uint8_t *image = image_alloc(size);
+        if (!image) {
+            fprintf(stderr, "captainfs: out of memory\n");
+            return 1;
+        }
+        int result = fs_format(image, size, inodes) == 0 && fs_mount_image(image, size) == 0 ? 0 : -1;
+        if (result == 0 && dir) result = pack_tree(dir, "/");
+        if (result == 0) {
+            fs_update_checksums();
+            result = image_write(image_path, image, size);
+            free(image);
+            return result == 0 ? 0 : 1;
+        }
+        free(image);
+        if (!grow || size >= (1ULL << 40)) {
+            fprintf(stderr, "captainfs: %s does not fit in %llu bytes\n",
+                    dir ? dir : "volume", (unsigned long long)size);
+            return 1;
+        }
+        size *= 2;
+    }
+}
+
+// ls and extract
+
+static int list_tree(const char *path, int depth) {
+    uint64_t cookie = 0;
+    fs_dir_entry entry;
+    int r;
+    while ((r = fs_read_dir(path, &cookie, &entry)) == 1) {
+        char inner[FS_MAX_PATH];
+        join_path(inner, path, entry.name);
+        if (entry.type == FS_TYPE_DIR) {
+            printf("%*s%s/\n", depth * 2, "", entry.name);
+            if (list_tree(inner, depth + 1) != 0) return -1;
+        } else {
+            printf("%*s%s  %llu\n", depth * 2, "", entry.name, (unsigned long long)entry.size);
+        }
+    }
+    return r;
+}
+
+static int cmd_ls(const char *image_path, const char *path) {
+    uint8_t *image = image_mount(image_path);
+    if (!image) return 1;
+    int result = list_tree(path, 0);
+    if (result != 0) fprintf(stderr, "captainfs: %s: not a directory\n", path);
+    free(image);
+    return result == 0 ? 0 : 1;
+}
+
+static int extract_file(const char *path, const char *host) {
+    int fd = fs_open(path, FS_O_RDONLY);
+    FILE *f = fopen(host, "wb");
+    if (fd < 0 || !f) {
+        fprintf(stderr, "captainfs: %s: cannot extract\n", host);
+        if (fd >= 0) fs_close(fd);
+        if (f) fclose(f);
+        return -1;
+    }
+    int result = 0, n;
+    while ((n = fs_read(fd, copy_buffer, COPY_CHUNK)) > 0) {
+        if (fwrite(copy_buffer, 1, n, f) != (size_t)n) {
+            result = -1;
+            break;
+        }
+    }
+    if (n < 0) result = -1;
+    fs_close(fd);
+    if (fclose(f) != 0) result = -1;
+    return result;
+}
+
+static int extract_tree(const char *path, const char *host) {
+    if (mkdir(host, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "captainfs: %s: %s\n", host, strerror(errno));
+        return -1;
+    }
+    uint64_t cookie = 0;
+    fs_dir_entry entry;
+    int r;
+    while ((r = fs_read_dir(path, &cookie, &entry)) == 1) {
+        char inner[FS_MAX_PATH], target[FS_MAX_PATH];
+        join_path(inner, path, entry.name);
+        join_path(target, host, entry.name);
+        int result = entry.type == FS_TYPE_DIR ? extract_tree(inner, target) : extract_file(inner, target);
+        if (result != 0) return -1;
+    }
+    return r;
+}
+
+static int cmd_extract(const char *image_path, const char *host) {
+    uint8_t *image = image_mount(image_path);
+    if (!image) return 1;
+    int result = extract_tree("/", host);
+    free(image);
+    return result == 0 ? 0 : 1;
+}
+
+// fsck
+
+static uint32_t fsck_errors;
+
+__attribute__((format(printf, 1, 2)))
+static void fsck_report(const char *fmt, ...) {
+    if (fsck_errors++ >= FSCK_MAX_REPORTS) return;
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    putchar('\n');
+}
+
+static uint8_t *block_at(uint8_t *image, uint32_t block) {
+    return image + (uint64_t)block * BLOCK_SIZE;
+}
+
+// Extent i of inode, or 0 if the indirect block is out of the data area
+static fs_extent *extent_of(uint8_t *image, const fs_superblock *sb, fs_inode *inode, uint32_t i) {
+    if (i < INLINE_EXTENTS) return &inode->extents[i];
+    if (inode->indirect_block < sb->data_start || inode->indirect_block >= sb->total_blocks) return 0;
+    return (fs_extent *)block_at(image, inode->indirect_block) + (i - INLINE_EXTENTS);
+}
+
+// Check one inode's extent list and count the blocks it owns into refs.
+// Returns 0 if the extents can be trusted for the directory walk.
+static int check_extents(uint8_t *image, const fs_superblock *sb, uint32_t ino, fs_inode *inode, uint32_t *refs) {
+    if (inode->extent_count > MAX_EXTENTS) {
+        fsck_report("inode %u: %u extents, at most %u fit", ino, inode->extent_count, (unsigned)MAX_EXTENTS);
+        return -1;
+    }
+    if (inode->extent_count > INLINE_EXTENTS || inode->indirect_block != NO_BLOCK) {
+        if (inode->indirect_block < sb->data_start || inode->indirect_block >= sb->total_blocks) {
+            fsck_report("inode %u: indirect extent block %u outside the data area", ino, inode->indirect_block);
+            return -1;
+        }
+        refs[inode->indirect_block]++;
+    }
+
+    int result = 0;
+    uint64_t next_logical = 0;
+    for (uint32_t i = 0; i < inode->extent_count; i++) {
+        fs_extent *e = extent_of(image, sb, inode, i);
+        if (e->length == 0 || e->start < sb->data_start || (uint64_t)e->start + e->length > sb->total_blocks) {
+            fsck_report("inode %u: extent %u (blocks %u+%u) outside the data area", ino, i, e->start, e->length);
+            result = -1;
+            continue;
+        }
+        if (e->logical < next_logical) {
+            fsck_report("inode %u: extent %u overlaps or is out of order", ino, i);
+            result = -1;
+        }
+        next_logical = (uint64_t)e->logical + e->length;
+        for (uint32_t k = 0; k < e->length; k++) refs[e->start + k]++;
+    }
+    uint64_t size_blocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (next_logical > size_blocks) {
+        fsck_report("inode %u: blocks mapped past its size of %llu bytes", ino, (unsigned long long)inode->size);
+    }
+    return result;
+}
+
+// Copy len bytes at offset of a file out of the image, holes reading as
+// zeros as they do in the kernel. Only for inodes check_extents passed.
+static void read_mapped(uint8_t *image, const fs_superblock *sb, fs_inode *inode, uint64_t offset, void *buffer, uint32_t len) {
+    uint8_t *out = buffer;
+    while (len > 0) {
+        uint32_t logical = offset / BLOCK_SIZE;
+        fs_extent *e = 0;
+        for (uint32_t i = 0; i < inode->extent_count && !e; i++) {
+            fs_extent *x = extent_of(image, sb, inode, i);
+            if (logical >= x->logical && logical - x->logical < x->length) e = x;
+        }
+        uint32_t within = offset % BLOCK_SIZE;
+        uint32_t n = BLOCK_SIZE - within;
+        if (n > len) n = len;
+        if (e) {
+            memcpy(out, block_at(image, e->start + (logical - e->logical)) + within, n);
+        } else {
+            memset(out, 0, n);
+        }
+        out += n;
+        offset += n;
+        len -= n;
+    }
+}
+
+// A compressed file's header must describe its size, with cluster offsets
+// in order and inside the blocks it maps
+static void check_compressed(uint8_t *image, const fs_superblock *sb, uint32_t ino, fs_inode *inode) {
+    fs_compress_header header;
+    uint64_t clusters = (inode->size + FS_CLUSTER_SIZE - 1) / FS_CLUSTER_SIZE;
+    read_mapped(image, sb, inode, 0, &header, sizeof(header));
+    if (header.magic != FS_COMPRESS_MAGIC || header.size != inode->size || header.clusters != clusters) {
+        fsck_report("inode %u: compressed, but without a valid header", ino);
+        return;
+    }
+    // The clusters follow the offsets back to back; the last offset is
+    // where the stored data ends
+    uint64_t header_len = sizeof(header) + (clusters + 1) * sizeof(uint32_t);
+    uint32_t prev = 0;
+    for (uint32_t c = 0; c <= header.clusters; c++) {
+        uint32_t offset;
+        read_mapped(image, sb, inode, sizeof(header) + (uint64_t)c * sizeof(uint32_t), &offset, sizeof(offset));
+        if ((c == 0 && offset != header_len) || (c > 0 && offset <= prev) ||
+            (c > 0 && offset - prev > FS_CLUSTER_SIZE)) {
+            fsck_report("inode %u: compressed cluster %u has bad bounds", ino, c ? c - 1 : 0);
+            return;
+        }
+        prev = offset;
+    }
+    if (inode->extent_count > 0) {
+        fs_extent *last = extent_of(image, sb, inode, inode->extent_count - 1);
+        if ((uint64_t)last->logical + last->length > ((uint64_t)prev + BLOCK_SIZE - 1) / BLOCK_SIZE) {
+            fsck_report("inode %u: blocks mapped past its compressed data", ino);
+        }
+    }
+}
+
+// Walk the tree breadth-first from the root, marking every inode reached.
+// A directory reached twice means a loop or a second link to it.
+static void check_tree(uint8_t *image, const fs_superblock *sb, fs_inode *inodes, const uint8_t *usable, uint8_t *reached) {
+    uint32_t *queue = malloc(((uint64_t)sb->inode_count + 1) * sizeof(uint32_t));
+    uint32_t head = 0, tail = 0;
+    queue[tail++] = ROOT_INODE;
+
+    while (head < tail) {
+        uint32_t dir_ino = queue[head++];
+        fs_inode *dir = &inodes[dir_ino - 1];
+        for (uint32_t i = 0; i < dir->extent_count; i++) {
+            fs_extent *e = extent_of(image, sb, dir, i);
+            for (uint32_t k = 0; k < e->length; k++) {
+                uint8_t *block = block_at(image, e->start + k);
+                uint32_t offset = 0;
+                while (offset < BLOCK_SIZE) {
+                    fs_dirent *de = (fs_dirent *)(block + offset);
+                    if (de->rec_len < DIRENT_HEADER || de->rec_len % 4 || offset + de->rec_len > BLOCK_SIZE ||
+                        (de->inode != NO_INODE && DIRENT_LEN(de->name_len) > de->rec_len)) {
+                        fsck_report("directory %u: corrupt entry at block %u offset %u", dir_ino, e->start + k, offset);
+                        break;
+                    }
+                    offset += de->rec_len;
+                    if (de->inode == NO_INODE) continue;
+
+                    uint32_t child = de->inode;
+                    if (child > sb->inode_count || inodes[child - 1].type == FS_TYPE_FREE) {
+                        fsck_report("directory %u: entry \"%.*s\" names free inode %u", dir_ino, de->name_len, de->name, child);
+                        continue;
+                    }
+                    fs_inode *inode = &inodes[child - 1];
+                    if (de->type != inode->type) {
+                        fsck_report("directory %u: entry \"%.*s\" has the wrong type", dir_ino, de->name_len, de->name);
+                    }
+                    if (inode->parent != dir_ino) {
+                        fsck_report("inode %u: parent is %u but it is linked from %u", child, inode->parent, dir_ino);
+                    }
+                    if (reached[child]) {
+                        fsck_report("inode %u: linked more than once%s", child,
+                                    inode->type == FS_TYPE_DIR ? " (directory loop)" : "");
+                        continue;
+                    }
+                    reached[child] = 1;
+                    if (inode->type == FS_TYPE_DIR && usable[child]) queue[tail++] = child;
+                }
+            }
+        }
+    }
+    free(queue);
+}
+
+// Count what each snapshot owns into refs: its map, the inode table
+// copies, their indirect blocks and one reference to every block they map
+static void check_snapshots(uint8_t *image, const fs_superblock *sb, uint32_t *refs) {
+    for (int s = 0; s < FS_MAX_SNAPSHOTS; s++) {
+        const fs_snapshot *snap = &sb->snapshots[s];
+        if (snap->map_block == NO_BLOCK) continue;
+        refs[snap->map_block]++;
+        uint32_t *map = (uint32_t *)block_at(image, snap->map_block);
+        for (uint32_t i = 0; i < sb->inode_blocks; i++) {
+            if (map[i] == NO_BLOCK) continue;
+            if (map[i] < sb->data_start || map[i] >= sb->total_blocks) {
+                fsck_report("snapshot %s: inode table copy %u outside the data area", snap->name, map[i]);
+                continue;
+            }
+            refs[map[i]]++;
+            fs_inode *table = (fs_inode *)block_at(image, map[i]);
+            for (uint32_t j = 0; j < INODES_PER_BLOCK; j++) {
+                if (table[j].type == FS_TYPE_FREE) continue;
+                if (check_extents(image, sb, i * INODES_PER_BLOCK + j + 1, &table[j], refs) != 0) {
+                    fsck_report("snapshot %s: bad extents in its copy of the inode above", snap->name);
+                }
+            }
+        }
+    }
+}
+
+static int cmd_fsck(const char *image_path) {
+    uint64_t size;
+    uint8_t *image = image_read(image_path, &size);
+    if (!image) return 1;
+    fs_superblock *sb = (fs_superblock *)image;
+    if (size < BLOCK_SIZE || !fs_superblock_valid(sb, size / BLOCK_SIZE)) {
+        printf("%s: bad superblock\n", image_path);
+        free(image);
+        return 1;
+    }
+    // Mounting replays the journal, so the check sees the volume the way
+    // the kernel would after a crash
+    if (fs_mount_image(image, size) != 0) {
+        printf("%s: journal cannot be replayed\n", image_path);
+        free(image);
+        return 1;
+    }
+
+    uint64_t *bitmap = (uint64_t *)block_at(image, sb->bitmap_start);
+    uint16_t *block_refs = (uint16_t *)block_at(image, sb->refcount_start);
+    fs_inode *inodes = (fs_inode *)block_at(image, sb->inode_start);
+    uint32_t *refs = calloc(sb->total_blocks, sizeof(uint32_t));
+    uint8_t *usable = calloc((uint64_t)sb->inode_count + 1, 1);
+    uint8_t *reached = calloc((uint64_t)sb->inode_count + 1, 1);
+    uint32_t used_inodes = 0, files = 0, dirs = 0;
+
+    for (uint32_t block = 0; block < sb->data_start; block++) refs[block] = 1;
+    for (uint32_t ino = 1; ino <= sb->inode_count; ino++) {
+        fs_inode *inode = &inodes[ino - 1];
+        if (inode->type == FS_TYPE_FREE) continue;
+        used_inodes++;
+        if (inode->type != FS_TYPE_FILE && inode->type != FS_TYPE_DIR) {
+            fsck_report("inode %u: unknown type %u", ino, inode->type);
+            continue;
+        }
+        if (inode->type == FS_TYPE_DIR) dirs++;
+        else files++;
+        usable[ino] = check_extents(image, sb, ino, inode, refs) == 0;
+        if (usable[ino] && (inode->flags & FS_FLAG_COMPRESSED)) check_compressed(image, sb, ino, inode);
+    }
+    check_snapshots(image, sb, refs);
+
+    reached[ROOT_INODE] = 1;
+    if (inodes[ROOT_INODE - 1].type != FS_TYPE_DIR || !usable[ROOT_INODE]) {
+        fsck_report("root inode is not a usable directory");
+    } else {
+        check_tree(image, sb, inodes, usable, reached);
+    }
+    for (uint32_t ino = 1; ino <= sb->inode_count; ino++) {
+        if (inodes[ino - 1].type != FS_TYPE_FREE && !reached[ino]) {
+            fsck_report("inode %u: orphaned, not reachable from the root", ino);
+        }
+    }
+
+    // Every block in use carries a checksum, except the checksum table and
+    // the journal
+    uint32_t *sums = (uint32_t *)block_at(image, sb->checksum_start);
+    uint32_t free_blocks = 0, orphaned = 0, bad_sums = 0;
+    for (uint32_t block = 0; block < sb->total_blocks; block++) {
+        int used = (bitmap[block / 64] >> (block % 64)) & 1;
+        if (!used) free_blocks++;
+        int summed = (block < sb->checksum_start || block >= sb->checksum_start + sb->checksum_blocks) &&
+                     (block < sb->journal_start || block >= sb->data_start);
+        if (used && summed && crc32c(0, block_at(image, block), BLOCK_SIZE) != sums[block]) {
+            bad_sums++;
+            fsck_report("block %u: checksum mismatch", block);
+        }
+        if (refs[block] && !used) {
+            fsck_report("block %u: in use but marked free", block);
+        } else if (!refs[block] && used) {
+            orphaned++;
+            fsck_report("block %u: marked used but owned by nothing", block);
+        }
+        if (refs[block] != block_refs[block]) {
+            fsck_report("block %u: refcount %u, but %u owners found", block, block_refs[block], refs[block]);
+        }
+    }
+    if (free_blocks != sb->free_blocks) {
+        fsck_report("superblock: %u free blocks recorded, %u found", sb->free_blocks, free_blocks);
+    }
+    if (sb->inode_count - used_inodes != sb->free_inodes) {
+        fsck_report("superblock: %u free inodes recorded, %u found", sb->free_inodes, sb->inode_count - used_inodes);
+    }
+
+    if (fsck_errors > FSCK_MAX_REPORTS) printf("... %u more\n", fsck_errors - FSCK_MAX_REPORTS);
+    printf("%s: %u files, %u directories, %u of %u blocks used, %u orphaned, %u bad checksums: %s\n", image_path,
+           files, dirs, sb->total_blocks - free_blocks, sb->total_blocks, orphaned, bad_sums,
+           fsck_errors ? "ERRORS FOUND" : "clean");
+    free(refs);
+    free(usable);
+    free(reached);
+    free(image);
+    return fsck_errors ? 1 : 0;
+}
+
+static int usage(void) {
+    fprintf(stderr,
+            "usage: captainfs mkfs [-z] <image> <size>|auto [dir]\n"
+            "       captainfs ls <image> [path]\n"
+            "       captainfs extract <image> <dir>\n"
+            "       captainfs fsck <image>\n");
+    return 2;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) return usage();
+    const char *cmd = argv[1];
+    if (!strcmp(cmd, "mkfs") && argc > 2 && !strcmp(argv[2], "-z")) {
+        pack_compressed = 1;
+        argv++;
+        argc--;
+    }
+    if (!strcmp(cmd, "mkfs") && (argc == 4 || argc == 5)) {
+        return cmd_mkfs(argv[2], argv[3], argc == 5 ? argv[4] : 0);
+    }
+    if (!strcmp(cmd, "ls") && (argc == 3 || argc == 4)) {
+        return cmd_ls(argv[2], argc == 4 ? argv[3] : "/");
+    }
+    if (!strcmp(cmd, "extract") && argc == 4) {
+        return cmd_extract(argv[2], argv[3]);
+    }
+    if (!strcmp(cmd, "fsck") && argc == 3) {
+        return cmd_fsck(argv[2]);
+    }
+    return usage();
+}